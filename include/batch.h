@@ -0,0 +1,44 @@
+/**
+ * @file batch.h
+ * @brief Header file for the batch mode (many files encoded or decoded by a worker pool).
+ */
+
+#ifndef BATCH_H
+#define BATCH_H
+
+#include "utils.h"
+#include "encode.h"
+#include "decode.h"
+#include "delta.h"
+#include "planes.h"
+#include <pthread.h>
+#include <dirent.h>
+#include <glob.h>
+
+/**
+ * @struct BatchOptions
+ * @brief Parameters applied to every file of a batch.
+ */
+typedef struct {
+    int encode;             // 1 to encode PGM images, 0 to decode QTC files
+    double alpha;           // Filtering parameter, 0 for a lossless compression
+    int format;             // QTC format to write (1, 2 or 3)
+    size_t memory_cap;      // Streaming encoder memory cap in bytes, 0 to encode in memory
+    int workers;            // Number of worker threads
+    int verbose;            // Prints each file written if not 0
+    int max_level;          // Level of the decoded pixels, QUADTREE_MAX_LEVELS for the whole images
+    int sequence;           // Codes the files in order on one worker, each frame as a delta of the previous one (Q4)
+    int comments;           // Writes the date and compression rate comments if not 0
+} BatchOptions;
+
+/**
+ * @brief Encodes or decodes a set of files with a pool of worker threads.
+ * @param input Directory (walked recursively), manifest file (one path per line) or glob pattern.
+ * @param output_dir Directory receiving the outputs, mirroring the input tree.
+ * @param options Parameters of the batch.
+ * @param failed Number of files that couldn't be processed (reported and skipped) on output.
+ * @return Number of files listed.
+ */
+size_t run_batch(const char * input, const char * output_dir, const BatchOptions * options, size_t * failed);
+
+#endif // BATCH_H
@@ -8,8 +8,57 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
 #include <limits.h> // for CHAR_BIT
 
+/**
+ * @brief Maximum number of bits that can be pushed or read in a single call.
+ *
+ * The current byte can already hold up to 7 bits, so 57 more bits is the most that fits in a 64-bit word.
+ */
+#define BITSTREAM_MAX_BITS 57
+
+/**
+ * @brief Loads a big-endian 64-bit word.
+ * @param src Pointer to the first byte (no alignment required).
+ * @return Value of the word, the first byte being the most significant one.
+ */
+static inline uint64_t load_be64(const unsigned char * src) {
+    uint64_t word;
+    memcpy(&word, src, sizeof(word));
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    word = __builtin_bswap64(word);
+#endif
+    return word;
+}
+
+/**
+ * @brief Loads a big-endian 32-bit word.
+ * @param src Pointer to the first byte (no alignment required).
+ * @return Value of the word, the first byte being the most significant one.
+ */
+static inline uint32_t load_be32(const unsigned char * src) {
+    uint32_t word;
+    memcpy(&word, src, sizeof(word));
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    word = __builtin_bswap32(word);
+#endif
+    return word;
+}
+
+/**
+ * @brief Stores a 64-bit word in big-endian order.
+ * @param dest Pointer to the first byte (no alignment required).
+ * @param word Value to store, the most significant byte goes first.
+ */
+static inline void store_be64(unsigned char * dest, uint64_t word) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    word = __builtin_bswap64(word);
+#endif
+    memcpy(dest, &word, sizeof(word));
+}
+
 /**
  * @struct BitStream
  * @brief Represents a stream of bits for encoding/decoding operations.
@@ -19,6 +68,11 @@ typedef struct {
     unsigned char * ptr;   ///< Pointer to the current byte in the buffer.
     size_t capa;           ///< Capacity of the current byte.
     void * address;        ///< Pointer to the start of the buffer (easier for freeing allocated memory because of start and ptr manipulation).
+    unsigned char * end;   ///< Pointer past the last byte of the buffer (a 64-bit word is always loaded/stored at once).
+    size_t mapped;         ///< Length of the memory mapping at address, 0 if the buffer is allocated with malloc.
+    int format;            ///< QTC container format of the data (1 for Q1, 2 for Q2).
+    int error;             ///< Set when a read or a write failed (see try_read_n_bits64() and try_push_n_bits64()).
+    int fd;                ///< Descriptor the data is still received from (see fill_bitstream()), -1 once it is complete.
 } BitStream;   
 
 /**
@@ -26,7 +80,48 @@ typedef struct {
  * @param size Size of the stream in bytes.
  * @return Pointer to the initialized BitStream.
  */
-BitStream * initBitStream(int size);
+BitStream * initBitStream(size_t size);
+
+/**
+ * @brief Initializes a BitStream, without exiting if memory allocation fails.
+ * @param size Size of the stream in bytes.
+ * @return Pointer to the initialized BitStream, NULL if memory allocation fails.
+ */
+BitStream * try_initBitStream(size_t size);
+
+/**
+ * @brief Initializes a read-only BitStream over existing data, without copying it.
+ * @param data Pointer to the first byte of the encoded data.
+ * @param size Size of the data in bytes.
+ * @param address Memory released by freeBitStream (malloc'd buffer or start of a mapping).
+ * @param mapped Length of the mapping at address, 0 if address was allocated with malloc.
+ * @return Pointer to the initialized BitStream.
+ */
+BitStream * initReadBitStream(unsigned char * data, size_t size, void * address, size_t mapped);
+
+/**
+ * @brief Initializes a BitStream writing into a buffer owned by the caller, without allocating anything.
+ * @param stream BitStream to initialize.
+ * @param buffer Buffer receiving the data.
+ * @param size Size of the buffer in bytes.
+ */
+void initBitStreamOver(BitStream * stream, unsigned char * buffer, size_t size);
+
+/**
+ * @brief Initializes a read-only BitStream over data owned by the caller, without allocating anything.
+ * @param stream BitStream to initialize.
+ * @param data Pointer to the first byte of the encoded data.
+ * @param size Size of the data in bytes.
+ */
+void initReadBitStreamOver(BitStream * stream, const unsigned char * data, size_t size);
+
+/**
+ * @brief Receives more data into a read-only BitStream whose `fd` is set, until `bytes` bytes past the read position are available.
+ * @param stream BitStream to fill, nothing is done once its data is complete.
+ * @param bytes Number of bytes needed past the read position, SIZE_MAX to read the whole input.
+ * @return Number of bytes available past the read position.
+ */
+size_t fill_bitstream(BitStream * stream, size_t bytes);
 
 /**
  * @brief Reads n bits from a BitStream.
@@ -44,6 +139,46 @@ void read_n_bits(BitStream * stream, unsigned char * dest, int n);
  */
 void push_n_bits(BitStream * stream, unsigned char src, int n);
 
+/**
+ * @brief Reads up to 57 bits from a BitStream in a single 64-bit load.
+ * @param stream BitStream to read from.
+ * @param n Number of bits to read (0 to BITSTREAM_MAX_BITS).
+ * @return The bits read, right aligned.
+ */
+uint64_t read_n_bits64(BitStream * stream, int n);
+
+/**
+ * @brief Writes up to 57 bits to a BitStream in a single 64-bit store.
+ * @param stream BitStream to write to.
+ * @param src Value containing the bits to write (right aligned).
+ * @param n Number of bits to write (0 to BITSTREAM_MAX_BITS).
+ */
+void push_n_bits64(BitStream * stream, uint64_t src, int n);
+
+/**
+ * @brief Reads up to 57 bits from a BitStream, setting the error flag of the stream instead of exiting on failure.
+ * @param stream BitStream to read from.
+ * @param n Number of bits to read (0 to BITSTREAM_MAX_BITS).
+ * @return The bits read, right aligned (0 on failure).
+ */
+uint64_t try_read_n_bits64(BitStream * stream, int n);
+
+/**
+ * @brief Writes up to 57 bits to a BitStream, setting the error flag of the stream instead of exiting on failure.
+ * @param stream BitStream to write to.
+ * @param src Value containing the bits to write (right aligned).
+ * @param n Number of bits to write (0 to BITSTREAM_MAX_BITS).
+ */
+void try_push_n_bits64(BitStream * stream, uint64_t src, int n);
+
+/**
+ * @brief Copies bytes to a byte aligned BitStream, setting the error flag of the stream if they don't fit.
+ * @param stream BitStream to write to.
+ * @param data Bytes to copy.
+ * @param size Number of bytes.
+ */
+void try_push_bytes(BitStream * stream, const unsigned char * data, size_t size);
+
 /**
  * @brief Checks if a byte is partially filled, if so, fills it with padding bits and advances the pointer.
  * @param stream BitStream to check and fill.
@@ -63,4 +198,4 @@ size_t BitStream_size(BitStream * stream);
  */
 void freeBitStream(BitStream * stream);
 
-#endif // BIT_H
\ No newline at end of file
+#endif // BIT_H
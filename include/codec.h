@@ -0,0 +1,139 @@
+/**
+ * @file codec.h
+ * @brief Header file for the in-memory codec API.
+ * 
+ * These functions never exit and keep no shared state: every error is returned as a QtcStatus
+ * and several threads can encode or decode at the same time with their own buffers.
+ */
+
+#ifndef CODEC_H
+#define CODEC_H
+
+#include "utils.h"
+#include "encode.h"
+#include "decode.h"
+#include "status.h"
+#include "context.h"
+#include "segmentation_grid.h"
+
+/**
+ * @brief Largest QTC file produced by qtc_encode() for an image.
+ * @param width Width (and height) of the image, a power of 2.
+ * @return Size in bytes, 0 if the width isn't supported.
+ */
+size_t qtc_encode_bound(int width);
+
+/**
+ * @brief Compresses pixels into the content of a QTC file (format line without comments, then the payload).
+ * @param pixels Grayscale pixels in raster order, width * width bytes.
+ * @param width Width (and height) of the image, a power of 2.
+ * @param alpha Filtering parameter, 0 for a lossless compression.
+ * @param format 1 for Q1, 2 for Q2, 3 for Q3.
+ * @param threads Number of threads used to build the Quadtree.
+ * @param output Buffer receiving the file content.
+ * @param capacity Size of the buffer in bytes (qtc_encode_bound() is always enough).
+ * @param size Size of the file content on output.
+ * @return QTC_OK, QTC_ERROR_ARGUMENT, QTC_ERROR_BUFFER or QTC_ERROR_MEMORY.
+ */
+QtcStatus qtc_encode(const unsigned char * pixels, int width, double alpha, int format, int threads,
+                     unsigned char * output, size_t capacity, size_t * size);
+
+/**
+ * @brief Reads the size of the image held by the content of a QTC file.
+ * @param data Content of the QTC file (with its header) or bare payload.
+ * @param size Size of the content in bytes.
+ * @param width Width (and height) of the image on output.
+ * @return QTC_OK or QTC_ERROR_CORRUPT.
+ */
+QtcStatus qtc_decoded_width(const unsigned char * data, size_t size, int * width);
+
+/**
+ * @brief Decompresses the content of a QTC file into pixels.
+ * @param data Content of the QTC file (with its header).
+ * @param size Size of the content in bytes.
+ * @param pixels Buffer receiving the pixels in raster order.
+ * @param capacity Size of the buffer in bytes, at least width * width.
+ * @param width Width (and height) of the image on output.
+ * @param threads Number of threads to use (Q2 chunks only).
+ * @return QTC_OK, QTC_ERROR_BUFFER, QTC_ERROR_CORRUPT or QTC_ERROR_MEMORY.
+ */
+QtcStatus qtc_decode(const unsigned char * data, size_t size, unsigned char * pixels, size_t capacity, int * width, int threads);
+
+/**
+ * @brief Decompresses the first levels of a QTC file into a thumbnail, the rest of the data is not read.
+ * @param data Content of the QTC file (with its header).
+ * @param size Size of the content in bytes.
+ * @param max_level Level whose node means are the pixels, the whole image if the Quadtree isn't that deep.
+ * @param pixels Buffer receiving the pixels in raster order.
+ * @param capacity Size of the buffer in bytes, at least width * width.
+ * @param width Width (and height) of the thumbnail on output, 2^max_level at most.
+ * @param threads Number of threads to use (Q2 chunks only).
+ * @return QTC_OK, QTC_ERROR_ARGUMENT, QTC_ERROR_BUFFER, QTC_ERROR_CORRUPT or QTC_ERROR_MEMORY.
+ */
+QtcStatus qtc_decode_level(const unsigned char * data, size_t size, int max_level, unsigned char * pixels, size_t capacity,
+                           int * width, int threads);
+
+/**
+ * @brief Creates an empty context, its buffers grow to the largest image seen and are reused by every call.
+ * @return The context, NULL if memory allocation fails.
+ */
+QtcContext * qtc_context_create(void);
+
+/**
+ * @brief Frees a context and all its buffers.
+ * @param context Context created with qtc_context_create() (NULL is ignored).
+ */
+void qtc_context_free(QtcContext * context);
+
+/**
+ * @brief Compresses pixels into the stream buffer of a context, allocating nothing once the context has seen this size.
+ * @param context Context created with qtc_context_create().
+ * @param pixels Grayscale pixels in raster order, width * width bytes.
+ * @param width Width (and height) of the image, a power of 2.
+ * @param alpha Filtering parameter, 0 for a lossless compression.
+ * @param format 1 for Q1, 2 for Q2, 3 for Q3.
+ * @param threads Number of threads used to build the Quadtree.
+ * @param output File content on output (same bytes as qtc_encode()), valid until the next encode with the context.
+ * @param size Size of the file content on output.
+ * @return QTC_OK, QTC_ERROR_ARGUMENT or QTC_ERROR_MEMORY.
+ */
+QtcStatus qtc_context_encode(QtcContext * context, const unsigned char * pixels, int width, double alpha, int format, int threads,
+                             const unsigned char ** output, size_t * size);
+
+/**
+ * @brief Decompresses the content of a QTC file into the pixel buffer of a context, allocating nothing once the context has seen this size.
+ * @param context Context created with qtc_context_create().
+ * @param data Content of the QTC file (with its header).
+ * @param size Size of the content in bytes.
+ * @param pixels Decoded pixels on output, valid until the next decode with the context.
+ * @param width Width (and height) of the image on output.
+ * @param threads Number of threads to use (Q2 chunks only).
+ * @return QTC_OK, QTC_ERROR_ARGUMENT, QTC_ERROR_CORRUPT or QTC_ERROR_MEMORY.
+ */
+QtcStatus qtc_context_decode(QtcContext * context, const unsigned char * data, size_t size,
+                             const unsigned char ** pixels, int * width, int threads);
+
+/**
+ * @brief Draws the segmentation grid of the last Quadtree encoded with a context into its grid buffer.
+ * @param context Context created with qtc_context_create().
+ * @param pixels Grid pixels on output, valid until the next grid with the context.
+ * @param width Width (and height) of the grid on output.
+ * @return QTC_OK, QTC_ERROR_ARGUMENT if nothing was encoded with the context, or QTC_ERROR_MEMORY.
+ */
+QtcStatus qtc_context_grid(QtcContext * context, const unsigned char ** pixels, int * width);
+
+/**
+ * @brief Makes the calls made with a context fill statistics: time of each stage, and the counters of the nodes and bits coded.
+ * @param context Context created with qtc_context_create().
+ * @param stats Statistics to fill (cleared with init_stats() by the caller, the times and the counters add up), NULL to stop.
+ */
+void qtc_context_set_stats(QtcContext * context, QtcStats * stats);
+
+/**
+ * @brief Describes a QtcStatus.
+ * @param status Status to describe.
+ * @return Static string.
+ */
+const char * qtc_strerror(QtcStatus status);
+
+#endif // CODEC_H
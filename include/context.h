@@ -0,0 +1,101 @@
+/**
+ * @file context.h
+ * @brief Header file for the codec context (buffers reused from one call to the next).
+ */
+
+#ifndef CONTEXT_H
+#define CONTEXT_H
+
+#include "quadtree.h"
+#include "image.h"
+#include "bit.h"
+#include "stats.h"
+#include <pthread.h>
+
+#define QTC_SHARED_SCRATCH 8 // Working arrays of the calling thread
+#define QTC_THREAD_SCRATCH 4 // Working arrays of each worker thread
+
+/**
+ * @struct Scratch
+ * @brief Buffer that only grows, keeping the largest size asked so far.
+ */
+typedef struct {
+    void * data;        // 16 bytes aligned buffer, NULL until the first reservation
+    size_t capacity;    // Size of the buffer in bytes
+} Scratch;
+
+/**
+ * @struct QtcContext
+ * @brief Buffers sized for the largest image seen so far, reused by every call made with the context.
+ * 
+ * A context is used by one call at a time, each thread of an application needs its own.
+ */
+typedef struct {
+    Quadtree quadtree;                      // Quadtree over `nodes`, valid after an encode
+    Scratch nodes;                          // Level arrays of the Quadtree
+    Scratch stream;                         // Encoded file content
+    Scratch pixels;                         // Decoded pixels
+    Scratch grid;                           // Segmentation grid pixels
+    Image image;                            // Image over `pixels`
+    Image grid_image;                       // Image over `grid`
+    Scratch shared[QTC_SHARED_SCRATCH];     // Working arrays of the calling thread
+    Scratch * thread_scratch;               // QTC_THREAD_SCRATCH working arrays per thread
+    int threads;                            // Threads `thread_scratch` is allocated for
+    QtcStats * stats;                       // Statistics filled by the calls made with the context, NULL if not wanted
+} QtcContext;
+
+/**
+ * @brief Makes sure a Scratch holds at least a given size, its content is not kept when it grows.
+ * @param scratch Scratch to grow.
+ * @param size Size needed in bytes.
+ * @return Pointer to the buffer, NULL if memory allocation fails.
+ */
+void * scratch_reserve(Scratch * scratch, size_t size);
+
+/**
+ * @brief Initializes a context on the stack, nothing is allocated until it is used.
+ * @param context Context to initialize.
+ */
+void init_context(QtcContext * context);
+
+/**
+ * @brief Frees the buffers of a context initialized with init_context().
+ * @param context Context to release.
+ */
+void release_context(QtcContext * context);
+
+/**
+ * @brief Returns the number of bytes held by the buffers of a context.
+ * @param context Current context.
+ * @return Sum of the capacities of its buffers.
+ */
+size_t context_memory_size(const QtcContext * context);
+
+/**
+ * @brief Returns the working arrays of the worker threads, QTC_THREAD_SCRATCH per thread.
+ * @param context Current context.
+ * @param threads Number of threads.
+ * @return Array of threads * QTC_THREAD_SCRATCH Scratch, NULL if memory allocation fails.
+ */
+Scratch * context_thread_scratch(QtcContext * context, int threads);
+
+/**
+ * @brief Returns the Quadtree of a context, initialized empty for the given levels.
+ * @param context Current context.
+ * @param levels Quadtree levels (at most QUADTREE_MAX_LEVELS).
+ * @param with_variance Uses a variance plane if not 0.
+ * @param pixels Pixels of the leaf level (see init_quadtree_over_pixels()), NULL to store the leaves.
+ * @return The Quadtree, NULL if memory allocation fails.
+ */
+Quadtree * context_quadtree(QtcContext * context, int levels, int with_variance, unsigned char * pixels);
+
+/**
+ * @brief Returns an Image of a context, sized for the given width.
+ * @param context Current context.
+ * @param width Width (and height) of the image.
+ * @param grid Returns the segmentation grid Image if not 0, the decoded Image otherwise.
+ * @return The Image, NULL if memory allocation fails.
+ */
+Image * context_image(QtcContext * context, int width, int grid);
+
+#endif // CONTEXT_H
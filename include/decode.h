@@ -9,6 +9,12 @@
 #include "quadtree.h"
 #include "image.h"
 #include "bit.h" 
+#include "status.h"
+#include "context.h"
+#include "rans.h"
+#include "index.h"
+#include "encode.h"
+#include "segmentation_grid.h"
 
 /**
  * @brief Constructs a quadtree from a BitStream.
@@ -17,6 +23,105 @@
  */
 Quadtree * decode(BitStream * stream);
 
+/**
+ * @brief Constructs a quadtree from a BitStream, decoding Q2 chunks concurrently.
+ * @param stream BitStream to read from.
+ * @param threads Number of threads to use.
+ * @return Pointer to the constructed Quadtree.
+ */
+Quadtree * decode_threads(BitStream * stream, int threads);
+
+/**
+ * @brief Decodes a BitStream straight into an Image, filling uniform blocs without building their nodes.
+ * @param stream BitStream to read from.
+ * @param threads Number of threads to use (Q2 chunks only).
+ * @return Pointer to the decoded Image.
+ */
+Image * decode_image(BitStream * stream, int threads);
+
+/**
+ * @brief Decodes the first levels of a BitStream into a thumbnail made of the means of level max_level.
+ * @param stream BitStream to read from.
+ * @param max_level Level of the pixels, the whole image if the Quadtree isn't that deep.
+ * @param threads Number of threads to use (Q2 chunks only).
+ * @return Pointer to the decoded Image, 2^max_level pixels wide at most.
+ */
+Image * decode_image_level(BitStream * stream, int max_level, int threads);
+
+/**
+ * @brief Reads the size of the image encoded in a BitStream.
+ * @param stream BitStream holding a Q1, Q2 or Q3 payload.
+ * @param width Width (and height) of the image on output.
+ * @return QTC_OK, or QTC_ERROR_CORRUPT if the levels are missing or too large.
+ */
+QtcStatus decoded_image_width(BitStream * stream, int * width);
+
+/**
+ * @brief Decodes a BitStream into an existing Image, returning a status instead of exiting on errors.
+ * @param stream BitStream to read from (only read, it can be shared between threads).
+ * @param image Image to fill, as wide as given by decoded_image_width(), or 2^k wide for the means of level k.
+ * @param threads Number of threads to use (Q2 chunks only).
+ * @param context Context whose working arrays are used and whose statistics receive the counters, NULL to allocate them for this call only.
+ * @return QTC_OK, QTC_ERROR_ARGUMENT if the Image doesn't have a valid size or for a Q4 delta frame or a Q5 multi-plane file, QTC_ERROR_CORRUPT or QTC_ERROR_MEMORY.
+ */
+QtcStatus decode_image_into(BitStream * stream, Image * image, int threads, QtcContext * context);
+
+/**
+ * @brief Decodes a BitStream into a Quadtree whose every level holds the decoded means, without exiting on errors.
+ * @param stream BitStream to read from (only read, it can be shared between threads).
+ * @param threads Number of threads to use (Q2 chunks only).
+ * @param context Context whose working arrays are used and whose statistics receive the counters, NULL to allocate them for this call only.
+ * @param quadtree Quadtree on output (leaves in raster order), freed with free_quadtree().
+ * @return QTC_OK, QTC_ERROR_ARGUMENT for a Q4 delta frame or a Q5 multi-plane file, QTC_ERROR_CORRUPT or QTC_ERROR_MEMORY.
+ */
+QtcStatus decode_quadtree_into(BitStream * stream, int threads, QtcContext * context, Quadtree ** quadtree);
+
+/**
+ * @brief Decodes a BitStream straight into an Image and adds every uniform bloc to a segmentation grid in the same pass, without exiting on errors.
+ * @param stream BitStream to read from.
+ * @param image Image to fill, as wide as given by decoded_image_width() or narrower (a power of 2) without a grid.
+ * @param grid Grid of the Image size receiving the uniform blocs, NULL if none.
+ * @param threads Number of threads to use (Q2 chunks only).
+ * @param context Context whose working arrays are used and whose statistics receive the counters, NULL to allocate them for this call only.
+ * @return QTC_OK, QTC_ERROR_ARGUMENT if the Image or the grid doesn't have a valid size or for a Q4 delta frame or a Q5 multi-plane file, QTC_ERROR_CORRUPT or QTC_ERROR_MEMORY.
+ */
+QtcStatus decode_image_grid_into(BitStream * stream, Image * image, SegmentationGrid * grid, int threads, QtcContext * context);
+
+/**
+ * @brief Decodes a BitStream straight into an Image and fills its segmentation grid in the same pass.
+ * @param stream BitStream to read from.
+ * @param grid Grid of the image size receiving the uniform blocs.
+ * @param threads Number of threads to use (Q2 chunks only).
+ * @return Pointer to the decoded Image.
+ */
+Image * decode_image_grid(BitStream * stream, SegmentationGrid * grid, int threads);
+
+/**
+ * @brief Decodes a region of interest into a pixel buffer, returning a status instead of exiting on errors.
+ * @param stream BitStream to read from (only read, it can be shared between threads).
+ * @param index Seek index of a Q1 payload built by build_qtc_index(), not used for Q2 (Q3 is not supported).
+ * @param x Column of the top-left corner of the region.
+ * @param y Row of the top-left corner of the region.
+ * @param width Width of the region.
+ * @param height Height of the region.
+ * @param pixels Buffer of width * height pixels receiving the region, row by row.
+ * @param context Context whose working arrays are used and whose statistics receive the counters, NULL to allocate them for this call only.
+ * @return QTC_OK, QTC_ERROR_ARGUMENT (region outside of the image, Q3, Q4, missing or other index), QTC_ERROR_CORRUPT or QTC_ERROR_MEMORY.
+ */
+QtcStatus decode_region_into(BitStream * stream, const QtcIndex * index, int x, int y, int width, int height, unsigned char * pixels, QtcContext * context);
+
+/**
+ * @brief Decodes a region of interest into a new pixel buffer, only reading the subtrees that intersect it.
+ * @param stream BitStream to read from.
+ * @param index Seek index of a Q1 payload, not used for Q2.
+ * @param x Column of the top-left corner of the region.
+ * @param y Row of the top-left corner of the region.
+ * @param width Width of the region.
+ * @param height Height of the region.
+ * @return Buffer of width * height pixels, row by row, to free with free().
+ */
+unsigned char * decode_region(BitStream * stream, const QtcIndex * index, int x, int y, int width, int height);
+
 /**
  * @brief Builds an image from a quadtree.
  * @param quadtree Quadtree representation of the Image. 
@@ -0,0 +1,33 @@
+/**
+ * @file delta.h
+ * @brief Header file for the temporal delta coding (Q4 format, frames coded against the previous one of a sequence).
+ */
+
+#ifndef DELTA_H
+#define DELTA_H
+
+#include "quadtree.h"
+#include "bit.h"
+#include "status.h"
+#include "context.h"
+
+/**
+ * @brief Encodes a Quadtree as a delta of the decoded Quadtree of the previous frame, without exiting on errors.
+ * @param stream BitStream to write to (its format is set to 4), at least encoded_size_bound() bytes.
+ * @param quadtree Quadtree of the frame, filtered or not.
+ * @param reference Decoded Quadtree of the previous frame, of the same levels.
+ * @param context Context whose working arrays are used, NULL to allocate them for this call only.
+ * @return QTC_OK, QTC_ERROR_ARGUMENT if the levels differ, QTC_ERROR_BUFFER or QTC_ERROR_MEMORY.
+ */
+QtcStatus encode_delta_to_stream(BitStream * stream, Quadtree * quadtree, const Quadtree * reference, QtcContext * context);
+
+/**
+ * @brief Decodes a Q4 payload by patching the decoded Quadtree of the previous frame in place.
+ * @param stream BitStream holding the Q4 payload.
+ * @param reference Decoded Quadtree of the previous frame, the Quadtree of the frame on output.
+ * @param context Context whose working arrays are used, NULL to allocate them for this call only.
+ * @return QTC_OK, QTC_ERROR_ARGUMENT if the levels differ, QTC_ERROR_CORRUPT or QTC_ERROR_MEMORY.
+ */
+QtcStatus decode_delta_into(BitStream * stream, Quadtree * reference, QtcContext * context);
+
+#endif // DELTA_H
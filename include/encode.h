@@ -9,6 +9,10 @@
 #include "quadtree.h"
 #include "image.h"
 #include "bit.h"
+#include "status.h"
+#include "context.h"
+#include "rans.h"
+#include "segmentation_grid.h"
 
 /**
  * @brief Encodes a Quadtree into a BitStream.
@@ -17,6 +21,121 @@
  */
 BitStream * encode(Quadtree * quadtree);
 
+/**
+ * @brief Default level of the chunks roots in the Q2 format (64 chunks).
+ */
+#define QTC_Q2_SPLIT 3
+
+/**
+ * @brief Levels from which the values of the Q2 offset table are on 64 bits (the payload can pass 4 GiB).
+ */
+#define QTC_Q2_WIDE_LEVELS 16
+
+/**
+ * @brief Returns the size in bytes of each value of the Q2 offset table.
+ * @param levels Levels of the Quadtree.
+ */
+static inline int q2_table_bytes(int levels) {
+    return levels >= QTC_Q2_WIDE_LEVELS ? 8 : 4;
+}
+
+/**
+ * @brief Encodes a Quadtree into a Q2 BitStream made of independent chunks.
+ * @param quadtree Quadtree to encode.
+ * @param split Level of the chunks roots.
+ * @return BitStream representation of the Quadtree.
+ */
+BitStream * encode_q2(Quadtree * quadtree, int split);
+
+/**
+ * @brief Encodes a Quadtree into a Q3 BitStream, the nodes of Q1 being entropy coded with an interleaved rANS.
+ * @param quadtree Quadtree to encode.
+ * @return BitStream representation of the Quadtree.
+ */
+BitStream * encode_q3(Quadtree * quadtree);
+
+/**
+ * @brief Encodes a P5 raster into a Q2 payload, reading it by bands to stay under a memory cap.
+ * @param input Input file, positioned on the first pixel (must be seekable in lossy mode).
+ * @param levels Levels of the Quadtree (the image is 2^levels pixels wide and high).
+ * @param max_val Maximum grayscale value of the image.
+ * @param output Output file, positioned after the QTC header.
+ * @param alpha Filtering parameter, 0 for a lossless compression.
+ * @param threads Number of threads used to build each subtree.
+ * @param memory_cap Memory cap in bytes.
+ * @param chunks_level Level of the chunks roots used on output.
+ * @return QTC_OK, QTC_ERROR_ARGUMENT for an unsupported size or a lossy encoding of an input that can't be read twice,
+ * QTC_ERROR_CORRUPT for a raster that is truncated or has invalid pixels, QTC_ERROR_MEMORY, or QTC_ERROR_BUFFER
+ * if the output can't be written or the chunks don't fit in the offset table (the output is then incomplete).
+ */
+QtcStatus encode_q2_streaming(FILE * input, int levels, int max_val, FILE * output, double alpha, int threads, size_t memory_cap,
+                              int * chunks_level);
+
+/**
+ * @brief Largest encoded payload of a Quadtree, whatever the format.
+ * @param levels Levels of the Quadtree.
+ * @return Size in bytes.
+ */
+size_t encoded_size_bound(int levels);
+
+/**
+ * @brief Encodes a Quadtree into a BitStream at Q1, Q2 or Q3 format, returning a status instead of exiting on errors.
+ * @param stream BitStream to write to (for instance one initialized with initBitStreamOver()).
+ * @param quadtree Quadtree to encode.
+ * @param format 1 for Q1, 2 for Q2 (chunks at level QTC_Q2_SPLIT), 3 for Q3 (entropy coded).
+ * @param context Context whose working arrays are used and whose statistics receive the counters, NULL to allocate them for this call only.
+ * @return QTC_OK, QTC_ERROR_BUFFER if the BitStream is full or QTC_ERROR_MEMORY.
+ */
+QtcStatus encode_to_stream(BitStream * stream, Quadtree * quadtree, int format, QtcContext * context);
+
+/**
+ * @brief Encodes a Quadtree into a BitStream and adds every uniform node written to a segmentation grid, without exiting on errors.
+ * @param stream BitStream to write to (its format is set accordingly).
+ * @param quadtree Quadtree to encode.
+ * @param format 1 for Q1, 2 for Q2 (chunks at level QTC_Q2_SPLIT), 3 for Q3 (entropy coded).
+ * @param context Context whose working arrays are used and whose statistics receive the counters, NULL to allocate them for this call only.
+ * @param grid Grid of the Quadtree size receiving the uniform blocs, NULL if none.
+ * @return QTC_OK, QTC_ERROR_BUFFER if the BitStream is full or QTC_ERROR_MEMORY.
+ */
+QtcStatus encode_grid_to_stream(BitStream * stream, Quadtree * quadtree, int format, QtcContext * context, SegmentationGrid * grid);
+
+/**
+ * @brief Encodes a Quadtree into a new BitStream and fills its segmentation grid in the same pass.
+ * @param quadtree Quadtree to encode.
+ * @param format 1 for Q1, 2 for Q2 (chunks at level QTC_Q2_SPLIT), 3 for Q3.
+ * @param grid Grid of the Quadtree size receiving the uniform blocs.
+ * @return BitStream representation of the Quadtree.
+ */
+BitStream * encode_with_grid(Quadtree * quadtree, int format, SegmentationGrid * grid);
+
+/**
+ * @brief Builds a Quadtree from an Image, returning a status instead of exiting on errors.
+ * @param image Image to build Quadtree from (square, with a size power of 2).
+ * @param threads Number of threads to use.
+ * @param quadtree Quadtree representation of the given Image on output, NULL on failure.
+ * @return QTC_OK, QTC_ERROR_ARGUMENT if the Image size isn't supported or QTC_ERROR_MEMORY.
+ */
+QtcStatus try_build_quadtree_from_image(Image * image, int threads, Quadtree ** quadtree);
+
+/**
+ * @brief Builds a Quadtree whose leaf level is the pixels of an Image (no copy of the pixels), without exiting on errors.
+ * @param image Image to build Quadtree from (square, with a size power of 2), it must outlive the Quadtree.
+ * @param threads Number of threads to use.
+ * @param quadtree Quadtree representation of the given Image on output, NULL on failure.
+ * @return QTC_OK, QTC_ERROR_ARGUMENT if the Image size isn't supported or QTC_ERROR_MEMORY.
+ */
+QtcStatus try_build_quadtree_over_image(Image * image, int threads, Quadtree ** quadtree);
+
+/**
+ * @brief Builds a Quadtree from an Image into the buffers of a context, without exiting on errors.
+ * @param image Image to build Quadtree from (square, with a size power of 2), it is the leaf level of the Quadtree.
+ * @param threads Number of threads to use.
+ * @param context Context holding the Quadtree.
+ * @param quadtree Quadtree of the context on output (valid until the next call with the context), NULL on failure.
+ * @return QTC_OK, QTC_ERROR_ARGUMENT if the Image size isn't supported or QTC_ERROR_MEMORY.
+ */
+QtcStatus build_quadtree_in_context(Image * image, int threads, QtcContext * context, Quadtree ** quadtree);
+
 /**
  * @brief Build a Quadtree from an Image.
  * @param image Image to build Quadtree from.
@@ -24,14 +143,64 @@ BitStream * encode(Quadtree * quadtree);
  */
 Quadtree* build_quadtree_from_image(Image *image);
 
+/**
+ * @brief Build a Quadtree from an Image, spreading independent subtrees across threads.
+ * @param image Image to build Quadtree from.
+ * @param threads Number of threads to use.
+ * @return Quadtree representation of the given Image (the same whatever the number of threads).
+ */
+Quadtree* build_quadtree_from_image_threads(Image *image, int threads);
+
+/**
+ * @brief Build a Quadtree whose leaf level is the pixels of an Image, spreading independent subtrees across threads.
+ * @param image Image to build Quadtree from, it must outlive the Quadtree.
+ * @param threads Number of threads to use.
+ * @return Quadtree representation of the given Image.
+ */
+Quadtree* build_quadtree_over_image_threads(Image *image, int threads);
+
+/**
+ * @brief Encodes a Quadtree once per alpha from a single construction, the Quadtree itself is not filtered, without exiting on errors.
+ * @param quadtree Unfiltered Quadtree.
+ * @param alphas Alpha of each variant, 0 for a lossless one.
+ * @param count Number of variants.
+ * @param format 1 for Q1, 2 for Q2, 3 for Q3.
+ * @param threads Number of threads to use (the variants are encoded in parallel).
+ * @param streams Array of `count` BitStreams on output, in the order of `alphas` (each one and the array to free), NULL on errors.
+ * @return QTC_OK, QTC_ERROR_MEMORY or the status of the encoder that failed.
+ */
+QtcStatus encode_ladder(Quadtree * quadtree, const double * alphas, int count, int format, int threads, BitStream *** streams);
+
 /**
  * @brief Filtering Quadtree (lossy compression).
  * @param quadtree Quadtree to filter.
- * @param node Current node.
- * @param index Index of the current node.
+ * @param level Level of the current node.
+ * @param j Index of the current node in its level.
+ * @param sigma medvar/maxvar of the Quadtree.
+ * @param alpha Given value to filter based on.
+ */
+int filtrage(Quadtree * quadtree, int level, int64_t j, double sigma, double alpha);
+
+/**
+ * @struct BlocError
+ * @brief Sums of the pixels of a bloc and squared error of the bloc once decoded, tracked by filtrage_error().
+ */
+typedef struct {
+    uint64_t sum;       // Sum of the pixels
+    uint64_t squares;   // Sum of the squares of the pixels
+    uint64_t error;     // Sum of the squared differences between the decoded pixels and the pixels
+} BlocError;
+
+/**
+ * @brief Filtering Quadtree (lossy compression), tracking the squared error of the decoded pixels.
+ * @param quadtree Unfiltered Quadtree to filter.
+ * @param level Level of the current node.
+ * @param j Index of the current node in its level.
  * @param sigma medvar/maxvar of the Quadtree.
  * @param alpha Given value to filter based on.
+ * @param bloc Sums and squared error of the bloc of the node on output.
+ * @return 1 if the node is uniform after filtering, 0 otherwise.
  */
-int filtrage(Quadtree * quadtree, Node * node, int index, double sigma, double alpha);
+int filtrage_error(Quadtree * quadtree, int level, int64_t j, double sigma, double alpha, BlocError * bloc);
 
 #endif // ENCODE_H
\ No newline at end of file
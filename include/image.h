@@ -12,13 +12,30 @@
 
 struct Quadtree;
 
+/**
+ * @enum ImageLayout
+ * @brief Order of the pixels of an Image.
+ */
+typedef enum {
+    IMAGE_RASTER = 0,       ///< Row by row.
+    IMAGE_LEAF_ORDER = 1    ///< Order of the leaves of the Quadtree: each base 4 digit of a pixel index is `2 * y_bit + (x_bit ^ y_bit)`.
+} ImageLayout;
+
 typedef struct {
     int width;              // Image's width (we work on square images so width = height)
-    int image_size;         // Number of pixels in the image (width * width)
+    size_t image_size;      // Number of pixels in the image (width * width)
     int max_val;            // Maximum grayscale value
     unsigned char * image;  // Pixel array of the image
+    ImageLayout layout;     // Order of the pixels, IMAGE_RASTER unless converted
 }Image;
 
+typedef struct {
+    int width;              // Image's width (square images, width = height)
+    int planes;             // Number of samples of a pixel (1 gray, 3 RGB, 4 RGB and alpha)
+    int max_val;            // Maximum value of a sample
+    unsigned char * pixels; // Samples of the image, interleaved pixel by pixel, row by row
+}ColorImage;
+
 
 /**
  * @brief Allocates memory for an image structure.
@@ -27,7 +44,7 @@ typedef struct {
  * @param max_val Maximum grayscale value for the Image (max 255).
  * @return Pointer to the allocated Image.
  */
-Image* allocate_image(int width, int image_size, int max_val);
+Image* allocate_image(int width, size_t image_size, int max_val);
 
 /**
  * @brief Frees allocated memory for an Image.
@@ -35,4 +52,46 @@ Image* allocate_image(int width, int image_size, int max_val);
  */
 void free_image(Image * image);
 
+/**
+ * @brief Allocates memory for a multi-plane image.
+ * @param width Width of the image (assumes the image to be square, width = height).
+ * @param planes Number of samples of a pixel (1 to 4).
+ * @param max_val Maximum value of a sample (max 255).
+ * @return Pointer to the allocated ColorImage.
+ */
+ColorImage * allocate_color_image(int width, int planes, int max_val);
+
+/**
+ * @brief Frees allocated memory for a ColorImage.
+ * @param image Pointer to the ColorImage to be freed.
+ */
+void free_color_image(ColorImage * image);
+
+/**
+ * @brief Copies rows of a raster image into a buffer of the whole image in leaf order.
+ * @param raster Rows to copy, `rows` rows of `width` pixels.
+ * @param leaves Pixels of the whole image in leaf order.
+ * @param width Width (and height) of the image, a power of 2.
+ * @param first_row Row of the image of the first row to copy.
+ * @param rows Number of rows to copy.
+ */
+void raster_to_leaf_order(const unsigned char * raster, unsigned char * leaves, int width, int first_row, int rows);
+
+/**
+ * @brief Copies rows of an image in leaf order into a raster buffer.
+ * @param leaves Pixels of the whole image in leaf order.
+ * @param raster Buffer receiving `rows` rows of `width` pixels.
+ * @param width Width (and height) of the image, a power of 2.
+ * @param first_row Row of the image of the first row to copy.
+ * @param rows Number of rows to copy.
+ */
+void leaf_order_to_raster(const unsigned char * leaves, unsigned char * raster, int width, int first_row, int rows);
+
+/**
+ * @brief Puts the pixels of an Image in the given order.
+ * @param image Image to convert (square, with a size power of 2 for IMAGE_LEAF_ORDER).
+ * @param layout New order of the pixels.
+ */
+void set_image_layout(Image * image, ImageLayout layout);
+
 #endif // IMAGE_H
\ No newline at end of file
@@ -0,0 +1,51 @@
+/**
+ * @file index.h
+ * @brief Header file for the seek index of a Q1 file (.qtci sidecar), used to decode a region of interest.
+ */
+
+#ifndef INDEX_H
+#define INDEX_H
+
+#include "quadtree.h"
+#include "status.h"
+
+#define QTC_INDEX_LEVEL 3 // Default level of the subtrees roots (64 subtrees)
+
+/**
+ * @struct QtcIndex
+ * @brief Where the nodes of each subtree of a level start in every deeper level of a Q1 payload.
+ *
+ * Nodes are written breadth-first, so the nodes of a subtree are contiguous in each level, the index
+ * gives the position of these runs and the state the decoder would have at the subtree root.
+ */
+typedef struct {
+    int levels;             // Levels of the Quadtree
+    int level;              // Level of the subtrees roots
+    uint64_t payload_size;  // Size in bytes of the payload the index was built for
+    unsigned char * roots;  // For each subtree root: its `moyenne`, then `epsilon` | `u` << 2
+    uint64_t * offsets;     // For each subtree, the bit offset of its nodes in levels `level` + 1 to `levels`
+} QtcIndex;
+
+/**
+ * @brief Builds the index of the Q1 payload of a Quadtree, without encoding it.
+ * @param quadtree Quadtree encoded at Q1 format.
+ * @param level Level of the subtrees roots (clamped to the levels of the Quadtree).
+ * @param index Index on output, to free with free_qtc_index().
+ * @return QTC_OK or QTC_ERROR_MEMORY.
+ */
+QtcStatus build_qtc_index(Quadtree * quadtree, int level, QtcIndex * index);
+
+/**
+ * @brief Allocates the arrays of an index.
+ * @param index Index whose `levels` and `level` are set.
+ * @return QTC_OK or QTC_ERROR_MEMORY.
+ */
+QtcStatus allocate_qtc_index(QtcIndex * index);
+
+/**
+ * @brief Frees the arrays of an index.
+ * @param index Index to free.
+ */
+void free_qtc_index(QtcIndex * index);
+
+#endif // INDEX_H
@@ -0,0 +1,75 @@
+/**
+ * @file planes.h
+ * @brief Header file for the multi-plane images (RGB and alpha), each plane coded by its own Quadtree.
+ */
+
+#ifndef PLANES_H
+#define PLANES_H
+
+#include "quadtree.h"
+#include "image.h"
+#include "bit.h"
+#include "status.h"
+#include "context.h"
+#include "encode.h"
+#include "decode.h"
+#include <pthread.h>
+
+#define QTC_MAX_PLANES 4    // RGB and alpha
+#define QTC_PLANES_RCT 1    // Flag of a Q5 payload: planes 0 and 2 hold R - G + 128 and B - G + 128 (mod 256)
+
+/**
+ * @brief Size of the head of a Q5 payload, before the planes.
+ * @param planes Number of planes.
+ * @return Size in bytes.
+ */
+size_t planes_head_size(int planes);
+
+/**
+ * @brief Builds, filters and encodes every plane of an image on a thread of its own.
+ * @param image Image to encode (square, with a size power of 2).
+ * @param alpha Filtering parameter of every plane, 0 for a lossless compression.
+ * @param format 1 for Q1, 2 for Q2, 3 for Q3.
+ * @param flags QTC_PLANES_RCT to code the red and blue planes as differences with the green one (3 planes at least, exact without filtering), 0 otherwise.
+ * @param threads Number of threads, shared between the planes.
+ * @return Array of `image->planes` BitStreams, one payload per plane (each one and the array to free).
+ */
+BitStream ** encode_planes(const ColorImage * image, double alpha, int format, int flags, int threads);
+
+/**
+ * @brief Writes the head of a Q5 payload: number of planes, flags, then the format and the size of each plane.
+ * @param head BitStream to write to, at least planes_head_size() bytes.
+ * @param streams Payloads of the planes, as given by encode_planes().
+ * @param planes Number of planes.
+ * @param flags Flags given to encode_planes().
+ * @return QTC_OK, or QTC_ERROR_BUFFER if the BitStream is full.
+ */
+QtcStatus write_planes_head(BitStream * head, BitStream ** streams, int planes, int flags);
+
+/**
+ * @brief Reads the size of the image encoded in a Q5 BitStream.
+ * @param stream BitStream holding a Q5 payload.
+ * @param width Width (and height) of the image on output.
+ * @param planes Number of planes on output.
+ * @return QTC_OK, or QTC_ERROR_CORRUPT if the head or a plane is invalid.
+ */
+QtcStatus decoded_planes_size(BitStream * stream, int * width, int * planes);
+
+/**
+ * @brief Decodes the planes of a Q5 BitStream concurrently into an interleaved image, without exiting on errors.
+ * @param stream BitStream holding a Q5 payload (only read).
+ * @param image Image to fill, of the width and planes given by decoded_planes_size().
+ * @param threads Number of threads, shared between the planes.
+ * @return QTC_OK, QTC_ERROR_ARGUMENT if the image doesn't have the size of the stream, QTC_ERROR_CORRUPT or QTC_ERROR_MEMORY.
+ */
+QtcStatus decode_planes_into(BitStream * stream, ColorImage * image, int threads);
+
+/**
+ * @brief Decodes the planes of a Q5 BitStream concurrently into a new interleaved image.
+ * @param stream BitStream holding a Q5 payload.
+ * @param threads Number of threads, shared between the planes.
+ * @return Pointer to the decoded ColorImage.
+ */
+ColorImage * decode_planes(BitStream * stream, int threads);
+
+#endif // PLANES_H
@@ -8,34 +8,235 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 
-typedef struct {
-    unsigned char moyenne; // Moyenne on 8 bits
-    unsigned char epsilon; // Epsilon on 2 bits 
-    unsigned char u;       // Uniformity on 1 bit
-    double v;              // Node variance
-}Node;
+#define QUADTREE_MAX_LEVELS 16 // 65536 x 65536 pixels, node indices and sizes are on 64 bits
 
+/**
+ * Nodes are stored level by level (structure of arrays): node j of level l has its 4 children at
+ * 4j to 4j+3 of level l+1 (clockwise from the top left) and its parent at j / 4 of level l-1.
+ * Leaves only store `moyenne`, their `epsilon`, `u` and `v` are always 0, 1 and 0.
+ * The leaf level can also be the pixels of the image itself (`pixels`, raster order), it then has
+ * no array in `moyennes` and is read and written with get_moyenne() and set_moyenne().
+ */
 typedef struct {
-    Node *nodes;      // Nodes array
-    int total_nodes;  // Total_nodes number
+    unsigned char * moyennes[QUADTREE_MAX_LEVELS + 1]; // Moyenne on 8 bits, one array per level
+    uint8_t * epsilons[QUADTREE_MAX_LEVELS];           // Epsilon on 2 bits, 4 nodes per byte (non-leaf levels only)
+    uint8_t * uniforms[QUADTREE_MAX_LEVELS];           // Uniformity on 1 bit, 8 nodes per byte (non-leaf levels only)
+    float * variances[QUADTREE_MAX_LEVELS];            // Node variance (non-leaf levels only, NULL if not allocated)
+    unsigned char * pixels;                            // Leaf level in raster order (width 2^levels), NULL if stored in moyennes[levels]
+    void * memory;    // Single allocation holding every array
+    int64_t total_nodes; // Total_nodes number
     int levels;       // Quadtree levels
     double medvar;    // Average variance of the Quadtree
     double maxvar;    // Maximum variance 
 }Quadtree;
 
 /**
- * @brief Checks if the given node is a leaf or not.
+ * @brief Returns the number of nodes of a level (4^level).
+ * @param level Level of the Quadtree.
+ */
+static inline int64_t nodes_in_level(int level) {
+    return (int64_t) 1 << (2 * level);
+}
+
+/**
+ * @brief Computes the position of a node in the grid of its level, without a loop over its digits.
+ * @param j Index of the node in its level (each base 4 digit is `2 * y_bit + (x_bit ^ y_bit)`).
+ * @param x Column of the node (in blocs of the node size).
+ * @param y Row of the node (in blocs of the node size).
+ */
+static inline void node_coordinates(int64_t j, uint32_t * x, uint32_t * y) {
+    uint64_t cx = (uint64_t) (j ^ (j >> 1)) & 0x5555555555555555, cy = (uint64_t) (j >> 1) & 0x5555555555555555;
+    // Keeps one bit out of two
+    cx = (cx | (cx >> 1)) & 0x3333333333333333;
+    cy = (cy | (cy >> 1)) & 0x3333333333333333;
+    cx = (cx | (cx >> 2)) & 0x0F0F0F0F0F0F0F0F;
+    cy = (cy | (cy >> 2)) & 0x0F0F0F0F0F0F0F0F;
+    cx = (cx | (cx >> 4)) & 0x00FF00FF00FF00FF;
+    cy = (cy | (cy >> 4)) & 0x00FF00FF00FF00FF;
+    cx = (cx | (cx >> 8)) & 0x0000FFFF0000FFFF;
+    cy = (cy | (cy >> 8)) & 0x0000FFFF0000FFFF;
+    *x = (uint32_t) ((cx | (cx >> 16)) & 0xFFFFFFFF);
+    *y = (uint32_t) ((cy | (cy >> 16)) & 0xFFFFFFFF);
+}
+
+/**
+ * @brief Computes the index of a node from its position in the grid of its level, the inverse of node_coordinates().
+ * @param x Column of the node (in blocs of the node size).
+ * @param y Row of the node (in blocs of the node size).
+ * @return Index of the node in its level.
+ */
+static inline int64_t node_index(uint32_t x, uint32_t y) {
+    // Puts each bit in one bit out of two
+    uint64_t sx = x, sy = y;
+    sx = (sx | (sx << 16)) & 0x0000FFFF0000FFFF;
+    sy = (sy | (sy << 16)) & 0x0000FFFF0000FFFF;
+    sx = (sx | (sx << 8)) & 0x00FF00FF00FF00FF;
+    sy = (sy | (sy << 8)) & 0x00FF00FF00FF00FF;
+    sx = (sx | (sx << 4)) & 0x0F0F0F0F0F0F0F0F;
+    sy = (sy | (sy << 4)) & 0x0F0F0F0F0F0F0F0F;
+    sx = (sx | (sx << 2)) & 0x3333333333333333;
+    sy = (sy | (sy << 2)) & 0x3333333333333333;
+    sx = (sx | (sx << 1)) & 0x5555555555555555;
+    sy = (sy | (sy << 1)) & 0x5555555555555555;
+    return (int64_t) ((sy << 1) | (sx ^ sy));
+}
+
+/**
+ * @brief Returns the offset of a leaf in the raster pixels of its Quadtree.
+ * @param levels Quadtree levels.
+ * @param j Index of the leaf.
+ */
+static inline size_t leaf_offset(int levels, int64_t j) {
+    uint32_t x, y;
+    node_coordinates(j, &x, &y);
+    return ((size_t) y << levels) + x;
+}
+
+/**
+ * @brief Returns the moyenne of a node, leaves included.
+ * @param quadtree Current quadtree.
+ * @param level Level of the node.
+ * @param j Index of the node in its level.
+ */
+static inline unsigned char get_moyenne(const Quadtree * quadtree, int level, int64_t j) {
+    if (level == quadtree->levels && quadtree->pixels) return quadtree->pixels[leaf_offset(level, j)];
+    return quadtree->moyennes[level][j];
+}
+
+/**
+ * @brief Sets the moyenne of a node, leaves included.
+ * @param quadtree Current quadtree.
+ * @param level Level of the node.
+ * @param j Index of the node in its level.
+ * @param moyenne Value to set.
+ */
+static inline void set_moyenne(Quadtree * quadtree, int level, int64_t j, unsigned char moyenne) {
+    if (level == quadtree->levels && quadtree->pixels) {
+        quadtree->pixels[leaf_offset(level, j)] = moyenne;
+    } else {
+        quadtree->moyennes[level][j] = moyenne;
+    }
+}
+
+/**
+ * @brief Returns the epsilon of a node.
+ * @param quadtree Current quadtree.
+ * @param level Level of the node.
+ * @param j Index of the node in its level.
+ */
+static inline unsigned char get_epsilon(const Quadtree * quadtree, int level, int64_t j) {
+    if (level == quadtree->levels) return 0;
+    return (quadtree->epsilons[level][j >> 2] >> (2 * (j & 3))) & 3;
+}
+
+/**
+ * @brief Returns the uniformity bit of a node.
+ * @param quadtree Current quadtree.
+ * @param level Level of the node.
+ * @param j Index of the node in its level.
+ */
+static inline unsigned char get_u(const Quadtree * quadtree, int level, int64_t j) {
+    if (level == quadtree->levels) return 1;
+    return (quadtree->uniforms[level][j >> 3] >> (j & 7)) & 1;
+}
+
+/**
+ * @brief Sets the epsilon of a non-leaf node.
+ * @param quadtree Current quadtree.
+ * @param level Level of the node (must not be the leaf level).
+ * @param j Index of the node in its level.
+ * @param epsilon Value to set (0 to 3).
+ */
+static inline void set_epsilon(Quadtree * quadtree, int level, int64_t j, unsigned char epsilon) {
+    uint8_t * byte = &quadtree->epsilons[level][j >> 2];
+    *byte = (*byte & ~(3 << (2 * (j & 3)))) | ((epsilon & 3) << (2 * (j & 3)));
+}
+
+/**
+ * @brief Sets the uniformity bit of a non-leaf node.
+ * @param quadtree Current quadtree.
+ * @param level Level of the node (must not be the leaf level).
+ * @param j Index of the node in its level.
+ * @param u Value to set (0 or 1).
+ */
+static inline void set_u(Quadtree * quadtree, int level, int64_t j, unsigned char u) {
+    uint8_t * byte = &quadtree->uniforms[level][j >> 3];
+    *byte = (*byte & ~(1 << (j & 7))) | ((u & 1) << (j & 7));
+}
+
+/**
+ * @brief Checks if the nodes of the given level are leaves or not.
  * @param quadtree Current quadtree.
- * @param index Index of the node we want to check. 
+ * @param level Level of the nodes we want to check. 
+ */
+int is_leaf(Quadtree * quadtree, int level);
+
+/**
+ * @brief Gives the decoded values to the nodes below a uniform node: its `moyenne`, `epsilon` 0 and `u` 1.
+ * @param quadtree Decoded Quadtree, its leaves in raster order or stored.
+ * @param level Level of the uniform node.
+ * @param j Index of the uniform node in its level.
  */
-int is_leaf(Quadtree * quadtree, int index);
+void fill_uniform_subtree(Quadtree * quadtree, int level, int64_t j);
 
 /**
  * @brief Creates and initializes an empty Quadtree.
  * @param levels Quadtree levels.
+ * @param with_variance Allocates the variance plane if not 0 (only needed to encode).
+ */
+Quadtree* create_empty_quadtree(int levels, int with_variance);
+
+/**
+ * @brief Creates and initializes an empty Quadtree, returning NULL instead of exiting on errors.
+ * @param levels Quadtree levels.
+ * @param with_variance Allocates the variance plane if not 0 (only needed to encode).
+ * @return The Quadtree, NULL if levels is too large or memory allocation fails.
+ */
+Quadtree* try_create_empty_quadtree(int levels, int with_variance);
+
+/**
+ * @brief Returns the size of the level arrays of a Quadtree.
+ * @param levels Quadtree levels (at most QUADTREE_MAX_LEVELS).
+ * @param with_variance Counts the variance plane if not 0.
+ * @return Size in bytes.
+ */
+size_t quadtree_memory_size(int levels, int with_variance);
+
+/**
+ * @brief Initializes an empty Quadtree over level arrays owned by the caller (the Quadtree must not be freed with free_quadtree()).
+ * @param quadtree Quadtree to initialize.
+ * @param memory 16 bytes aligned memory of at least quadtree_memory_size() bytes.
+ * @param levels Quadtree levels (at most QUADTREE_MAX_LEVELS).
+ * @param with_variance Uses a variance plane if not 0.
+ */
+void init_quadtree_over(Quadtree * quadtree, void * memory, int levels, int with_variance);
+
+/**
+ * @brief Returns the size of the level arrays of a Quadtree whose leaf level is an image (see init_quadtree_over_pixels()).
+ * @param levels Quadtree levels (at most QUADTREE_MAX_LEVELS).
+ * @param with_variance Counts the variance plane if not 0.
+ * @return Size in bytes.
+ */
+size_t quadtree_memory_size_over_pixels(int levels, int with_variance);
+
+/**
+ * @brief Initializes an empty Quadtree whose leaf level is the pixels of an image (a single pixel Quadtree still stores its leaf).
+ * @param quadtree Quadtree to initialize.
+ * @param memory 16 bytes aligned memory of at least quadtree_memory_size_over_pixels() bytes.
+ * @param levels Quadtree levels (at most QUADTREE_MAX_LEVELS).
+ * @param with_variance Uses a variance plane if not 0.
+ * @param pixels 2^levels x 2^levels pixels in raster order, they must outlive the Quadtree.
+ */
+void init_quadtree_over_pixels(Quadtree * quadtree, void * memory, int levels, int with_variance, unsigned char * pixels);
+
+/**
+ * @brief Creates a view of a Quadtree sharing its means (pixels included) and variances, with its own copy of the epsilon and uniformity planes.
+ * @param quadtree Quadtree to view, it must outlive the view.
+ * @return The view (freed with free_quadtree()), NULL if memory allocation fails.
  */
-Quadtree* create_empty_quadtree(int levels);
+Quadtree* try_create_quadtree_view(const Quadtree * quadtree);
 
 /**
  * @brief Frees allocated memory for a Quadtree.
@@ -43,4 +244,4 @@ Quadtree* create_empty_quadtree(int levels);
  */
 void free_quadtree(Quadtree *quadtree);
 
-#endif // QUADTREE_H
\ No newline at end of file
+#endif // QUADTREE_H
@@ -0,0 +1,187 @@
+/**
+ * @file rans.h
+ * @brief Header file for the interleaved rANS entropy coder of the Q3 format.
+ */
+
+#ifndef RANS_H
+#define RANS_H
+
+#include "bit.h"
+#include "status.h"
+
+#define RANS_PROB_BITS 12                       // Frequencies of a model sum to 2^12
+#define RANS_PROB_SCALE (1 << RANS_PROB_BITS)
+#define RANS_LOW (UINT32_C(1) << 23)            // Lower bound of a normalized state
+#define RANS_LANES 4                            // Interleaved states, symbol k goes to lane k % 4
+#define RANS_MAX_SYMBOLS 256
+
+// Q3 models: for each level L from 1, the flags of its non-leaf nodes (model 2L - 2) and the mean residuals (model 2L - 1)
+#define QTC_Q3_FLAGS 5                          // Flags symbol: epsilon 0 to 3, or 4 for epsilon 0 and u 1
+
+/**
+ * @struct RansModel
+ * @brief Static distribution of the symbols of one kind of field.
+ */
+typedef struct {
+    uint16_t freq[RANS_MAX_SYMBOLS];            // Normalized frequency of each symbol, 0 if it never occurs
+    uint16_t cum[RANS_MAX_SYMBOLS];             // Sum of the frequencies of the previous symbols
+    uint32_t slot[RANS_PROB_SCALE];             // Decoding entry of each slot: symbol, frequency - 1 << 8, slot - cum << 20 (decoding only)
+} RansModel;
+
+/**
+ * @struct RansEncoder
+ * @brief rANS encoder writing its bytes backward, from the end of a buffer.
+ */
+typedef struct {
+    uint32_t state[RANS_LANES];
+    unsigned char * ptr;                        // First byte written so far
+    unsigned char * start;                      // Start of the buffer
+    unsigned char * end;                        // End of the buffer, where the data ends
+    unsigned int lane;                          // Lane of the next symbol (symbols are encoded last to first)
+    int error;                                  // Set if the buffer is full
+} RansEncoder;
+
+/**
+ * @struct RansDecoder
+ * @brief rANS decoder reading its bytes forward.
+ */
+typedef struct {
+    uint32_t state[RANS_LANES];                 // States of the lanes, the one of the next symbol first
+    const unsigned char * ptr;                  // Next byte to read
+    const unsigned char * end;                  // End of the data
+    int error;                                  // Set if the data ended too early
+} RansDecoder;
+
+/**
+ * @brief Normalizes symbol counts into the frequencies of a model, every symbol that occurs keeping a frequency of at least 1.
+ * @param model Model to fill (`freq` and `cum`).
+ * @param counts Number of occurrences of each symbol.
+ * @param alphabet Number of symbols (at most RANS_MAX_SYMBOLS).
+ */
+void rans_model_from_counts(RansModel * model, const uint32_t * counts, int alphabet);
+
+/**
+ * @brief Writes the frequencies of a model into a BitStream (zero runs and 1 or 2 bytes per frequency).
+ * @param stream BitStream to write to, byte aligned.
+ * @param model Model to write.
+ * @param alphabet Number of symbols.
+ */
+void rans_push_model(BitStream * stream, const RansModel * model, int alphabet);
+
+/**
+ * @brief Reads the frequencies of a model from a BitStream and builds its decoding table.
+ * @param stream BitStream to read from, byte aligned.
+ * @param model Model to fill.
+ * @param alphabet Number of symbols.
+ * @return QTC_OK, or QTC_ERROR_CORRUPT if the frequencies are truncated or don't sum to RANS_PROB_SCALE (or 0).
+ */
+QtcStatus rans_read_model(BitStream * stream, RansModel * model, int alphabet);
+
+/**
+ * @brief Returns the bits taken by symbols coded with a model (the final states not counted).
+ * @param model Model of the symbols.
+ * @param counts Number of occurrences of each symbol (their frequency must not be 0).
+ * @param alphabet Number of symbols.
+ * @return Size in bits, rounded.
+ */
+uint64_t rans_cost(const RansModel * model, const uint32_t * counts, int alphabet);
+
+/**
+ * @brief Largest output of the encoder for a number of symbols (12 bits at most per symbol, plus the states).
+ * @param symbols Number of symbols.
+ * @return Size in bytes.
+ */
+size_t rans_size_bound(size_t symbols);
+
+/**
+ * @brief Initializes an encoder writing backward from the end of a buffer.
+ * @param encoder Encoder to initialize.
+ * @param buffer Buffer receiving the data.
+ * @param size Size of the buffer in bytes.
+ * @param symbols Number of symbols that will be encoded, in reverse order.
+ */
+void rans_encoder_init(RansEncoder * encoder, unsigned char * buffer, size_t size, size_t symbols);
+
+/**
+ * @brief Writes the final states in front of the data.
+ * @param encoder Encoder whose symbols are all encoded.
+ * @return Size of the data in bytes (starting at encoder->ptr), 0 if the buffer is full.
+ */
+size_t rans_encoder_flush(RansEncoder * encoder);
+
+/**
+ * @brief Initializes a decoder over the output of rans_encoder_flush().
+ * @param decoder Decoder to initialize.
+ * @param data First byte of the data.
+ * @param size Size of the data in bytes.
+ */
+void rans_decoder_init(RansDecoder * decoder, const unsigned char * data, size_t size);
+
+/**
+ * @brief Checks that a decoder read exactly the data of the encoder.
+ * @param decoder Decoder whose symbols are all decoded.
+ * @return 1 if the data wasn't truncated, the states are back to their initial value and every byte was read.
+ */
+int rans_decoder_done(const RansDecoder * decoder);
+
+/**
+ * @brief Encodes one symbol, the symbols being given from the last one to the first one.
+ *
+ * Kept inline, it runs once per field of every node.
+ *
+ * @param encoder Encoder to write to.
+ * @param model Model of the symbol.
+ * @param s Symbol to encode (its frequency must not be 0).
+ */
+static inline void rans_encode(RansEncoder * encoder, const RansModel * model, int s) {
+    uint32_t freq = model->freq[s];
+    uint32_t x = encoder->state[encoder->lane];
+    uint32_t x_max = ((RANS_LOW >> RANS_PROB_BITS) << 8) * freq;
+    while (x >= x_max) {
+        if (encoder->ptr == encoder->start) {
+            encoder->error = 1;
+            return;
+        }
+        *--encoder->ptr = x & 0xFF;
+        x >>= 8;
+    }
+    encoder->state[encoder->lane] = ((x / freq) << RANS_PROB_BITS) + (x % freq) + model->cum[s];
+    encoder->lane = (encoder->lane + RANS_LANES - 1) % RANS_LANES;
+}
+
+/**
+ * @brief Decodes one symbol.
+ *
+ * Kept inline, it runs once per field of every node. Past the end of the data the error flag is set
+ * and zeros are read, so a corrupted stream can't loop or read out of bounds.
+ * The states are rotated instead of indexed by lane, so the decoder of a loop (a local copy,
+ * see decode_frontier_q3()) lives in registers.
+ *
+ * @param decoder Decoder to read from.
+ * @param model Model of the symbol.
+ * @return Symbol decoded.
+ */
+static inline int rans_decode(RansDecoder * decoder, const RansModel * model) {
+    uint32_t x = decoder->state[0];
+    uint32_t entry = model->slot[x & (RANS_PROB_SCALE - 1)];
+    int s = entry & 0xFF;
+    x = (((entry >> 8) & 0xFFF) + 1) * (x >> RANS_PROB_BITS) + (entry >> 20);
+    // x is at least RANS_LOW >> RANS_PROB_BITS, 2 bytes always bring it back above RANS_LOW
+    if (x < RANS_LOW && decoder->end - decoder->ptr >= 2) {
+        x = (x << 8) | *decoder->ptr++;
+        if (x < RANS_LOW) x = (x << 8) | *decoder->ptr++;
+    }
+    while (x < RANS_LOW) {
+        if (decoder->ptr == decoder->end) {
+            decoder->error = 1;
+            x = RANS_LOW;
+            break;
+        }
+        x = (x << 8) | *decoder->ptr++;
+    }
+    for (int i = 0; i < RANS_LANES - 1; i++) decoder->state[i] = decoder->state[i + 1];
+    decoder->state[RANS_LANES - 1] = x;
+    return s;
+}
+
+#endif // RANS_H
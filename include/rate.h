@@ -0,0 +1,93 @@
+/**
+ * @file rate.h
+ * @brief Header file for the rate control (alpha chosen to meet a size budget or a quality).
+ */
+
+#ifndef RATE_H
+#define RATE_H
+
+#include "quadtree.h"
+#include "encode.h"
+#include "status.h"
+#include "stats.h"
+#include <math.h>
+#include <float.h>
+
+/**
+ * @struct UniformThresholds
+ * @brief Smallest alpha at which filtrage() makes each non-leaf node uniform.
+ */
+typedef struct {
+    double * alphas;        // One value per non-leaf node, level by level (0 if already uniform, INFINITY if never)
+    double * sorted;        // Distinct finite and positive values of `alphas`, increasing
+    uint64_t * errors;      // Squared error of each non-leaf node made uniform, same order as `alphas` (NULL until compute_uniform_errors())
+    size_t count;           // Number of values in `sorted`
+    int levels;             // Levels of the Quadtree
+} UniformThresholds;
+
+/**
+ * @brief Computes once the filtering threshold of every node of an unfiltered Quadtree.
+ * @param quadtree Unfiltered Quadtree, with its variance plane.
+ * @param thresholds Thresholds on output, to free with free_uniform_thresholds().
+ * @return QTC_OK or QTC_ERROR_MEMORY.
+ */
+QtcStatus compute_uniform_thresholds(Quadtree * quadtree, UniformThresholds * thresholds);
+
+/**
+ * @brief Computes once the squared error of every non-leaf node of an unfiltered Quadtree if it is made uniform.
+ * @param quadtree Unfiltered Quadtree.
+ * @param thresholds Thresholds of the Quadtree, receiving the errors.
+ * @return QTC_OK or QTC_ERROR_MEMORY.
+ */
+QtcStatus compute_uniform_errors(Quadtree * quadtree, UniformThresholds * thresholds);
+
+/**
+ * @brief Frees the arrays of UniformThresholds.
+ * @param thresholds Thresholds to free.
+ */
+void free_uniform_thresholds(UniformThresholds * thresholds);
+
+/**
+ * @brief Predicts the exact size of the payload encode_to_stream() would write after filtrage() with an alpha.
+ * @param quadtree Unfiltered Quadtree.
+ * @param thresholds Thresholds of the Quadtree.
+ * @param alpha Filtering parameter, 0 for a lossless compression.
+ * @param format 1 for Q1, 2 for Q2.
+ * @return Size of the payload in bytes (the header lines are not counted).
+ */
+size_t predict_encoded_size(Quadtree * quadtree, const UniformThresholds * thresholds, double alpha, int format);
+
+/**
+ * @brief Finds the smallest alpha whose payload fits in a budget, without filtering or encoding.
+ * @param quadtree Unfiltered Quadtree.
+ * @param thresholds Thresholds of the Quadtree.
+ * @param target Budget of the payload in bytes.
+ * @param format 1 for Q1, 2 for Q2.
+ * @param alpha Alpha on output (0 if the lossless payload fits, the largest useful one if nothing fits).
+ * @param predicted Size of the payload with this alpha on output.
+ * @return 1 if the budget is met, 0 otherwise.
+ */
+int alpha_for_target_size(Quadtree * quadtree, const UniformThresholds * thresholds, size_t target, int format,
+                          double * alpha, size_t * predicted);
+
+/**
+ * @brief Predicts the exact squared error of the decoded pixels after filtrage() with an alpha.
+ * @param quadtree Unfiltered Quadtree.
+ * @param thresholds Thresholds of the Quadtree, with their errors.
+ * @param alpha Filtering parameter, 0 for a lossless compression.
+ * @return Sum of the squared differences between the decoded pixels and the pixels.
+ */
+uint64_t predict_squared_error(Quadtree * quadtree, const UniformThresholds * thresholds, double alpha);
+
+/**
+ * @brief Finds the largest alpha whose decoded image meets a PSNR, without filtering or decoding.
+ * @param quadtree Unfiltered Quadtree.
+ * @param thresholds Thresholds of the Quadtree, with their errors.
+ * @param psnr Smallest PSNR in dB.
+ * @param alpha Alpha on output (0 if no filtering meets the PSNR, the lossless image always does).
+ * @param predicted Squared error of the decoded pixels with this alpha on output.
+ */
+void alpha_for_target_psnr(Quadtree * quadtree, const UniformThresholds * thresholds, double psnr,
+                           double * alpha, uint64_t * predicted);
+
+#endif // RATE_H
@@ -8,8 +8,35 @@
 
 #include "quadtree.h"
 #include "image.h"
+#include "status.h"
 #include <string.h>
 
+/**
+ * @struct GridBloc
+ * @brief Uniform bloc of a segmentation grid.
+ */
+typedef struct {
+    uint32_t x, y;  // Top-left corner, in pixels
+    uint32_t size;  // Side of the bloc, in pixels
+} GridBloc;
+
+/**
+ * @struct SegmentationGrid
+ * @brief Segmentation grid filled by the encoders and decoders as they visit the uniform blocs.
+ *
+ * The raster has the borders of the blocs drawn at 190 on a white image, the list holds the blocs
+ * in the order they are visited (it depends on the format, not on the number of threads).
+ */
+typedef struct {
+    Image * image;          // Raster grid, NULL if it isn't drawn
+    int list;               // Lists the blocs if not 0
+    GridBloc * blocs;       // Blocs listed
+    size_t count;           // Number of blocs listed
+    size_t capacity;        // Capacity of `blocs`
+    int failed;             // Set if the list couldn't grow
+    uint32_t left, top;     // Column left - 1 and row top - 1 are drawn by an enclosing bloc, they are skipped
+} SegmentationGrid;
+
 /**
  * @brief Generates a segmentation grid from a Quadtree.
  * @param quadtree Pointer to the Quadtree.
@@ -17,4 +44,51 @@
  */
 Image * generate_segmentation_grid(Quadtree * quadtree);
 
-#endif // SEGMENTATION_GRID_H
\ No newline at end of file
+/**
+ * @brief Draws the segmentation grid of a Quadtree into an existing Image (of the Quadtree size).
+ * @param quadtree Pointer to the Quadtree.
+ * @param image Image receiving the grid.
+ */
+void draw_segmentation_grid(Quadtree * quadtree, Image * image);
+
+/**
+ * @brief Initializes an empty segmentation grid, the raster is whited.
+ * @param grid Grid to initialize.
+ * @param image Raster receiving the borders (of the image size), NULL to only list the blocs.
+ * @param list Lists the blocs if not 0.
+ */
+void init_segmentation_grid(SegmentationGrid * grid, Image * image, int list);
+
+/**
+ * @brief Adds a uniform bloc to a segmentation grid: draws its top and left borders and lists it.
+ * @param grid Current grid.
+ * @param x Column of the top-left corner of the bloc.
+ * @param y Row of the top-left corner of the bloc.
+ * @param size Size of the bloc.
+ */
+void grid_add_bloc(SegmentationGrid * grid, uint32_t x, uint32_t y, uint32_t size);
+
+/**
+ * @brief Draws the top and left borders of a non-uniform bloc, without listing it.
+ * @param grid Current grid.
+ * @param x Column of the top-left corner of the bloc.
+ * @param y Row of the top-left corner of the bloc.
+ * @param size Size of the bloc.
+ */
+void grid_draw_borders(SegmentationGrid * grid, uint32_t x, uint32_t y, uint32_t size);
+
+/**
+ * @brief Appends the blocs listed in a part of a grid to the grid, then frees the list of the part.
+ * @param grid Grid receiving the blocs.
+ * @param part Grid filled for a part of the image (by one thread).
+ * @return QTC_OK or QTC_ERROR_MEMORY.
+ */
+QtcStatus merge_segmentation_grid(SegmentationGrid * grid, SegmentationGrid * part);
+
+/**
+ * @brief Frees the list of a segmentation grid (not its raster).
+ * @param grid Grid to free.
+ */
+void free_segmentation_grid(SegmentationGrid * grid);
+
+#endif // SEGMENTATION_GRID_H
@@ -0,0 +1,35 @@
+/**
+ * @file server.h
+ * @brief Header file for the tile server (decoded Quadtrees kept in an LRU cache, levels and windows served over a socket).
+ */
+
+#ifndef SERVER_H
+#define SERVER_H
+
+#include "utils.h"
+#include "decode.h"
+#include "context.h"
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+
+/**
+ * @struct ServerOptions
+ * @brief Parameters of the tile server.
+ */
+typedef struct {
+    size_t cache_bytes;     // Memory cap of the decoded Quadtrees in bytes
+    int workers;            // Number of worker threads, each one serves a connection at a time
+    int verbose;            // Prints each request if not 0
+} ServerOptions;
+
+/**
+ * @brief Serves the levels and windows of QTC files over a socket, until the process is stopped.
+ * @param address TCP port on 127.0.0.1 if it is a number, path of a Unix socket otherwise.
+ * @param options Parameters of the server.
+ * @note Exits program with an error message if the socket can't be opened, never returns otherwise.
+ */
+void run_server(const char * address, const ServerOptions * options);
+
+#endif // SERVER_H
@@ -0,0 +1,151 @@
+/**
+ * @file stats.h
+ * @brief Header file for the codec statistics (time of each stage and counters of the Quadtree coding).
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include "quadtree.h"
+#include "rans.h"
+#include <stdio.h>
+#include <time.h>
+#include <math.h>
+
+/**
+ * @enum QtcStage
+ * @brief Stages of an encode or a decode.
+ */
+typedef enum {
+    QTC_STAGE_READ,     ///< Reading the PGM or QTC file.
+    QTC_STAGE_BUILD,    ///< Building the Quadtree from the image.
+    QTC_STAGE_FILTER,   ///< filtrage().
+    QTC_STAGE_ENCODE,   ///< Writing the nodes into the BitStream.
+    QTC_STAGE_DECODE,   ///< Reading the nodes from the BitStream (into an Image or a Quadtree).
+    QTC_STAGE_IMAGE,    ///< Building the Image from a decoded Quadtree.
+    QTC_STAGE_WRITE,    ///< Writing the QTC or PGM file.
+    QTC_STAGE_COUNT
+} QtcStage;
+
+/**
+ * @struct QtcStats
+ * @brief Wall time of each stage and counters of the nodes and bits of one image.
+ *
+ * The counters are incremented by the encoding and decoding loops of the calls made with a context
+ * whose statistics are set, so they add up over the calls. The bits are those of the format coded:
+ * the fields for Q1 and Q2, the rANS cost of the symbols for Q3, whose flags symbol codes `epsilon`
+ * and `u` together (see `format`).
+ */
+typedef struct {
+    double seconds[QTC_STAGE_COUNT];    // Wall time of each stage, 0 if it didn't run
+    uint64_t nodes_visited;             // Nodes written or read by the coding loops
+    uint64_t nodes_emitted;             // Nodes with at least one field in the stream (the 4th leaves have none)
+    uint64_t nodes_skipped;             // Nodes left out under a uniform node
+    uint64_t interpolations;            // 4th children whose `moyenne` is interpolated
+    uint64_t uniformized;               // Nodes made uniform by filtrage()
+    uint64_t squared_error;             // Squared error of the decoded pixels given by filtrage_error()
+    uint64_t pixels;                    // Pixels of the filtered image, 0 if not filtered (no error printed)
+    int format;                         // Format of the payload the bits are counted for, 0 if none
+    uint64_t bits_header;               // Bits of the payload outside the fields, counted when the whole payload is coded
+    uint64_t bits_moyenne;              // Bits of the `moyenne` fields (Q3: of the mean residuals)
+    uint64_t bits_epsilon;              // Bits of the `epsilon` fields (Q3: of the flags symbols)
+    uint64_t bits_u;                    // Bits of the `u` fields (Q3: 0, they are in the flags symbols)
+    uint64_t payload_bytes;             // Size of the encoded data (without the header lines)
+    uint64_t bytes_allocated;           // Bytes the buffers of the context grew by during the calls
+} QtcStats;
+
+/**
+ * @brief Clears the statistics.
+ * @param stats Statistics to clear.
+ */
+void init_stats(QtcStats * stats);
+
+/**
+ * @brief Returns the time of a monotonic clock, to time a stage.
+ * @return Time in seconds.
+ */
+double stats_clock(void);
+
+/**
+ * @brief Adds the time elapsed since `start` to a stage.
+ * @param stats Statistics to update, nothing is done if NULL.
+ * @param stage Stage timed.
+ * @param start Time returned by stats_clock() when the stage started.
+ */
+void stats_stage(QtcStats * stats, QtcStage stage, double start);
+
+/**
+ * @brief Counts the nodes of a level walked by a coding loop.
+ * @param stats Statistics to update, nothing is done if NULL.
+ * @param levels Levels of the Quadtree.
+ * @param level Level of the nodes.
+ * @param nodes Nodes walked: 1 for the root, else the 4 children of each non-uniform parent.
+ * @param uniform Uniform non-leaf nodes among them, whose descendants are skipped.
+ */
+void stats_nodes(QtcStats * stats, int levels, int level, uint64_t nodes, uint64_t uniform);
+
+/**
+ * @brief Counts the fields of Q1 (or Q2) nodes written or read by a coding loop.
+ * @param stats Statistics to update, nothing is done if NULL.
+ * @param moyennes Number of `moyenne` fields (8 bits each).
+ * @param epsilons Number of `epsilon` fields (2 bits each).
+ * @param us Number of `u` fields (1 bit each).
+ */
+void stats_fields(QtcStats * stats, uint64_t moyennes, uint64_t epsilons, uint64_t us);
+
+/**
+ * @brief Counts the rANS cost of the symbols of Q3 levels coded or decoded.
+ * @param stats Statistics to update, nothing is done if NULL.
+ * @param levels Levels of the Quadtree.
+ * @param last Last level coded.
+ * @param models Models of every level (see QTC_Q3_FLAGS for their order).
+ * @param counts RANS_MAX_SYMBOLS counters per model, the symbols coded.
+ */
+void stats_q3_fields(QtcStats * stats, int levels, int last, const RansModel * models, const uint32_t * counts);
+
+/**
+ * @brief Counts the bits of a whole payload that are not in the fields, once it is coded.
+ * @param stats Statistics to update, nothing is done if NULL.
+ * @param format Format of the payload.
+ * @param fields Bits of the fields before the payload was coded (see stats_field_bits()).
+ * @param bytes Size of the payload.
+ */
+void stats_payload(QtcStats * stats, int format, uint64_t fields, uint64_t bytes);
+
+/**
+ * @brief Returns the bits of the fields counted so far.
+ * @param stats Current statistics, NULL gives 0.
+ * @return Sum of the `moyenne`, `epsilon` and `u` bits.
+ */
+uint64_t stats_field_bits(const QtcStats * stats);
+
+/**
+ * @brief Adds the node and bits counters of a part of the work (one thread) to the statistics.
+ * @param stats Statistics to update, nothing is done if NULL.
+ * @param part Counters of the part.
+ */
+void merge_stats(QtcStats * stats, const QtcStats * part);
+
+/**
+ * @brief Counts the uniform non-leaf nodes of a Quadtree (filtrage() only turns `u` on).
+ * @param quadtree Current Quadtree.
+ * @return Number of nodes whose `u` is 1.
+ */
+uint64_t count_uniform_nodes(const Quadtree * quadtree);
+
+/**
+ * @brief Returns the PSNR of 8 bit pixels from their squared error.
+ * @param squared_error Sum of the squared differences between the decoded pixels and the pixels.
+ * @param pixels Number of pixels.
+ * @return PSNR in dB, INFINITY if the error is 0.
+ */
+double psnr_of_error(uint64_t squared_error, uint64_t pixels);
+
+/**
+ * @brief Prints the statistics, one value per line.
+ * @param out Output stream.
+ * @param stats Statistics to print.
+ */
+void print_stats(FILE * out, const QtcStats * stats);
+
+#endif // STATS_H
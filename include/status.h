@@ -0,0 +1,21 @@
+/**
+ * @file status.h
+ * @brief Status codes returned by the functions that don't exit on errors.
+ */
+
+#ifndef STATUS_H
+#define STATUS_H
+
+/**
+ * @enum QtcStatus
+ * @brief Result of a library call.
+ */
+typedef enum {
+    QTC_OK = 0,                 ///< Success.
+    QTC_ERROR_ARGUMENT = -1,    ///< Invalid argument (unsupported image size, NULL pointer...).
+    QTC_ERROR_MEMORY = -2,      ///< Memory allocation failed.
+    QTC_ERROR_CORRUPT = -3,     ///< Invalid or truncated QTC data.
+    QTC_ERROR_BUFFER = -4       ///< Output buffer too small.
+} QtcStatus;
+
+#endif // STATUS_H
@@ -8,37 +8,170 @@
 
 #include <string.h>
 #include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
 #include "quadtree.h"
 #include "image.h"
 #include "bit.h"
+#include "index.h"
+#include "segmentation_grid.h"
+
+#define QTC_DATE_COMMENT_SIZE 128 // Compression date comment line of a QTC file, with its end of line and '\0'
 
 /**
  * @brief Reads a PGM image from a file.
- * @param filename Path to the PGM file.
+ * @param filename Path to the PGM file, "-" for the standard input.
  * @return Pointer to the allocated Image structure.
  */
 Image * read_pgm(const char *filename);
 
+/**
+ * @brief Reads a PGM image from a file, its pixels in the given order.
+ * @param filename Path to the PGM file, "-" for the standard input.
+ * @param layout Order of the pixels, IMAGE_LEAF_ORDER is only used for a size power of 2.
+ * @return Pointer to the allocated Image structure.
+ */
+Image * read_pgm_layout(const char * filename, ImageLayout layout);
+
+/**
+ * @brief Reads a PGM image from a file, its pixels in the given order, without exiting on errors (the cause is printed).
+ * @param filename Path to the PGM file, "-" for the standard input.
+ * @param layout Order of the pixels, IMAGE_LEAF_ORDER is only used for a size power of 2.
+ * @param image Allocated Image on output, NULL on errors.
+ * @return QTC_OK, QTC_ERROR_ARGUMENT for a file that can't be opened or an image that can't be compressed,
+ * QTC_ERROR_CORRUPT for an invalid or truncated file, or QTC_ERROR_MEMORY.
+ */
+QtcStatus load_pgm(const char * filename, ImageLayout layout, Image ** image);
+
+/**
+ * @brief Reads a multi-plane image from a PPM (P6, RGB) or PAM (P7, up to 4 planes) file.
+ * @param filename Path to the PPM or PAM file, "-" for the standard input.
+ * @return Pointer to the allocated ColorImage structure.
+ */
+ColorImage * read_ppm(const char * filename);
+
 /**
  * @brief Writes a BitStream to a QTC file.
- * @param filename Path to the output QTC file.
+ * @param filename Path to the output QTC file, "-" for the standard output.
  * @param stream Pointer to the BitStream o write.
  * @param quadtree Pointer to the associaed Quadtree.
+ * @param comments Writes the date and compression rate comments if not 0 (0 makes the output only depend on the input).
  */
-void write_qtc(const char *filename, BitStream *stream, Quadtree *quadtree);
+void write_qtc(const char *filename, BitStream *stream, Quadtree *quadtree, int comments);
+
+/**
+ * @brief Writes the planes of an image to a QTC file at Q5 format.
+ * @param filename Path to the output QTC file, "-" for the standard output.
+ * @param streams Payloads of the planes, as given by encode_planes().
+ * @param planes Number of planes.
+ * @param flags Flags given to encode_planes().
+ * @param width Width (and height) of the image.
+ * @param comments Writes the date and compression rate comments if not 0.
+ */
+void write_qtc_planes(const char * filename, BitStream ** streams, int planes, int flags, int width, int comments);
+
+/**
+ * @brief Compresses a P5 PGM image into a Q2 file, reading it by bands to stay under a memory cap.
+ * @param input_file Path to the P5 PGM image (square, with a size power of 2).
+ * @param output_file Path to the output QTC file.
+ * @param alpha Filtering parameter, 0 for a lossless compression.
+ * @param threads Number of threads used to build each subtree.
+ * @param memory_cap Memory cap in bytes.
+ * @param comments Writes the date comment if not 0.
+ * @param chunks_level Level of the chunks roots used on output.
+ * @return QTC_OK, QTC_ERROR_ARGUMENT for a file that can't be opened or isn't a P5 image that can be compressed,
+ * QTC_ERROR_CORRUPT for an invalid or truncated image, QTC_ERROR_MEMORY, or QTC_ERROR_BUFFER if the output
+ * can't be written (nothing is written then).
+ */
+QtcStatus write_qtc_streaming(const char * input_file, const char * output_file, double alpha, int threads, size_t memory_cap,
+                              int comments, int * chunks_level);
+
+/**
+ * @brief Returns the offset of the encoded data in the content of a QTC file (after the format and comment lines).
+ * @param data Content of the QTC file.
+ * @param size Size of the content in bytes.
+ * @return Offset of the first byte of encoded data.
+ */
+size_t skip_qtc_header(const unsigned char * data, size_t size);
+
+/**
+ * @brief Returns the format of a QTC file from its format line.
+ * @param data Content of the QTC file.
+ * @param size Size of the content in bytes.
+ * @return 2 for a Q2 file, 3 for a Q3 file, 4 for a delta frame (Q4), 5 for a multi-plane file (Q5), 1 otherwise.
+ */
+int qtc_format(const unsigned char * data, size_t size);
+
+/**
+ * @brief Copies the compression date comment line of a QTC header, for the comments of the decoded image.
+ * @param data Content of the QTC file, from its format line.
+ * @param size Size of the content in bytes.
+ * @param date Buffer of QTC_DATE_COMMENT_SIZE bytes receiving the line, empty if the header has none.
+ */
+void qtc_compression_date(const unsigned char * data, size_t size, char * date);
 
 /**
  * @brief Reads a BitStream from a QTC file.
- * @param filename Path to the QTC file.
+ * @param filename Path to the QTC file, "-" for the standard input.
+ * @param date Buffer of QTC_DATE_COMMENT_SIZE bytes receiving the compression date comment line (see qtc_compression_date()), NULL if not wanted.
  * @return Pointer to the reconstructed BitStream.
  */
-BitStream * read_qtc(const char *filename);
+BitStream * read_qtc(const char *filename, char * date);
+
+/**
+ * @brief Writes the seek index of a Q1 file (.qtci sidecar).
+ * @param filename Path to the index file.
+ * @param index Index to write.
+ */
+void write_qtc_index(const char * filename, const QtcIndex * index);
+
+/**
+ * @brief Writes the list of the uniform blocs of a segmentation grid (compact binary format).
+ * @param filename Path to the block list file.
+ * @param grid Grid whose blocs are listed.
+ * @param width Side of the image.
+ */
+void write_grid_blocs(const char * filename, const SegmentationGrid * grid, int width);
+
+/**
+ * @brief Reads the seek index of a Q1 file.
+ * @param filename Path to the index file.
+ * @param index Index on output, to free with free_qtc_index().
+ */
+void read_qtc_index(const char * filename, QtcIndex * index);
+
+/**
+ * @brief Writes pixels as a PGM image in P5 format, not necessarily square.
+ * @param filename Path to the output PGM file, "-" for the standard output.
+ * @param pixels Pixels of the image, row by row.
+ * @param width Width of the image.
+ * @param height Height of the image.
+ * @param max_val Maximum grayscale value.
+ * @param comments Writes the date comments if not 0.
+ * @param date Compression date comment line of the decoded QTC file, NULL or empty if unknown.
+ */
+void write_pgm_pixels(const char * filename, const unsigned char * pixels, int width, int height, int max_val, int comments, const char * date);
 
 /**
  * @brief Writes a PGM image in P5 format.
- * @param filename Path to the output PGM file.
+ * @param filename Path to the output PGM file, "-" for the standard output.
  * @param image Pointer to the Image structure to write.
+ * @param comments Writes the date comments if not 0.
+ * @param date Compression date comment line of the decoded QTC file, NULL or empty if unknown.
+ */
+void write_pgm(const char * filename, Image * image, int comments, const char * date);
+
+/**
+ * @brief Writes a multi-plane image in P6 format (3 planes) or P7 format (PAM, any other number of planes).
+ * @param filename Path to the output file, "-" for the standard output.
+ * @param image Pointer to the ColorImage structure to write.
+ * @param comments Writes the date comments if not 0.
+ * @param date Compression date comment line of the decoded QTC file, NULL or empty if unknown.
  */
-void write_pgm(const char * filename, Image * image);
+void write_ppm(const char * filename, const ColorImage * image, int comments, const char * date);
 
 #endif // UTILS_H
\ No newline at end of file
@@ -10,5 +10,15 @@
 #include "segmentation_grid.h"
 #include "encode.h"
 #include "decode.h"
+#include "batch.h"
+#include "context.h"
+#include "codec.h"
+#include "rate.h"
+#include "rans.h"
+#include "delta.h"
+#include "index.h"
+#include "stats.h"
+#include "server.h"
+#include "planes.h"
 
 #endif // QTC_H
\ No newline at end of file
@@ -0,0 +1,479 @@
+/**
+ * @file batch.c
+ * @brief Implementation of the batch mode.
+ * 
+ * The input files are listed first (from a directory, a manifest or a glob pattern), then the workers
+ * take them one by one until the list is empty. Each output goes in the output directory,
+ * at the same relative path as its input with the extension of the output format.
+ * A sequence is coded by a single worker in the order of the list, each frame after the first one
+ * as a delta of the previous one, or as a key frame when the delta isn't smaller.
+ */
+
+#include "batch.h"
+
+/**
+ * @struct FileList
+ * @brief Growable list of input paths with their relative path in the output tree.
+ */
+typedef struct {
+    char ** paths;          // Input paths
+    char ** relatives;      // Relative paths of the outputs (with the input extension)
+    size_t count;
+    size_t capacity;
+} FileList;
+
+/**
+ * @struct BatchState
+ * @brief State shared by the workers.
+ */
+typedef struct {
+    const FileList * files;
+    const BatchOptions * options;
+    const char * output_dir;
+    size_t next;            // Next file to process
+    size_t failed;          // Files that couldn't be processed
+    uint64_t bytes;         // Input bytes processed
+    pthread_mutex_t lock;
+} BatchState;
+
+/**
+ * @brief Duplicates a string, exits on allocation failure.
+ * 
+ * @param s String to duplicate.
+ * @return Allocated copy.
+ */
+static char * batch_strdup(const char * s) {
+    char * copy = strdup(s);
+    if (!copy) {
+        fprintf(stderr, "Error while allocating memory for the batch file list.\n");
+        exit(EXIT_FAILURE);
+    }
+    return copy;
+}
+
+/**
+ * @brief Adds a file to the list.
+ * 
+ * @param list List to add to.
+ * @param path Input path.
+ * @param relative Relative path of the output, leading `/` and `./` are removed.
+ */
+static void add_file(FileList * list, const char * path, const char * relative) {
+    if (list->count == list->capacity) {
+        list->capacity = list->capacity ? 2 * list->capacity : 64;
+        list->paths = (char **) realloc(list->paths, list->capacity * sizeof(char *));
+        list->relatives = (char **) realloc(list->relatives, list->capacity * sizeof(char *));
+        if (!list->paths || !list->relatives) {
+            fprintf(stderr, "Error while allocating memory for the batch file list.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    while (*relative == '/' || (relative[0] == '.' && relative[1] == '/')) relative += *relative == '/' ? 1 : 2;
+    list->paths[list->count] = batch_strdup(path);
+    list->relatives[list->count] = batch_strdup(relative);
+    list->count++;
+}
+
+/**
+ * @brief Checks the extension of a path.
+ * 
+ * @param path Path to check.
+ * @param extension Expected extension, without the dot.
+ * @return 1 if the path has this extension, 0 otherwise.
+ */
+static int has_extension(const char * path, const char * extension) {
+    const char * dot = strrchr(path, '.');
+    return dot && !strchr(dot, '/') && !strcmp(dot + 1, extension);
+}
+
+/**
+ * @brief Adds the files of a directory and its subdirectories that have the given extension.
+ * 
+ * @param list List to add to.
+ * @param dir Path of the directory.
+ * @param root Length of the path of the walked root directory, to make the relative paths.
+ * @param extension Extension of the input files.
+ */
+static void walk_directory(FileList * list, const char * dir, size_t root, const char * extension) {
+    DIR * d = opendir(dir);
+    if (!d) {
+        fprintf(stderr, "Error while opening directory %s\n", dir);
+        exit(EXIT_FAILURE);
+    }
+    struct dirent * entry;
+    while ((entry = readdir(d))) {
+        if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, "..")) continue;
+        char path[PATH_MAX];
+        if (snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name) >= (int) sizeof(path)) continue;
+        struct stat st;
+        if (stat(path, &st)) continue;
+        if (S_ISDIR(st.st_mode)) {
+            walk_directory(list, path, root, extension);
+        } else if (S_ISREG(st.st_mode) && has_extension(path, extension)) {
+            add_file(list, path, path + root);
+        }
+    }
+    closedir(d);
+}
+
+/**
+ * @brief Adds the paths of a manifest file, one per line (empty lines and lines starting with `#` are skipped).
+ * 
+ * @param list List to add to.
+ * @param manifest Path of the manifest.
+ */
+static void read_manifest(FileList * list, const char * manifest) {
+    FILE * file = fopen(manifest, "r");
+    if (!file) {
+        fprintf(stderr, "Error while opening file %s\n", manifest);
+        exit(EXIT_FAILURE);
+    }
+    char line[PATH_MAX];
+    while (fgets(line, sizeof(line), file)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] && line[0] != '#') add_file(list, line, line);
+    }
+    fclose(file);
+}
+
+/**
+ * @brief Compares two paths for qsort().
+ * 
+ * @param a Pointer to the first path.
+ * @param b Pointer to the second path.
+ * @return Order of the paths.
+ */
+static int compare_paths(const void * a, const void * b) {
+    return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+/**
+ * @brief Lists the input files of a batch.
+ * 
+ * A directory is walked recursively for the files with the input extension (listed in path order), an existing
+ * file with another extension is a manifest (kept in its order), anything else is a glob pattern (sorted).
+ * 
+ * @param list List to fill.
+ * @param input Directory, manifest or glob pattern.
+ * @param extension Extension of the input files.
+ */
+static void list_files(FileList * list, const char * input, const char * extension) {
+    struct stat st;
+    if (!stat(input, &st) && S_ISDIR(st.st_mode)) {
+        size_t root = strlen(input);
+        while (root > 1 && input[root - 1] == '/') root--;
+        char dir[PATH_MAX];
+        snprintf(dir, sizeof(dir), "%.*s", (int) root, input);
+        walk_directory(list, dir, root + 1, extension);
+        // The relative paths are the paths without the same prefix, both arrays sorted on their own stay paired
+        qsort(list->paths, list->count, sizeof(char *), compare_paths);
+        qsort(list->relatives, list->count, sizeof(char *), compare_paths);
+    } else if (!stat(input, &st) && S_ISREG(st.st_mode) && !has_extension(input, extension)) {
+        read_manifest(list, input);
+    } else {
+        glob_t matches;
+        if (glob(input, 0, NULL, &matches) == 0) {
+            for (size_t i = 0; i < matches.gl_pathc; i++) add_file(list, matches.gl_pathv[i], matches.gl_pathv[i]);
+        }
+        globfree(&matches);
+    }
+}
+
+/**
+ * @brief Creates the missing parent directories of a path.
+ * 
+ * @param path Path of a file.
+ */
+static void make_parents(const char * path) {
+    char dir[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%s", path);
+    for (char * slash = strchr(dir + 1, '/'); slash; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        if (mkdir(dir, 0755) && errno != EEXIST) {
+            fprintf(stderr, "Error while creating directory %s\n", dir);
+            exit(EXIT_FAILURE);
+        }
+        *slash = '/';
+    }
+}
+
+/**
+ * @brief Maps a QTC file of the batch, a file that can't be read is a status instead of exiting as with read_qtc().
+ * 
+ * Same loading as the tile server: the file is mapped, then the BitStream points at the data
+ * after the format and comment lines, with the format of the file.
+ * 
+ * @param path Path of the file.
+ * @param stream BitStream over the encoded data on output, to free with freeBitStream() (which unmaps the file), NULL on errors.
+ * @param date Buffer of QTC_DATE_COMMENT_SIZE bytes receiving the compression date comment line of the file.
+ * @return QTC_OK, QTC_ERROR_CORRUPT for a file that can't be opened or without a QTC format line, or QTC_ERROR_MEMORY.
+ */
+static QtcStatus map_qtc(const char * path, BitStream ** stream, char * date) {
+    *stream = NULL;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return QTC_ERROR_CORRUPT;
+    struct stat st;
+    if (fstat(fd, &st) || st.st_size < 2) {
+        close(fd);
+        return QTC_ERROR_CORRUPT;
+    }
+    size_t size = st.st_size;
+    unsigned char * data = (unsigned char *) mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd); // The mapping stays valid after closing the file
+    if (data == MAP_FAILED) return QTC_ERROR_MEMORY;
+    if (data[0] != 'Q' || data[1] < '1' || data[1] > '5') {
+        munmap(data, size);
+        return QTC_ERROR_CORRUPT;
+    }
+    madvise(data, size, MADV_SEQUENTIAL);
+    size_t offset = skip_qtc_header(data, size);
+    *stream = initReadBitStream(data + offset, size - offset, data, size);
+    (*stream)->format = qtc_format(data, size);
+    qtc_compression_date(data, size, date);
+    return QTC_OK;
+}
+
+/**
+ * @brief Decodes a frame of a sequence into the reference of the next one.
+ * 
+ * A delta frame patches the reference, a full frame replaces it once it is decoded whole,
+ * so a corrupted full frame leaves the reference as it was.
+ * 
+ * @param reference Decoded Quadtree of the previous frame, NULL before the first one.
+ * @param stream Frame, Q4 only if there is a reference of the same levels.
+ * @param context Context of the worker.
+ * @return QTC_OK, QTC_ERROR_ARGUMENT for a delta frame without its reference, QTC_ERROR_CORRUPT or QTC_ERROR_MEMORY.
+ */
+static QtcStatus update_reference(Quadtree ** reference, BitStream * stream, QtcContext * context) {
+    BitStream payload;
+    initReadBitStreamOver(&payload, stream->start, stream->ptr - stream->start);
+    payload.format = stream->format;
+    if (stream->format == 4) return *reference ? decode_delta_into(&payload, *reference, context) : QTC_ERROR_ARGUMENT;
+    Quadtree * decoded;
+    QtcStatus status = decode_quadtree_into(&payload, 1, context, &decoded);
+    if (status != QTC_OK) return status;
+    if (*reference) free_quadtree(*reference);
+    *reference = decoded;
+    return QTC_OK;
+}
+
+/**
+ * @brief Decodes a Q5 file of the batch into a P6 image (3 planes) or a P7 image.
+ * 
+ * The extension of the output path is replaced by the one of the image.
+ * 
+ * @param stream BitStream holding a Q5 payload.
+ * @param output Output path, ending with a 3 letter extension.
+ * @param options Parameters of the batch.
+ * @param date Compression date comment line of the file.
+ * @return QTC_OK, QTC_ERROR_ARGUMENT with --max-level (the planes are decoded whole), or the status of the decoding.
+ */
+static QtcStatus decode_color_file(BitStream * stream, char * output, const BatchOptions * options, const char * date) {
+    if (options->max_level < QUADTREE_MAX_LEVELS) {
+        fprintf(stderr, "A Q5 file is decoded whole, without --max-level.\n");
+        return QTC_ERROR_ARGUMENT;
+    }
+    int width, planes;
+    QtcStatus status = decoded_planes_size(stream, &width, &planes);
+    if (status != QTC_OK) return status;
+    ColorImage * image = allocate_color_image(width, planes, 255);
+    status = decode_planes_into(stream, image, 1);
+    if (status == QTC_OK) {
+        memcpy(output + strlen(output) - 3, planes == 3 ? "ppm" : "pam", 3);
+        write_ppm(output, image, options->comments, date);
+    }
+    free_color_image(image);
+    return status;
+}
+
+/**
+ * @brief Encodes or decodes one file of the batch on the calling thread.
+ * 
+ * The Quadtree, BitStream and decoded Image live in the context of the worker,
+ * so files of the same size don't allocate them again.
+ * A file that can't be coded is reported and left out, the batch goes on with the next one.
+ * In a sequence, the reference is then dropped: the next frame is encoded as a full frame,
+ * and decoding resumes at the next full frame.
+ * 
+ * @param input Input path.
+ * @param output Output path, its extension becomes .ppm or .pam for a Q5 file.
+ * @param options Parameters of the batch.
+ * @param context Context of the worker.
+ * @param reference Decoded Quadtree of the previous frame of a sequence, NULL out of a sequence.
+ * @return QTC_OK, or the status of the failure (nothing is written then).
+ */
+static QtcStatus process_file(const char * input, char * output, const BatchOptions * options, QtcContext * context, Quadtree ** reference) {
+    QtcStatus status = QTC_OK;
+    if (options->encode && options->memory_cap) {
+        int split;
+        status = write_qtc_streaming(input, output, options->alpha, 1, options->memory_cap, options->comments, &split);
+    } else if (options->encode) {
+        Image * image;
+        status = load_pgm(input, IMAGE_LEAF_ORDER, &image);
+        Quadtree * quadtree;
+        if (status == QTC_OK) status = build_quadtree_in_context(image, 1, context, &quadtree);
+        if (status == QTC_OK) {
+            if (options->alpha) filtrage(quadtree, 0, 0, quadtree->medvar / quadtree->maxvar, options->alpha);
+            // A frame with a reference of the same levels is also coded as a delta, in the second half of the buffer
+            int delta = reference && *reference && (*reference)->levels == quadtree->levels;
+            size_t bound = encoded_size_bound(quadtree->levels);
+            unsigned char * buffer = (unsigned char *) scratch_reserve(&context->stream, delta ? 2 * bound : bound);
+            BitStream stream, delta_stream;
+            if (!buffer) {
+                status = QTC_ERROR_MEMORY;
+            } else {
+                initBitStreamOver(&stream, buffer, bound);
+                status = encode_to_stream(&stream, quadtree, options->format, context);
+            }
+            if (status == QTC_OK && delta) {
+                initBitStreamOver(&delta_stream, buffer + bound, bound);
+                status = encode_delta_to_stream(&delta_stream, quadtree, *reference, context);
+                // A scene change makes the delta larger than the full frame, which becomes a key frame
+                if (status == QTC_OK && delta_stream.ptr - delta_stream.start < stream.ptr - stream.start) stream = delta_stream;
+            }
+            if (status == QTC_OK) write_qtc(output, &stream, quadtree, options->comments);
+            // The reference of the next frame is this one as it is decoded
+            if (status == QTC_OK && reference) status = update_reference(reference, &stream, context);
+        }
+        if (image) free_image(image);
+    } else if (reference) {
+        BitStream * stream;
+        char date[QTC_DATE_COMMENT_SIZE];
+        status = map_qtc(input, &stream, date);
+        if (status == QTC_OK) status = update_reference(reference, stream, context);
+        if (status == QTC_OK) {
+            // The pixels of the frame are the leaf level of the reference, in raster order
+            Quadtree * frame = *reference;
+            int width = 1 << frame->levels;
+            Image image = {width, (size_t) width * width, 255, frame->levels ? frame->pixels : frame->moyennes[0], IMAGE_RASTER};
+            write_pgm(output, &image, options->comments, date);
+        }
+        if (stream) freeBitStream(stream);
+    } else {
+        BitStream * stream;
+        char date[QTC_DATE_COMMENT_SIZE];
+        status = map_qtc(input, &stream, date);
+        if (status == QTC_OK && stream->format == 5) {
+            status = decode_color_file(stream, output, options, date);
+        } else if (status == QTC_OK) {
+            int width;
+            status = decoded_image_width(stream, &width);
+            if (options->max_level < QUADTREE_MAX_LEVELS && width > (1 << options->max_level)) width = 1 << options->max_level;
+            Image * image = (status == QTC_OK) ? context_image(context, width, 0) : NULL;
+            if (status == QTC_OK && !image) status = QTC_ERROR_MEMORY;
+            if (status == QTC_OK) status = decode_image_into(stream, image, 1, context);
+            if (status == QTC_OK) write_pgm(output, image, options->comments, date);
+        }
+        if (stream) freeBitStream(stream);
+    }
+    if (status == QTC_OK) return QTC_OK;
+    if (status == QTC_ERROR_MEMORY) {
+        fprintf(stderr, "Error while allocating memory for %s, skipped\n", input);
+    } else {
+        fprintf(stderr, "Invalid file %s, skipped\n", input);
+    }
+    if (reference && *reference) {
+        free_quadtree(*reference);
+        *reference = NULL;
+    }
+    return status;
+}
+
+/**
+ * @brief Worker of the batch: processes the next file of the list until there is none.
+ * 
+ * @param arg Pointer to the BatchState.
+ * @return NULL.
+ */
+static void * batch_worker(void * arg) {
+    BatchState * state = (BatchState *) arg;
+    const char * extension = state->options->encode ? "qtc" : "pgm";
+    QtcContext context;
+    init_context(&context);
+    Quadtree * reference = NULL;
+    for (;;) {
+        pthread_mutex_lock(&state->lock);
+        size_t i = state->next++;
+        pthread_mutex_unlock(&state->lock);
+        if (i >= state->files->count) break;
+
+        // Output path: same relative path in the output directory, with the output extension
+        const char * relative = state->files->relatives[i];
+        const char * dot = strrchr(relative, '.');
+        int stem = (dot && !strchr(dot, '/')) ? (int) (dot - relative) : (int) strlen(relative);
+        char output[PATH_MAX];
+        snprintf(output, sizeof(output), "%s/%.*s.%s", state->output_dir, stem, relative, extension);
+        make_parents(output);
+
+        struct stat st;
+        uint64_t size = stat(state->files->paths[i], &st) ? 0 : (uint64_t) st.st_size;
+        QtcStatus status = process_file(state->files->paths[i], output, state->options, &context, state->options->sequence ? &reference : NULL);
+        pthread_mutex_lock(&state->lock);
+        state->bytes += size;
+        state->failed += status != QTC_OK;
+        pthread_mutex_unlock(&state->lock);
+        if (status == QTC_OK && state->options->verbose) fprintf(stdout, "File written: %s\n", output);
+    }
+    if (reference) free_quadtree(reference);
+    release_context(&context);
+    return NULL;
+}
+
+/**
+ * @brief Encodes or decodes a set of files with a pool of worker threads.
+ * 
+ * Each worker processes whole files on its own, one after the other. A file that fails is reported
+ * and skipped. The total throughput (images/s and MB/s of input) and the number of failures are printed at the end.
+ * 
+ * @param input Directory (walked recursively), manifest file (one path per line) or glob pattern.
+ * @param output_dir Directory receiving the outputs, mirroring the input tree.
+ * @param options Parameters of the batch.
+ * @param failed Number of files that couldn't be processed on output.
+ * @return Number of files listed.
+ */
+size_t run_batch(const char * input, const char * output_dir, const BatchOptions * options, size_t * failed) {
+    *failed = 0;
+    FileList files = {NULL, NULL, 0, 0};
+    list_files(&files, input, options->encode ? "pgm" : "qtc");
+    if (!files.count) {
+        fprintf(stderr, "No input file found for %s\n", input);
+        return 0;
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    BatchState state = {&files, options, output_dir, 0, 0, 0, PTHREAD_MUTEX_INITIALIZER};
+    int workers = (options->workers < 1 || options->sequence) ? 1 : options->workers;
+    if ((size_t) workers > files.count) workers = files.count;
+    pthread_t * threads = (pthread_t *) malloc(workers * sizeof(pthread_t));
+    if (!threads) {
+        fprintf(stderr, "Error while allocating memory for the batch workers.\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 1; i < workers; i++) {
+        if (pthread_create(&threads[i], NULL, batch_worker, &state)) {
+            fprintf(stderr, "Error while creating the batch workers.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    batch_worker(&state);
+    for (int i = 1; i < workers; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+    if (seconds <= 0) seconds = 1e-9;
+    fprintf(stdout, "%zu files (%zu failed) in %.3f s with %d workers: %.1f images/s, %.1f MB/s\n",
+            files.count, state.failed, seconds, workers, files.count / seconds, state.bytes / 1e6 / seconds);
+    *failed = state.failed;
+
+    for (size_t i = 0; i < files.count; i++) {
+        free(files.paths[i]);
+        free(files.relatives[i]);
+    }
+    free(files.paths);
+    free(files.relatives);
+    free(threads);
+    pthread_mutex_destroy(&state.lock);
+    return files.count;
+}
@@ -0,0 +1,414 @@
+/**
+ * @file bench.c
+ * @brief Benchmark of each stage of the codec over the data/ corpus, with a JSON report.
+ *
+ * Every image of data/PGM goes through read_pgm, build_quadtree_from_image, filtrage, encode,
+ * write_qtc, read_qtc, decode, build_image_from_quadtree and write_pgm, every file of
+ * data/QTC.lossless and data/QTC.lossy through the last four. Each stage is timed alone, in a loop,
+ * until its median is stable. A second mode compares two reports and flags the regressions.
+ */
+
+#include "qtc.h"
+#include <getopt.h>
+#include <dirent.h>
+#include <sys/resource.h>
+
+#define BENCH_MIN_RUNS 10       // Runs before a median is compared with the previous one
+#define BENCH_MAX_RUNS 10000    // Runs of a stage at most
+#define BENCH_BATCH 5           // Runs between two checks of the median
+#define BENCH_STABLE 0.01       // Largest relative change of the median between two checks of a stable stage
+#define BENCH_PATH 512
+
+/**
+ * @struct BenchState
+ * @brief Inputs of the stages of one file, each stage reusing the outputs kept from the previous ones.
+ */
+typedef struct {
+    const char * path;      // File benchmarked
+    const char * qtc_file;  // Temporary QTC file
+    const char * pgm_file;  // Temporary PGM file
+    double alpha;           // Filtering parameter of the filtrage stage
+    Image * image;          // Image read from `path`
+    Quadtree * quadtree;    // Quadtree of `image`, unfiltered
+    BitStream * stream;     // Encoded or read BitStream
+    Quadtree * decoded;     // Quadtree decoded from `stream`
+    Image * built;          // Image built from `decoded`
+    void * prepared;        // Input prepared for one run, outside of the timing
+    void * output;          // Output of one run, freed outside of the timing
+} BenchState;
+
+/**
+ * @struct BenchStage
+ * @brief One function of the codec, with what has to be done around each run without being timed.
+ */
+typedef struct {
+    const char * name;
+    void (* prepare)(BenchState * state);   // Before each run, can be NULL
+    void (* run)(BenchState * state);       // Timed
+    void (* release)(BenchState * state);   // After each run, can be NULL
+} BenchStage;
+
+/**
+ * @struct BenchResult
+ * @brief Timings of one stage on one file.
+ */
+typedef struct {
+    char file[BENCH_PATH];
+    char stage[64];
+    int runs;
+    int stable;             // Set if the median settled before the time budget
+    size_t bytes;           // Raw size of the image (one byte per pixel), used for the throughput
+    double median_ms;
+    double max_ms;          // Slowest run, the runs are too few for a meaningful p99
+    double mb_per_s;
+    long peak_rss_kb;       // Peak resident set size during the stage
+} BenchResult;
+
+// Stages, each one works on the outputs kept from the previous ones
+static void run_read_pgm(BenchState * s) { s->output = read_pgm(s->path); }
+static void release_image(BenchState * s) { free_image((Image *) s->output); }
+static void run_build(BenchState * s) { s->output = build_quadtree_from_image(s->image); }
+static void release_quadtree(BenchState * s) { free_quadtree((Quadtree *) s->output); }
+static void prepare_filtrage(BenchState * s) {
+    s->prepared = try_create_quadtree_view(s->quadtree);
+    if (!s->prepared) {
+        fprintf(stderr, "Error while allocating memory for the filtering.\n");
+        exit(EXIT_FAILURE);
+    }
+}
+static void run_filtrage(BenchState * s) {
+    Quadtree * view = (Quadtree *) s->prepared;
+    filtrage(view, 0, 0, view->medvar / view->maxvar, s->alpha);
+}
+static void release_filtrage(BenchState * s) { free_quadtree((Quadtree *) s->prepared); }
+static void run_encode(BenchState * s) { s->output = encode(s->quadtree); }
+static void release_stream(BenchState * s) { freeBitStream((BitStream *) s->output); }
+static void run_write_qtc(BenchState * s) { write_qtc(s->qtc_file, s->stream, s->quadtree, 0); }
+static void run_read_qtc(BenchState * s) { s->output = read_qtc(s->path, NULL); }
+static void prepare_decode(BenchState * s) {
+    // Reading moves the start of the stream, each run reads its own copy
+    static BitStream copy;
+    copy = *s->stream;
+    s->prepared = &copy;
+}
+static void run_decode(BenchState * s) { s->output = decode((BitStream *) s->prepared); }
+static void run_build_image(BenchState * s) { s->output = build_image_from_quadtree(s->decoded); }
+static void run_write_pgm(BenchState * s) { write_pgm(s->pgm_file, s->built, 0, NULL); }
+
+static const BenchStage stage_read_pgm = {"read_pgm", NULL, run_read_pgm, release_image};
+static const BenchStage stage_build = {"build_quadtree_from_image", NULL, run_build, release_quadtree};
+static const BenchStage stage_filtrage = {"filtrage", prepare_filtrage, run_filtrage, release_filtrage};
+static const BenchStage stage_encode = {"encode", NULL, run_encode, release_stream};
+static const BenchStage stage_write_qtc = {"write_qtc", NULL, run_write_qtc, NULL};
+static const BenchStage stage_read_qtc = {"read_qtc", NULL, run_read_qtc, release_stream};
+static const BenchStage stage_decode = {"decode", prepare_decode, run_decode, release_quadtree};
+static const BenchStage stage_build_image = {"build_image_from_quadtree", NULL, run_build_image, release_image};
+static const BenchStage stage_write_pgm = {"write_pgm", NULL, run_write_pgm, NULL};
+
+// Function that returns the time of a monotonic clock in seconds
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Function that compares two doubles for qsort
+static int compare_doubles(const void * a, const void * b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+// Function that resets the peak resident set size of the process, returns 0 if the kernel doesn't support it
+static int reset_peak_rss(void) {
+    FILE * file = fopen("/proc/self/clear_refs", "w");
+    if (!file) return 0;
+    int done = fputs("5", file) >= 0;
+    return fclose(file) == 0 && done;
+}
+
+// Function that returns the peak resident set size in kB since the last reset (or since the start)
+static long peak_rss_kb(void) {
+    FILE * file = fopen("/proc/self/status", "r");
+    char line[256];
+    long peak = -1;
+    while (file && fgets(line, sizeof(line), file)) {
+        if (sscanf(line, "VmHWM: %ld", &peak) == 1) break;
+    }
+    if (file) fclose(file);
+    if (peak < 0) {
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        peak = usage.ru_maxrss;
+    }
+    return peak;
+}
+
+// Function that times a stage in a loop, batch after batch, until its median is stable or the time budget is spent
+static void run_stage(const BenchStage * stage, BenchState * state, size_t bytes, double max_time, BenchResult * result) {
+    static double samples[BENCH_MAX_RUNS];
+    static double sorted[BENCH_MAX_RUNS];
+    reset_peak_rss();
+    int runs = 0, stable = 0;
+    double previous = 0., median = 0., start = now_seconds();
+    // The first run warms up the caches and the page tables, it is not counted
+    for (int warmup = 1; runs < BENCH_MAX_RUNS; warmup = 0) {
+        for (int b = 0; b < (warmup ? 1 : BENCH_BATCH) && runs < BENCH_MAX_RUNS; b++) {
+            if (stage->prepare) stage->prepare(state);
+            double t0 = now_seconds();
+            stage->run(state);
+            double t1 = now_seconds();
+            if (stage->release) stage->release(state);
+            if (!warmup) samples[runs++] = t1 - t0;
+        }
+        if (runs < BENCH_MIN_RUNS) continue;
+        memcpy(sorted, samples, runs * sizeof(double));
+        qsort(sorted, runs, sizeof(double), compare_doubles);
+        median = sorted[runs / 2];
+        if (previous > 0 && fabs(median - previous) <= BENCH_STABLE * previous) {
+            stable = 1;
+            break;
+        }
+        previous = median;
+        if (now_seconds() - start > max_time) break;
+    }
+    snprintf(result->stage, sizeof(result->stage), "%s", stage->name);
+    result->runs = runs;
+    result->stable = stable;
+    result->bytes = bytes;
+    result->median_ms = median * 1e3;
+    result->max_ms = runs ? sorted[runs - 1] * 1e3 : 0.;
+    result->mb_per_s = median > 0 ? bytes / median / 1e6 : 0.;
+    result->peak_rss_kb = peak_rss_kb();
+}
+
+// Function that writes one result as a line of the JSON report
+static void print_result(FILE * out, const BenchResult * r, int last) {
+    fprintf(out, "    {\"file\": \"%s\", \"stage\": \"%s\", \"runs\": %d, \"stable\": %s, \"bytes\": %zu, "
+                 "\"median_ms\": %.6f, \"max_ms\": %.6f, \"mb_per_s\": %.3f, \"peak_rss_kb\": %ld}%s\n",
+            r->file, r->stage, r->runs, r->stable ? "true" : "false", r->bytes,
+            r->median_ms, r->max_ms, r->mb_per_s, r->peak_rss_kb, last ? "" : ",");
+}
+
+// Function that lists the files of a directory with an extension, sorted by name
+static int list_files(const char * dir, const char * extension, char paths[][BENCH_PATH], int max) {
+    struct dirent ** entries;
+    int n = scandir(dir, &entries, NULL, alphasort);
+    int count = 0;
+    for (int i = 0; i < n; i++) {
+        const char * dot = strrchr(entries[i]->d_name, '.');
+        if (count < max && dot && !strcmp(dot + 1, extension)) {
+            snprintf(paths[count++], BENCH_PATH, "%s/%s", dir, entries[i]->d_name);
+        }
+        free(entries[i]);
+    }
+    if (n >= 0) free(entries);
+    return count;
+}
+
+// Function that benchmarks every stage on the corpus and writes the JSON report
+static int run_benchmark(const char * data_dir, FILE * out, double alpha, double max_time) {
+    enum { MAX_FILES = 256 };
+    static char pgm[MAX_FILES][BENCH_PATH], qtc[2 * MAX_FILES][BENCH_PATH];
+    char dir[BENCH_PATH];
+    snprintf(dir, sizeof(dir), "%s/PGM", data_dir);
+    int pgm_count = list_files(dir, "pgm", pgm, MAX_FILES);
+    snprintf(dir, sizeof(dir), "%s/QTC.lossless", data_dir);
+    int qtc_count = list_files(dir, "qtc", qtc, MAX_FILES);
+    snprintf(dir, sizeof(dir), "%s/QTC.lossy", data_dir);
+    qtc_count += list_files(dir, "qtc", qtc + qtc_count, MAX_FILES);
+    if (!pgm_count && !qtc_count) {
+        fprintf(stderr, "No PGM or QTC file found in %s.\n", data_dir);
+        return EXIT_FAILURE;
+    }
+
+    char tmp_dir[] = "/tmp/qtc_bench.XXXXXX";
+    if (!mkdtemp(tmp_dir)) {
+        fprintf(stderr, "Error while creating a temporary directory.\n");
+        return EXIT_FAILURE;
+    }
+    char qtc_file[64], pgm_file[64];
+    snprintf(qtc_file, sizeof(qtc_file), "%s/out.qtc", tmp_dir);
+    snprintf(pgm_file, sizeof(pgm_file), "%s/out.pgm", tmp_dir);
+
+    const BenchStage * pgm_stages[] = {&stage_read_pgm, &stage_build, &stage_filtrage, &stage_encode, &stage_write_qtc,
+                                       &stage_read_qtc, &stage_decode, &stage_build_image, &stage_write_pgm};
+    const BenchStage * qtc_stages[] = {&stage_read_qtc, &stage_decode, &stage_build_image, &stage_write_pgm};
+    int pgm_stage_count = sizeof(pgm_stages) / sizeof(pgm_stages[0]);
+    int qtc_stage_count = sizeof(qtc_stages) / sizeof(qtc_stages[0]);
+    int total = pgm_count * pgm_stage_count + qtc_count * qtc_stage_count, done = 0;
+
+    fprintf(out, "{\n  \"alpha\": %g,\n  \"max_time_s\": %g,\n  \"results\": [\n", alpha, max_time);
+    for (int f = 0; f < pgm_count + qtc_count; f++) {
+        int is_pgm = f < pgm_count;
+        BenchState state = {is_pgm ? pgm[f] : qtc[f - pgm_count], qtc_file, pgm_file, alpha, NULL, NULL, NULL, NULL, NULL, NULL, NULL};
+        const BenchStage ** stages = is_pgm ? pgm_stages : qtc_stages;
+        int count = is_pgm ? pgm_stage_count : qtc_stage_count;
+        const char * name = state.path;
+        // Raw size of the image, known before the first stage
+        size_t bytes;
+        if (is_pgm) {
+            state.image = read_pgm(state.path);
+            bytes = (size_t) state.image->image_size;
+        } else {
+            state.stream = read_qtc(state.path, NULL);
+            int width;
+            if (decoded_image_width(state.stream, &width) != QTC_OK) {
+                fprintf(stderr, "Invalid QTC file %s\n", state.path);
+                return EXIT_FAILURE;
+            }
+            bytes = (size_t) width * width;
+        }
+        for (int k = 0; k < count; k++) {
+            const BenchStage * stage = stages[k];
+            BenchResult result;
+            run_stage(stage, &state, bytes, max_time, &result);
+            snprintf(result.file, sizeof(result.file), "%s", name);
+            // Outputs kept as inputs of the next stages, the stages after write_qtc read the file it wrote
+            if (stage == &stage_build) {
+                state.quadtree = build_quadtree_from_image(state.image);
+            } else if (stage == &stage_encode) {
+                state.stream = encode(state.quadtree);
+            } else if (stage == &stage_write_qtc) {
+                freeBitStream(state.stream);
+                state.path = qtc_file;
+                state.stream = read_qtc(state.path, NULL);
+            } else if (stage == &stage_decode) {
+                BitStream copy = *state.stream;
+                state.decoded = decode(&copy);
+            } else if (stage == &stage_build_image) {
+                state.built = build_image_from_quadtree(state.decoded);
+            }
+            print_result(out, &result, ++done == total);
+            fflush(out);
+            fprintf(stderr, "[%d/%d] %s %s: %.3f ms\n", done, total, result.file, result.stage, result.median_ms);
+        }
+        if (state.image) free_image(state.image);
+        if (state.quadtree) free_quadtree(state.quadtree);
+        if (state.stream) freeBitStream(state.stream);
+        if (state.decoded) free_quadtree(state.decoded);
+        if (state.built) free_image(state.built);
+    }
+    fprintf(out, "  ]\n}\n");
+    remove(qtc_file);
+    remove(pgm_file);
+    rmdir(tmp_dir);
+    return EXIT_SUCCESS;
+}
+
+// Function that reads the results of a JSON report written by run_benchmark()
+static BenchResult * read_results(const char * filename, int * count) {
+    FILE * file = fopen(filename, "r");
+    if (!file) {
+        fprintf(stderr, "Error while opening file %s\n", filename);
+        exit(EXIT_FAILURE);
+    }
+    int capacity = 64;
+    BenchResult * results = (BenchResult *) malloc(capacity * sizeof(BenchResult));
+    char line[2 * BENCH_PATH];
+    *count = 0;
+    while (results && fgets(line, sizeof(line), file)) {
+        BenchResult r;
+        char stable[8];
+        // The slowest run was named p99_ms in the earlier reports, both names are read
+        if (sscanf(line, " {\"file\": \"%511[^\"]\", \"stage\": \"%63[^\"]\", \"runs\": %d, \"stable\": %7[a-z], \"bytes\": %zu, "
+                         "\"median_ms\": %lf, \"%*[a-z0-9]_ms\": %lf, \"mb_per_s\": %lf, \"peak_rss_kb\": %ld",
+                   r.file, r.stage, &r.runs, stable, &r.bytes, &r.median_ms, &r.max_ms, &r.mb_per_s, &r.peak_rss_kb) != 9) continue;
+        r.stable = !strcmp(stable, "true");
+        if (*count == capacity) {
+            BenchResult * grown = (BenchResult *) realloc(results, 2 * capacity * sizeof(BenchResult));
+            if (!grown) break;
+            results = grown;
+            capacity *= 2;
+        }
+        results[(*count)++] = r;
+    }
+    fclose(file);
+    if (!results || !*count) {
+        fprintf(stderr, "No result found in %s\n", filename);
+        exit(EXIT_FAILURE);
+    }
+    return results;
+}
+
+// Function that compares two reports, regressions are the stages whose median or peak RSS grew by more than the threshold,
+// the slowest run is too noisy over a few runs to be compared
+static int compare_reports(const char * old_file, const char * new_file, double threshold) {
+    int old_count, new_count, regressions = 0, compared = 0;
+    BenchResult * old_results = read_results(old_file, &old_count);
+    BenchResult * new_results = read_results(new_file, &new_count);
+    fprintf(stdout, "%-40s %-26s %12s %12s %8s %8s\n", "file", "stage", "old ms", "new ms", "time", "rss");
+    for (int i = 0; i < new_count; i++) {
+        const BenchResult * n = &new_results[i];
+        const BenchResult * o = NULL;
+        for (int k = 0; k < old_count && !o; k++) {
+            if (!strcmp(old_results[k].file, n->file) && !strcmp(old_results[k].stage, n->stage)) o = &old_results[k];
+        }
+        if (!o) continue;
+        compared++;
+        double time = o->median_ms > 0 ? 100. * (n->median_ms / o->median_ms - 1.) : 0.;
+        double rss = o->peak_rss_kb > 0 ? 100. * ((double) n->peak_rss_kb / o->peak_rss_kb - 1.) : 0.;
+        int regression = time > threshold || rss > threshold;
+        regressions += regression;
+        fprintf(stdout, "%-40s %-26s %12.4f %12.4f %+7.1f%% %+7.1f%%%s\n", n->file, n->stage, o->median_ms, n->median_ms,
+                time, rss, regression ? "  REGRESSION" : "");
+    }
+    fprintf(stdout, "%d stages compared, %d regressions (threshold %.1f%%).\n", compared, regressions, threshold);
+    free(old_results);
+    free(new_results);
+    return regressions ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+// Displays help message (-h) on the standard output
+static void print_help(char ** argv) {
+    fprintf(stdout, " Usage: %s [-d data] [-o report.json] [-a alpha] [-T seconds] [-h]\n"
+                "        %s -C old.json new.json [-r percent]\n"
+                "-d : Directory holding PGM/, QTC.lossless/ and QTC.lossy/ (default data).\n"
+                "-o : Writes the JSON report into a file (default standard output).\n"
+                "-a : Alpha of the filtrage stage (default 1.5).\n"
+                "-T : Time budget of a stage in seconds, when its median doesn't settle before (default 1).\n"
+                "-C : Compares two reports and exits with a failure status if a stage regressed.\n"
+                "-r : Relative growth of the median or of the peak RSS flagged as a regression, in percent (default 10).\n"
+                "-h : Displays this help message.\n", argv[0], argv[0]);
+}
+
+int main(int argc, char ** argv) {
+    const char * data_dir = "data";
+    const char * output_file = NULL;
+    double alpha = 1.5, max_time = 1., threshold = 10.;
+    int compare = 0, option;
+    while ((option = getopt(argc, argv, "d:o:a:T:Cr:h")) != -1) {
+        switch (option) {
+            case 'd': data_dir = optarg; break;
+            case 'o': output_file = optarg; break;
+            case 'a': alpha = atof(optarg); break;
+            case 'T': max_time = atof(optarg); break;
+            case 'C': compare = 1; break;
+            case 'r': threshold = atof(optarg); break;
+            case 'h':
+                print_help(argv);
+                return EXIT_SUCCESS;
+            default:
+                print_help(argv);
+                return EXIT_FAILURE;
+        }
+    }
+    if (compare) {
+        if (argc - optind != 2) {
+            fprintf(stderr, "-C needs the old and the new report.\n");
+            return EXIT_FAILURE;
+        }
+        return compare_reports(argv[optind], argv[optind + 1], threshold);
+    }
+    if (alpha < 0 || max_time <= 0) {
+        fprintf(stderr, "Alpha must be positive and the time budget greater than 0.\n");
+        return EXIT_FAILURE;
+    }
+    FILE * out = output_file ? fopen(output_file, "w") : stdout;
+    if (!out) {
+        fprintf(stderr, "Error while opening file %s\n", output_file);
+        return EXIT_FAILURE;
+    }
+    int status = run_benchmark(data_dir, out, alpha, max_time);
+    if (out != stdout) fclose(out);
+    return status;
+}
@@ -1,154 +1,357 @@
 /**
  * @file bit.c
  * @brief Implementation of a BitStream.
+ *
+ * Bits are written from the most to the least significant position of each byte.
+ * Every read or write works on a whole 64-bit big-endian word starting at the current byte,
+ * so up to BITSTREAM_MAX_BITS bits are moved with a few shifts instead of one bit at a time.
  */
 
 #include "bit.h" 
+#include <sys/mman.h>
+#include <unistd.h>
+#include <errno.h>
 
 /**
  * @brief Initializes a BitStream.
  *
  * Allocates memory for the BitStream and initializes it.
+ * The buffer gets a spare 64-bit word so the last bytes can still be written with a full word store.
  * 
  * @param size Size of the stream in bytes.
  * @return A pointer to the initialized BitStream.
  */
-BitStream * initBitStream(int size) {
-    BitStream * stream = (BitStream *) malloc(sizeof(BitStream));
-    if(!stream) {
-        fprintf(stderr, "Memory allocation for BitStream structure failed.\n");
+BitStream * initBitStream(size_t size) {
+    BitStream * stream = try_initBitStream(size);
+    if (!stream) {
+        fprintf(stderr, "Memory allocation for BitStream failed.\n");
         exit(EXIT_FAILURE);
     }
-    stream->start = (unsigned char *) malloc(sizeof(unsigned char) * size);
+    return stream;
+}
+
+/**
+ * @brief Initializes a BitStream, without exiting if memory allocation fails.
+ *
+ * Same BitStream as initBitStream(), for the code paths that return a status.
+ * 
+ * @param size Size of the stream in bytes.
+ * @return A pointer to the initialized BitStream, NULL if memory allocation fails.
+ */
+BitStream * try_initBitStream(size_t size) {
+    BitStream * stream = (BitStream *) malloc(sizeof(BitStream));
+    if (!stream) return NULL;
+    stream->start = (unsigned char *) malloc(sizeof(unsigned char) * size + sizeof(uint64_t));
     if (!stream->start) {
-        fprintf(stderr, "Memory allocation for BitStream stream failed.\n");
-        exit(EXIT_FAILURE);
+        free(stream);
+        return NULL;
     }
     stream->ptr = stream->start;
     stream->capa = CHAR_BIT;         // Capacity of the current byte.
     stream->address = stream->start;
+    stream->end = stream->start + size + sizeof(uint64_t);
+    stream->mapped = 0;
+    stream->format = 1;
+    stream->error = 0;
+    stream->fd = -1;
     return stream;
 }
 
 /**
- * @brief Retrieves a bit at a specific position from a byte.
+ * @brief Initializes a BitStream writing into a buffer owned by the caller.
+ *
+ * Nothing is allocated, the BitStream doesn't need to be freed. The whole buffer can be used,
+ * the last bytes are written one by one instead of with a full word store.
+ * 
+ * @param stream BitStream to initialize.
+ * @param buffer Buffer receiving the data.
+ * @param size Size of the buffer in bytes.
+ */
+void initBitStreamOver(BitStream * stream, unsigned char * buffer, size_t size) {
+    stream->start = buffer;
+    stream->ptr = buffer;
+    stream->capa = CHAR_BIT;
+    stream->address = NULL;
+    stream->end = buffer + size;
+    stream->mapped = 0;
+    stream->format = 1;
+    stream->error = 0;
+    stream->fd = -1;
+}
+
+/**
+ * @brief Initializes a read-only BitStream over data owned by the caller.
+ *
+ * Nothing is allocated or copied, the BitStream doesn't need to be freed.
+ * 
+ * @param stream BitStream to initialize.
+ * @param data Pointer to the first byte of the encoded data.
+ * @param size Size of the data in bytes.
+ */
+void initReadBitStreamOver(BitStream * stream, const unsigned char * data, size_t size) {
+    initBitStreamOver(stream, (unsigned char *) data, size);
+    stream->ptr = stream->end;
+}
+
+/**
+ * @brief Initializes a read-only BitStream over existing data.
+ *
+ * The stream points straight into the given data (for instance a memory mapped file), nothing is copied.
+ * The write pointer is placed at the end of the data, so any push fails.
  * 
- * @param byte Byte to extract bit from.
- * @param b Position of the bit to extract.
- * @return Value of the extracted bit (0 or 1).
+ * @param data Pointer to the first byte of the encoded data.
+ * @param size Size of the data in bytes.
+ * @param address Memory released by freeBitStream (malloc'd buffer or start of a mapping).
+ * @param mapped Length of the mapping at address, 0 if address was allocated with malloc.
+ * @return A pointer to the initialized BitStream.
+ */
+BitStream * initReadBitStream(unsigned char * data, size_t size, void * address, size_t mapped) {
+    BitStream * stream = (BitStream *) malloc(sizeof(BitStream));
+    if(!stream) {
+        fprintf(stderr, "Memory allocation for BitStream structure failed.\n");
+        exit(EXIT_FAILURE);
+    }
+    stream->start = data;
+    stream->ptr = data + size;
+    stream->capa = CHAR_BIT;
+    stream->address = address;
+    stream->end = data + size;
+    stream->mapped = mapped;
+    stream->format = 1;
+    stream->error = 0;
+    stream->fd = -1;
+    return stream;
+}
+
+/**
+ * @brief Receives more data into a BitStream read from a pipe.
+ *
+ * The data is appended after `ptr`, up to the end of the buffer which never moves, so a decoder
+ * can go on reading the bytes it already has. When the input ends, `fd` is set to -1 (it is not closed)
+ * and the BitStream is an ordinary read-only one, as it is once the buffer is full. A read error sets
+ * the error flag.
+ *
+ * @param stream BitStream to fill.
+ * @param bytes Number of bytes needed past the read position, SIZE_MAX to read the whole input.
+ * @return Number of bytes available past the read position.
  */
-static unsigned char getbit(unsigned char byte, size_t b) {
-    return (byte >> b) & 1;
+size_t fill_bitstream(BitStream * stream, size_t bytes) {
+    while (stream->fd >= 0 && (size_t) (stream->ptr - stream->start) < bytes) {
+        if (stream->ptr == stream->end) {
+            // Past the largest payload, what follows isn't read
+            stream->fd = -1;
+            break;
+        }
+        ssize_t n = read(stream->fd, stream->ptr, stream->end - stream->ptr);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            if (n < 0) stream->error = 1;
+            stream->fd = -1;
+            break;
+        }
+        stream->ptr += n;
+    }
+    return stream->ptr - stream->start;
 }
 
 /**
- * @brief Sets a specific bit in a byte.
+ * @brief Loads the word at the current read position.
  * 
- * @param byte Pointer to the byte to modify.
- * @param b Position of the bit to set.
- * @param valb Value to set (0 or 1).
+ * Near the end of the buffer, missing bytes are read as zeros instead of going past the buffer.
+ * 
+ * @param curr BitStream to load from.
+ * @return Big-endian word starting at the current byte.
  */
-static void setbit(unsigned char * byte, size_t b, unsigned char valb) {
-    valb ? (*byte |= (1 << b)) : (*byte &= ~(1 << b));
+static inline uint64_t load_current_word(BitStream * curr) {
+    if (curr->start + sizeof(uint64_t) <= curr->end) {
+        return load_be64(curr->start);
+    }
+    uint64_t word = 0;
+    size_t remaining = curr->end - curr->start;
+    for (size_t i = 0; i < sizeof(uint64_t); i++) {
+        word = (word << CHAR_BIT) | (i < remaining ? curr->start[i] : 0);
+    }
+    return word;
 }
 
 /**
- * @brief Pushes bits from a source byte into a BitStream.
+ * @brief Pushes bits from a source value into a BitStream.
  * 
- * Writes bits from the most significant to the least significant position.
- * Automatically manages byte boundaries and advances the stream pointer.
+ * Merges the bits already in the current byte with the new ones into a single word and stores it at once.
+ * Bits past the written ones are cleared, so the current byte never needs to be initialized.
  * 
  * @param curr BitStream to write to.
- * @param src Source byte containing the bits to push.
+ * @param src Source value containing the bits to push (right aligned).
  * @param nbit Number of bits to push.
  * @return Number of bits successfully written.
  */
-static size_t pushbits(BitStream * curr, unsigned char src, size_t nbit) {
-    size_t bits_written = 0;
-    for(size_t i = 0 ; i < nbit ; i++) {
-        if(!curr->capa) { // Checks if the current byte is full, if true, advances the pointer to the next one
-            curr->ptr++;
-            curr->capa = CHAR_BIT;
+static size_t pushbits(BitStream * curr, uint64_t src, size_t nbit) {
+    size_t used = CHAR_BIT - curr->capa;        // Bits already written in the current byte
+    size_t total = used + nbit;
+    size_t touched = (total + CHAR_BIT - 1) / CHAR_BIT;
+    if (nbit > BITSTREAM_MAX_BITS || curr->ptr > curr->end || (size_t) (curr->end - curr->ptr) < (touched ? touched : 1)) {
+        return 0;
+    }
+    uint64_t word = (uint64_t) (*curr->ptr & (0xFF00 >> used)) << 56;
+    if (nbit) {
+        word |= (src & ((UINT64_C(1) << nbit) - 1)) << (64 - total);
+    }
+    if (curr->ptr + sizeof(uint64_t) <= curr->end) {
+        store_be64(curr->ptr, word);
+    } else {
+        // End of the buffer, only the bytes holding bits are stored
+        for (size_t i = 0; i < touched; i++) {
+            curr->ptr[i] = word >> (56 - CHAR_BIT * i);
         }
-        unsigned char bit_to_write = getbit(src, nbit - 1 - i); // Retrieves bits from left to right (most to least significant).
-        setbit(curr->ptr, curr->capa - 1, bit_to_write);
-        curr->capa--;
-        bits_written++;
     }
-    return bits_written;
+    curr->ptr += total / CHAR_BIT;                // Advances over the bytes that are now full
+    curr->capa = CHAR_BIT - total % CHAR_BIT;
+    return nbit;
 }
 
 /**
- * @brief Pulls bits from a BitStream into a destination byte.
+ * @brief Pulls bits from a BitStream into a destination value.
  * 
  * Reads bits from a BitStream from most to least significant position.
- * Automatically manages byte boundaries and advances the stream pointer.
+ * The data written in the stream ends at `ptr`, reading past it fails.
  * 
  * @param curr Bitstream to read (pull) from.
- * @param dest Pointer to the destination byte to store the bits.
+ * @param dest Pointer to the destination value to store the bits.
  * @param nbit Number of bits to read.
  * @return Number of bits successfully read.
  */
-static size_t pullbits(BitStream * curr, unsigned char * dest, size_t nbit) {
-    size_t bits_readed = 0;
-    *dest = 0;
-    for(size_t i = 0 ; i < nbit ; i++) {
-        if(!curr->capa) {
-            curr->start++;
-            curr->capa = CHAR_BIT;
-        }
-        unsigned char bit_to_read = getbit(*curr->start, curr->capa - 1);
-        setbit(dest, nbit - 1 - i, bit_to_read);
-        curr->capa--;
-        bits_readed++;
+static size_t pullbits(BitStream * curr, uint64_t * dest, size_t nbit) {
+    size_t used = CHAR_BIT - curr->capa;        // Bits already read in the current byte
+    size_t total = used + nbit;
+    if (nbit > BITSTREAM_MAX_BITS || curr->start > curr->ptr || (size_t) (curr->ptr - curr->start) * CHAR_BIT < total) {
+        *dest = 0;
+        return 0;
     }
-    return bits_readed;
+    *dest = nbit ? (load_current_word(curr) << used) >> (64 - nbit) : 0;
+    curr->start += total / CHAR_BIT;
+    curr->capa = CHAR_BIT - total % CHAR_BIT;
+    return nbit;
 }
 
 /**
- * @brief Reads a fixed number of bits from a BitStream.
+ * @brief Reads up to 57 bits from a BitStream without exiting on errors.
+ * 
+ * If the bits can't be read, the error flag of the stream is set and 0 is returned,
+ * so a decoder can check the flag once at the end.
+ * 
+ * @param stream BitStream to read from.
+ * @param n Number of bits to read.
+ * @return The bits read, right aligned.
+ */
+uint64_t try_read_n_bits64(BitStream * stream, int n) {
+    uint64_t value;
+    if (n < 0 || pullbits(stream, &value, n) != (size_t) n) {
+        stream->error = 1;
+        return 0;
+    }
+    return value;
+}
+
+/**
+ * @brief Pushes up to 57 bits into a BitStream without exiting on errors.
+ * 
+ * If the bits can't be written, the error flag of the stream is set and nothing is written.
+ * 
+ * @param stream BitStream to write to.
+ * @param src Source value containing the bits to push.
+ * @param n Number of bits to push.
+ */
+void try_push_n_bits64(BitStream * stream, uint64_t src, int n) {
+    if (n < 0 || pushbits(stream, src, n) != (size_t) n) {
+        stream->error = 1;
+    }
+}
+
+/**
+ * @brief Reads up to 57 bits from a BitStream.
  * 
  * Handles errors in case the requested number of bits cannot be read.
  * 
  * @param stream BitStream to read from.
- * @param dest Pointer to the destination byte to store the bits.
  * @param n Number of bits to read.
+ * @return The bits read, right aligned.
  */
-void read_n_bits(BitStream * stream, unsigned char * dest, int n) {
-    if (pullbits(stream, dest, n) != (size_t) n) {
+uint64_t read_n_bits64(BitStream * stream, int n) {
+    uint64_t value = try_read_n_bits64(stream, n);
+    if (stream->error) {
         fprintf(stderr, "Erreur lors de la lecture du flux binaire.\n");
-        freeBitStream(stream);
         exit(EXIT_FAILURE);
     }
+    return value;
 }
 
 /**
- * @brief Pushes a fixed number of bits into a BitStream.
+ * @brief Pushes up to 57 bits into a BitStream.
  * 
  * Handles errors in case the requested number of bits cannot be written.
  * 
  * @param stream BitStream to write to.
- * @param src Source byte containing the bits to push.
+ * @param src Source value containing the bits to push.
  * @param n Number of bits to push.
  */
-void push_n_bits(BitStream * stream, unsigned char src, int n) {
-    if (pushbits(stream, src, n) != (size_t) n) {
+void push_n_bits64(BitStream * stream, uint64_t src, int n) {
+    try_push_n_bits64(stream, src, n);
+    if (stream->error) {
         fprintf(stderr, "Erreur lors de l'écriture des bits\n");
         exit(EXIT_FAILURE);
     }
 }
 
+/**
+ * @brief Copies bytes to a BitStream without exiting on errors.
+ * 
+ * The stream must be byte aligned (see finishBitStream()), the bytes are copied at once.
+ * If they don't fit, the error flag of the stream is set and nothing is written.
+ * 
+ * @param stream BitStream to write to.
+ * @param data Bytes to copy.
+ * @param size Number of bytes.
+ */
+void try_push_bytes(BitStream * stream, const unsigned char * data, size_t size) {
+    if (stream->capa != CHAR_BIT || stream->ptr > stream->end || (size_t) (stream->end - stream->ptr) < size) {
+        stream->error = 1;
+        return;
+    }
+    memcpy(stream->ptr, data, size);
+    stream->ptr += size;
+}
+
+/**
+ * @brief Reads a fixed number of bits from a BitStream.
+ * 
+ * @param stream BitStream to read from.
+ * @param dest Pointer to the destination byte to store the bits.
+ * @param n Number of bits to read (at most 8).
+ */
+void read_n_bits(BitStream * stream, unsigned char * dest, int n) {
+    *dest = (unsigned char) read_n_bits64(stream, n);
+}
+
+/**
+ * @brief Pushes a fixed number of bits into a BitStream.
+ * 
+ * @param stream BitStream to write to.
+ * @param src Source byte containing the bits to push.
+ * @param n Number of bits to push (at most 8).
+ */
+void push_n_bits(BitStream * stream, unsigned char src, int n) {
+    push_n_bits64(stream, src, n);
+}
+
 /**
  * @brief Finalizes a BitStream by padding the last partially filled byte (if any).
  * 
- * Pads the current byte with zeros if it is partially filled and moves the pointer to the next byte.
+ * The padding bits are already zeros, so it only moves the pointer to the next byte.
  * 
  * @param stream BitStream to finalize.
  */
 void finishBitStream(BitStream * stream) {
     if(stream->capa != CHAR_BIT) {
-        // adds stram->capa padding bites to the partially filled byte.
-        push_n_bits(stream, 0, stream->capa);
         stream->ptr++;
         stream->capa = CHAR_BIT;
     }
@@ -175,8 +378,12 @@ size_t BitStream_size(BitStream * stream) {
  */
 void freeBitStream(BitStream * stream) {
     if (stream) {
-        free(stream->address);
+        if (stream->mapped) {
+            munmap(stream->address, stream->mapped);
+        } else {
+            free(stream->address);
+        }
         stream->address = NULL;
     }
     free(stream);
-}
\ No newline at end of file
+}
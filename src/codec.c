@@ -0,0 +1,277 @@
+/**
+ * @file codec.c
+ * @brief Implementation of the in-memory codec API.
+ * 
+ * Images and BitStreams are set up on the stack over the caller buffers,
+ * only the Quadtree and the decoder frontiers are allocated.
+ */
+
+#include "codec.h"
+
+/**
+ * @brief Returns the levels of a Quadtree for an image width.
+ * 
+ * @param width Width of the image.
+ * @return Levels, or -1 if the width isn't a supported power of 2.
+ */
+static int levels_of_width(int width) {
+    if (width < 1 || (width & (width - 1))) return -1;
+    int levels = 0;
+    while ((1 << levels) < width) levels++;
+    return levels <= QUADTREE_MAX_LEVELS ? levels : -1;
+}
+
+size_t qtc_encode_bound(int width) {
+    int levels = levels_of_width(width);
+    return levels < 0 ? 0 : 3 + encoded_size_bound(levels);
+}
+
+/**
+ * @brief Compresses pixels into a buffer with the Quadtree and working arrays of a context.
+ * 
+ * Same bytes as `codec -c -n`: the Quadtree is built (and filtered if alpha isn't 0),
+ * then encoded straight into the buffer after the format line.
+ * 
+ * @return QTC_OK, QTC_ERROR_ARGUMENT, QTC_ERROR_BUFFER or QTC_ERROR_MEMORY.
+ */
+static QtcStatus encode_with_context(QtcContext * context, const unsigned char * pixels, int width, double alpha, int format,
+                                     int threads, unsigned char * output, size_t capacity, size_t * size) {
+    *size = 0;
+    if (!pixels || !output || levels_of_width(width) < 0 || format < 1 || format > 3 || alpha < 0) {
+        return QTC_ERROR_ARGUMENT;
+    }
+    if (capacity < 3) return QTC_ERROR_BUFFER;
+    QtcStats * stats = context->stats;
+    size_t memory = context_memory_size(context);
+    Image image = {width, (size_t) width * width, 255, (unsigned char *) pixels, IMAGE_RASTER};
+    Quadtree * quadtree;
+    double start = stats_clock();
+    QtcStatus status = build_quadtree_in_context(&image, threads < 1 ? 1 : threads, context, &quadtree);
+    if (status != QTC_OK) return status;
+    stats_stage(stats, QTC_STAGE_BUILD, start);
+    if (alpha) {
+        uint64_t uniform = stats ? count_uniform_nodes(quadtree) : 0;
+        start = stats_clock();
+        filtrage(quadtree, 0, 0, quadtree->medvar / quadtree->maxvar, alpha);
+        stats_stage(stats, QTC_STAGE_FILTER, start);
+        if (stats) stats->uniformized = count_uniform_nodes(quadtree) - uniform;
+    }
+
+    memcpy(output, format == 3 ? "Q3\n" : format == 2 ? "Q2\n" : "Q1\n", 3);
+    BitStream stream;
+    initBitStreamOver(&stream, output + 3, capacity - 3);
+    start = stats_clock();
+    status = encode_to_stream(&stream, quadtree, format, context);
+    if (status != QTC_OK) return status;
+    stats_stage(stats, QTC_STAGE_ENCODE, start);
+    *size = 3 + (stream.ptr - stream.start);
+    if (stats) {
+        stats->payload_bytes = stream.ptr - stream.start;
+        stats->bytes_allocated += context_memory_size(context) - memory;
+    }
+    return status;
+}
+
+/**
+ * @brief Compresses pixels into the content of a QTC file.
+ * 
+ * @see encode_with_context(), the buffers are only kept for this call.
+ * 
+ * @param pixels Grayscale pixels in raster order, width * width bytes.
+ * @param width Width (and height) of the image, a power of 2.
+ * @param alpha Filtering parameter, 0 for a lossless compression.
+ * @param format 1 for Q1, 2 for Q2, 3 for Q3.
+ * @param threads Number of threads used to build the Quadtree.
+ * @param output Buffer receiving the file content.
+ * @param capacity Size of the buffer in bytes.
+ * @param size Size of the file content on output.
+ * @return QTC_OK, QTC_ERROR_ARGUMENT, QTC_ERROR_BUFFER or QTC_ERROR_MEMORY.
+ */
+QtcStatus qtc_encode(const unsigned char * pixels, int width, double alpha, int format, int threads,
+                     unsigned char * output, size_t capacity, size_t * size) {
+    QtcContext context;
+    init_context(&context);
+    QtcStatus status = encode_with_context(&context, pixels, width, alpha, format, threads, output, capacity, size);
+    release_context(&context);
+    return status;
+}
+
+/**
+ * @brief Reads the payload of the content of a QTC file.
+ * 
+ * @param data Content of the QTC file (with its header).
+ * @param size Size of the content in bytes.
+ * @param stream Read-only BitStream over the payload on output.
+ * @param width Width (and height) of the image on output.
+ * @return QTC_OK or QTC_ERROR_CORRUPT.
+ */
+static QtcStatus open_qtc_data(const unsigned char * data, size_t size, BitStream * stream, int * width) {
+    if (!data || size < 2 || data[0] != 'Q' || data[1] < '1' || data[1] > '3') return QTC_ERROR_CORRUPT;
+    size_t offset = skip_qtc_header(data, size);
+    initReadBitStreamOver(stream, data + offset, size - offset);
+    stream->format = qtc_format(data, size);
+    return decoded_image_width(stream, width);
+}
+
+QtcStatus qtc_decoded_width(const unsigned char * data, size_t size, int * width) {
+    if (!data) return QTC_ERROR_CORRUPT;
+    size_t offset = size && data[0] == 'Q' ? skip_qtc_header(data, size) : 0;
+    BitStream stream;
+    initReadBitStreamOver(&stream, data + offset, size - offset);
+    return decoded_image_width(&stream, width);
+}
+
+/**
+ * @brief Decompresses the content of a QTC file into pixels.
+ * 
+ * The payload is read in place, the pixels are written straight into the caller buffer.
+ * 
+ * @param data Content of the QTC file (with its header).
+ * @param size Size of the content in bytes.
+ * @param pixels Buffer receiving the pixels in raster order.
+ * @param capacity Size of the buffer in bytes, at least width * width.
+ * @param width Width (and height) of the image on output.
+ * @param threads Number of threads to use (Q2 chunks only).
+ * @return QTC_OK, QTC_ERROR_BUFFER, QTC_ERROR_CORRUPT or QTC_ERROR_MEMORY.
+ */
+QtcStatus qtc_decode(const unsigned char * data, size_t size, unsigned char * pixels, size_t capacity, int * width, int threads) {
+    return qtc_decode_level(data, size, QUADTREE_MAX_LEVELS, pixels, capacity, width, threads);
+}
+
+/**
+ * @brief Decompresses the first levels of a QTC file into a thumbnail.
+ * 
+ * Nodes are stored breadth-first, so only the prefix of the payload holding levels 0 to max_level
+ * (the top section and the beginning of each chunk for Q2) is decoded.
+ * 
+ * @param data Content of the QTC file (with its header).
+ * @param size Size of the content in bytes.
+ * @param max_level Level whose node means are the pixels, the whole image if the Quadtree isn't that deep.
+ * @param pixels Buffer receiving the pixels in raster order.
+ * @param capacity Size of the buffer in bytes, at least width * width.
+ * @param width Width (and height) of the thumbnail on output, 2^max_level at most.
+ * @param threads Number of threads to use (Q2 chunks only).
+ * @return QTC_OK, QTC_ERROR_ARGUMENT, QTC_ERROR_BUFFER, QTC_ERROR_CORRUPT or QTC_ERROR_MEMORY.
+ */
+QtcStatus qtc_decode_level(const unsigned char * data, size_t size, int max_level, unsigned char * pixels, size_t capacity,
+                           int * width, int threads) {
+    if (max_level < 0) return QTC_ERROR_ARGUMENT;
+    BitStream stream;
+    QtcStatus status = open_qtc_data(data, size, &stream, width);
+    if (status != QTC_OK) return status;
+    if (max_level < QUADTREE_MAX_LEVELS && *width > (1 << max_level)) *width = 1 << max_level;
+    if (!pixels || capacity < (size_t) *width * *width) return QTC_ERROR_BUFFER;
+    Image image = {*width, (size_t) *width * *width, 255, pixels, IMAGE_RASTER};
+    return decode_image_into(&stream, &image, threads, NULL);
+}
+
+QtcContext * qtc_context_create(void) {
+    QtcContext * context = (QtcContext *) malloc(sizeof(QtcContext));
+    if (context) init_context(context);
+    return context;
+}
+
+void qtc_context_free(QtcContext * context) {
+    if (!context) return;
+    release_context(context);
+    free(context);
+}
+
+/**
+ * @brief Compresses pixels into the stream buffer of a context.
+ * 
+ * The Quadtree, the working arrays and the output come from the context: once it has seen an image
+ * of this size, nothing is allocated. The Quadtree is kept for qtc_context_grid().
+ * 
+ * @param context Context created with qtc_context_create().
+ * @param pixels Grayscale pixels in raster order, width * width bytes.
+ * @param width Width (and height) of the image, a power of 2.
+ * @param alpha Filtering parameter, 0 for a lossless compression.
+ * @param format 1 for Q1, 2 for Q2, 3 for Q3.
+ * @param threads Number of threads used to build the Quadtree.
+ * @param output File content on output, valid until the next encode with the context.
+ * @param size Size of the file content on output.
+ * @return QTC_OK, QTC_ERROR_ARGUMENT or QTC_ERROR_MEMORY.
+ */
+QtcStatus qtc_context_encode(QtcContext * context, const unsigned char * pixels, int width, double alpha, int format, int threads,
+                             const unsigned char ** output, size_t * size) {
+    *output = NULL;
+    *size = 0;
+    size_t bound = qtc_encode_bound(width);
+    if (!context || !bound) return QTC_ERROR_ARGUMENT;
+    unsigned char * buffer = (unsigned char *) scratch_reserve(&context->stream, bound);
+    if (!buffer) return QTC_ERROR_MEMORY;
+    QtcStatus status = encode_with_context(context, pixels, width, alpha, format, threads, buffer, bound, size);
+    if (status == QTC_OK) *output = buffer;
+    return status;
+}
+
+/**
+ * @brief Decompresses the content of a QTC file into the pixel buffer of a context.
+ * 
+ * The frontiers of the decoder and the pixels come from the context: once it has seen an image
+ * of this size, nothing is allocated.
+ * 
+ * @param context Context created with qtc_context_create().
+ * @param data Content of the QTC file (with its header).
+ * @param size Size of the content in bytes.
+ * @param pixels Decoded pixels on output, valid until the next decode with the context.
+ * @param width Width (and height) of the image on output.
+ * @param threads Number of threads to use (Q2 chunks only).
+ * @return QTC_OK, QTC_ERROR_ARGUMENT, QTC_ERROR_CORRUPT or QTC_ERROR_MEMORY.
+ */
+QtcStatus qtc_context_decode(QtcContext * context, const unsigned char * data, size_t size,
+                             const unsigned char ** pixels, int * width, int threads) {
+    *pixels = NULL;
+    if (!context) return QTC_ERROR_ARGUMENT;
+    BitStream stream;
+    QtcStatus status = open_qtc_data(data, size, &stream, width);
+    if (status != QTC_OK) return status;
+    size_t memory = context_memory_size(context);
+    Image * image = context_image(context, *width, 0);
+    if (!image) return QTC_ERROR_MEMORY;
+    double start = stats_clock();
+    status = decode_image_into(&stream, image, threads, context);
+    if (status != QTC_OK) return status;
+    *pixels = image->image;
+    if (context->stats) {
+        stats_stage(context->stats, QTC_STAGE_DECODE, start);
+        context->stats->payload_bytes = stream.ptr - stream.start;
+        context->stats->bytes_allocated += context_memory_size(context) - memory;
+    }
+    return status;
+}
+
+/**
+ * @brief Draws the segmentation grid of the last Quadtree encoded with a context into its grid buffer.
+ * 
+ * @param context Context created with qtc_context_create().
+ * @param pixels Grid pixels on output, valid until the next grid with the context.
+ * @param width Width (and height) of the grid on output.
+ * @return QTC_OK, QTC_ERROR_ARGUMENT if nothing was encoded with the context, or QTC_ERROR_MEMORY.
+ */
+QtcStatus qtc_context_grid(QtcContext * context, const unsigned char ** pixels, int * width) {
+    *pixels = NULL;
+    if (!context || !context->quadtree.memory) return QTC_ERROR_ARGUMENT;
+    *width = 1 << context->quadtree.levels;
+    Image * image = context_image(context, *width, 1);
+    if (!image) return QTC_ERROR_MEMORY;
+    draw_segmentation_grid(&context->quadtree, image);
+    *pixels = image->image;
+    return QTC_OK;
+}
+
+void qtc_context_set_stats(QtcContext * context, QtcStats * stats) {
+    if (context) context->stats = stats;
+}
+
+const char * qtc_strerror(QtcStatus status) {
+    switch (status) {
+        case QTC_OK: return "Success.";
+        case QTC_ERROR_ARGUMENT: return "Invalid argument.";
+        case QTC_ERROR_MEMORY: return "Error while allocating memory.";
+        case QTC_ERROR_CORRUPT: return "Invalid or truncated QTC data.";
+        case QTC_ERROR_BUFFER: return "Output buffer too small.";
+    }
+    return "Unknown error.";
+}
@@ -0,0 +1,122 @@
+/**
+ * @file context.c
+ * @brief Implementation of the codec context.
+ * 
+ * Every buffer of a context is a Scratch: it is allocated the first time it is needed and only
+ * reallocated when a larger image comes, so a context used on images of the same size
+ * doesn't allocate anything after its first call.
+ */
+
+#include "context.h"
+
+/**
+ * @brief Makes sure a Scratch holds at least a given size.
+ * 
+ * The buffer is replaced (not reallocated) when it is too small, so its content is lost.
+ * 
+ * @param scratch Scratch to grow.
+ * @param size Size needed in bytes.
+ * @return Pointer to the buffer, NULL if memory allocation fails.
+ */
+void * scratch_reserve(Scratch * scratch, size_t size) {
+    if (size <= scratch->capacity && scratch->data) return scratch->data;
+    size = (size + 15) & ~(size_t) 15;
+    void * data = aligned_alloc(16, size ? size : 16);
+    if (!data) return NULL;
+    free(scratch->data);
+    scratch->data = data;
+    scratch->capacity = size;
+    return data;
+}
+
+/**
+ * @brief Initializes a context, nothing is allocated until it is used.
+ * 
+ * @param context Context to initialize.
+ */
+void init_context(QtcContext * context) {
+    memset(context, 0, sizeof(QtcContext));
+}
+
+/**
+ * @brief Frees the buffers of a context.
+ * 
+ * @param context Context to release, it can be used again afterwards (with the same statistics).
+ */
+void release_context(QtcContext * context) {
+    QtcStats * stats = context->stats;
+    free(context->nodes.data);
+    free(context->stream.data);
+    free(context->pixels.data);
+    free(context->grid.data);
+    for (int i = 0; i < QTC_SHARED_SCRATCH; i++) free(context->shared[i].data);
+    for (int i = 0; i < context->threads * QTC_THREAD_SCRATCH; i++) free(context->thread_scratch[i].data);
+    free(context->thread_scratch);
+    init_context(context);
+    context->stats = stats;
+}
+
+/**
+ * @brief Returns the number of bytes held by the buffers of a context.
+ * 
+ * @param context Current context.
+ * @return Sum of the capacities of its buffers.
+ */
+size_t context_memory_size(const QtcContext * context) {
+    size_t size = context->nodes.capacity + context->stream.capacity + context->pixels.capacity + context->grid.capacity;
+    for (int i = 0; i < QTC_SHARED_SCRATCH; i++) size += context->shared[i].capacity;
+    for (int i = 0; i < context->threads * QTC_THREAD_SCRATCH; i++) size += context->thread_scratch[i].capacity;
+    return size;
+}
+
+/**
+ * @brief Returns the working arrays of the worker threads.
+ * 
+ * The working arrays of the threads already known are kept when more threads are asked.
+ * 
+ * @param context Current context.
+ * @param threads Number of threads.
+ * @return Array of threads * QTC_THREAD_SCRATCH Scratch, NULL if memory allocation fails.
+ */
+Scratch * context_thread_scratch(QtcContext * context, int threads) {
+    if (threads <= context->threads) return context->thread_scratch;
+    Scratch * scratch = (Scratch *) realloc(context->thread_scratch, threads * QTC_THREAD_SCRATCH * sizeof(Scratch));
+    if (!scratch) return NULL;
+    memset(scratch + context->threads * QTC_THREAD_SCRATCH, 0, (threads - context->threads) * QTC_THREAD_SCRATCH * sizeof(Scratch));
+    context->thread_scratch = scratch;
+    context->threads = threads;
+    return scratch;
+}
+
+/**
+ * @brief Returns the Quadtree of a context, initialized empty for the given levels.
+ * 
+ * @param context Current context.
+ * @param levels Quadtree levels (at most QUADTREE_MAX_LEVELS).
+ * @param with_variance Uses a variance plane if not 0.
+ * @param pixels Pixels of the leaf level (see init_quadtree_over_pixels()), NULL to store the leaves.
+ * @return The Quadtree, NULL if memory allocation fails.
+ */
+Quadtree * context_quadtree(QtcContext * context, int levels, int with_variance, unsigned char * pixels) {
+    size_t size = pixels ? quadtree_memory_size_over_pixels(levels, with_variance) : quadtree_memory_size(levels, with_variance);
+    void * memory = scratch_reserve(&context->nodes, size);
+    if (!memory) return NULL;
+    init_quadtree_over_pixels(&context->quadtree, memory, levels, with_variance, pixels);
+    return &context->quadtree;
+}
+
+/**
+ * @brief Returns an Image of a context, sized for the given width.
+ * 
+ * @param context Current context.
+ * @param width Width (and height) of the image.
+ * @param grid Returns the segmentation grid Image if not 0, the decoded Image otherwise.
+ * @return The Image, NULL if memory allocation fails.
+ */
+Image * context_image(QtcContext * context, int width, int grid) {
+    Image * image = grid ? &context->grid_image : &context->image;
+    unsigned char * pixels = scratch_reserve(grid ? &context->grid : &context->pixels, (size_t) width * width);
+    if (!pixels) return NULL;
+    *image = (Image) {width, (size_t) width * width, 255, pixels, IMAGE_RASTER};
+    return image;
+}
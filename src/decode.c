@@ -4,6 +4,15 @@
  */
 
 #include "decode.h"
+#include <string.h>
+#include <pthread.h>
+
+/**
+ * @brief Frontier parents decoded between two fill_bitstream() calls on a BitStream still being received.
+ *
+ * A parent takes 44 bits at most (3 `moyenne`, 4 `epsilon` and 4 `u`), 6 bytes are asked for each one.
+ */
+#define QTC_FILL_PARENTS 1024
 
 /**
  * @brief Reads a non-leaf node from a BitStream.
@@ -12,136 +21,1417 @@
  * a non-leaf node from the BitStream and stores them in the given node.
  * 
  * @param stream BitStream to read from.
- * @param node Node to store the read data.
+ * @param quadtree Quadtree containing the node.
+ * @param level Level of the node.
+ * @param j Index of the node in its level.
  */
-static void read_node(BitStream * stream, Node * node) {
-    read_n_bits(stream, &node->moyenne, 8);
-    read_n_bits(stream, &node->epsilon, 2);
-    (!node->epsilon) ? read_n_bits(stream, &node->u, 1) : (node->u = 0);
+static void read_node(BitStream * stream, Quadtree * quadtree, int level, int64_t j) {
+    // `moyenne` and `epsilon` are read at once
+    uint64_t bits = read_n_bits64(stream, 10);
+    unsigned char epsilon = bits & 3;
+    unsigned char u = (!epsilon) ? read_n_bits64(stream, 1) : 0;
+    quadtree->moyennes[level][j] = bits >> 2;
+    if (!is_leaf(quadtree, level)) {
+        set_epsilon(quadtree, level, j, epsilon);
+        set_u(quadtree, level, j, u);
+    }
 }
 
 /**
- * @brief Reads a leaf node from a BitStream.
+ * @brief Reads the 4 leaves of a node from a BitStream.
  * 
- * Reads only `moyenne` value because this is the only value in the BitStream for a leaf node,
- * their `epsilon` and `u` are constant : `epsilon` = 1, `u` = 0.
+ * Reads only the `moyenne` of the first 3 leaves (at once) because this is the only value in the BitStream
+ * for a leaf node, their `epsilon` and `u` are constant : `epsilon` = 0, `u` = 1.
+ * The 4th one is interpolated from the parent node and the three other leaves.
  * 
  * @param stream BitStream to read from.
- * @param node Node to store the read data.
+ * @param quadtree Quadtree containing the nodes.
+ * @param j Index of the first leaf (multiple of 4).
  */
-static void read_leaf(BitStream * stream, Node * node) {
-    read_n_bits(stream, &node->moyenne, 8);
-    node->epsilon = 0;
-    node->u = 1;
+static void read_leaves(BitStream * stream, Quadtree * quadtree, int64_t j) {
+    int levels = quadtree->levels;
+    uint64_t bits = read_n_bits64(stream, 24);
+    unsigned char m0 = bits >> 16, m1 = bits >> 8, m2 = bits;
+    set_moyenne(quadtree, levels, j, m0);
+    set_moyenne(quadtree, levels, j + 1, m1);
+    set_moyenne(quadtree, levels, j + 2, m2);
+    set_moyenne(quadtree, levels, j + 3, 4 * quadtree->moyennes[levels - 1][j / 4] + get_epsilon(quadtree, levels - 1, j / 4) - m0 - m1 - m2);
 }
 
 /**
  * @brief Interpolates the average of the 4th child of a node.
  * 
- * Calculates the `moyenne` value of the 4th child node based on the parent node and the three other childs.
- * Reads additionnal values from the BitStream if the node is not a leaf.
+ * Calculates the `moyenne` value of the 4th child node based on the parent node and the three other childs,
+ * then reads its `epsilon` and `u` from the BitStream (the leaves are read by read_leaves()).
  * 
  * @param stream BitStream to read from.
  * @param quadtree Quadtree containing the nodes.
- * @param node Node to store the interpolated data.
- * @param parent_node Parent node of the current node.
- * @param index Index of the current node.
+ * @param level Level of the current node.
+ * @param j Index of the current node in its level.
  */
-static void interpolation_4th_child(BitStream * stream, Quadtree * quadtree, Node * node, Node * parent_node, int index) {
-    node->moyenne = 4 * parent_node->moyenne + parent_node->epsilon - quadtree->nodes[index - 1].moyenne - quadtree->nodes[index - 2].moyenne - quadtree->nodes[index - 3].moyenne;
-    if (is_leaf(quadtree, index)) {
-        node->epsilon = 0;
-        node->u = 1;
-        return;
-    } 
-    read_n_bits(stream, &node->epsilon, 2);
-    !node->epsilon ? read_n_bits(stream, &node->u, 1) : (node->u = 0);
+static void interpolation_4th_child(BitStream * stream, Quadtree * quadtree, int level, int64_t j) {
+    unsigned char moyenne = 4 * quadtree->moyennes[level - 1][j / 4] + get_epsilon(quadtree, level - 1, j / 4)
+                            - get_moyenne(quadtree, level, j - 1) - get_moyenne(quadtree, level, j - 2) - get_moyenne(quadtree, level, j - 3);
+    set_moyenne(quadtree, level, j, moyenne);
+    unsigned char epsilon = read_n_bits64(stream, 2);
+    set_epsilon(quadtree, level, j, epsilon);
+    set_u(quadtree, level, j, !epsilon ? read_n_bits64(stream, 1) : 0);
 }
 
 /**
- * @brief Constructs a quadtree from a BitStream.
+ * @brief Reserves the next frontier of a decoder building a Quadtree.
+ * 
+ * @param frontier Buffer of the next frontier.
+ * @param count Number of nodes of the current frontier.
+ * @return Room for the 4 children of each node.
+ * @note Exits program with an error message if memory allocation fails.
+ */
+static uint32_t * reserve_next_frontier(Scratch * frontier, size_t count) {
+    uint32_t * next = (uint32_t *) scratch_reserve(frontier, 4 * count * sizeof(uint32_t));
+    if (!next) {
+        fprintf(stderr, "Error while allocating memory for the decoding frontier.\n");
+        exit(EXIT_FAILURE);
+    }
+    return next;
+}
+
+/**
+ * @brief Reads the levels of a subtree, level by level.
+ * 
+ * Reads the nodes of levels `split` + 1 to `last` that descend from node t of level `split`, already read.
+ * Only the children of non-uniform nodes are in the stream: the frontier holds the non-uniform nodes
+ * of a level in stream order, their children are the nodes read next. A uniform node gives its `moyenne`
+ * to its whole subtree at once, down to the leaves whatever `last` (see fill_uniform_subtree()),
+ * so the nodes below it are never visited one by one.
+ * The frontier goes back and forth between two buffers, which only grow.
+ * 
+ * @param stream BitStream to read from.
+ * @param quadtree Quadtree to fill.
+ * @param split Level of the subtree root.
+ * @param t Index of the subtree root in its level.
+ * @param last Last level to read.
+ * @param frontier Two buffers for the frontier.
+ */
+static void decode_levels(BitStream * stream, Quadtree * quadtree, int split, int64_t t, int last, Scratch * frontier) {
+    // Non-leaf nodes only, their index fits in 32 bits
+    uint32_t * current = reserve_next_frontier(&frontier[0], 1);
+    current[0] = t;
+    size_t count = split < last && !get_u(quadtree, split, t);
+    for (int level = split + 1; level <= last && count; level++) {
+        if (is_leaf(quadtree, level)) {
+            for (size_t p = 0; p < count; p++) read_leaves(stream, quadtree, 4 * (int64_t) current[p]);
+            break;
+        }
+        uint32_t * next = level < last ? reserve_next_frontier(&frontier[1], count) : NULL;
+        size_t n = 0;
+        for (size_t p = 0; p < count; p++) {
+            for (int64_t j = 4 * (int64_t) current[p]; j < 4 * (int64_t) current[p] + 4; j++) {
+                // Interpolation of the 4th child
+                if (j % 4 == 3) {
+                    interpolation_4th_child(stream, quadtree, level, j);
+                } else {
+                    read_node(stream, quadtree, level, j);
+                }
+                if (get_u(quadtree, level, j)) {
+                    fill_uniform_subtree(quadtree, level, j);
+                } else if (next) {
+                    next[n++] = j;
+                }
+            }
+        }
+        Scratch swap = frontier[0];
+        frontier[0] = frontier[1];
+        frontier[1] = swap;
+        current = next;
+        count = n;
+    }
+}
+
+/**
+ * @brief Creates the empty Quadtree of a decoder, its leaf level in raster order.
  * 
- * Decodes a Quadtree by reading its nodes from the given BitStream.
+ * The pixels take the place of the stored leaf level in the allocation of the Quadtree,
+ * the decoder writes each leaf at its place in the image and build_image_from_quadtree()
+ * copies them at once.
+ * 
+ * @param levels Quadtree levels.
+ * @return The Quadtree (exits on errors like create_empty_quadtree()).
+ */
+static Quadtree * create_decoded_quadtree(int levels) {
+    Quadtree * quadtree = create_empty_quadtree(levels, 0);
+    if (levels) {
+        quadtree->pixels = quadtree->moyennes[levels];
+        quadtree->moyennes[levels] = NULL;
+    }
+    return quadtree;
+}
+
+/**
+ * @brief Constructs a quadtree from a Q1 BitStream.
+ * 
+ * Decodes a Quadtree by reading its nodes from the given BitStream, level by level.
  * 
  * @param stream BitStream to read from.
  * @return Pointer to the constructed Quadtree.
  */
-Quadtree * decode(BitStream * stream) {
+static Quadtree * decode_q1(BitStream * stream) {
     // Read the first byte to determine the levels of the quadtree
     unsigned char levels;
     read_n_bits(stream, &levels, 8);
-    Quadtree * quadtree = create_empty_quadtree(levels);
+    Quadtree * quadtree = create_decoded_quadtree(levels);
 
-    for (int i = 0; i < quadtree->total_nodes; i++) {
-        Node * current_node = &quadtree->nodes[i];
+    // Special case for the root which has no parent
+    read_node(stream, quadtree, 0, 0);
+    if (levels && get_u(quadtree, 0, 0)) fill_uniform_subtree(quadtree, 0, 0);
+    Scratch frontier[2] = {{NULL, 0}, {NULL, 0}};
+    decode_levels(stream, quadtree, 0, 0, quadtree->levels, frontier);
+    free(frontier[0].data);
+    free(frontier[1].data);
+    return quadtree;
+}
 
-        // Special case for the root to avoid iterating on its parent (itself) while it is not initialized
-        if (!i) {
-            read_node(stream, current_node);
-            continue;
-        }   
+/**
+ * @struct Q2Layout
+ * @brief Sections of a Q2 payload.
+ */
+typedef struct {
+    int levels;                         // Levels of the Quadtree
+    int split;                          // Level of the chunks roots
+    int64_t chunks;                     // Number of chunks
+    int entry;                          // Bytes of each value of the offset table, see q2_table_bytes()
+    const unsigned char * first_chunk;  // First chunk of the payload
+    const unsigned char * table;        // Offset table
+    size_t chunks_size;                 // Bytes between the first chunk and the table
+    uint64_t top;                       // Offset of the top section
+} Q2Layout;
 
-        Node * current_node_parent = &quadtree->nodes[(i - 1) / 4];
+/**
+ * @brief Reads a value of the offset table of a Q2 payload.
+ * 
+ * @param q2 Sections of the payload.
+ * @param i Index of the value in the table.
+ * @return Value read, 4 or 8 bytes big-endian.
+ */
+static inline uint64_t table_value(const Q2Layout * q2, int64_t i) {
+    const unsigned char * src = q2->table + q2->entry * i;
+    return q2->entry == 8 ? load_be64(src) : load_be32(src);
+}
 
-        // if the parent is uniform, then the children are also uniform and their averages are equal to that of the parent node
-        if (current_node_parent->u) {
-            current_node->moyenne = current_node_parent->moyenne;
-            current_node->epsilon = 0;
-            current_node->u = 1;
-            continue;
+/**
+ * @brief Returns the offset of a chunk from the first chunk.
+ * 
+ * @param q2 Layout of the payload.
+ * @param t Index of the chunk.
+ */
+static inline uint64_t chunk_offset(const Q2Layout * q2, int64_t t) {
+    return table_value(q2, 2 * t);
+}
+
+/**
+ * @brief Returns the size of a chunk in bytes.
+ * 
+ * @param q2 Layout of the payload.
+ * @param t Index of the chunk.
+ */
+static inline uint64_t chunk_size(const Q2Layout * q2, int64_t t) {
+    return table_value(q2, 2 * t + 1);
+}
+
+/**
+ * @brief Reads and checks the layout of a Q2 payload.
+ * 
+ * @param stream BitStream holding the payload.
+ * @param q2 Layout on output.
+ * @return QTC_OK, or QTC_ERROR_CORRUPT if a chunk or the top section is outside of the payload.
+ */
+static QtcStatus read_q2_layout(BitStream * stream, Q2Layout * q2) {
+    size_t size = stream->ptr - stream->start;
+    const unsigned char * data = stream->start;
+    if (size < 2 || data[1] > data[0] || data[0] > QUADTREE_MAX_LEVELS) {
+        return QTC_ERROR_CORRUPT;
+    }
+    q2->levels = data[0];
+    q2->split = data[1];
+    q2->chunks = nodes_in_level(q2->split);
+    q2->entry = q2_table_bytes(q2->levels);
+    size_t table_size = (2 * (size_t) q2->chunks + 1) * q2->entry;
+    if (size < 2 + table_size) {
+        return QTC_ERROR_CORRUPT;
+    }
+    q2->first_chunk = data + 2;
+    q2->table = data + size - table_size;
+    q2->chunks_size = q2->table - q2->first_chunk;
+    for (int64_t t = 0; t < q2->chunks; t++) {
+        uint64_t offset = chunk_offset(q2, t);
+        if (offset > q2->chunks_size || chunk_size(q2, t) > q2->chunks_size - offset) {
+            return QTC_ERROR_CORRUPT;
         }
+    }
+    q2->top = table_value(q2, 2 * q2->chunks);
+    if (q2->top > q2->chunks_size) {
+        return QTC_ERROR_CORRUPT;
+    }
+    return QTC_OK;
+}
+
+/**
+ * @struct DecodeTask
+ * @brief Chunks of a Q2 BitStream decoded by one thread.
+ */
+typedef struct {
+    Quadtree * quadtree;
+    const Q2Layout * q2;          // Layout of the payload
+    int64_t first;                // First chunk of the task
+    int64_t last;                 // Chunk after the last one of the task
+    Scratch frontier[2];          // Frontier of the chunk being decoded
+} DecodeTask;
 
-        // Interpolation of the 4th child
-        if (!(i % 4)) {
-            interpolation_4th_child(stream, quadtree, current_node, current_node_parent, i);
-            continue;
+/**
+ * @brief Decodes the chunks of a task.
+ * 
+ * Each chunk only fills the nodes of its own subtree. Tasks start on even chunks, so the two
+ * subtrees sharing a byte of the uniformity plane on the level below `split` are on the same thread.
+ * 
+ * @param arg Pointer to the DecodeTask.
+ * @return NULL.
+ */
+static void * decode_chunks(void * arg) {
+    DecodeTask * task = (DecodeTask *) arg;
+    const Q2Layout * q2 = task->q2;
+    for (int64_t t = task->first; t < task->last; t++) {
+        BitStream chunk;
+        initReadBitStreamOver(&chunk, q2->first_chunk + chunk_offset(q2, t), chunk_size(q2, t));
+        decode_levels(&chunk, task->quadtree, q2->split, t, task->quadtree->levels, task->frontier);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Constructs a quadtree from a Q2 BitStream.
+ * 
+ * Decodes the top section first, then spreads the chunks across the threads,
+ * giving each thread about the same number of bytes to decode.
+ * 
+ * @param stream BitStream to read from.
+ * @param threads Number of threads to use.
+ * @return Pointer to the constructed Quadtree.
+ * 
+ * @see encode_q2() for the layout of the payload.
+ */
+static Quadtree * decode_q2(BitStream * stream, int threads) {
+    Q2Layout q2;
+    if (read_q2_layout(stream, &q2) != QTC_OK) {
+        fprintf(stderr, "Invalid Q2 file.\n");
+        exit(EXIT_FAILURE);
+    }
+    int levels = q2.levels, split = q2.split;
+    int64_t chunks = q2.chunks;
+    const unsigned char * first_chunk = q2.first_chunk;
+    size_t chunks_size = q2.chunks_size;
+    uint64_t top = q2.top;
+
+    // Top section
+    Quadtree * quadtree = create_decoded_quadtree(levels);
+    BitStream top_stream;
+    initReadBitStreamOver(&top_stream, first_chunk + top, chunks_size - top);
+    read_node(&top_stream, quadtree, 0, 0);
+    if (levels && get_u(quadtree, 0, 0)) fill_uniform_subtree(quadtree, 0, 0);
+    Scratch frontier[2] = {{NULL, 0}, {NULL, 0}};
+    decode_levels(&top_stream, quadtree, 0, 0, split, frontier);
+    free(frontier[0].data);
+    free(frontier[1].data);
+
+    // Chunks, split in contiguous ranges of even length holding about the same number of bytes
+    if (threads > chunks / 2) threads = chunks / 2 > 0 ? chunks / 2 : 1;
+    DecodeTask * tasks = (DecodeTask *) malloc(threads * sizeof(DecodeTask));
+    pthread_t * workers = (pthread_t *) malloc(threads * sizeof(pthread_t));
+    if (!tasks || !workers) {
+        fprintf(stderr, "Error while allocating memory for decoding threads.\n");
+        exit(EXIT_FAILURE);
+    }
+    uint64_t total = 0;
+    for (int64_t t = 0; t < chunks; t++) total += chunk_size(&q2, t);
+    int64_t t = 0;
+    uint64_t done = 0;
+    for (int i = 0; i < threads; i++) {
+        tasks[i] = (DecodeTask) {quadtree, &q2, t, chunks, {{NULL, 0}, {NULL, 0}}};
+        if (i == threads - 1) break;
+        uint64_t target = total * (i + 1) / threads;
+        while (t < chunks && (done < target || t - tasks[i].first < 2 || t % 2)) {
+            done += chunk_size(&q2, t);
+            t++;
         }
-        
-        // if the node is a leaf we read the node as a leaf otherwise we read it as a node
-        is_leaf(quadtree, i) ? read_leaf(stream, current_node) : read_node(stream, current_node);
+        tasks[i].last = t;
     }
+    for (int i = 1; i < threads; i++) {
+        if (pthread_create(&workers[i], NULL, decode_chunks, &tasks[i])) {
+            fprintf(stderr, "Error while creating decoding threads.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    decode_chunks(&tasks[0]);
+    for (int i = 1; i < threads; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    for (int i = 0; i < threads; i++) {
+        free(tasks[i].frontier[0].data);
+        free(tasks[i].frontier[1].data);
+    }
+    free(tasks);
+    free(workers);
     return quadtree;
 }
 
 /**
- * @brief Recursively builds an image from a quadtree.
+ * @brief Reads the header of a Q3 payload.
+ * 
+ * @param stream BitStream positioned on the payload.
+ * @param levels Levels of the Quadtree on output.
+ * @param moyenne Mean of the root on output.
+ * @param flags Flags symbol of the root on output.
+ * @return QTC_OK, or QTC_ERROR_CORRUPT if the header is truncated or invalid.
+ */
+static QtcStatus read_q3_header(BitStream * stream, int * levels, unsigned char * moyenne, int * flags) {
+    *levels = try_read_n_bits64(stream, 8);
+    *moyenne = try_read_n_bits64(stream, 8);
+    *flags = try_read_n_bits64(stream, 8);
+    if (stream->error || *levels > QUADTREE_MAX_LEVELS || *flags >= QTC_Q3_FLAGS) return QTC_ERROR_CORRUPT;
+    return QTC_OK;
+}
+
+/**
+ * @brief Reads the models of a Q3 payload and starts the rANS decoder on the data that follows.
  * 
- * Helper function to build an Image recursively based on a Quadtree.
+ * @param stream BitStream positioned on the models.
+ * @param levels Levels of the Quadtree (at least 1).
+ * @param scratch Buffer receiving the models.
+ * @param models Models of every level on output (see QTC_Q3_FLAGS for their order).
+ * @param decoder Decoder to initialize.
+ * @return QTC_OK, QTC_ERROR_CORRUPT or QTC_ERROR_MEMORY.
+ */
+static QtcStatus read_q3_models(BitStream * stream, int levels, Scratch * scratch, RansModel ** models, RansDecoder * decoder) {
+    *models = (RansModel *) scratch_reserve(scratch, 2 * levels * sizeof(RansModel));
+    if (!*models) return QTC_ERROR_MEMORY;
+    for (int level = 1; level <= levels; level++) {
+        RansModel * flags = *models + 2 * level - 2;
+        if (level < levels && rans_read_model(stream, flags, QTC_Q3_FLAGS) != QTC_OK) return QTC_ERROR_CORRUPT;
+        if (rans_read_model(stream, flags + 1, RANS_MAX_SYMBOLS) != QTC_OK) return QTC_ERROR_CORRUPT;
+    }
+    rans_decoder_init(decoder, stream->start, stream->ptr - stream->start);
+    return QTC_OK;
+}
+
+/**
+ * @brief Reads the levels below the root of a Q3 payload into a Quadtree.
  * 
- * @param quadtree Quadtree to build the image from.
- * @param image Image to fill.
- * @param index Index of the current node.
- * @param x X coordinate of the current node.
- * @param y Y coordinate of the current node.
- * @param size Size of the current pixel bloc.
+ * Same walk as decode_levels(), the fields coming from the rANS decoder.
+ * 
+ * @param decoder rANS decoder positioned on the first symbol.
+ * @param models Models of every level.
+ * @param quadtree Quadtree whose root is filled and not uniform.
+ * @param frontier Two buffers for the frontier.
+ */
+static void decode_levels_q3(RansDecoder * decoder, const RansModel * models, Quadtree * quadtree, Scratch * frontier) {
+    RansDecoder local = *decoder; // Kept in registers, the stores to the Quadtree can't alias it
+    uint32_t * current = reserve_next_frontier(&frontier[0], 1);
+    current[0] = 0;
+    size_t count = 1;
+    for (int level = 1; level <= quadtree->levels && count; level++) {
+        int leaf = is_leaf(quadtree, level);
+        const RansModel * flags = models + 2 * level - 2;
+        const RansModel * residuals = flags + 1;
+        const unsigned char * parent_m = quadtree->moyennes[level - 1];
+        uint32_t * next = !leaf ? reserve_next_frontier(&frontier[1], count) : NULL;
+        size_t n = 0;
+        for (size_t k = 0; k < count; k++) {
+            int64_t p = current[k];
+            int somme = 4 * parent_m[p] + get_epsilon(quadtree, level - 1, p);
+            for (int64_t j = 4 * p; j < 4 * p + 4; j++) {
+                unsigned char moyenne;
+                if (j % 4 != 3) {
+                    moyenne = parent_m[p] + rans_decode(&local, residuals);
+                    somme -= moyenne;
+                } else {
+                    moyenne = somme; // Interpolation of the 4th child
+                }
+                set_moyenne(quadtree, level, j, moyenne);
+                if (leaf) continue;
+                int symbol = rans_decode(&local, flags);
+                set_epsilon(quadtree, level, j, symbol & 3);
+                set_u(quadtree, level, j, symbol == 4);
+                if (symbol == 4) {
+                    fill_uniform_subtree(quadtree, level, j);
+                } else {
+                    next[n++] = j;
+                }
+            }
+        }
+        Scratch swap = frontier[0];
+        frontier[0] = frontier[1];
+        frontier[1] = swap;
+        current = next;
+        count = n;
+    }
+    *decoder = local;
+}
+
+/**
+ * @brief Constructs a quadtree from a Q3 BitStream.
+ * 
+ * @param stream BitStream to read from.
+ * @return Pointer to the constructed Quadtree.
+ * 
+ * @see encode_q3() for the layout of the payload.
  */
-static void build_image_from_quadtree_rec(Quadtree * quadtree, Image * image, int index, int x, int y, int size) {
-    if (is_leaf(quadtree, index)) {
-        image->image[y * image->width + x] = quadtree->nodes[index].moyenne;
-        return;
+static Quadtree * decode_q3(BitStream * stream) {
+    BitStream payload;
+    initReadBitStreamOver(&payload, stream->start, stream->ptr - stream->start);
+    int levels, flags;
+    unsigned char moyenne;
+    if (read_q3_header(&payload, &levels, &moyenne, &flags) != QTC_OK) {
+        fprintf(stderr, "Invalid Q3 file.\n");
+        exit(EXIT_FAILURE);
+    }
+    Quadtree * quadtree = create_decoded_quadtree(levels);
+    quadtree->moyennes[0][0] = moyenne;
+    if (!levels) return quadtree;
+    set_epsilon(quadtree, 0, 0, flags & 3);
+    set_u(quadtree, 0, 0, flags == 4);
+    if (flags == 4) {
+        // Nothing follows a uniform root
+        fill_uniform_subtree(quadtree, 0, 0);
+        return quadtree;
     }
-    // size of the child bloc
-    int child_size = size / 2;
 
-    // Builds the 4 children recursively clockwise 
-    build_image_from_quadtree_rec(quadtree, image, 4 * index + 1, x, y, child_size);                           // Top left 
-    build_image_from_quadtree_rec(quadtree, image, 4 * index + 2, x + child_size, y, child_size);              // Top right 
-    build_image_from_quadtree_rec(quadtree, image, 4 * index + 3, x + child_size, y + child_size, child_size); // Bottom right 
-    build_image_from_quadtree_rec(quadtree, image, 4 * index + 4, x, y + child_size, child_size);              // Bottom left 
+    Scratch scratch = {NULL, 0};
+    RansModel * models;
+    RansDecoder decoder;
+    QtcStatus status = read_q3_models(&payload, levels, &scratch, &models, &decoder);
+    if (status == QTC_ERROR_MEMORY) {
+        fprintf(stderr, "Error while allocating memory for the Q3 models.\n");
+        exit(EXIT_FAILURE);
+    }
+    Scratch frontier[2] = {{NULL, 0}, {NULL, 0}};
+    if (status == QTC_OK) {
+        decode_levels_q3(&decoder, models, quadtree, frontier);
+        if (!rans_decoder_done(&decoder)) status = QTC_ERROR_CORRUPT;
+    }
+    free(scratch.data);
+    free(frontier[0].data);
+    free(frontier[1].data);
+    if (status != QTC_OK) {
+        fprintf(stderr, "Invalid Q3 file.\n");
+        exit(EXIT_FAILURE);
+    }
+    return quadtree;
+}
+
+/**
+ * @brief Constructs a quadtree from a BitStream.
+ * 
+ * @param stream BitStream to read from.
+ * @return Pointer to the constructed Quadtree.
+ */
+Quadtree * decode(BitStream * stream) {
+    return decode_threads(stream, 1);
+}
+
+/**
+ * @brief Constructs a quadtree from a BitStream using several threads.
+ * 
+ * Q1 and Q3 streams are always decoded on a single thread, Q2 chunks are spread across the threads.
+ * A BitStream still being received is read to its end first.
+ * 
+ * @param stream BitStream to read from.
+ * @param threads Number of threads to use.
+ * @return Pointer to the constructed Quadtree.
+ */
+Quadtree * decode_threads(BitStream * stream, int threads) {
+    if (stream->format == 4) {
+        fprintf(stderr, "Delta frame, it is decoded with the previous frames of its sequence.\n");
+        exit(EXIT_FAILURE);
+    }
+    if (stream->format == 5) {
+        fprintf(stderr, "Multi-plane file, its planes are decoded with decode_planes().\n");
+        exit(EXIT_FAILURE);
+    }
+    fill_bitstream(stream, SIZE_MAX);
+    if (stream->format == 2) {
+        return decode_q2(stream, threads < 1 ? 1 : threads);
+    }
+    return stream->format == 3 ? decode_q3(stream) : decode_q1(stream);
 }
 
 /**
  * @brief Builds an image from a quadtree.
  * 
- * Builds an Image by recursively traversing its nodes and assigning pixel values to the corresponding blocks in the Image.
+ * The leaf level holds every pixel: in raster order (decoded Quadtrees) it is copied at once,
+ * stored in leaf order it is put back in raster order by 4x4 blocs (see leaf_order_to_raster()).
  * 
  * @param quadtree Quadtree representation of the Image. 
  * @return Pointer to the constructed Image.
  */
 Image * build_image_from_quadtree(Quadtree * quadtree) {
     int width = 1 << quadtree->levels; // 2^quadtree->levels
-    int image_size = width * width;
+    size_t image_size = (size_t) width * width;
     Image * image = allocate_image(width, image_size, 255);
-    build_image_from_quadtree_rec(quadtree, image, 0, 0, 0, width);
+    if (quadtree->pixels) {
+        memcpy(image->image, quadtree->pixels, image_size);
+        return image;
+    }
+    leaf_order_to_raster(quadtree->moyennes[quadtree->levels], image->image, width, 0, width);
     return image;
-}
\ No newline at end of file
+}
+/**
+ * @struct FrontierNode
+ * @brief Non-uniform node whose children are the next ones in the stream.
+ */
+typedef struct {
+    uint32_t j;             // Index of the node in its level
+    uint32_t x, y;          // Position of the node bloc, in blocs of its level
+    unsigned char moyenne;
+    unsigned char epsilon;
+} FrontierNode;
+
+/**
+ * @brief Fills a square bloc of an Image with one value.
+ * 
+ * @param image Image to fill.
+ * @param x X coordinate of the top-left corner of the bloc.
+ * @param y Y coordinate of the top-left corner of the bloc.
+ * @param size Size of the bloc.
+ * @param value Value of the pixels.
+ */
+static void fill_block(Image * image, size_t x, size_t y, size_t size, unsigned char value) {
+    unsigned char * row = image->image + y * image->width + x;
+    for (size_t i = 0; i < size; i++, row += image->width) {
+        memset(row, value, size);
+    }
+}
+
+/**
+ * @brief Writes the mean of each frontier node as a pixel, the Image being as wide as the level of the frontier.
+ * 
+ * @param image Image to fill.
+ * @param frontier Buffer holding the frontier nodes.
+ * @param count Number of frontier nodes.
+ */
+static void write_frontier_pixels(Image * image, const Scratch * frontier, size_t count) {
+    const FrontierNode * nodes = (const FrontierNode *) frontier->data;
+    for (size_t p = 0; p < count; p++) {
+        image->image[(size_t) nodes[p].y * image->width + nodes[p].x] = nodes[p].moyenne;
+    }
+}
+
+/**
+ * @brief Decodes the levels below a frontier straight into an Image.
+ * 
+ * Reads the children of the frontier nodes in stream order, level by level up to `last`.
+ * Leaves are written as pixels, uniform nodes fill their whole bloc at once (their descendants
+ * are not in the stream), the other nodes make the frontier of the next level.
+ * The Image is 2^`last` wide at least, each pixel being a node of level log2(width).
+ * Only the nodes present in the stream are visited. Reading errors are left in the error flag of the stream.
+ * The frontier goes back and forth between two buffers, which only grow.
+ * 
+ * @param stream BitStream to read from.
+ * @param image Image to fill.
+ * @param levels Levels of the Quadtree.
+ * @param level Level of the frontier nodes.
+ * @param last Last level to read.
+ * @param frontier Two buffers, the first one holding the frontier nodes in stream order, and on output
+ *        the frontier of level `last` (empty when `last` is the leaf level).
+ * @param count Number of frontier nodes, updated.
+ * @param grid Grid receiving the uniform blocs (the Image is then the whole image), NULL if none.
+ * @param stats Statistics receiving the nodes and the fields of each level, NULL if none.
+ * @return QTC_OK or QTC_ERROR_MEMORY.
+ */
+static QtcStatus decode_frontier(BitStream * stream, Image * image, int levels, int level, int last, Scratch * frontier, size_t * count, SegmentationGrid * grid, QtcStats * stats) {
+    for (level++; level <= last && *count; level++) {
+        int leaf = level == levels;
+        size_t size = (size_t) image->width >> level; // Bloc size of the children
+        const FrontierNode * current = (const FrontierNode *) frontier[0].data;
+        FrontierNode * next = leaf ? NULL : (FrontierNode *) scratch_reserve(&frontier[1], 4 * *count * sizeof(FrontierNode));
+        if (!leaf && !next) {
+            *count = 0;
+            return QTC_ERROR_MEMORY;
+        }
+        size_t n = 0, us = 0;
+        for (size_t p = 0; p < *count; p++) {
+            if (stream->fd >= 0 && p % QTC_FILL_PARENTS == 0) fill_bitstream(stream, 6 * QTC_FILL_PARENTS);
+            FrontierNode parent = current[p];
+            int somme = 4 * parent.moyenne + parent.epsilon;
+            for (int i = 0; i < 4; i++) {
+                // Clockwise: top left, top right, bottom right, bottom left
+                uint32_t x = 2 * parent.x + (i == 1 || i == 2);
+                uint32_t y = 2 * parent.y + (i >> 1);
+                unsigned char moyenne, epsilon = 0, u = 1;
+                if (i < 3) {
+                    moyenne = try_read_n_bits64(stream, 8);
+                    somme -= moyenne;
+                } else {
+                    moyenne = somme; // Interpolation of the 4th child
+                }
+                if (!leaf) {
+                    epsilon = try_read_n_bits64(stream, 2);
+                    u = !epsilon ? try_read_n_bits64(stream, 1) : 0;
+                    us += !epsilon;
+                }
+                if (leaf) {
+                    image->image[(size_t) y * image->width + x] = moyenne;
+                } else if (u) {
+                    fill_block(image, x * size, y * size, size, moyenne);
+                } else {
+                    next[n++] = (FrontierNode) {4 * parent.j + i, x, y, moyenne, epsilon};
+                }
+                if (grid && u) grid_add_bloc(grid, x * size, y * size, size);
+            }
+        }
+        stats_nodes(stats, levels, level, 4 * *count, leaf ? 0 : 4 * *count - n);
+        stats_fields(stats, 3 * *count, leaf ? 0 : 4 * *count, us);
+        Scratch swap = frontier[0];
+        frontier[0] = frontier[1];
+        frontier[1] = swap;
+        *count = n;
+    }
+    return QTC_OK;
+}
+
+/**
+ * @brief Reads the root and decodes the levels below it straight into an Image.
+ * 
+ * @param stream BitStream positioned on the root.
+ * @param image Image to fill.
+ * @param levels Levels of the Quadtree.
+ * @param last Last level to read.
+ * @param frontier Two buffers, the first one holding the frontier of level `last` on output.
+ * @param count Number of nodes of the frontier on output.
+ * @param grid Grid receiving the uniform blocs, NULL if none.
+ * @param stats Statistics receiving the nodes and the fields read, NULL if none.
+ * @return QTC_OK or QTC_ERROR_MEMORY.
+ */
+static QtcStatus decode_root(BitStream * stream, Image * image, int levels, int last, Scratch * frontier, size_t * count, SegmentationGrid * grid, QtcStats * stats) {
+    fill_bitstream(stream, 2);
+    uint64_t bits = try_read_n_bits64(stream, 10);
+    unsigned char epsilon = bits & 3;
+    unsigned char u = (!epsilon) ? try_read_n_bits64(stream, 1) : 0;
+    FrontierNode * root = (FrontierNode *) scratch_reserve(&frontier[0], sizeof(FrontierNode));
+    *count = 0;
+    if (!root) return QTC_ERROR_MEMORY;
+    *root = (FrontierNode) {0, 0, 0, bits >> 2, epsilon};
+    *count = 1;
+    stats_nodes(stats, levels, 0, 1, levels && u);
+    stats_fields(stats, 1, 1, !epsilon);
+    if (!levels || u) {
+        fill_block(image, 0, 0, image->width, root->moyenne);
+        if (grid) grid_add_bloc(grid, 0, 0, image->width);
+        *count = 0;
+    }
+    return decode_frontier(stream, image, levels, 0, last, frontier, count, grid, stats);
+}
+
+/**
+ * @brief Decodes the levels below the frontier of a Q3 payload straight into an Image.
+ * 
+ * Same walk as decode_frontier(), the fields coming from the rANS decoder.
+ * 
+ * @param decoder rANS decoder positioned on the first symbol below the frontier.
+ * @param models Models of every level.
+ * @param image Image to fill.
+ * @param levels Levels of the Quadtree.
+ * @param last Last level to read.
+ * @param frontier Two buffers, the first one holding the root, and on output the frontier of level `last`.
+ * @param count Number of frontier nodes (1), updated.
+ * @param grid Grid receiving the uniform blocs, NULL if none.
+ * @param stats Statistics receiving the nodes of each level, NULL if none.
+ * @param counts RANS_MAX_SYMBOLS counters per model, zeroed, receiving the symbols decoded, NULL if none.
+ * @return QTC_OK or QTC_ERROR_MEMORY.
+ */
+static QtcStatus decode_frontier_q3(RansDecoder * decoder, const RansModel * models, Image * image, int levels, int last, Scratch * frontier, size_t * count,
+                                    SegmentationGrid * grid, QtcStats * stats, uint32_t * counts) {
+    RansDecoder local = *decoder; // Kept in registers, the stores to the pixels can't alias it
+    for (int level = 1; level <= last && *count; level++) {
+        int leaf = level == levels;
+        const RansModel * flags = models + 2 * level - 2;
+        const RansModel * residuals = flags + 1;
+        uint32_t * flags_counts = counts ? counts + (2 * level - 2) * RANS_MAX_SYMBOLS : NULL;
+        size_t size = (size_t) image->width >> level; // Bloc size of the children
+        const FrontierNode * current = (const FrontierNode *) frontier[0].data;
+        FrontierNode * next = leaf ? NULL : (FrontierNode *) scratch_reserve(&frontier[1], 4 * *count * sizeof(FrontierNode));
+        if (!leaf && !next) {
+            *count = 0;
+            *decoder = local;
+            return QTC_ERROR_MEMORY;
+        }
+        size_t n = 0;
+        for (size_t p = 0; p < *count; p++) {
+            FrontierNode parent = current[p];
+            int somme = 4 * parent.moyenne + parent.epsilon;
+            for (int i = 0; i < 4; i++) {
+                // Clockwise: top left, top right, bottom right, bottom left
+                uint32_t x = 2 * parent.x + (i == 1 || i == 2);
+                uint32_t y = 2 * parent.y + (i >> 1);
+                unsigned char moyenne;
+                if (i < 3) {
+                    int residual = rans_decode(&local, residuals);
+                    if (flags_counts) flags_counts[RANS_MAX_SYMBOLS + residual]++;
+                    moyenne = parent.moyenne + residual;
+                    somme -= moyenne;
+                } else {
+                    moyenne = somme; // Interpolation of the 4th child
+                }
+                if (leaf) {
+                    image->image[(size_t) y * image->width + x] = moyenne;
+                    if (grid) grid_add_bloc(grid, x, y, 1);
+                    continue;
+                }
+                int symbol = rans_decode(&local, flags);
+                if (flags_counts) flags_counts[symbol]++;
+                if (symbol == 4) {
+                    fill_block(image, x * size, y * size, size, moyenne);
+                    if (grid) grid_add_bloc(grid, x * size, y * size, size);
+                } else {
+                    next[n++] = (FrontierNode) {4 * parent.j + i, x, y, moyenne, symbol};
+                }
+            }
+        }
+        stats_nodes(stats, levels, level, 4 * *count, leaf ? 0 : 4 * *count - n);
+        Scratch swap = frontier[0];
+        frontier[0] = frontier[1];
+        frontier[1] = swap;
+        *count = n;
+    }
+    *decoder = local;
+    return QTC_OK;
+}
+
+/**
+ * @brief Decodes a Q3 BitStream straight into an Image.
+ * 
+ * Above the leaves, the symbols of the deeper levels are left in the stream.
+ * 
+ * @param stream BitStream holding the payload.
+ * @param image Image to fill.
+ * @param depth Level of the pixels of the Image.
+ * @param context Context holding the frontiers, the models and the statistics (with the symbol counts).
+ * @param grid Grid receiving the uniform blocs, NULL if none.
+ * @return QTC_OK, QTC_ERROR_CORRUPT or QTC_ERROR_MEMORY.
+ */
+static QtcStatus decode_image_q3(BitStream * stream, Image * image, int depth, QtcContext * context, SegmentationGrid * grid) {
+    BitStream payload;
+    initReadBitStreamOver(&payload, stream->start, stream->ptr - stream->start);
+    int levels, flags;
+    unsigned char moyenne;
+    if (read_q3_header(&payload, &levels, &moyenne, &flags) != QTC_OK) return QTC_ERROR_CORRUPT;
+    stats_nodes(context->stats, levels, 0, 1, levels && flags == 4);
+    if (flags == 4) {
+        fill_block(image, 0, 0, image->width, moyenne);
+        if (grid) grid_add_bloc(grid, 0, 0, image->width);
+        return QTC_OK;
+    }
+    FrontierNode * root = (FrontierNode *) scratch_reserve(&context->shared[0], sizeof(FrontierNode));
+    if (!root) return QTC_ERROR_MEMORY;
+    *root = (FrontierNode) {0, 0, 0, moyenne, flags};
+    size_t count = 1;
+
+    RansModel * models;
+    RansDecoder decoder;
+    uint32_t * counts = NULL;
+    if (context->stats) {
+        counts = (uint32_t *) scratch_reserve(&context->shared[2], 2 * levels * RANS_MAX_SYMBOLS * sizeof(uint32_t));
+        if (!counts) return QTC_ERROR_MEMORY;
+        memset(counts, 0, 2 * levels * RANS_MAX_SYMBOLS * sizeof(uint32_t));
+    }
+    QtcStatus status = read_q3_models(&payload, levels, &context->shared[4], &models, &decoder);
+    if (status == QTC_OK) status = decode_frontier_q3(&decoder, models, image, levels, depth, context->shared, &count, grid, context->stats, counts);
+    if (status == QTC_OK && (depth == levels ? !rans_decoder_done(&decoder) : decoder.error)) status = QTC_ERROR_CORRUPT;
+    if (status == QTC_OK) stats_q3_fields(context->stats, levels, depth, models, counts);
+    if (status == QTC_OK) write_frontier_pixels(image, &context->shared[0], count);
+    return status;
+}
+
+/**
+ * @struct ImageTask
+ * @brief Chunks of a Q2 BitStream decoded into an Image by one thread.
+ */
+typedef struct {
+    Image * image;
+    const Q2Layout * q2;
+    const FrontierNode * roots; // Non-uniform chunks roots
+    int depth;                  // Level of the pixels of the Image
+    size_t first;               // First root of the task
+    size_t last;                // Root after the last one of the task
+    Scratch * frontier;         // Frontier buffers of the task
+    SegmentationGrid grid;      // Part of the grid drawn by the task (its own list), unused without a grid
+    int with_grid;              // Set if the uniform blocs go to `grid`
+    QtcStatus status;           // Result of the task
+    int started;                // Set if the task runs on its own thread
+    QtcStats * stats;           // Counters of the task, added to the statistics once it is done, NULL if not wanted
+} ImageTask;
+
+/**
+ * @brief Decodes the chunks of a task into the Image, each chunk only writes its own bloc.
+ * 
+ * @param arg Pointer to the ImageTask.
+ * @return NULL.
+ */
+static void * decode_image_chunks(void * arg) {
+    ImageTask * task = (ImageTask *) arg;
+    const Q2Layout * q2 = task->q2;
+    for (size_t r = task->first; r < task->last && task->status == QTC_OK; r++) {
+        int64_t t = task->roots[r].j;
+        BitStream chunk;
+        initReadBitStreamOver(&chunk, q2->first_chunk + chunk_offset(q2, t), chunk_size(q2, t));
+        FrontierNode * root = (FrontierNode *) scratch_reserve(&task->frontier[0], sizeof(FrontierNode));
+        if (!root) {
+            task->status = QTC_ERROR_MEMORY;
+            break;
+        }
+        *root = task->roots[r];
+        size_t count = 1;
+        // The borders of the chunk bloc are drawn beforehand, the blocs of a chunk stay inside it
+        uint32_t side = (uint32_t) task->image->width >> q2->split;
+        task->grid.left = root->x * side;
+        task->grid.top = root->y * side;
+        task->status = decode_frontier(&chunk, task->image, q2->levels, q2->split, task->depth, task->frontier, &count,
+                                       task->with_grid ? &task->grid : NULL, task->stats);
+        if (task->status == QTC_OK && chunk.error) task->status = QTC_ERROR_CORRUPT;
+        if (task->status == QTC_OK) write_frontier_pixels(task->image, &task->frontier[0], count);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Decodes a Q2 BitStream straight into an Image.
+ * 
+ * The top section gives the non-uniform chunks roots, their chunks are split in contiguous
+ * ranges holding about the same number of bytes, one per thread.
+ * If the pixels are not below the chunks roots, only the top section is read.
+ * 
+ * @param image Image to fill.
+ * @param q2 Layout of the payload.
+ * @param depth Level of the pixels of the Image.
+ * @param threads Number of threads to use.
+ * @param context Context holding the frontiers, the tasks and the statistics (each task counts its own nodes).
+ * @param grid Grid receiving the uniform blocs, NULL if none. Each task fills a part of its own,
+ *        the parts are merged in chunk order.
+ * @return QTC_OK, QTC_ERROR_CORRUPT or QTC_ERROR_MEMORY.
+ */
+static QtcStatus decode_image_q2(Image * image, const Q2Layout * q2, int depth, int threads, QtcContext * context, SegmentationGrid * grid) {
+    BitStream top_stream;
+    initReadBitStreamOver(&top_stream, q2->first_chunk + q2->top, q2->chunks_size - q2->top);
+    size_t count;
+    QtcStatus status = decode_root(&top_stream, image, q2->levels, depth < q2->split ? depth : q2->split, context->shared, &count, grid, context->stats);
+    if (status == QTC_OK && top_stream.error) status = QTC_ERROR_CORRUPT;
+    if (status != QTC_OK) return status;
+    if (depth <= q2->split) {
+        write_frontier_pixels(image, &context->shared[0], count);
+        return QTC_OK;
+    }
+    const FrontierNode * roots = (const FrontierNode *) context->shared[0].data;
+    uint32_t side = (uint32_t) image->width >> q2->split;
+    for (size_t r = 0; grid && r < count; r++) grid_draw_borders(grid, roots[r].x * side, roots[r].y * side, side);
+
+    if (threads > (int) count) threads = count > 0 ? count : 1;
+    ImageTask * tasks = (ImageTask *) scratch_reserve(&context->shared[2], threads * sizeof(ImageTask));
+    pthread_t * workers = (pthread_t *) scratch_reserve(&context->shared[3], threads * sizeof(pthread_t));
+    Scratch * scratch = context_thread_scratch(context, threads);
+    QtcStats * parts = context->stats ? (QtcStats *) scratch_reserve(&context->shared[5], threads * sizeof(QtcStats)) : NULL;
+    if (!tasks || !workers || !scratch || (context->stats && !parts)) return QTC_ERROR_MEMORY;
+    uint64_t total = 0;
+    for (size_t r = 0; r < count; r++) total += chunk_size(q2, roots[r].j);
+    size_t r = 0;
+    uint64_t done = 0;
+    for (int i = 0; i < threads; i++) {
+        tasks[i] = (ImageTask) {image, q2, roots, depth, r, count, scratch + i * QTC_THREAD_SCRATCH, {0}, grid != NULL, QTC_OK, 0, parts ? parts + i : NULL};
+        if (parts) init_stats(parts + i);
+        if (grid) tasks[i].grid = (SegmentationGrid) {grid->image, grid->list, NULL, 0, 0, 0, 0, 0};
+        if (i == threads - 1) break;
+        uint64_t target = total * (i + 1) / threads;
+        while (r < count && (done < target || r == tasks[i].first)) {
+            done += chunk_size(q2, roots[r].j);
+            r++;
+        }
+        tasks[i].last = r;
+    }
+    // The calling thread takes the first task and the ones whose thread can't be created
+    for (int i = 1; i < threads; i++) {
+        tasks[i].started = !pthread_create(&workers[i], NULL, decode_image_chunks, &tasks[i]);
+    }
+    decode_image_chunks(&tasks[0]);
+    for (int i = 1; i < threads; i++) {
+        if (tasks[i].started) {
+            pthread_join(workers[i], NULL);
+        } else {
+            decode_image_chunks(&tasks[i]);
+        }
+    }
+    for (int i = 0; i < threads; i++) {
+        if (tasks[i].status != QTC_OK) status = tasks[i].status;
+        if (parts) merge_stats(context->stats, parts + i);
+        if (grid && merge_segmentation_grid(grid, &tasks[i].grid) != QTC_OK && status == QTC_OK) status = QTC_ERROR_MEMORY;
+    }
+    return status;
+}
+
+/**
+ * @struct Window
+ * @brief Rectangle of an image decoded on its own, from the subtrees of one level that intersect it.
+ */
+typedef struct {
+    int x, y;                   // Top-left corner, in pixels of the full image
+    int width, height;          // Size of the rectangle
+    unsigned char * pixels;     // width * height pixels, row by row
+    int levels;                 // Levels of the Quadtree
+    int level;                  // Level of the subtrees roots
+} Window;
+
+/**
+ * @brief Fills a Window with the means of the subtrees roots, the bloc of a uniform root is then complete.
+ * 
+ * @param window Window to fill.
+ * @param means Means of the nodes of the roots level, 2^level wide, row by row.
+ */
+static void fill_window(const Window * window, const unsigned char * means) {
+    int shift = window->levels - window->level;
+    size_t side = (size_t) 1 << window->level;
+    for (int i = 0; i < window->height; i++) {
+        unsigned char * row = window->pixels + (size_t) i * window->width;
+        const unsigned char * src = means + ((size_t) (window->y + i) >> shift) * side;
+        for (int k = 0; k < window->width; k++) row[k] = src[(size_t) (window->x + k) >> shift];
+    }
+}
+
+/**
+ * @brief Checks if the bloc of a subtree root intersects a Window.
+ * 
+ * @param window Current Window.
+ * @param root Subtree root.
+ * @return 1 if some pixels of the bloc are in the Window.
+ */
+static int window_intersects(const Window * window, const FrontierNode * root) {
+    int shift = window->levels - window->level;
+    int64_t x = (int64_t) root->x << shift, y = (int64_t) root->y << shift, side = (int64_t) 1 << shift;
+    return x < window->x + window->width && x + side > window->x && y < window->y + window->height && y + side > window->y;
+}
+
+/**
+ * @brief Decodes a non-uniform subtree into its own bloc, then copies the part inside the Window.
+ * 
+ * The subtree is decoded as a Quadtree of its own, positions being relative to its root.
+ * A Q2 chunk holds the levels of the subtree one after the other, in a Q1 payload the nodes
+ * of each level are found with the bit offsets of the index.
+ * 
+ * @param window Window to fill.
+ * @param root Subtree root.
+ * @param chunk Q2 chunk of the subtree, NULL for a Q1 payload.
+ * @param payload Q1 payload.
+ * @param size Size of the Q1 payload in bytes.
+ * @param offsets Bit offsets of the subtree in each level below its root (Q1 only).
+ * @param scratch Frontier buffers (two) and bloc pixels.
+ * @param stats Statistics receiving the nodes and the fields read, NULL if none.
+ * @return QTC_OK, QTC_ERROR_CORRUPT or QTC_ERROR_MEMORY.
+ */
+static QtcStatus decode_window_subtree(const Window * window, const FrontierNode * root, BitStream * chunk,
+                                       const unsigned char * payload, size_t size, const uint64_t * offsets, Scratch * scratch, QtcStats * stats) {
+    int depth = window->levels - window->level;
+    int side = 1 << depth;
+    Image bloc = {side, (size_t) side * side, 255, (unsigned char *) scratch_reserve(&scratch[2], (size_t) side * side), IMAGE_RASTER};
+    FrontierNode * node = (FrontierNode *) scratch_reserve(&scratch[0], sizeof(FrontierNode));
+    if (!bloc.image || !node) return QTC_ERROR_MEMORY;
+    *node = (FrontierNode) {root->j, 0, 0, root->moyenne, root->epsilon};
+    size_t count = 1;
+    QtcStatus status = QTC_OK;
+    if (chunk) {
+        status = decode_frontier(chunk, &bloc, depth, 0, depth, scratch, &count, NULL, stats);
+        if (status == QTC_OK && chunk->error) status = QTC_ERROR_CORRUPT;
+    }
+    for (int level = 1; !chunk && level <= depth && count && status == QTC_OK; level++) {
+        uint64_t bit = offsets[level - 1];
+        if (bit / 8 >= size) return QTC_ERROR_CORRUPT;
+        BitStream stream;
+        initReadBitStreamOver(&stream, payload + bit / 8, size - bit / 8);
+        if (bit % 8) try_read_n_bits64(&stream, bit % 8);
+        status = decode_frontier(&stream, &bloc, depth, level - 1, level, scratch, &count, NULL, stats);
+        if (status == QTC_OK && stream.error) status = QTC_ERROR_CORRUPT;
+    }
+    if (status != QTC_OK) return status;
+
+    int64_t x0 = (int64_t) root->x << depth, y0 = (int64_t) root->y << depth;
+    int64_t left = x0 > window->x ? x0 : window->x;
+    int64_t right = x0 + side < window->x + window->width ? x0 + side : window->x + window->width;
+    int64_t top = y0 > window->y ? y0 : window->y;
+    int64_t bottom = y0 + side < window->y + window->height ? y0 + side : window->y + window->height;
+    for (int64_t y = top; y < bottom; y++) {
+        memcpy(window->pixels + (y - window->y) * window->width + (left - window->x), bloc.image + (y - y0) * side + (left - x0), right - left);
+    }
+    return QTC_OK;
+}
+
+/**
+ * @brief Decodes a rectangle of a BitStream, only reading the subtrees that intersect it.
+ * 
+ * The subtrees are the Q2 chunks, whose roots come from the top section, or for a Q1 payload
+ * the subtrees of the index level, whose roots are in the index.
+ * The Window is first filled with the means of the roots, then each non-uniform subtree
+ * that intersects it is decoded into a bloc of its own and copied.
+ * 
+ * @param stream BitStream to read from (only read).
+ * @param index Seek index of a Q1 payload, not used for Q2.
+ * @param window Window to fill.
+ * @param context Context holding the buffers and the statistics.
+ * @return QTC_OK, QTC_ERROR_ARGUMENT if a Q1 payload has no matching index or for Q3, QTC_ERROR_CORRUPT or QTC_ERROR_MEMORY.
+ */
+static QtcStatus decode_window(BitStream * stream, const QtcIndex * index, Window * window, QtcContext * context) {
+    const unsigned char * payload = stream->start;
+    size_t size = stream->ptr - stream->start;
+    Scratch * scratch = context_thread_scratch(context, 1);
+    if (!scratch) return QTC_ERROR_MEMORY;
+    if (stream->format == 2) {
+        Q2Layout q2;
+        QtcStatus status = read_q2_layout(stream, &q2);
+        if (status != QTC_OK) return status;
+        window->level = q2.split;
+        int side = 1 << q2.split;
+        Image means = {side, (size_t) side * side, 255, (unsigned char *) scratch_reserve(&context->shared[2], (size_t) side * side), IMAGE_RASTER};
+        if (!means.image) return QTC_ERROR_MEMORY;
+        BitStream top_stream;
+        initReadBitStreamOver(&top_stream, q2.first_chunk + q2.top, q2.chunks_size - q2.top);
+        size_t count;
+        status = decode_root(&top_stream, &means, q2.levels, q2.split, context->shared, &count, NULL, context->stats);
+        if (status == QTC_OK && top_stream.error) status = QTC_ERROR_CORRUPT;
+        if (status != QTC_OK) return status;
+        write_frontier_pixels(&means, &context->shared[0], count);
+        fill_window(window, means.image);
+        const FrontierNode * roots = (const FrontierNode *) context->shared[0].data;
+        for (size_t r = 0; r < count && status == QTC_OK; r++) {
+            if (!window_intersects(window, &roots[r])) continue;
+            BitStream chunk;
+            initReadBitStreamOver(&chunk, q2.first_chunk + chunk_offset(&q2, roots[r].j), chunk_size(&q2, roots[r].j));
+            status = decode_window_subtree(window, &roots[r], &chunk, NULL, 0, NULL, scratch, context->stats);
+        }
+        return status;
+    }
+    if (stream->format == 3 || !index || index->levels != window->levels || index->payload_size != size) {
+        return QTC_ERROR_ARGUMENT;
+    }
+    window->level = index->level;
+    int64_t subtrees = nodes_in_level(index->level);
+    unsigned char * means = (unsigned char *) scratch_reserve(&context->shared[2], subtrees);
+    if (!means) return QTC_ERROR_MEMORY;
+    for (int64_t t = 0; t < subtrees; t++) {
+        uint32_t x, y;
+        node_coordinates(t, &x, &y);
+        means[(size_t) y * (1 << index->level) + x] = index->roots[2 * t];
+    }
+    fill_window(window, means);
+    int depth = index->levels - index->level;
+    QtcStatus status = QTC_OK;
+    for (int64_t t = 0; t < subtrees && status == QTC_OK; t++) {
+        unsigned char flags = index->roots[2 * t + 1];
+        if (flags & 4) continue;
+        uint32_t x, y;
+        node_coordinates(t, &x, &y);
+        FrontierNode root = {t, x, y, index->roots[2 * t], flags & 3};
+        if (!window_intersects(window, &root)) continue;
+        status = decode_window_subtree(window, &root, NULL, payload, size, index->offsets + (size_t) t * depth, scratch, context->stats);
+    }
+    return status;
+}
+
+/**
+ * @brief Reads the size of the image encoded in a BitStream.
+ * 
+ * @param stream BitStream holding a Q1, Q2 or Q3 payload.
+ * @param width Width (and height) of the image on output.
+ * @return QTC_OK, or QTC_ERROR_CORRUPT if the levels are missing or too large.
+ */
+QtcStatus decoded_image_width(BitStream * stream, int * width) {
+    if (stream->ptr <= stream->start || stream->start[0] > QUADTREE_MAX_LEVELS) {
+        return QTC_ERROR_CORRUPT;
+    }
+    *width = 1 << stream->start[0];
+    return QTC_OK;
+}
+
+/**
+ * @brief Decodes a BitStream into an existing Image, without exiting on errors.
+ * 
+ * Same result as build_image_from_quadtree() on the decoded Quadtree, without building it:
+ * uniform blocs are filled row by row and the nodes below them are never created,
+ * so the work follows the size of the stream rather than the number of pixels.
+ * The stream is only read, several threads can decode the same data. A stream still being received
+ * (`fd` set, read from a pipe) is decoded at Q1 format as its data comes in, Q2 and Q3 streams are received
+ * entirely first; the whole stream is then received on return.
+ * 
+ * A narrower Image, 2^k pixels wide, receives the means of the nodes of level k (a thumbnail):
+ * nodes are written breadth-first, so the decoding stops at level k and the rest of the stream is not read.
+ * 
+ * @param stream BitStream to read from.
+ * @param image Image to fill, as wide as given by decoded_image_width() or narrower (a power of 2).
+ * @param threads Number of threads to use (Q2 chunks only).
+ * @param context Context whose working arrays are used, NULL to allocate them for this call only.
+ * @return QTC_OK, QTC_ERROR_ARGUMENT if the Image doesn't have a valid size or for a Q4 delta frame or a Q5 multi-plane file, QTC_ERROR_CORRUPT or QTC_ERROR_MEMORY.
+ */
+QtcStatus decode_image_into(BitStream * stream, Image * image, int threads, QtcContext * context) {
+    return decode_image_grid_into(stream, image, NULL, threads, context);
+}
+
+/**
+ * @brief Gives every non-leaf node of a Quadtree the fields of its 4 children, from the leaves up.
+ * 
+ * The decoded means of a node are `moyenne` = sum / 4 and `epsilon` = sum % 4 of the means of its children
+ * (the encoder computes them so and the 4th child is interpolated from them), `u` is set on the constant blocs.
+ * 
+ * @param quadtree Quadtree whose leaves are set.
+ */
+static void derive_levels(Quadtree * quadtree) {
+    for (int level = quadtree->levels - 1; level >= 0; level--) {
+        int64_t total = nodes_in_level(level);
+        int above_leaves = level == quadtree->levels - 1;
+        for (int64_t j = 0; j < total; j++) {
+            unsigned char first = get_moyenne(quadtree, level + 1, 4 * j);
+            int sum = 0, constant = 1;
+            for (int i = 0; i < 4; i++) {
+                unsigned char moyenne = get_moyenne(quadtree, level + 1, 4 * j + i);
+                sum += moyenne;
+                constant &= moyenne == first && (above_leaves || get_u(quadtree, level + 1, 4 * j + i));
+            }
+            quadtree->moyennes[level][j] = sum / 4;
+            set_epsilon(quadtree, level, j, sum % 4);
+            set_u(quadtree, level, j, constant);
+        }
+    }
+}
+
+/**
+ * @brief Decodes a BitStream into a Quadtree, without exiting on errors.
+ * 
+ * The image is decoded with decode_image_into() straight into the leaf level, kept in raster order
+ * like the Quadtrees of decode(), then the levels above are derived from it. Every level keeps
+ * the decoded means, so a thumbnail or a window of any level is read from the Quadtree without decoding again.
+ * 
+ * @param stream BitStream to read from (only read, it can be shared between threads).
+ * @param threads Number of threads to use (Q2 chunks only).
+ * @param context Context whose working arrays are used, NULL to allocate them for this call only.
+ * @param quadtree Quadtree on output, freed with free_quadtree().
+ * @return QTC_OK, QTC_ERROR_ARGUMENT for a Q4 delta frame or a Q5 multi-plane file, QTC_ERROR_CORRUPT or QTC_ERROR_MEMORY.
+ */
+QtcStatus decode_quadtree_into(BitStream * stream, int threads, QtcContext * context, Quadtree ** quadtree) {
+    int width;
+    if (decoded_image_width(stream, &width) != QTC_OK) return QTC_ERROR_CORRUPT;
+    if (stream->format >= 4) return QTC_ERROR_ARGUMENT;
+    int levels = stream->start[0];
+    Quadtree * decoded = try_create_empty_quadtree(levels, 0);
+    if (!decoded) return QTC_ERROR_MEMORY;
+    if (levels) {
+        decoded->pixels = decoded->moyennes[levels];
+        decoded->moyennes[levels] = NULL;
+    }
+    Image image = {width, (size_t) width * width, 255, levels ? decoded->pixels : decoded->moyennes[0], IMAGE_RASTER};
+    QtcStatus status = decode_image_into(stream, &image, threads, context);
+    if (status != QTC_OK) {
+        free_quadtree(decoded);
+        return status;
+    }
+    derive_levels(decoded);
+    *quadtree = decoded;
+    return QTC_OK;
+}
+
+/**
+ * @brief Decodes a BitStream straight into an Image and fills its segmentation grid in the same pass, without exiting on errors.
+ * 
+ * Every uniform bloc is added to the grid when it is filled, leaves being blocs of one pixel.
+ * The grid is only defined for the whole image.
+ * 
+ * @param stream BitStream to read from.
+ * @param image Image to fill, as wide as given by decoded_image_width() or narrower (a power of 2) without a grid.
+ * @param grid Grid of the Image size receiving the uniform blocs, NULL if none.
+ * @param threads Number of threads to use (Q2 chunks only).
+ * @param context Context whose working arrays are used, NULL to allocate them for this call only.
+ * @return QTC_OK, QTC_ERROR_ARGUMENT if the Image or the grid doesn't have a valid size or for a Q4 delta frame or a Q5 multi-plane file, QTC_ERROR_CORRUPT or QTC_ERROR_MEMORY.
+ */
+QtcStatus decode_image_grid_into(BitStream * stream, Image * image, SegmentationGrid * grid, int threads, QtcContext * context) {
+    int width;
+    if (decoded_image_width(stream, &width) != QTC_OK) return QTC_ERROR_CORRUPT;
+    if (stream->format >= 4) return QTC_ERROR_ARGUMENT; // Needs the previous frame (see decode_delta_into()) or holds planes (see decode_planes_into())
+    if (image->width < 1 || image->width > width || (image->width & (image->width - 1)) || image->image_size != (size_t) image->width * image->width) {
+        return QTC_ERROR_ARGUMENT;
+    }
+    if (grid && (image->width != width || (grid->image && grid->image->width != width))) return QTC_ERROR_ARGUMENT;
+    int depth = 0;
+    while ((1 << depth) < image->width) depth++;
+    QtcContext local;
+    if (!context) init_context(context = &local);
+    uint64_t fields = stats_field_bits(context->stats);
+    QtcStatus status;
+    if (stream->format != 1) fill_bitstream(stream, SIZE_MAX); // The chunks and the models come before their offsets
+    if (stream->format == 2) {
+        Q2Layout q2;
+        status = read_q2_layout(stream, &q2);
+        if (status == QTC_OK) status = decode_image_q2(image, &q2, depth, threads < 1 ? 1 : threads, context, grid);
+    } else if (stream->format == 3) {
+        status = decode_image_q3(stream, image, depth, context, grid);
+    } else {
+        BitStream payload;
+        initReadBitStreamOver(&payload, stream->start, stream->ptr - stream->start);
+        // Still being received: the data comes in as the levels are decoded, into the buffer of the stream
+        payload.end = stream->end;
+        payload.fd = stream->fd;
+        int levels = try_read_n_bits64(&payload, 8);
+        size_t count;
+        status = decode_root(&payload, image, levels, depth, context->shared, &count, grid, context->stats);
+        fill_bitstream(&payload, SIZE_MAX);
+        stream->ptr = payload.ptr;
+        stream->fd = -1;
+        if (status == QTC_OK && payload.error) status = QTC_ERROR_CORRUPT;
+        if (status == QTC_OK) write_frontier_pixels(image, &context->shared[0], count);
+    }
+    // A thumbnail leaves the end of the payload unread, only the fields read are counted
+    if (status == QTC_OK && image->width == width) stats_payload(context->stats, stream->format, fields, stream->ptr - stream->start);
+    else if (status == QTC_OK && context->stats) context->stats->format = stream->format;
+    if (context == &local) release_context(&local);
+    if (status == QTC_OK && grid && grid->failed) status = QTC_ERROR_MEMORY;
+    return status;
+}
+
+/**
+ * @brief Exits with an error message if an Image couldn't be decoded.
+ * 
+ * @param stream BitStream decoded.
+ * @param status Status returned by the decoding.
+ */
+static void check_image_status(BitStream * stream, QtcStatus status) {
+    if (status == QTC_ERROR_MEMORY) {
+        fprintf(stderr, "Error while allocating memory for decoding.\n");
+        exit(EXIT_FAILURE);
+    } else if (status != QTC_OK) {
+        fprintf(stderr, stream->format == 2 ? "Invalid Q2 file.\n" : stream->format == 3 ? "Invalid Q3 file.\n" : "Erreur lors de la lecture du flux binaire.\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * @brief Decodes a BitStream straight into an Image.
+ * 
+ * @see decode_image_into()
+ * 
+ * @param stream BitStream to read from.
+ * @param threads Number of threads to use (Q2 chunks only).
+ * @return Pointer to the decoded Image.
+ */
+Image * decode_image(BitStream * stream, int threads) {
+    return decode_image_level(stream, QUADTREE_MAX_LEVELS, threads);
+}
+
+/**
+ * @brief Decodes the first levels of a BitStream into a thumbnail.
+ * 
+ * @see decode_image_into()
+ * 
+ * @param stream BitStream to read from.
+ * @param max_level Level of the pixels of the thumbnail, the whole image if the Quadtree isn't that deep.
+ * @param threads Number of threads to use (Q2 chunks only).
+ * @return Pointer to the decoded Image, 2^max_level pixels wide at most.
+ */
+Image * decode_image_level(BitStream * stream, int max_level, int threads) {
+    int width;
+    if (decoded_image_width(stream, &width) != QTC_OK) {
+        fprintf(stderr, "Unsupported Quadtree levels.\n");
+        exit(EXIT_FAILURE);
+    }
+    if (max_level < QUADTREE_MAX_LEVELS && width > (1 << max_level)) width = 1 << max_level;
+    Image * image = allocate_image(width, (size_t) width * width, 255);
+    check_image_status(stream, decode_image_into(stream, image, threads, NULL));
+    return image;
+}
+
+/**
+ * @brief Decodes a BitStream straight into an Image and fills its segmentation grid in the same pass.
+ * 
+ * @see decode_image_grid_into()
+ * 
+ * @param stream BitStream to read from.
+ * @param grid Grid of the image size receiving the uniform blocs.
+ * @param threads Number of threads to use (Q2 chunks only).
+ * @return Pointer to the decoded Image.
+ */
+Image * decode_image_grid(BitStream * stream, SegmentationGrid * grid, int threads) {
+    int width;
+    if (decoded_image_width(stream, &width) != QTC_OK) {
+        fprintf(stderr, "Unsupported Quadtree levels.\n");
+        exit(EXIT_FAILURE);
+    }
+    Image * image = allocate_image(width, (size_t) width * width, 255);
+    check_image_status(stream, decode_image_grid_into(stream, image, grid, threads, NULL));
+    return image;
+}
+
+/**
+ * @brief Decodes a region of interest into a pixel buffer, without exiting on errors.
+ * 
+ * Only the subtrees whose bloc intersects the region are read: the chunks of a Q2 payload,
+ * or the subtrees of the index level of a Q1 payload, found with its seek index.
+ * The result is the crop of the whole decoded image.
+ * 
+ * @param stream BitStream to read from (only read, it can be shared between threads).
+ * @param index Seek index of a Q1 payload built by build_qtc_index(), not used for Q2.
+ * @param x Column of the top-left corner of the region.
+ * @param y Row of the top-left corner of the region.
+ * @param width Width of the region.
+ * @param height Height of the region.
+ * @param pixels Buffer of width * height pixels receiving the region, row by row.
+ * @param context Context whose working arrays are used, NULL to allocate them for this call only.
+ * @return QTC_OK, QTC_ERROR_ARGUMENT if the region is outside of the image, for Q3 and Q4 or if a Q1 payload
+ *         has no matching index, QTC_ERROR_CORRUPT or QTC_ERROR_MEMORY.
+ */
+QtcStatus decode_region_into(BitStream * stream, const QtcIndex * index, int x, int y, int width, int height, unsigned char * pixels, QtcContext * context) {
+    int image_width;
+    if (decoded_image_width(stream, &image_width) != QTC_OK) return QTC_ERROR_CORRUPT;
+    if (stream->format >= 4) return QTC_ERROR_ARGUMENT;
+    if (!pixels || x < 0 || y < 0 || width < 1 || height < 1 || width > image_width - x || height > image_width - y) {
+        return QTC_ERROR_ARGUMENT;
+    }
+    fill_bitstream(stream, SIZE_MAX);
+    Window window = {x, y, width, height, pixels, stream->start[0], 0};
+    QtcContext local;
+    if (!context) init_context(context = &local);
+    QtcStatus status = decode_window(stream, index, &window, context);
+    if (status == QTC_OK && context->stats) context->stats->format = stream->format; // Only the fields read are counted
+    if (context == &local) release_context(&local);
+    return status;
+}
+
+/**
+ * @brief Decodes a region of interest into a new pixel buffer.
+ * 
+ * @see decode_region_into()
+ * 
+ * @param stream BitStream to read from.
+ * @param index Seek index of a Q1 payload, not used for Q2.
+ * @param x Column of the top-left corner of the region.
+ * @param y Row of the top-left corner of the region.
+ * @param width Width of the region.
+ * @param height Height of the region.
+ * @return Buffer of width * height pixels, row by row, to free with free().
+ */
+unsigned char * decode_region(BitStream * stream, const QtcIndex * index, int x, int y, int width, int height) {
+    unsigned char * pixels = (unsigned char *) malloc((size_t) width * height);
+    if (!pixels) {
+        fprintf(stderr, "Error while allocating memory for decoding.\n");
+        exit(EXIT_FAILURE);
+    }
+    QtcStatus status = decode_region_into(stream, index, x, y, width, height, pixels, NULL);
+    if (status == QTC_ERROR_MEMORY) {
+        fprintf(stderr, "Error while allocating memory for decoding.\n");
+        exit(EXIT_FAILURE);
+    } else if (status == QTC_ERROR_ARGUMENT) {
+        fprintf(stderr, stream->format == 3 ? "Regions can't be decoded from a Q3 file.\n" :
+                        stream->format == 2 ? "Region outside of the image.\n" : "Region outside of the image or index not matching the Q1 file.\n");
+        exit(EXIT_FAILURE);
+    } else if (status != QTC_OK) {
+        fprintf(stderr, stream->format == 2 ? "Invalid Q2 file.\n" : "Erreur lors de la lecture du flux binaire.\n");
+        exit(EXIT_FAILURE);
+    }
+    return pixels;
+}
@@ -0,0 +1,236 @@
+/**
+ * @file delta.c
+ * @brief Implementation of the temporal delta coding.
+ *
+ * A frame of a sequence is coded against the decoded Quadtree of the previous frame (the reference),
+ * which the encoder and the decoder both keep. The Q4 payload is the levels byte, then the nodes
+ * breadth-first like Q1, each one preceded by a `same` bit: a node whose subtree decodes the same as
+ * in the reference is 1 and nothing else, the reference is kept there. Only the children of changed
+ * non-uniform nodes are written, so the payload and the decoding follow the changed regions.
+ * The 4th child of a leaf group has no bit at all, its `moyenne` is always interpolated.
+ */
+
+#include "delta.h"
+
+/**
+ * @brief Returns the bit of a node in a plane of one bit per node.
+ *
+ * @param plane Bits of a level.
+ * @param j Index of the node in its level.
+ * @return 0 or 1.
+ */
+static inline int plane_bit(const uint8_t * plane, int64_t j) {
+    return (plane[j >> 3] >> (j & 7)) & 1;
+}
+
+/**
+ * @brief Flags the nodes whose subtree decodes the same as in the reference, from the leaves up.
+ *
+ * A node is the same when its `moyenne` is, and for a non-leaf node its `epsilon` and `u`, then
+ * its 4 children if it isn't uniform. The nodes below a uniform node of the frame are compared too,
+ * but their flags are never used.
+ *
+ * @param quadtree Quadtree of the frame.
+ * @param reference Decoded Quadtree of the previous frame.
+ * @param same One plane per level receiving the flags.
+ */
+static void compare_levels(const Quadtree * quadtree, const Quadtree * reference, uint8_t ** same) {
+    int levels = quadtree->levels;
+    for (int level = levels; level >= 0; level--) {
+        int64_t total = nodes_in_level(level);
+        int leaf = level == levels;
+        memset(same[level], 0, (total + 7) / 8);
+        for (int64_t j = 0; j < total; j++) {
+            int equal = get_moyenne(quadtree, level, j) == get_moyenne(reference, level, j);
+            if (equal && !leaf) {
+                unsigned char u = get_u(quadtree, level, j);
+                // The flags of the 4 children are the same nibble
+                equal = get_epsilon(quadtree, level, j) == get_epsilon(reference, level, j) && u == get_u(reference, level, j)
+                        && (u || ((same[level + 1][j >> 1] >> (4 * (j & 1))) & 15) == 15);
+            }
+            same[level][j >> 3] |= equal << (j & 7);
+        }
+    }
+}
+
+/**
+ * @brief Writes the fields of a changed node, like encode() does.
+ *
+ * @param stream BitStream to write to.
+ * @param quadtree Quadtree of the frame.
+ * @param level Level of the node.
+ * @param j Index of the node in its level.
+ * @param fourth Leaves out the `moyenne` of a 4th child if not 0.
+ */
+static void write_changed(BitStream * stream, const Quadtree * quadtree, int level, int64_t j, int fourth) {
+    if (!fourth) try_push_n_bits64(stream, get_moyenne(quadtree, level, j), 8);
+    if (level == quadtree->levels) return;
+    unsigned char epsilon = get_epsilon(quadtree, level, j);
+    try_push_n_bits64(stream, epsilon, 2);
+    if (!epsilon) try_push_n_bits64(stream, get_u(quadtree, level, j), 1);
+}
+
+/**
+ * @brief Encodes a Quadtree as a delta of the decoded Quadtree of the previous frame, without exiting on errors.
+ *
+ * The subtrees are compared once from the leaves up, then only the changed nodes are walked:
+ * the frontier holds the changed non-uniform nodes of a level, their children are the nodes written next.
+ *
+ * @param stream BitStream to write to (its format is set to 4), at least encoded_size_bound() bytes.
+ * @param quadtree Quadtree of the frame, filtered or not.
+ * @param reference Decoded Quadtree of the previous frame, of the same levels.
+ * @param context Context whose working arrays are used, NULL to allocate them for this call only.
+ * @return QTC_OK, QTC_ERROR_ARGUMENT if the levels differ, QTC_ERROR_BUFFER or QTC_ERROR_MEMORY.
+ */
+QtcStatus encode_delta_to_stream(BitStream * stream, Quadtree * quadtree, const Quadtree * reference, QtcContext * context) {
+    int levels = quadtree->levels;
+    if (reference->levels != levels) return QTC_ERROR_ARGUMENT;
+    QtcContext local;
+    if (!context) init_context(context = &local);
+    QtcStatus status = QTC_OK;
+
+    // One bit per node and level
+    size_t size = 0;
+    for (int level = 0; level <= levels; level++) size += (nodes_in_level(level) + 7) / 8;
+    uint8_t * planes = (uint8_t *) scratch_reserve(&context->shared[2], size);
+    uint32_t * current = (uint32_t *) scratch_reserve(&context->shared[0], sizeof(uint32_t));
+    if (!planes || !current) {
+        status = QTC_ERROR_MEMORY;
+        goto done;
+    }
+    uint8_t * same[QUADTREE_MAX_LEVELS + 1];
+    for (int level = 0; level <= levels; level++) {
+        same[level] = planes;
+        planes += (nodes_in_level(level) + 7) / 8;
+    }
+    compare_levels(quadtree, reference, same);
+
+    stream->format = 4;
+    try_push_n_bits64(stream, levels, 8);
+    int root_same = plane_bit(same[0], 0);
+    try_push_n_bits64(stream, root_same, 1);
+    if (!root_same) write_changed(stream, quadtree, 0, 0, 0);
+    size_t count = !root_same && levels && !get_u(quadtree, 0, 0);
+    current[0] = 0;
+
+    for (int level = 1; level <= levels && count; level++) {
+        int leaf = level == levels;
+        uint32_t * next = leaf ? NULL : (uint32_t *) scratch_reserve(&context->shared[1], 4 * count * sizeof(uint32_t));
+        if (!leaf && !next) {
+            status = QTC_ERROR_MEMORY;
+            goto done;
+        }
+        size_t n = 0;
+        for (size_t p = 0; p < count; p++) {
+            for (int i = 0; i < (leaf ? 3 : 4); i++) {
+                int64_t j = 4 * current[p] + i;
+                int s = plane_bit(same[level], j);
+                try_push_n_bits64(stream, s, 1);
+                if (s) continue;
+                write_changed(stream, quadtree, level, j, i == 3);
+                if (!leaf && !get_u(quadtree, level, j)) next[n++] = j;
+            }
+        }
+        Scratch swap = context->shared[0];
+        context->shared[0] = context->shared[1];
+        context->shared[1] = swap;
+        current = next;
+        count = n;
+    }
+    finishBitStream(stream);
+    if (stream->error) status = QTC_ERROR_BUFFER;
+
+done:
+    if (context == &local) release_context(&local);
+    return status;
+}
+
+/**
+ * @brief Reads the fields of a changed node into the reference.
+ *
+ * @param stream BitStream to read from.
+ * @param quadtree Reference being patched.
+ * @param level Level of the node.
+ * @param j Index of the node in its level.
+ * @param fourth Interpolates the `moyenne` of a 4th child from its parent and siblings if not 0.
+ * @return `u` of the node (1 for a leaf).
+ */
+static int read_changed(BitStream * stream, Quadtree * quadtree, int level, int64_t j, int fourth) {
+    unsigned char moyenne;
+    if (fourth) {
+        moyenne = 4 * quadtree->moyennes[level - 1][j / 4] + get_epsilon(quadtree, level - 1, j / 4)
+                  - get_moyenne(quadtree, level, j - 1) - get_moyenne(quadtree, level, j - 2) - get_moyenne(quadtree, level, j - 3);
+    } else {
+        moyenne = try_read_n_bits64(stream, 8);
+    }
+    set_moyenne(quadtree, level, j, moyenne);
+    if (level == quadtree->levels) return 1;
+    unsigned char epsilon = try_read_n_bits64(stream, 2);
+    unsigned char u = !epsilon ? try_read_n_bits64(stream, 1) : 0;
+    set_epsilon(quadtree, level, j, epsilon);
+    set_u(quadtree, level, j, u);
+    if (u) fill_uniform_subtree(quadtree, level, j);
+    return u;
+}
+
+/**
+ * @brief Decodes a Q4 payload by patching the decoded Quadtree of the previous frame in place.
+ *
+ * The unchanged subtrees are not touched, the changed nodes get their new values and the nodes
+ * below a changed uniform node the decoded ones, so the work follows the changed regions.
+ *
+ * @param stream BitStream holding the Q4 payload.
+ * @param reference Decoded Quadtree of the previous frame, the Quadtree of the frame on output.
+ * @param context Context whose working arrays are used, NULL to allocate them for this call only.
+ * @return QTC_OK, QTC_ERROR_ARGUMENT if the levels differ, QTC_ERROR_CORRUPT or QTC_ERROR_MEMORY.
+ */
+QtcStatus decode_delta_into(BitStream * stream, Quadtree * reference, QtcContext * context) {
+    fill_bitstream(stream, SIZE_MAX);
+    BitStream payload;
+    initReadBitStreamOver(&payload, stream->start, stream->ptr - stream->start);
+    int levels = try_read_n_bits64(&payload, 8);
+    if (payload.error) return QTC_ERROR_CORRUPT;
+    if (levels != reference->levels) return QTC_ERROR_ARGUMENT;
+    QtcContext local;
+    if (!context) init_context(context = &local);
+    QtcStatus status = QTC_OK;
+
+    uint32_t * current = (uint32_t *) scratch_reserve(&context->shared[0], sizeof(uint32_t));
+    if (!current) {
+        status = QTC_ERROR_MEMORY;
+        goto done;
+    }
+    size_t count = 0;
+    if (!try_read_n_bits64(&payload, 1)) count = !read_changed(&payload, reference, 0, 0, 0);
+    current[0] = 0;
+
+    for (int level = 1; level <= levels && count; level++) {
+        int leaf = level == levels;
+        uint32_t * next = leaf ? NULL : (uint32_t *) scratch_reserve(&context->shared[1], 4 * count * sizeof(uint32_t));
+        if (!leaf && !next) {
+            status = QTC_ERROR_MEMORY;
+            goto done;
+        }
+        size_t n = 0;
+        for (size_t p = 0; p < count; p++) {
+            for (int i = 0; i < 4; i++) {
+                int64_t j = 4 * current[p] + i;
+                if (leaf && i == 3) {
+                    read_changed(&payload, reference, level, j, 1);
+                } else if (!try_read_n_bits64(&payload, 1) && !read_changed(&payload, reference, level, j, i == 3)) {
+                    next[n++] = j;
+                }
+            }
+        }
+        Scratch swap = context->shared[0];
+        context->shared[0] = context->shared[1];
+        context->shared[1] = swap;
+        current = next;
+        count = n;
+    }
+    if (payload.error) status = QTC_ERROR_CORRUPT;
+
+done:
+    if (context == &local) release_context(&local);
+    return status;
+}
@@ -4,6 +4,11 @@
  */
 
 #include "encode.h"
+#include <string.h>
+#include <pthread.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 // Fonction qui écrit un noeud qui n'est pas une feuille dans le BitStream
 /**
@@ -13,37 +18,141 @@
  * If a node is the 4th we only writes `epsilon` and if necessary te `u` bit, decoding will interpolates the value of `moyenne`.
  * 
  * @param stream BitStream where we write the data.
- * @param node Current node that we write data from.
- * @param index Index of the current node.
+ * @param quadtree Quadtree containing the node.
+ * @param level Level of the current node.
+ * @param j Index of the current node in its level.
+ * @return Number of bits written.
  */
-static void write_node(BitStream * stream, Node * node, int index) {
-    if (index % 4 || !index){                   // !index to write the root, index % 4 to write the first 3 childs
-        push_n_bits(stream, node->moyenne, 8);
+static int write_node(BitStream * stream, Quadtree * quadtree, int level, int64_t j) {
+    // The fields are packed in a single value and pushed at once
+    uint64_t bits = 0;
+    int n = 0;
+    unsigned char epsilon = get_epsilon(quadtree, level, j);
+    if (j % 4 != 3 || !level){                  // !level to write the root, j % 4 != 3 to write the first 3 childs
+        bits = quadtree->moyennes[level][j];
+        n = 8;
     }
-    push_n_bits(stream, node->epsilon, 2);
-    if (!node->epsilon) {                       // If epsilon == 0, writes the u bit
-        push_n_bits(stream, node->u, 1);
+    bits = (bits << 2) | epsilon;
+    n += 2;
+    if (!epsilon) {                             // If epsilon == 0, writes the u bit
+        bits = (bits << 1) | get_u(quadtree, level, j);
+        n++;
     } 
+    try_push_n_bits64(stream, bits, n);
+    return n;
 }
 
-// Fonction qui érit un noeud qui est une feuille dans le BitStream
+// Fonction qui érit les feuilles d'un noeud dans le BitStream
 /**
- * @brief Writes a leaf node.
+ * @brief Writes the 4 leaves of a node.
  * 
- * Writes only the `moyenne` of a leaf node because leaf have per definition epsilon = 0 and u = 1.
+ * Writes only the `moyenne` of the first 3 leaves because leaf have per definition epsilon = 0 and u = 1,
+ * decoding will interpolates the 4th. The 3 means are pushed at once.
  * 
  * @param BitStream BitStream where we write the data.
- * @param node Current node that we write data from.
- * @param index Index of the current node.
+ * @param quadtree Quadtree containing the nodes.
+ * @param j Index of the first leaf (multiple of 4).
  */
-static void write_leaf(BitStream * stream, Node * node, int index) {
-    if (index % 4) { // We write only the first 3 childs, decoding will interpolates th 4th
-        push_n_bits(stream, node->moyenne, 8);
+static void write_leaves(BitStream * stream, Quadtree * quadtree, int64_t j) {
+    int levels = quadtree->levels;
+    uint64_t bits = (uint64_t) get_moyenne(quadtree, levels, j) << 16 | get_moyenne(quadtree, levels, j + 1) << 8 | get_moyenne(quadtree, levels, j + 2);
+    try_push_n_bits64(stream, bits, 24);
+}
+
+/**
+ * @brief Adds a node written in the stream to a segmentation grid if it is uniform.
+ * 
+ * @param grid Grid receiving the bloc of the node.
+ * @param quadtree Quadtree containing the node.
+ * @param level Level of the node.
+ * @param j Index of the node in its level.
+ */
+static void grid_node(SegmentationGrid * grid, Quadtree * quadtree, int level, int64_t j) {
+    if (!get_u(quadtree, level, j)) return;
+    uint32_t x, y, size = (uint32_t) 1 << (quadtree->levels - level);
+    node_coordinates(j, &x, &y);
+    grid_add_bloc(grid, x * size, y * size, size);
+}
+
+/**
+ * @brief Writes the levels of a subtree, level by level.
+ * 
+ * Writes the nodes of levels `split` + 1 to `last` that descend from node t of level `split`.
+ * Only the children of non-uniform nodes are in the stream: the frontier holds the non-uniform nodes
+ * of a level in stream order, their children are the nodes written next and the non-uniform ones
+ * among them make the next frontier. So the work follows the number of nodes written, nothing
+ * below a uniform node is visited. The whole Quadtree is the subtree of the root (split = 0, t = 0).
+ * The frontier goes back and forth between two buffers, which only grow.
+ * The nodes and the fields of each level go to the statistics, the `u` fields being the bits written beyond the others.
+ * 
+ * @param stream BitStream where we write the data.
+ * @param quadtree Quadtree to encode.
+ * @param split Level of the subtree root.
+ * @param t Index of the subtree root in its level.
+ * @param last Last level to write.
+ * @param frontier Two buffers for the frontier.
+ * @param grid Grid receiving the uniform nodes written, NULL if none.
+ * @param stats Statistics receiving the counters, NULL if none.
+ * @return QTC_OK or QTC_ERROR_MEMORY.
+ */
+static QtcStatus encode_levels(BitStream * stream, Quadtree * quadtree, int split, int64_t t, int last, Scratch * frontier, SegmentationGrid * grid, QtcStats * stats) {
+    // Non-leaf nodes only, their index fits in 32 bits
+    uint32_t * current = (uint32_t *) scratch_reserve(&frontier[0], sizeof(uint32_t));
+    if (!current) return QTC_ERROR_MEMORY;
+    current[0] = t;
+    size_t count = split < last && !get_u(quadtree, split, t);
+    for (int level = split + 1; level <= last && count; level++) {
+        if (is_leaf(quadtree, level)) {
+            for (size_t p = 0; p < count; p++) {
+                int64_t j = 4 * (int64_t) current[p];
+                write_leaves(stream, quadtree, j);
+                for (int i = 0; grid && i < 4; i++) grid_node(grid, quadtree, level, j + i);
+            }
+            stats_nodes(stats, quadtree->levels, level, 4 * count, 0);
+            stats_fields(stats, 3 * count, 0, 0);
+            break;
+        }
+        uint32_t * next = level < last ? (uint32_t *) scratch_reserve(&frontier[1], 4 * count * sizeof(uint32_t)) : NULL;
+        if (level < last && !next) return QTC_ERROR_MEMORY;
+        size_t n = 0, uniform = 0;
+        uint64_t bits = 0;
+        for (size_t p = 0; p < count; p++) {
+            for (int64_t j = 4 * (int64_t) current[p]; j < 4 * (int64_t) current[p] + 4; j++) {
+                bits += write_node(stream, quadtree, level, j);
+                if (grid) grid_node(grid, quadtree, level, j);
+                int u = get_u(quadtree, level, j);
+                uniform += u;
+                if (next && !u) next[n++] = j;
+            }
+        }
+        stats_nodes(stats, quadtree->levels, level, 4 * count, uniform);
+        stats_fields(stats, 3 * count, 4 * count, bits - 32 * count); // 3 `moyenne` and 4 `epsilon` per parent
+        Scratch swap = frontier[0];
+        frontier[0] = frontier[1];
+        frontier[1] = swap;
+        current = next;
+        count = n;
     }
+    return QTC_OK;
 }
 
 /**
- * @brief Encodes a Quadtree into a BitStream.
+ * @brief Writes the root of a Q1 or Q2 payload, always as a node, even when it is the only leaf.
+ * 
+ * @param stream BitStream where we write the data.
+ * @param quadtree Quadtree to encode.
+ * @param grid Grid receiving the root if it is uniform, NULL if none.
+ * @param stats Statistics receiving the counters, NULL if none.
+ */
+static void write_root(BitStream * stream, Quadtree * quadtree, SegmentationGrid * grid, QtcStats * stats) {
+    int bits = write_node(stream, quadtree, 0, 0);
+    if (grid) grid_node(grid, quadtree, 0, 0);
+    stats_nodes(stats, quadtree->levels, 0, 1, quadtree->levels && get_u(quadtree, 0, 0));
+    stats_fields(stats, 1, 1, bits - 10);
+}
+
+/**
+ * @brief Encodes a Quadtree at Q1 format into a BitStream.
  * 
  * Encodes Quadtree data into a BitStream, following the current logic :
  * - Writes `moyenne` on 8 bits.
@@ -51,123 +160,987 @@ static void write_leaf(BitStream * stream, Node * node, int index) {
  * - If `epsilon` = 0, writes `u` on 1 bit.
  * - `moyenne` is not written for the 4th child of a node, decoding will interpolates its value.
  * For a leaf, only writes `moyenne` because `epsilon` and `u` are constant.
+ * Nodes are written level by level (breadth-first order).
  * 
+ * @param stream BitStream to write to.
  * @param quadtree Quadtree to encode.
- * @return BitStream representation of the Quadtree.
+ * @param context Context holding the frontier and the statistics.
+ * @param grid Grid receiving the uniform nodes written, NULL if none.
+ * @return QTC_OK, QTC_ERROR_BUFFER if the BitStream is full or QTC_ERROR_MEMORY.
  */
-BitStream * encode(Quadtree * quadtree) {
-    BitStream * stream = initBitStream(quadtree->total_nodes * 2); // We write at max 11 bits per node, so allacoting 2 bytes per node for the BitStream buffer
-    push_n_bits(stream, quadtree->levels, 8);                      // Writes quadtree's levels
-    for (int i = 0 ; i < quadtree->total_nodes ; i++) {
-        Node * current_node = &quadtree->nodes[i];
+static QtcStatus encode_q1_stream(BitStream * stream, Quadtree * quadtree, QtcContext * context, SegmentationGrid * grid) {
+    try_push_n_bits64(stream, quadtree->levels, 8);                // Writes quadtree's levels
+
+    write_root(stream, quadtree, grid, context->stats);
+    QtcStatus status = encode_levels(stream, quadtree, 0, 0, quadtree->levels, context->shared, grid, context->stats);
+    finishBitStream(stream);
+    if (status != QTC_OK) return status;
+    return stream->error ? QTC_ERROR_BUFFER : QTC_OK;
+}
+
+/**
+ * @brief Writes a value of the Q2 offset table, big-endian.
+ * 
+ * @param stream BitStream to write to, byte aligned.
+ * @param value Offset or size in bytes.
+ * @param bytes Size of the value, 4 or 8 (see q2_table_bytes()).
+ */
+static void push_table_value(BitStream * stream, uint64_t value, int bytes) {
+    if (bytes == 8) try_push_n_bits64(stream, value >> 32, 32);
+    try_push_n_bits64(stream, value & 0xFFFFFFFF, 32);
+}
+
+/**
+ * @brief Encodes a Quadtree at Q2 format into a BitStream.
+ * 
+ * The Q2 payload splits the Q1 bitstream in independent chunks so they can be decoded concurrently:
+ * - `levels` and `split` on 8 bits each.
+ * - One byte aligned chunk per node of level `split`, holding the levels of its subtree below it
+ *   (empty for uniform nodes), in the same order as Q1.
+ * - The top section: root and levels 1 to `split` in the same order as Q1, byte aligned.
+ * - The offset table, at the very end: for each chunk its offset from the first chunk and its size
+ *   in bytes, then the offset of the top section, all on 32 bits (64 bits from QTC_Q2_WIDE_LEVELS levels).
+ * 
+ * @param stream BitStream to write to.
+ * @param quadtree Quadtree to encode.
+ * @param split Level of the chunks roots (clamped so that each chunk covers at least 8x8 pixels).
+ * @param context Context holding the offset table, the frontier and the statistics.
+ * @param grid Grid receiving the uniform nodes written, NULL if none.
+ * @return QTC_OK, QTC_ERROR_BUFFER if the BitStream is full or QTC_ERROR_MEMORY.
+ */
+static QtcStatus encode_q2_stream(BitStream * stream, Quadtree * quadtree, int split, QtcContext * context, SegmentationGrid * grid) {
+    if (split > quadtree->levels - 3) split = quadtree->levels - 3;
+    if (split < 0) split = 0;
+    int64_t chunks = nodes_in_level(split);
+    stream->format = 2;
+    try_push_n_bits64(stream, quadtree->levels, 8);
+    try_push_n_bits64(stream, split, 8);
+
+    uint64_t * offsets = (uint64_t *) scratch_reserve(&context->shared[0], chunks * sizeof(uint64_t));
+    uint64_t * sizes = (uint64_t *) scratch_reserve(&context->shared[1], chunks * sizeof(uint64_t));
+    if (!offsets || !sizes) return QTC_ERROR_MEMORY;
+    unsigned char * first_chunk = stream->ptr;
+    for (int64_t t = 0; t < chunks; t++) {
+        offsets[t] = stream->ptr - first_chunk;
+        if (encode_levels(stream, quadtree, split, t, quadtree->levels, context->shared + 2, grid, context->stats) != QTC_OK) return QTC_ERROR_MEMORY;
+        finishBitStream(stream);
+        sizes[t] = stream->ptr - first_chunk - offsets[t];
+    }
+
+    // Top section
+    uint64_t top = stream->ptr - first_chunk;
+    write_root(stream, quadtree, grid, context->stats);
+    if (encode_levels(stream, quadtree, 0, 0, split, context->shared + 2, grid, context->stats) != QTC_OK) return QTC_ERROR_MEMORY;
+    finishBitStream(stream);
+
+    // Offset table
+    int bytes = q2_table_bytes(quadtree->levels);
+    for (int64_t t = 0; t < chunks; t++) {
+        push_table_value(stream, offsets[t], bytes);
+        push_table_value(stream, sizes[t], bytes);
+    }
+    push_table_value(stream, top, bytes);
+    return stream->error ? QTC_ERROR_BUFFER : QTC_OK;
+}
+
+/**
+ * @brief Returns the flags symbol of a non-leaf node in the Q3 format.
+ * 
+ * @param quadtree Quadtree containing the node.
+ * @param level Level of the node.
+ * @param j Index of the node in its level.
+ * @return `epsilon` if it isn't 0, else 4 for a uniform node and 0 for the others.
+ */
+static int q3_flags(Quadtree * quadtree, int level, int64_t j) {
+    unsigned char epsilon = get_epsilon(quadtree, level, j);
+    return epsilon ? epsilon : 4 * get_u(quadtree, level, j);
+}
 
-        // To avoid case where the root is uniform or to iterate on itself while it's not initialized
-        if (!i) {
-            write_node(stream, current_node, i);
-            continue;
+/**
+ * @brief Lists the non-uniform nodes of every non-leaf level, in stream order.
+ * 
+ * The list of a level is built from the one of the level above: only the children of the listed
+ * nodes are visited, so the work follows the number of nodes written.
+ * The buffer holding the lists is copied into the spare one when it grows.
+ * 
+ * @param quadtree Quadtree to encode, its root not uniform.
+ * @param scratch Two buffers, the first one holding the lists of every level one after the other on output.
+ * @param starts Index of the first node of the list of each level on output, `levels` + 1 values.
+ * @return QTC_OK or QTC_ERROR_MEMORY.
+ */
+static QtcStatus list_q3_parents(Quadtree * quadtree, Scratch * scratch, size_t * starts) {
+    int n = quadtree->levels;
+    uint32_t * list = (uint32_t *) scratch_reserve(&scratch[0], sizeof(uint32_t));
+    if (!list) return QTC_ERROR_MEMORY;
+    list[0] = 0;
+    starts[0] = 0;
+    starts[1] = 1;
+    for (int level = 1; level < n; level++) {
+        size_t first = starts[level - 1], end = starts[level];
+        size_t size = (end + 4 * (end - first)) * sizeof(uint32_t);
+        if (size > scratch[0].capacity) {
+            uint32_t * grown = (uint32_t *) scratch_reserve(&scratch[1], 2 * size);
+            if (!grown) return QTC_ERROR_MEMORY;
+            memcpy(grown, list, end * sizeof(uint32_t));
+            Scratch swap = scratch[0];
+            scratch[0] = scratch[1];
+            scratch[1] = swap;
+            list = grown;
         }
+        size_t next = end;
+        for (size_t p = first; p < end; p++) {
+            for (int64_t j = 4 * (int64_t) list[p]; j < 4 * (int64_t) list[p] + 4; j++) {
+                if (!get_u(quadtree, level, j)) list[next++] = j;
+            }
+        }
+        starts[level + 1] = next;
+    }
+    return QTC_OK;
+}
 
-        Node * current_node_parent = &quadtree->nodes[(i - 1) / 4];
+/**
+ * @brief Counts the symbols of each Q3 model.
+ * 
+ * The nodes written are the ones of Q1: children of non-uniform nodes, the 4th child without its mean.
+ * 
+ * @param quadtree Quadtree to encode.
+ * @param list Non-uniform nodes of every non-leaf level (see list_q3_parents()).
+ * @param starts Index of the first node of the list of each level.
+ * @param counts RANS_MAX_SYMBOLS counters per model, zeroed, updated.
+ * @param grid Grid receiving the uniform nodes written, NULL if none.
+ * @return Number of symbols.
+ */
+static size_t count_q3_symbols(Quadtree * quadtree, const uint32_t * list, const size_t * starts, uint32_t * counts, SegmentationGrid * grid) {
+    size_t symbols = 0;
+    for (int level = 1; level <= quadtree->levels; level++) {
+        int leaf = is_leaf(quadtree, level);
+        uint32_t * flags = counts + (2 * level - 2) * RANS_MAX_SYMBOLS;
+        uint32_t * residuals = flags + RANS_MAX_SYMBOLS;
+        const unsigned char * parent_m = quadtree->moyennes[level - 1];
+        for (size_t k = starts[level - 1]; k < starts[level]; k++) {
+            int64_t p = list[k];
+            for (int i = 0; i < 3; i++) residuals[(unsigned char) (get_moyenne(quadtree, level, 4 * p + i) - parent_m[p])]++;
+            symbols += 3;
+            for (int i = 0; grid && i < 4; i++) grid_node(grid, quadtree, level, 4 * p + i);
+            if (!leaf) {
+                for (int i = 0; i < 4; i++) flags[q3_flags(quadtree, level, 4 * p + i)]++;
+                symbols += 4;
+            }
+        }
+    }
+    return symbols;
+}
 
-        // If parent node is uniform, ignores his childs
-        if (current_node_parent->u) {
-            continue;
+/**
+ * @brief Encodes the symbols of the Q3 nodes, from the last one to the first one.
+ * 
+ * In stream order, each child gives its mean residual (except the 4th) then its flags (except leaves),
+ * so they are given here in the exact reverse order.
+ * 
+ * @param encoder rANS encoder.
+ * @param quadtree Quadtree to encode.
+ * @param models Models of every level.
+ * @param list Non-uniform nodes of every non-leaf level (see list_q3_parents()).
+ * @param starts Index of the first node of the list of each level.
+ */
+static void encode_q3_symbols(RansEncoder * encoder, Quadtree * quadtree, const RansModel * models, const uint32_t * list, const size_t * starts) {
+    for (int level = quadtree->levels; level >= 1; level--) {
+        int leaf = is_leaf(quadtree, level);
+        const RansModel * flags = models + 2 * level - 2;
+        const RansModel * residuals = flags + 1;
+        const unsigned char * parent_m = quadtree->moyennes[level - 1];
+        for (size_t k = starts[level]; k-- > starts[level - 1];) {
+            int64_t p = list[k];
+            for (int i = 3; i >= 0; i--) {
+                if (!leaf) rans_encode(encoder, flags, q3_flags(quadtree, level, 4 * p + i));
+                if (i < 3) rans_encode(encoder, residuals, (unsigned char) (get_moyenne(quadtree, level, 4 * p + i) - parent_m[p]));
+            }
         }
+    }
+}
 
-        // If i is a leaf index, writes it has a leaf, elsewise writes it a non-leaf node (leaf index starts at quadtree->total_nodes - (1 << (2 * quadtree->levels)))
-        (is_leaf(quadtree, i)) ? write_leaf(stream, current_node, i) : write_node(stream, current_node, i);
+/**
+ * @brief Encodes a Quadtree at Q3 format into a BitStream.
+ * 
+ * The Q3 payload holds the nodes of Q1 in the same order, entropy coded:
+ * - `levels`, the root `moyenne` and the root flags symbol on 8 bits each, nothing follows if the root is uniform.
+ * - For each level from 1, the frequencies of its flags model (non-leaf levels) and of its mean residuals model.
+ * - The interleaved rANS data: each child codes its `moyenne` minus the one of its parent (modulo 256,
+ *   not for the 4th child) and, unless it is a leaf, `epsilon` and `u` as a single flags symbol.
+ * 
+ * @param stream BitStream to write to.
+ * @param quadtree Quadtree to encode.
+ * @param context Context holding the lists of nodes, the counts, the models, the rANS output and the statistics.
+ * @param grid Grid receiving the uniform nodes written, NULL if none.
+ * @return QTC_OK, QTC_ERROR_BUFFER if the BitStream is full or QTC_ERROR_MEMORY.
+ */
+static QtcStatus encode_q3_stream(BitStream * stream, Quadtree * quadtree, QtcContext * context, SegmentationGrid * grid) {
+    int n = quadtree->levels;
+    stream->format = 3;
+    try_push_n_bits64(stream, n, 8);
+    try_push_n_bits64(stream, quadtree->moyennes[0][0], 8);
+    int root = n ? q3_flags(quadtree, 0, 0) : 4; // A single pixel is a uniform leaf
+    try_push_n_bits64(stream, root, 8);
+    if (grid) grid_node(grid, quadtree, 0, 0);
+    stats_nodes(context->stats, n, 0, 1, n && root == 4);
+    if (root == 4) return stream->error ? QTC_ERROR_BUFFER : QTC_OK;
+
+    size_t starts[QUADTREE_MAX_LEVELS + 1];
+    if (list_q3_parents(quadtree, context->shared, starts) != QTC_OK) return QTC_ERROR_MEMORY;
+    const uint32_t * list = (const uint32_t *) context->shared[0].data;
+    uint32_t * counts = (uint32_t *) scratch_reserve(&context->shared[2], 2 * n * RANS_MAX_SYMBOLS * sizeof(uint32_t));
+    RansModel * models = (RansModel *) scratch_reserve(&context->shared[3], 2 * n * sizeof(RansModel));
+    if (!counts || !models) return QTC_ERROR_MEMORY;
+    memset(counts, 0, 2 * n * RANS_MAX_SYMBOLS * sizeof(uint32_t));
+    size_t symbols = count_q3_symbols(quadtree, list, starts, counts, grid);
+    for (int level = 1; level <= n; level++) {
+        RansModel * flags = models + 2 * level - 2;
+        rans_model_from_counts(flags, counts + (2 * level - 2) * RANS_MAX_SYMBOLS, QTC_Q3_FLAGS);
+        rans_model_from_counts(flags + 1, counts + (2 * level - 1) * RANS_MAX_SYMBOLS, RANS_MAX_SYMBOLS);
+        if (level < n) rans_push_model(stream, flags, QTC_Q3_FLAGS);
+        rans_push_model(stream, flags + 1, RANS_MAX_SYMBOLS);
+        // The nodes of the level are the children of the listed parents of the level above
+        stats_nodes(context->stats, n, level, 4 * (starts[level] - starts[level - 1]), level < n ? counts[(2 * level - 2) * RANS_MAX_SYMBOLS + 4] : 0);
+    }
+    stats_q3_fields(context->stats, n, n, models, counts);
+
+    size_t size = rans_size_bound(symbols);
+    unsigned char * buffer = (unsigned char *) scratch_reserve(&context->shared[4], size);
+    if (!buffer) return QTC_ERROR_MEMORY;
+    RansEncoder encoder;
+    rans_encoder_init(&encoder, buffer, size, symbols);
+    encode_q3_symbols(&encoder, quadtree, models, list, starts);
+    size = rans_encoder_flush(&encoder);
+    if (encoder.error) return QTC_ERROR_BUFFER;
+    try_push_bytes(stream, encoder.ptr, size);
+    return stream->error ? QTC_ERROR_BUFFER : QTC_OK;
+}
+
+/**
+ * @brief Largest payload of a Quadtree, whatever the format.
+ * 
+ * At most 11 bits per node, plus the chunks padding and offset table of Q2.
+ * Q3 codes a node in less than that, its models take at most 522 bytes per level plus the rANS states.
+ * 
+ * @param levels Levels of the Quadtree.
+ * @return Size in bytes.
+ */
+size_t encoded_size_bound(int levels) {
+    size_t total_nodes = ((((size_t) 1) << (2 * levels + 2)) - 1) / 3;
+    return 2 * total_nodes + (2 * q2_table_bytes(levels) + 1) * nodes_in_level(QTC_Q2_SPLIT) + 16 + 528 * (size_t) levels + 32;
+}
+
+/**
+ * @brief Encodes a Quadtree into a BitStream at Q1, Q2 or Q3 format, without exiting on errors.
+ * 
+ * @param stream BitStream to write to (its format is set accordingly).
+ * @param quadtree Quadtree to encode.
+ * @param format 1 for Q1, 2 for Q2 (chunks at level QTC_Q2_SPLIT), 3 for Q3 (entropy coded).
+ * @param context Context whose working arrays are used and whose statistics receive the counters, NULL to allocate them for this call only.
+ * @return QTC_OK, QTC_ERROR_BUFFER if the BitStream is full or QTC_ERROR_MEMORY.
+ */
+QtcStatus encode_to_stream(BitStream * stream, Quadtree * quadtree, int format, QtcContext * context) {
+    return encode_grid_to_stream(stream, quadtree, format, context, NULL);
+}
+
+/**
+ * @brief Encodes a Quadtree into a BitStream and fills its segmentation grid in the same pass, without exiting on errors.
+ * 
+ * Every uniform node written in the stream is added to the grid, which then covers the whole image.
+ * 
+ * @param stream BitStream to write to (its format is set accordingly).
+ * @param quadtree Quadtree to encode.
+ * @param format 1 for Q1, 2 for Q2 (chunks at level QTC_Q2_SPLIT), 3 for Q3 (entropy coded).
+ * @param context Context whose working arrays are used and whose statistics receive the counters, NULL to allocate them for this call only.
+ * @param grid Grid of the Quadtree size receiving the uniform blocs, NULL if none.
+ * @return QTC_OK, QTC_ERROR_BUFFER if the BitStream is full or QTC_ERROR_MEMORY (also if the grid list couldn't grow).
+ */
+QtcStatus encode_grid_to_stream(BitStream * stream, Quadtree * quadtree, int format, QtcContext * context, SegmentationGrid * grid) {
+    QtcContext local;
+    if (!context) init_context(context = &local);
+    uint64_t fields = stats_field_bits(context->stats);
+    unsigned char * first = stream->ptr;
+    QtcStatus status = format == 2 ? encode_q2_stream(stream, quadtree, QTC_Q2_SPLIT, context, grid)
+                     : format == 3 ? encode_q3_stream(stream, quadtree, context, grid) : encode_q1_stream(stream, quadtree, context, grid);
+    if (status == QTC_OK) stats_payload(context->stats, format == 2 || format == 3 ? format : 1, fields, stream->ptr - first);
+    if (context == &local) release_context(&local);
+    return status == QTC_OK && grid && grid->failed ? QTC_ERROR_MEMORY : status;
+}
+
+/**
+ * @brief Encodes a Quadtree into a new BitStream and fills its segmentation grid in the same pass.
+ * 
+ * @see encode_grid_to_stream()
+ * 
+ * @param quadtree Quadtree to encode.
+ * @param format 1 for Q1, 2 for Q2 (chunks at level QTC_Q2_SPLIT), 3 for Q3.
+ * @param grid Grid of the Quadtree size receiving the uniform blocs.
+ * @return BitStream representation of the Quadtree.
+ */
+BitStream * encode_with_grid(Quadtree * quadtree, int format, SegmentationGrid * grid) {
+    BitStream * stream = initBitStream(encoded_size_bound(quadtree->levels));
+    QtcStatus status = encode_grid_to_stream(stream, quadtree, format, NULL, grid);
+    if (status == QTC_ERROR_MEMORY) {
+        fprintf(stderr, "Error while allocating memory for the segmentation grid.\n");
+        exit(EXIT_FAILURE);
+    } else if (status != QTC_OK) {
+        fprintf(stderr, "Erreur lors de l'écriture des bits\n");
+        exit(EXIT_FAILURE);
     }
-    finishBitStream(stream);
     return stream;
 }
 
-// Fonction récursive pour construire un quadtree à partir d'une image
 /**
- * @brief Builds recursively a Quadtree from an Image.
+ * @brief Encodes a Quadtree into a BitStream.
  * 
- * Helper function to build recursively a Quadtree from an Image.
+ * @see encode_q1_stream() for the Q1 layout.
  * 
- * @param quadtree Quadtree to fill.
- * @param image Image to build Quadtree from.
- * @param size Size of the current bloc.
- * @param index Index of the current node.
- * @param x X coordinate of the pixel.
- * @param y Y coordinate of the pixel.
- */
-static void build_quadtree_rec(Quadtree *quadtree, Image *image, int size, int index, int x, int y) {
-    // If a bloc is of size 1, it's a leaf
-    if (size == 1) {
-        quadtree->nodes[index].moyenne = image->image[y * image->width + x];
-        quadtree->nodes[index].epsilon = 0;
-        quadtree->nodes[index].u = 1;
-        quadtree->nodes[index].v = 0.;
-        return;
-    }
-
-    // Size of the child bloc
-    int child_size = size / 2;
-
-    // Builds recursively the 4 children clockwise
-    build_quadtree_rec(quadtree, image, child_size, 4 * index + 1, x, y);                           // Top left 
-    build_quadtree_rec(quadtree, image, child_size, 4 * index + 2, x + child_size, y);              // Top right 
-    build_quadtree_rec(quadtree, image, child_size, 4 * index + 3, x + child_size, y + child_size); // Bottom right
-    build_quadtree_rec(quadtree, image, child_size, 4 * index + 4, x, y + child_size);              // Bottom left
-
-    // Retrieves moyenne, uniformity bit and variance of the 4 childs into arrays
-    unsigned char child_moyennes[4];
-    unsigned char child_u[4];
-    double child_v[4];
+ * @param quadtree Quadtree to encode.
+ * @return BitStream representation of the Quadtree.
+ */
+BitStream * encode(Quadtree * quadtree) {
+    BitStream * stream = initBitStream(quadtree->total_nodes * 2); // We write at max 11 bits per node, so allacoting 2 bytes per node for the BitStream buffer
+    QtcContext context;
+    init_context(&context);
+    QtcStatus status = encode_q1_stream(stream, quadtree, &context, NULL);
+    release_context(&context);
+    if (status == QTC_ERROR_MEMORY) {
+        fprintf(stderr, "Error while allocating memory for the encoding frontier.\n");
+        exit(EXIT_FAILURE);
+    } else if (status != QTC_OK) {
+        fprintf(stderr, "Erreur lors de l'écriture des bits\n");
+        exit(EXIT_FAILURE);
+    }
+    return stream;
+}
+
+/**
+ * @brief Encodes a Quadtree into a BitStream at Q2 format.
+ * 
+ * @see encode_q2_stream() for the Q2 layout.
+ * 
+ * @param quadtree Quadtree to encode.
+ * @param split Level of the chunks roots (clamped so that each chunk covers at least 8x8 pixels).
+ * @return BitStream representation of the Quadtree.
+ */
+BitStream * encode_q2(Quadtree * quadtree, int split) {
+    if (split > quadtree->levels - 3) split = quadtree->levels - 3;
+    if (split < 0) split = 0;
+    BitStream * stream = initBitStream(quadtree->total_nodes * 2 + nodes_in_level(split) * (2 * q2_table_bytes(quadtree->levels) + 1) + 16);
+    QtcContext context;
+    init_context(&context);
+    QtcStatus status = encode_q2_stream(stream, quadtree, split, &context, NULL);
+    release_context(&context);
+    if (status == QTC_ERROR_MEMORY) {
+        fprintf(stderr, "Error while allocating memory for the Q2 offset table and frontier.\n");
+        exit(EXIT_FAILURE);
+    } else if (status != QTC_OK) {
+        fprintf(stderr, "Erreur lors de l'écriture des bits\n");
+        exit(EXIT_FAILURE);
+    }
+    return stream;
+}
+
+/**
+ * @brief Encodes a Quadtree into a BitStream at Q3 format.
+ * 
+ * @see encode_q3_stream() for the Q3 layout.
+ * 
+ * @param quadtree Quadtree to encode.
+ * @return BitStream representation of the Quadtree.
+ */
+BitStream * encode_q3(Quadtree * quadtree) {
+    BitStream * stream = initBitStream(encoded_size_bound(quadtree->levels));
+    QtcContext context;
+    init_context(&context);
+    QtcStatus status = encode_q3_stream(stream, quadtree, &context, NULL);
+    release_context(&context);
+    if (status == QTC_ERROR_MEMORY) {
+        fprintf(stderr, "Error while allocating memory for the Q3 models.\n");
+        exit(EXIT_FAILURE);
+    } else if (status != QTC_OK) {
+        fprintf(stderr, "Erreur lors de l'écriture des bits\n");
+        exit(EXIT_FAILURE);
+    }
+    return stream;
+}
+
+/**
+ * @brief Spreads the 16 low bits of a value on the even bit positions.
+ * 
+ * @param v Value to spread.
+ * @return Spread value (bit i of v goes to bit 2i).
+ */
+static unsigned int spread_bits(unsigned int v) {
+    v &= 0xFFFF;
+    v = (v | (v << 8)) & 0x00FF00FF;
+    v = (v | (v << 4)) & 0x0F0F0F0F;
+    v = (v | (v << 2)) & 0x33333333;
+    v = (v | (v << 1)) & 0x55555555;
+    return v;
+}
+
+/**
+ * @brief Copies the pixels of a square bloc of an Image in leaf order.
+ * 
+ * Leaves are stored clockwise (top left, top right, bottom right, bottom left) at every level,
+ * so each base 4 digit of a leaf index is `2 * y_bit + (x_bit ^ y_bit)`.
+ * 
+ * @param image Image to read pixels from.
+ * @param leaves Leaves of the bloc receiving the pixels in leaf order (leaf 0 is the top-left pixel of the bloc).
+ * @param x0 X coordinate of the top-left corner of the bloc.
+ * @param y0 Y coordinate of the top-left corner of the bloc.
+ * @param size Size of the bloc.
+ */
+static void leaves_from_image(Image * image, unsigned char * leaves, int x0, int y0, int size) {
+    for (int y = 0; y < size; y++) {
+        uint64_t row = (uint64_t) spread_bits(y) << 1;
+        const unsigned char * pixels = image->image + (size_t) (y0 + y) * image->width + x0;
+        for (int x = 0; x < size; x++) {
+            leaves[row | spread_bits(x ^ y)] = pixels[x];
+        }
+    }
+}
+
+/**
+ * @brief Computes one parent node from its 4 children.
+ * 
+ * Same computation as the vectorized path, used for the last parents of a level and when SSE2 is not available.
+ * `u` and `v` can be read for the children and written for the parents in place (parent j only overwrites children of parents < j).
+ * 
+ * @param child_m Means of the children (4j to 4j+3).
+ * @param m Mean of parent j on output.
+ * @param u Uniformity bit of parent j on output.
+ * @param v Variance of parent j on output.
+ * @param eps Epsilon of the parents.
+ * @param j Index of the parent in its level.
+ * @param child_u Uniformity bits of the children, NULL for leaves (always uniform).
+ * @param child_v Variances of the children, NULL for leaves (always 0).
+ */
+static void reduce_parent(const unsigned char * child_m, unsigned char * m, unsigned char * u, double * v, unsigned char * eps, int64_t j, const unsigned char * child_u, const double * child_v) {
+    unsigned char cm[4];
+    int child_uniform = 1;
+    double cv[4] = {0., 0., 0., 0.};
     int somme_moyennes = 0;
     for (int i = 0; i < 4; i++) {
-        child_moyennes[i] = quadtree->nodes[4 * index + i + 1].moyenne;
-        child_u[i] = quadtree->nodes[4 * index + i + 1].u;
-        child_v[i] = quadtree->nodes[4 * index + i + 1].v;
-        somme_moyennes += child_moyennes[i];
+        cm[i] = child_m[4 * j + i];
+        somme_moyennes += cm[i];
+        if (child_u) child_uniform &= child_u[4 * j + i];
+        if (child_v) cv[i] = child_v[4 * j + i];
+    }
+    unsigned char moyenne = somme_moyennes / 4;
+    double somme_v = 0.;
+    for (int i = 0; i < 4; i++) {
+        double m_diff = moyenne - cm[i];
+        somme_v += (cv[i] * cv[i]) + (m_diff * m_diff);
     }
+    m[j] = moyenne;
+    eps[j] = somme_moyennes % 4;
+    u[j] = (cm[0] == cm[1] && cm[1] == cm[2] && cm[2] == cm[3] && child_uniform) ? 1 : 0;
+    v[j] = sqrt(somme_v) / 4;
+}
+
+#ifdef __SSE2__
+/**
+ * @brief Computes 4 consecutive parent nodes from their 16 children with SSE2.
+ * 
+ * The 16 children means are loaded at once, each 32-bit lane holding the 4 children of one parent.
+ * Variances are computed 2 parents at a time, with the same operations in the same order as reduce_parent(),
+ * so the results are bit-identical.
+ * 
+ * @see reduce_parent() for the parameters, j being the first of the 4 parents.
+ */
+static void reduce_4_parents(const unsigned char * child_m, unsigned char * m, unsigned char * u, double * v, unsigned char * eps, int64_t j, const unsigned char * child_u, const double * child_v) {
+    const __m128i low_bytes = _mm_set1_epi32(0x00FF00FF);
+    const __m128i low_word = _mm_set1_epi32(0xFFFF);
+    __m128i children = _mm_loadu_si128((const __m128i *) (child_m + 4 * j));
 
-    // Calculate moyenne and epsilon of the current node
-    quadtree->nodes[index].moyenne = somme_moyennes / 4;
-    quadtree->nodes[index].epsilon = somme_moyennes % 4;
+    // 4-sum of each lane, then moyenne and epsilon
+    __m128i pairs = _mm_add_epi32(_mm_and_si128(children, low_bytes), _mm_and_si128(_mm_srli_epi32(children, 8), low_bytes));
+    __m128i sums = _mm_add_epi32(_mm_and_si128(pairs, low_word), _mm_srli_epi32(pairs, 16));
+    __m128i moyennes = _mm_srli_epi32(sums, 2);
+    __m128i epsilons = _mm_and_si128(sums, _mm_set1_epi32(3));
 
-    // Calculate variance of the current node
-    double somme_v = 0.;
+    // A lane is uniform if its 4 bytes are equal (equal to the lane rotated by one byte) and all the children are uniform
+    __m128i rotated = _mm_or_si128(_mm_srli_epi32(children, 8), _mm_slli_epi32(children, 24));
+    __m128i uniform = _mm_cmpeq_epi32(children, rotated);
+    if (child_u) {
+        __m128i cu = _mm_loadu_si128((const __m128i *) (child_u + 4 * j));
+        uniform = _mm_and_si128(uniform, _mm_cmpeq_epi32(cu, _mm_set1_epi32(0x01010101)));
+    }
+    uniform = _mm_and_si128(uniform, _mm_set1_epi32(1));
+
+    // Squared differences between the parent moyenne and each child moyenne
+    __m128d sq_lo[4], sq_hi[4];
+    for (int i = 0; i < 4; i++) {
+        __m128i child = _mm_and_si128(_mm_srli_epi32(children, 8 * i), _mm_set1_epi32(0xFF));
+        __m128i diff = _mm_sub_epi32(moyennes, child);
+        __m128d d_lo = _mm_cvtepi32_pd(diff);
+        __m128d d_hi = _mm_cvtepi32_pd(_mm_shuffle_epi32(diff, _MM_SHUFFLE(1, 0, 3, 2)));
+        sq_lo[i] = _mm_mul_pd(d_lo, d_lo);
+        sq_hi[i] = _mm_mul_pd(d_hi, d_hi);
+    }
+
+    // Variance: sqrt(sum of (child_v^2 + m_diff^2)) / 4, summed in children order
+    __m128d somme_lo = _mm_setzero_pd(), somme_hi = _mm_setzero_pd();
     for (int i = 0; i < 4; i++) {
-        double m_diff = quadtree->nodes[index].moyenne - child_moyennes[i];
-        somme_v += (child_v[i] * child_v[i]) + (m_diff * m_diff);
+        __m128d a_lo = sq_lo[i], a_hi = sq_hi[i];
+        if (child_v) {
+            __m128d cv_lo = _mm_set_pd(child_v[4 * (j + 1) + i], child_v[4 * j + i]);
+            __m128d cv_hi = _mm_set_pd(child_v[4 * (j + 3) + i], child_v[4 * (j + 2) + i]);
+            a_lo = _mm_add_pd(_mm_mul_pd(cv_lo, cv_lo), a_lo);
+            a_hi = _mm_add_pd(_mm_mul_pd(cv_hi, cv_hi), a_hi);
+        }
+        somme_lo = _mm_add_pd(somme_lo, a_lo);
+        somme_hi = _mm_add_pd(somme_hi, a_hi);
+    }
+    const __m128d four = _mm_set1_pd(4.);
+    _mm_storeu_pd(v + j, _mm_div_pd(_mm_sqrt_pd(somme_lo), four));
+    _mm_storeu_pd(v + j + 2, _mm_div_pd(_mm_sqrt_pd(somme_hi), four));
+
+    // Packs the 32-bit lanes back to bytes
+    int packed_m = _mm_cvtsi128_si32(_mm_packus_epi16(_mm_packs_epi32(moyennes, moyennes), moyennes));
+    int packed_eps = _mm_cvtsi128_si32(_mm_packus_epi16(_mm_packs_epi32(epsilons, epsilons), epsilons));
+    int packed_u = _mm_cvtsi128_si32(_mm_packus_epi16(_mm_packs_epi32(uniform, uniform), uniform));
+    memcpy(m + j, &packed_m, 4);
+    memcpy(eps + j, &packed_eps, 4);
+    memcpy(u + j, &packed_u, 4);
+}
+#endif
+
+/**
+ * @brief Reduces a whole level of the Quadtree into its parent level.
+ * 
+ * Computes `moyenne`, `epsilon`, `u` and `v` of the `count` parents from their children,
+ * which are stored contiguously (children of parent j are 4j to 4j+3).
+ * 
+ * @param child_m Means of the children.
+ * @param m Means of the parents.
+ * @param u Uniformity bits, replaced in place (children are leaves if child_u is NULL).
+ * @param v Variances, replaced in place (children are leaves if child_v is NULL).
+ * @param eps Epsilon of the parents.
+ * @param count Number of parents.
+ * @param child_u Uniformity bits of the children (u or NULL).
+ * @param child_v Variances of the children (v or NULL).
+ */
+static void reduce_level(const unsigned char * child_m, unsigned char * m, unsigned char * u, double * v, unsigned char * eps, int64_t count, const unsigned char * child_u, const double * child_v) {
+    int64_t j = 0;
+#ifdef __SSE2__
+    for (; j + 4 <= count; j += 4) {
+        reduce_4_parents(child_m, m, u, v, eps, j, child_u, child_v);
+    }
+#endif
+    for (; j < count; j++) {
+        reduce_parent(child_m, m, u, v, eps, j, child_u, child_v);
+    }
+}
+
+/**
+ * @brief Packs one byte per node into a 2-bit epsilon plane.
+ * 
+ * @param plane Epsilon plane of the level.
+ * @param eps Epsilon of each node of the level.
+ * @param count Number of nodes of the level.
+ */
+static void pack_epsilons(uint8_t * plane, const unsigned char * eps, int64_t count) {
+    for (int64_t j = 0; j < count; j += 4) {
+        uint8_t byte = 0;
+        for (int k = 0; k < 4 && j + k < count; k++) {
+            byte |= eps[j + k] << (2 * k);
+        }
+        plane[j / 4] = byte;
+    }
+}
+
+/**
+ * @brief Packs one byte per node into a 1-bit uniformity plane.
+ * 
+ * @param plane Uniformity plane of the level.
+ * @param u Uniformity bit of each node of the level.
+ * @param count Number of nodes of the level.
+ */
+static void pack_uniforms(uint8_t * plane, const unsigned char * u, int64_t count) {
+    for (int64_t j = 0; j < count; j += 8) {
+        uint8_t byte = 0;
+        for (int k = 0; k < 8 && j + k < count; k++) {
+            byte |= u[j + k] << k;
+        }
+        plane[j / 8] = byte;
+    }
+}
+
+/**
+ * @brief Reduces a range of nodes of a level and stores them in the Quadtree.
+ * 
+ * The working arrays are indexed from the first node of the range.
+ * 
+ * @param quadtree Quadtree being built.
+ * @param level Level of the parents.
+ * @param start Index of the first parent in its level (multiple of 8 unless the whole level is reduced).
+ * @param count Number of parents.
+ * @param child_m Means of the children of the range (the leaves of the subtree when they are not stored).
+ * @param u Uniformity bits, children on input (unless they are leaves) and parents on output.
+ * @param v Variances, children on input (unless they are leaves) and parents on output.
+ * @param eps Working array for the epsilons of the parents.
+ * @param somme Sum of the variances, updated.
+ * @param maxvar Maximum variance, updated.
+ */
+static void build_level(Quadtree * quadtree, int level, int64_t start, int64_t count, const unsigned char * child_m, unsigned char * u, double * v, unsigned char * eps, double * somme, double * maxvar) {
+    int children_are_leaves = is_leaf(quadtree, level + 1);
+    reduce_level(child_m, quadtree->moyennes[level] + start, u, v, eps, count,
+                 children_are_leaves ? NULL : u, children_are_leaves ? NULL : v);
+    pack_epsilons(quadtree->epsilons[level] + start / 4, eps, count);
+    pack_uniforms(quadtree->uniforms[level] + start / 8, u, count);
+    float * variances = quadtree->variances[level] + start;
+    for (int64_t j = 0; j < count; j++) {
+        variances[j] = (float) v[j];
+        *somme += v[j];
+        if (v[j] > *maxvar) {
+            *maxvar = v[j];
+        }
+    }
+}
+
+/**
+ * @struct BuildTask
+ * @brief Subtrees built by one thread.
+ * 
+ * Each subtree rooted at level `split` is built from its leaves up to level `top`,
+ * the levels above are built by the calling thread once all the subtrees are done.
+ */
+typedef struct {
+    Quadtree * quadtree;
+    Image * image;
+    int split;              // Level of the subtrees roots
+    int top;                // Last level built by the subtrees
+    int first;              // First subtree of the task
+    int last;               // Subtree after the last one of the task
+    unsigned char * top_u;  // Uniformity bits of the whole level `top`
+    double * top_v;         // Variances of the whole level `top`
+    double * sommes;        // Sum of the variances of each subtree
+    double * maxvars;       // Maximum variance of each subtree
+    Scratch * scratch;      // QTC_THREAD_SCRATCH working arrays of the task
+    unsigned char * leaves; // Leaves of the last subtree, in leaf order
+    int failed;             // Set if the working arrays couldn't be allocated
+    int started;            // Set if the task runs on its own thread
+} BuildTask;
+
+/**
+ * @brief Builds the subtrees of a task.
+ * 
+ * Each thread works on its own subtrees and its own working arrays, the results of a subtree
+ * are only written in the ranges of the Quadtree levels that belong to it.
+ * The sum and maximum of the variances are kept per subtree and merged later in subtree order,
+ * so `medvar` doesn't depend on the number of threads.
+ * 
+ * @param arg Pointer to the BuildTask.
+ * @return NULL.
+ */
+static void * build_subtrees(void * arg) {
+    BuildTask * task = (BuildTask *) arg;
+    Quadtree * quadtree = task->quadtree;
+    int n = quadtree->levels;
+    int deepest = n - 1 - task->split > 0 ? n - 1 - task->split : 0;
+    size_t scratch = nodes_in_level(deepest);
+    int size = task->image->width >> task->split;
+    unsigned char * u = (unsigned char *) scratch_reserve(&task->scratch[0], scratch);
+    unsigned char * eps = (unsigned char *) scratch_reserve(&task->scratch[1], scratch);
+    double * v = (double *) scratch_reserve(&task->scratch[2], scratch * sizeof(double));
+    unsigned char * leaves = quadtree->pixels ? (unsigned char *) scratch_reserve(&task->scratch[3], (size_t) size * size) : NULL;
+    if (!u || !eps || !v || (quadtree->pixels && !leaves)) {
+        task->failed = 1;
+        return NULL;
+    }
+
+    for (int64_t t = task->first; t < task->last; t++) {
+        uint32_t x, y;
+        node_coordinates(t, &x, &y);
+        if (task->image->layout == IMAGE_LEAF_ORDER) {
+            // The leaves of a subtree are consecutive pixels, copied only if the leaf level isn't the Image itself
+            const unsigned char * bloc = task->image->image + (size_t) t * size * size;
+            task->leaves = quadtree->moyennes[n] + (size_t) t * size * size;
+            if (task->leaves != bloc) memcpy(task->leaves, bloc, (size_t) size * size);
+        } else {
+            // Without a stored leaf level, the leaves of one subtree at a time are copied in leaf order
+            task->leaves = quadtree->pixels ? leaves : quadtree->moyennes[n] + (size_t) t * size * size;
+            leaves_from_image(task->image, task->leaves, x * size, y * size, size);
+        }
+
+        task->sommes[t] = 0.;
+        task->maxvars[t] = 0.;
+        for (int level = n - 1; level >= task->top; level--) {
+            int64_t count = nodes_in_level(level - task->split);
+            const unsigned char * child_m = level == n - 1 ? task->leaves : quadtree->moyennes[level + 1] + 4 * (size_t) t * count;
+            build_level(quadtree, level, t * count, count, child_m, u, v, eps, &task->sommes[t], &task->maxvars[t]);
+        }
+        if (task->top < n) {
+            int64_t count = nodes_in_level(task->top - task->split);
+            memcpy(task->top_u + t * count, u, count);
+            memcpy(task->top_v + t * count, v, count * sizeof(double));
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Builds the whole Quadtree of an Image.
+ * 
+ * Builds a Quadtree bottom-up, one level at a time: the pixels are copied once in leaf order
+ * (into the leaf level, or one subtree at a time into a working array when the leaf level is
+ * the Image itself), then each level is reduced into its parent level over contiguous arrays.
+ * An Image already in leaf order is read as it is, subtree by subtree.
+ * The 64 subtrees under the third level are independent, they are spread across the threads
+ * and built down to the level where each of them has at least 16 nodes (so no byte of the packed
+ * planes is shared). The few levels above are built once all the threads are done.
+ * Variances are computed in double precision and stored as floats.
+ * Every working array comes from the context.
+ * 
+ * @param image Image to build Quadtree from.
+ * @param quadtree Empty Quadtree with a variance plane and log2(width) levels, `medvar` holding the sum
+ *        of the variances (not yet divided) on output.
+ * @param threads Number of threads to use.
+ * @param context Context holding the working arrays.
+ * @param root_v Variance of the root in double precision on output.
+ * @return QTC_OK or QTC_ERROR_MEMORY.
+ */
+static QtcStatus build_tree(Image * image, Quadtree * quadtree, int threads, QtcContext * context, double * root_v) {
+    int n = quadtree->levels;
+
+    // Subtrees roots level, and last level built by the subtrees
+    int split = n - 3 < 0 ? 0 : (n - 3 > 3 ? 3 : n - 3);
+    int top = split + 2 <= n - 1 ? split + 2 : n;
+    int64_t subtrees = nodes_in_level(split);
+    if (threads < 1) threads = 1;
+    if (threads > subtrees) threads = subtrees;
+
+    Scratch * shared = context->shared;
+    unsigned char * top_u = (unsigned char *) scratch_reserve(&shared[0], nodes_in_level(top));
+    unsigned char * eps = (unsigned char *) scratch_reserve(&shared[1], nodes_in_level(top));
+    double * top_v = (double *) scratch_reserve(&shared[2], nodes_in_level(top) * sizeof(double));
+    double * sommes = (double *) scratch_reserve(&shared[3], subtrees * sizeof(double));
+    double * maxvars = (double *) scratch_reserve(&shared[4], subtrees * sizeof(double));
+    BuildTask * tasks = (BuildTask *) scratch_reserve(&shared[5], threads * sizeof(BuildTask));
+    pthread_t * workers = (pthread_t *) scratch_reserve(&shared[6], threads * sizeof(pthread_t));
+    Scratch * scratch = context_thread_scratch(context, threads);
+    if (!top_u || !eps || !top_v || !sommes || !maxvars || !tasks || !workers || !scratch) return QTC_ERROR_MEMORY;
+
+    // Subtrees, the calling thread takes the first task and the ones whose thread can't be created
+    for (int i = 0; i < threads; i++) {
+        tasks[i] = (BuildTask) {quadtree, image, split, top, subtrees * i / threads, subtrees * (i + 1) / threads, top_u, top_v, sommes, maxvars, scratch + i * QTC_THREAD_SCRATCH, NULL, 0, 0};
+    }
+    for (int i = 1; i < threads; i++) {
+        tasks[i].started = !pthread_create(&workers[i], NULL, build_subtrees, &tasks[i]);
+    }
+    build_subtrees(&tasks[0]);
+    int failed = 0;
+    for (int i = 1; i < threads; i++) {
+        if (tasks[i].started) {
+            pthread_join(workers[i], NULL);
+        } else {
+            build_subtrees(&tasks[i]);
+        }
+    }
+    for (int i = 0; i < threads; i++) failed |= tasks[i].failed;
+    if (failed) return QTC_ERROR_MEMORY;
+
+    for (int64_t t = 0; t < subtrees; t++) {
+        quadtree->medvar += sommes[t];
+        if (maxvars[t] > quadtree->maxvar) {
+            quadtree->maxvar = maxvars[t];
+        }
+    }
+
+    // Levels above the subtrees, from the deepest one to the root (the leaves are the ones of the single subtree if top is the leaf level)
+    for (int level = top - 1; level >= 0; level--) {
+        const unsigned char * child_m = level == n - 1 ? tasks[0].leaves : quadtree->moyennes[level + 1];
+        build_level(quadtree, level, 0, nodes_in_level(level), child_m, top_u, top_v, eps, &quadtree->medvar, &quadtree->maxvar);
+    }
+    *root_v = n ? top_v[0] : 0.; // A single pixel image has no variance
+    return QTC_OK;
+}
+
+/**
+ * @brief Makes the pixels of an Image in leaf order the stored leaf level of a Quadtree initialized over them.
+ * 
+ * init_quadtree_over_pixels() takes raster pixels, read through leaf_offset(): pixels already
+ * in leaf order are the `moyennes` of the leaf level instead, as if the Quadtree stored them.
+ * 
+ * @param quadtree Quadtree initialized over the pixels of the Image.
+ * @param image Image the Quadtree is built from.
+ */
+static void use_leaf_order(Quadtree * quadtree, const Image * image) {
+    if (image->layout != IMAGE_LEAF_ORDER || !quadtree->pixels) return;
+    quadtree->moyennes[quadtree->levels] = quadtree->pixels;
+    quadtree->pixels = NULL;
+}
+
+/**
+ * @brief Returns the levels of the Quadtree of an Image.
+ * 
+ * @param image Image to build Quadtree from.
+ * @return log2 of the width, -1 if the Image isn't square with a supported size power of 2.
+ */
+static int image_levels(const Image * image) {
+    if (!image || image->width < 1 || image->width > (1 << QUADTREE_MAX_LEVELS) || (image->width & (image->width - 1))) {
+        return -1;
     }
-    quadtree->nodes[index].v = sqrt(somme_v) / 4;
+    int levels = 0;
+    while ((1 << levels) < image->width) levels++;
+    return levels;
+}
 
-    // Update medvar and maxvar of the Quadtree
-    quadtree->medvar += quadtree->nodes[index].v;
-    if (quadtree->nodes[index].v > quadtree->maxvar) {
-        quadtree->maxvar = quadtree->nodes[index].v;
+/**
+ * @brief Builds a Quadtree from an Image in its own allocation.
+ * 
+ * @see build_tree() for the construction, `medvar` is then averaged over the non-leaf nodes.
+ * 
+ * @param image Image to build Quadtree from (square, with a size power of 2).
+ * @param threads Number of threads to use.
+ * @param over_pixels Uses the Image as the leaf level if not 0, the leaves are stored otherwise.
+ * @param quadtree Quadtree representation of the given Image on output, NULL on failure.
+ * @return QTC_OK, QTC_ERROR_ARGUMENT if the Image size isn't supported or QTC_ERROR_MEMORY.
+ */
+static QtcStatus build_allocated_quadtree(Image * image, int threads, int over_pixels, Quadtree ** quadtree) {
+    *quadtree = NULL;
+    int levels = image_levels(image);
+    if (levels < 0) return QTC_ERROR_ARGUMENT;
+    Quadtree * result;
+    if (over_pixels) {
+        result = (Quadtree *) malloc(sizeof(Quadtree));
+        void * memory = result ? aligned_alloc(16, quadtree_memory_size_over_pixels(levels, 1)) : NULL;
+        if (!memory) {
+            free(result);
+            return QTC_ERROR_MEMORY;
+        }
+        init_quadtree_over_pixels(result, memory, levels, 1, image->image);
+        use_leaf_order(result, image);
+    } else {
+        result = try_create_empty_quadtree(levels, 1);
+        if (!result) return QTC_ERROR_MEMORY;
     }
+    QtcContext context;
+    init_context(&context);
+    double root_v;
+    QtcStatus status = build_tree(image, result, threads, &context, &root_v);
+    release_context(&context);
+    if (status != QTC_OK) {
+        free_quadtree(result);
+        return status;
+    }
+    result->medvar /= result->total_nodes - nodes_in_level(levels);
+    *quadtree = result;
+    return QTC_OK;
+}
 
-    // Checks if the node is uniform
-    quadtree->nodes[index].u = (child_moyennes[0] == child_moyennes[1] &&
-                                child_moyennes[1] == child_moyennes[2] &&
-                                child_moyennes[2] == child_moyennes[3] &&
-                                child_u[0] == 1 &&
-                                child_u[1] == 1 &&
-                                child_u[2] == 1 &&
-                                child_u[3] == 1) ? 1 : 0;
+/**
+ * @brief Builds a Quadtree from an Image, without exiting on errors.
+ * 
+ * @param image Image to build Quadtree from (square, with a size power of 2).
+ * @param threads Number of threads to use.
+ * @param quadtree Quadtree representation of the given Image on output, NULL on failure.
+ * @return QTC_OK, QTC_ERROR_ARGUMENT if the Image size isn't supported or QTC_ERROR_MEMORY.
+ */
+QtcStatus try_build_quadtree_from_image(Image * image, int threads, Quadtree ** quadtree) {
+    return build_allocated_quadtree(image, threads, 0, quadtree);
+}
+
+/**
+ * @brief Builds a Quadtree whose leaf level is the pixels of an Image, without exiting on errors.
+ * 
+ * Same nodes as try_build_quadtree_from_image(), without a copy of the pixels in the Quadtree:
+ * the leaves are read from (and a decoder would write them to) `image->image`.
+ * 
+ * @param image Image to build Quadtree from (square, with a size power of 2), it must outlive the Quadtree.
+ * @param threads Number of threads to use.
+ * @param quadtree Quadtree representation of the given Image on output, NULL on failure.
+ * @return QTC_OK, QTC_ERROR_ARGUMENT if the Image size isn't supported or QTC_ERROR_MEMORY.
+ */
+QtcStatus try_build_quadtree_over_image(Image * image, int threads, Quadtree ** quadtree) {
+    return build_allocated_quadtree(image, threads, 1, quadtree);
+}
+
+/**
+ * @brief Builds a Quadtree from an Image into a context.
+ * 
+ * Same Quadtree as try_build_quadtree_over_image(), its level arrays and the working arrays of the
+ * construction are the buffers of the context, nothing is allocated once they are large enough.
+ * The leaf level is the Image, which must outlive the use of the Quadtree.
+ * 
+ * @param image Image to build Quadtree from (square, with a size power of 2).
+ * @param threads Number of threads to use.
+ * @param context Context holding the Quadtree.
+ * @param quadtree Quadtree of the context on output (valid until the next call with the context), NULL on failure.
+ * @return QTC_OK, QTC_ERROR_ARGUMENT if the Image size isn't supported or QTC_ERROR_MEMORY.
+ */
+QtcStatus build_quadtree_in_context(Image * image, int threads, QtcContext * context, Quadtree ** quadtree) {
+    *quadtree = NULL;
+    int levels = image_levels(image);
+    if (levels < 0) return QTC_ERROR_ARGUMENT;
+    Quadtree * result = context_quadtree(context, levels, 1, image->image);
+    if (!result) return QTC_ERROR_MEMORY;
+    use_leaf_order(result, image);
+    double root_v;
+    QtcStatus status = build_tree(image, result, threads, context, &root_v);
+    if (status != QTC_OK) return status;
+    result->medvar /= result->total_nodes - nodes_in_level(levels);
+    *quadtree = result;
+    return QTC_OK;
+}
+
+/**
+ * @brief Exits with an error message if the construction of a Quadtree failed.
+ * 
+ * @param status Status returned by the construction.
+ */
+static void check_build_status(QtcStatus status) {
+    if (status == QTC_ERROR_ARGUMENT) {
+        fprintf(stderr, "Image must be square with a size power of 2.\n");
+        exit(EXIT_FAILURE);
+    } else if (status != QTC_OK) {
+        fprintf(stderr, "Error while allocating memory for Quadtree construction.\n");
+        exit(EXIT_FAILURE);
+    }
 }
 
 /**
  * @brief Build a Quadtree from an Image.
  * 
- * Builds a Quadtree from an Image.
+ * Builds a Quadtree from an Image on a single thread.
  * 
  * @param image Image to build Quadtree from.
  * @return Quadtree representation of the given Image.
  */
 Quadtree* build_quadtree_from_image(Image *image) {
-    int n = log2(image->width); // Levels of the Quadtree
-    Quadtree * quadtree = create_empty_quadtree(n);
-    // Quadtree construction
-    int child_size = image->width;
-    build_quadtree_rec(quadtree, image, child_size, 0, 0, 0);
-    quadtree->medvar /= quadtree->total_nodes - (1 << (2 * quadtree->levels));
+    return build_quadtree_from_image_threads(image, 1);
+}
+
+/**
+ * @brief Build a Quadtree from an Image using several threads.
+ * 
+ * @see try_build_quadtree_from_image()
+ * 
+ * @param image Image to build Quadtree from.
+ * @param threads Number of threads to use.
+ * @return Quadtree representation of the given Image.
+ */
+Quadtree* build_quadtree_from_image_threads(Image *image, int threads) {
+    Quadtree * quadtree;
+    check_build_status(try_build_quadtree_from_image(image, threads, &quadtree));
+    return quadtree;
+}
+
+/**
+ * @brief Build a Quadtree whose leaf level is the pixels of an Image, using several threads.
+ * 
+ * @see try_build_quadtree_over_image()
+ * 
+ * @param image Image to build Quadtree from, it must outlive the Quadtree.
+ * @param threads Number of threads to use.
+ * @return Quadtree representation of the given Image.
+ */
+Quadtree* build_quadtree_over_image_threads(Image *image, int threads) {
+    Quadtree * quadtree;
+    check_build_status(try_build_quadtree_over_image(image, threads, &quadtree));
     return quadtree;
 }
 
@@ -177,24 +1150,451 @@ Quadtree* build_quadtree_from_image(Image *image) {
  * Filter recursively the Quadtree based on an given alpha and sigma (medvar/maxvar).
  * 
  * @param quadtree Quadtree to filter.
- * @param node Current node.
- * @param index Index of the current node.
+ * @param level Level of the current node.
+ * @param j Index of the current node in its level.
  * @param sigma medvar/maxvar of the Quadtree.
  * @param alpha Given value to filter based on.
  */
-int filtrage(Quadtree * quadtree, Node * node, int index, double sigma, double alpha) {
-    // If a node is uniform returns 1 (as a leaf is always uniform no need to check if the node is a leaf)
-    if (node->u) return 1;
+int filtrage(Quadtree * quadtree, int level, int64_t j, double sigma, double alpha) {
+    // If a node is uniform returns 1 (a leaf is always uniform)
+    if (get_u(quadtree, level, j)) return 1;
     // Filtering sum of the 4 childs
     int s = 0;
-    s += filtrage(quadtree, &quadtree->nodes[4 * index + 1], 4 * index + 1, sigma * alpha, alpha);
-    s += filtrage(quadtree, &quadtree->nodes[4 * index + 2], 4 * index + 2, sigma * alpha, alpha);
-    s += filtrage(quadtree, &quadtree->nodes[4 * index + 3], 4 * index + 3, sigma * alpha, alpha);
-    s += filtrage(quadtree, &quadtree->nodes[4 * index + 4], 4 * index + 4, sigma * alpha, alpha);
+    s += filtrage(quadtree, level + 1, 4 * j, sigma * alpha, alpha);
+    s += filtrage(quadtree, level + 1, 4 * j + 1, sigma * alpha, alpha);
+    s += filtrage(quadtree, level + 1, 4 * j + 2, sigma * alpha, alpha);
+    s += filtrage(quadtree, level + 1, 4 * j + 3, sigma * alpha, alpha);
     // If the 4 childs are not unifrom or if node's variance > sigma, we can't uniformize the node
-    if (s < 4 || node->v > sigma) return 0;
+    if (s < 4 || quadtree->variances[level][j] > sigma) return 0;
     // Node is uniformized
-    node->epsilon = 0;
-    node->u = 1;
+    set_epsilon(quadtree, level, j, 0);
+    set_u(quadtree, level, j, 1);
     return 1;
-}
\ No newline at end of file
+}
+
+/**
+ * @brief Filtering Quadtree (lossy compression), tracking the squared error of the decoded pixels.
+ * 
+ * Same filtering as filtrage(). The sums of the pixels and of their squares come up with the recursion:
+ * a uniform node is a constant bloc of its mean (exact for an unfiltered Quadtree), a node made uniform
+ * decodes as its mean m, so its error is sum((p - m)^2) = squares - 2 m sum + n m^2 over its n pixels,
+ * the error of another node is the one of its children.
+ * 
+ * @param quadtree Unfiltered Quadtree to filter.
+ * @param level Level of the current node.
+ * @param j Index of the current node in its level.
+ * @param sigma medvar/maxvar of the Quadtree.
+ * @param alpha Given value to filter based on.
+ * @param bloc Sums and squared error of the bloc of the node on output.
+ * @return 1 if the node is uniform after filtering, 0 otherwise.
+ */
+int filtrage_error(Quadtree * quadtree, int level, int64_t j, double sigma, double alpha, BlocError * bloc) {
+    int levels = quadtree->levels;
+    uint64_t n = (uint64_t) 1 << (2 * (levels - level));
+    uint64_t m = get_moyenne(quadtree, level, j);
+    if (get_u(quadtree, level, j)) {
+        *bloc = (BlocError) {n * m, n * m * m, 0};
+        return 1;
+    }
+    *bloc = (BlocError) {0, 0, 0};
+    if (level + 1 == levels) {
+        // The 4 leaves are uniform, they are only read if the node is made uniform
+        if (quadtree->variances[level][j] > sigma) return 0;
+        for (int i = 0; i < 4; i++) {
+            uint64_t p = get_moyenne(quadtree, levels, 4 * j + i);
+            bloc->sum += p;
+            bloc->squares += p * p;
+        }
+    } else {
+        int s = 0;
+        for (int i = 0; i < 4; i++) {
+            BlocError child;
+            s += filtrage_error(quadtree, level + 1, 4 * j + i, sigma * alpha, alpha, &child);
+            bloc->sum += child.sum;
+            bloc->squares += child.squares;
+            bloc->error += child.error;
+        }
+        // The sums only matter when the node is made uniform
+        if (s < 4 || quadtree->variances[level][j] > sigma) return 0;
+    }
+    set_epsilon(quadtree, level, j, 0);
+    set_u(quadtree, level, j, 1);
+    bloc->error = bloc->squares + n * m * m - 2 * m * bloc->sum;
+    return 1;
+}
+
+/**
+ * @struct LadderTask
+ * @brief Variants of an encode ladder handled by one thread.
+ */
+typedef struct {
+    Quadtree * quadtree;    // Shared unfiltered Quadtree, only read
+    const double * alphas;  // Alpha of each variant
+    int count;              // Number of variants
+    int format;             // QTC format (1, 2 or 3)
+    int first;              // First variant of the task, then one every `step`
+    int step;               // Number of tasks
+    BitStream ** streams;   // Encoded variants
+    int started;            // Set if the task runs on its own thread
+    QtcStatus status;       // Status of the first variant that failed, QTC_OK if none
+} LadderTask;
+
+/**
+ * @brief Filters and encodes the variants of a task, stopping at the first one that fails.
+ * 
+ * Each variant is filtered on its own view of the Quadtree, whose epsilon and uniformity planes
+ * are copies, so the variants never write in the shared Quadtree.
+ * 
+ * @param arg Pointer to the LadderTask, whose status is set.
+ * @return NULL.
+ */
+static void * encode_variants(void * arg) {
+    LadderTask * task = (LadderTask *) arg;
+    for (int i = task->first; i < task->count; i += task->step) {
+        Quadtree * view = try_create_quadtree_view(task->quadtree);
+        if (!view) {
+            task->status = QTC_ERROR_MEMORY;
+            return NULL;
+        }
+        if (task->alphas[i]) filtrage(view, 0, 0, view->medvar / view->maxvar, task->alphas[i]);
+        BitStream * stream = try_initBitStream(encoded_size_bound(view->levels));
+        task->status = stream ? encode_to_stream(stream, view, task->format, NULL) : QTC_ERROR_MEMORY;
+        free_quadtree(view);
+        if (task->status != QTC_OK) {
+            freeBitStream(stream);
+            return NULL;
+        }
+        task->streams[i] = stream;
+    }
+    return NULL;
+}
+
+/**
+ * @brief Encodes a Quadtree once per alpha, from a single construction, without exiting on errors.
+ * 
+ * The Quadtree is left unfiltered: every variant is filtered on its own view (see try_create_quadtree_view()),
+ * the variants are spread across the threads. Every thread started is joined before returning,
+ * and on a failure the variants already encoded are freed.
+ * 
+ * @param quadtree Unfiltered Quadtree.
+ * @param alphas Alpha of each variant, 0 for a lossless one.
+ * @param count Number of variants.
+ * @param format 1 for Q1, 2 for Q2, 3 for Q3.
+ * @param threads Number of threads to use.
+ * @param streams Array of `count` BitStreams on output, in the order of `alphas` (each one and the array to free).
+ * @return QTC_OK, QTC_ERROR_MEMORY or the status of the encoder that failed.
+ */
+QtcStatus encode_ladder(Quadtree * quadtree, const double * alphas, int count, int format, int threads, BitStream *** streams) {
+    if (threads > count) threads = count;
+    if (threads < 1) threads = 1;
+    BitStream ** encoded = (BitStream **) calloc(count ? count : 1, sizeof(BitStream *));
+    LadderTask * tasks = (LadderTask *) malloc(threads * sizeof(LadderTask));
+    pthread_t * workers = (pthread_t *) malloc(threads * sizeof(pthread_t));
+    QtcStatus status = QTC_OK;
+    if (!encoded || !tasks || !workers) {
+        status = QTC_ERROR_MEMORY;
+        goto done;
+    }
+    // The calling thread takes the first task and the ones whose thread can't be created
+    for (int i = 0; i < threads; i++) {
+        tasks[i] = (LadderTask) {quadtree, alphas, count, format, i, threads, encoded, 0, QTC_OK};
+    }
+    for (int i = 1; i < threads; i++) {
+        tasks[i].started = !pthread_create(&workers[i], NULL, encode_variants, &tasks[i]);
+    }
+    encode_variants(&tasks[0]);
+    for (int i = 1; i < threads; i++) {
+        if (tasks[i].started) {
+            pthread_join(workers[i], NULL);
+        } else {
+            encode_variants(&tasks[i]);
+        }
+    }
+    for (int i = 0; i < threads && status == QTC_OK; i++) status = tasks[i].status;
+
+done:
+    if (status != QTC_OK && encoded) {
+        for (int i = 0; i < count; i++) freeBitStream(encoded[i]);
+        free(encoded);
+        encoded = NULL;
+    }
+    free(tasks);
+    free(workers);
+    *streams = encoded;
+    return status;
+}
+
+/**
+ * @brief Estimates the memory used by the streaming encoder.
+ * 
+ * One band of rows, the bloc of one subtree with its Quadtree, working arrays and chunk,
+ * and the top levels of the whole Quadtree with the offset table.
+ * 
+ * @param levels Levels of the Quadtree.
+ * @param split Level of the subtrees roots.
+ * @return Estimated peak memory in bytes.
+ */
+static size_t streaming_memory(int levels, int split) {
+    size_t width = (size_t) 1 << levels;
+    size_t size = width >> split;
+    return width * size + 10 * size * size + 40 * ((size_t) 1 << (2 * split));
+}
+
+/**
+ * @brief Writes bytes to the output of the streaming encoder.
+ * 
+ * @param output Output file.
+ * @param data Bytes to write.
+ * @param size Number of bytes.
+ * @return QTC_OK, or QTC_ERROR_BUFFER if the output can't take them.
+ */
+static QtcStatus write_streaming_bytes(FILE * output, const void * data, size_t size) {
+    if (size && fwrite(data, 1, size, output) != size) {
+        fprintf(stderr, "Error while writing encoded data.\n");
+        return QTC_ERROR_BUFFER;
+    }
+    return QTC_OK;
+}
+
+/**
+ * @brief Builds, and if requested filters and writes, all the subtrees rooted at level `split`.
+ * 
+ * The raster is read one band of `width >> split` rows at a time, each square bloc of the band
+ * is the Image of one subtree. Only the root of each subtree is kept in the top Quadtree:
+ * its filtered values in the planes of level `split`, its unfiltered `u` and double variance in
+ * `top_u` and `top_v` to build the levels above. Chunks are written in raster order, the offset
+ * table gives their place. Without output, only the variances are gathered (first lossy pass).
+ * 
+ * @param written Number of chunk bytes written on output.
+ * @return QTC_OK, QTC_ERROR_CORRUPT for a raster that is truncated or has invalid pixels, QTC_ERROR_MEMORY,
+ * or QTC_ERROR_BUFFER if the output can't be written or the chunks don't fit in the offset table.
+ */
+static QtcStatus stream_subtrees(FILE * input, int levels, int max_val, int split, int threads, Quadtree * top,
+                                 unsigned char * top_u, double * top_v, double * somme, double * maxvar,
+                                 double sigma, double alpha, FILE * output, uint64_t * offsets, uint64_t * sizes, uint64_t * written) {
+    int width = 1 << levels;
+    int size = width >> split;
+    int blocs = 1 << split;
+    QtcStatus status = QTC_OK;
+    *written = 0;
+    // Every subtree has the same size, their Image, Quadtree and chunk buffers are reused
+    QtcContext context;
+    init_context(&context);
+    unsigned char * band = (unsigned char *) malloc((size_t) width * size);
+    Image * bloc = context_image(&context, size, 0);
+    Quadtree * subtree = bloc ? context_quadtree(&context, levels - split, 1, bloc->image) : NULL;
+    unsigned char * chunk_buffer = (unsigned char *) scratch_reserve(&context.stream, encoded_size_bound(levels - split));
+    if (!band || !subtree || !chunk_buffer) {
+        fprintf(stderr, "Error while allocating memory for the image band.\n");
+        status = QTC_ERROR_MEMORY;
+        goto done;
+    }
+    for (int y = 0; y < blocs && status == QTC_OK; y++) {
+        if (fread(band, 1, (size_t) width * size, input) != (size_t) width * size) {
+            fprintf(stderr, "Error while reading pixels values.\n");
+            status = QTC_ERROR_CORRUPT;
+            break;
+        }
+        if (max_val < 255) {
+            for (size_t i = 0; i < (size_t) width * size && status == QTC_OK; i++) {
+                if (band[i] > max_val) {
+                    fprintf(stderr, "Error invalid pixel value.\n");
+                    status = QTC_ERROR_CORRUPT;
+                }
+            }
+            if (status != QTC_OK) break;
+        }
+        for (int x = 0; x < blocs && status == QTC_OK; x++) {
+            for (int row = 0; row < size; row++) {
+                memcpy(bloc->image + (size_t) row * size, band + (size_t) row * width + (size_t) x * size, size);
+            }
+            double root_v;
+            init_quadtree_over_pixels(subtree, context.nodes.data, levels - split, 1, bloc->image);
+            status = build_tree(bloc, subtree, threads, &context, &root_v);
+            if (status != QTC_OK) {
+                fprintf(stderr, "Error while allocating memory for Quadtree construction.\n");
+                break;
+            }
+            *somme += subtree->medvar;
+            if (subtree->maxvar > *maxvar) *maxvar = subtree->maxvar;
+
+            int64_t t = ((int64_t) spread_bits(y) << 1) | spread_bits(x ^ y);
+            top->moyennes[split][t] = subtree->moyennes[0][0];
+            top_u[t] = get_u(subtree, 0, 0);
+            top_v[t] = root_v;
+            if (output) {
+                if (alpha) filtrage(subtree, 0, 0, sigma, alpha);
+                set_epsilon(top, split, t, get_epsilon(subtree, 0, 0));
+                set_u(top, split, t, get_u(subtree, 0, 0));
+                top->variances[split][t] = (float) root_v;
+
+                // Chunk: the levels below the subtree root
+                BitStream chunk;
+                initBitStreamOver(&chunk, chunk_buffer, context.stream.capacity);
+                status = encode_levels(&chunk, subtree, 0, 0, subtree->levels, context.shared, NULL, NULL);
+                if (status != QTC_OK) {
+                    fprintf(stderr, "Error while allocating memory for the encoding frontier.\n");
+                    break;
+                }
+                finishBitStream(&chunk);
+                size_t chunk_size = chunk.ptr - chunk.start;
+                if (q2_table_bytes(levels) == 4 && *written + chunk_size > UINT32_MAX) {
+                    fprintf(stderr, "Encoded data too large for the Q2 offset table.\n");
+                    status = QTC_ERROR_BUFFER;
+                    break;
+                }
+                offsets[t] = *written;
+                sizes[t] = chunk_size;
+                status = write_streaming_bytes(output, chunk.start, chunk_size);
+                *written += chunk_size;
+            }
+        }
+    }
+
+done:
+    free(band);
+    release_context(&context);
+    return status;
+}
+
+/**
+ * @brief Encodes a P5 raster into a Q2 payload with bounded memory.
+ * 
+ * The chunks roots level is the shallowest one whose estimated memory fits in `memory_cap`
+ * (the deepest possible one if none fits), so the whole image and Quadtree never live in memory.
+ * Each subtree is built, filtered and written as soon as its band is read, then the top levels are
+ * built, filtered and written with the offset table. Filtering thresholds only depend on the depth,
+ * the lossy mode reads the raster a first time to compute `medvar` and `maxvar`.
+ * The decoded image is the same as with encode_q2() on the whole Quadtree with the same split.
+ * 
+ * @param input Input file, positioned on the first pixel (must be seekable in lossy mode).
+ * @param levels Levels of the Quadtree (the image is 2^levels pixels wide and high).
+ * @param max_val Maximum grayscale value of the image.
+ * @param output Output file, positioned after the QTC header.
+ * @param alpha Filtering parameter, 0 for a lossless compression.
+ * @param threads Number of threads used to build each subtree.
+ * @param memory_cap Memory cap in bytes.
+ * @param chunks_level Level of the chunks roots used on output.
+ * @return QTC_OK, QTC_ERROR_ARGUMENT for an unsupported size or a lossy encoding of an input that can't be read twice,
+ * QTC_ERROR_CORRUPT for a raster that is truncated or has invalid pixels, QTC_ERROR_MEMORY, or QTC_ERROR_BUFFER
+ * if the output can't be written or the chunks don't fit in the offset table (the output is then incomplete).
+ */
+QtcStatus encode_q2_streaming(FILE * input, int levels, int max_val, FILE * output, double alpha, int threads, size_t memory_cap,
+                              int * chunks_level) {
+    if (levels < 1 || levels > QUADTREE_MAX_LEVELS) {
+        fprintf(stderr, "Unsupported image size for the streaming encoder.\n");
+        return QTC_ERROR_ARGUMENT;
+    }
+    int split = 0;
+    while (split < levels - 1 && streaming_memory(levels, split) > memory_cap) split++;
+    *chunks_level = split;
+    int64_t chunks = nodes_in_level(split);
+
+    // Levels 0 to split of the whole Quadtree (the level below is never used)
+    QtcStatus status = QTC_OK;
+    BitStream * stream = NULL;
+    double * sigmas = NULL;
+    Quadtree * top = try_create_empty_quadtree(split + 1, 1);
+    unsigned char * top_u = (unsigned char *) malloc(chunks);
+    unsigned char * eps = (unsigned char *) malloc(chunks);
+    double * top_v = (double *) malloc(chunks * sizeof(double));
+    uint64_t * offsets = (uint64_t *) malloc(chunks * sizeof(uint64_t));
+    uint64_t * sizes = (uint64_t *) malloc(chunks * sizeof(uint64_t));
+    if (!top || !top_u || !eps || !top_v || !offsets || !sizes) {
+        fprintf(stderr, "Error while allocating memory for the streaming encoder.\n");
+        status = QTC_ERROR_MEMORY;
+        goto done;
+    }
+
+    // First pass, medvar and maxvar of the whole Quadtree
+    uint64_t written = 0;
+    double sigma = 0.;
+    if (alpha) {
+        long raster = ftell(input);
+        if (raster < 0) {
+            fprintf(stderr, "Lossy streaming compression needs a seekable input.\n");
+            status = QTC_ERROR_ARGUMENT;
+            goto done;
+        }
+        double somme = 0., maxvar = 0.;
+        status = stream_subtrees(input, levels, max_val, split, threads, top, top_u, top_v, &somme, &maxvar, 0., 0., NULL, NULL, NULL, &written);
+        if (status != QTC_OK) goto done;
+        for (int level = split - 1; level >= 0; level--) {
+            build_level(top, level, 0, nodes_in_level(level), top->moyennes[level + 1], top_u, top_v, eps, &somme, &maxvar);
+        }
+        if (fseek(input, raster, SEEK_SET)) {
+            fprintf(stderr, "Lossy streaming compression needs a seekable input.\n");
+            status = QTC_ERROR_ARGUMENT;
+            goto done;
+        }
+        uint64_t internal = (((uint64_t) 1 << (2 * levels)) - 1) / 3;
+        sigma = (somme / internal) / maxvar;
+    }
+
+    // Filtering threshold of the subtrees roots, same sequence of products as filtrage()
+    sigmas = (double *) malloc((split + 1) * sizeof(double));
+    if (!sigmas) {
+        fprintf(stderr, "Error while allocating memory for the streaming encoder.\n");
+        status = QTC_ERROR_MEMORY;
+        goto done;
+    }
+    sigmas[0] = sigma;
+    for (int level = 1; level <= split; level++) sigmas[level] = sigmas[level - 1] * alpha;
+
+    unsigned char header[2] = {(unsigned char) levels, (unsigned char) split};
+    status = write_streaming_bytes(output, header, 2);
+    if (status != QTC_OK) goto done;
+    double somme = 0., maxvar = 0.;
+    status = stream_subtrees(input, levels, max_val, split, threads, top, top_u, top_v, &somme, &maxvar,
+                             sigmas[split], alpha, output, offsets, sizes, &written);
+    if (status != QTC_OK) goto done;
+
+    // Top levels, filtered bottom-up: a node is uniformized when its 4 children are uniform
+    for (int level = split - 1; level >= 0; level--) {
+        build_level(top, level, 0, nodes_in_level(level), top->moyennes[level + 1], top_u, top_v, eps, &somme, &maxvar);
+        if (!alpha) continue;
+        for (int64_t j = 0; j < nodes_in_level(level); j++) {
+            if (get_u(top, level, j)) continue;
+            int s = get_u(top, level + 1, 4 * j) + get_u(top, level + 1, 4 * j + 1) + get_u(top, level + 1, 4 * j + 2) + get_u(top, level + 1, 4 * j + 3);
+            if (s < 4 || top->variances[level][j] > sigmas[level]) continue;
+            set_epsilon(top, level, j, 0);
+            set_u(top, level, j, 1);
+        }
+    }
+
+    // Top section and offset table
+    int bytes = q2_table_bytes(levels);
+    stream = try_initBitStream(top->total_nodes * 2 + (2 * chunks + 1) * bytes);
+    if (!stream) {
+        fprintf(stderr, "Error while allocating memory for the streaming encoder.\n");
+        status = QTC_ERROR_MEMORY;
+        goto done;
+    }
+    write_node(stream, top, 0, 0);
+    QtcContext context;
+    init_context(&context);
+    status = encode_levels(stream, top, 0, 0, split, context.shared, NULL, NULL);
+    release_context(&context);
+    if (status != QTC_OK) {
+        fprintf(stderr, "Error while allocating memory for the encoding frontier.\n");
+        goto done;
+    }
+    finishBitStream(stream);
+    for (int64_t t = 0; t < chunks; t++) {
+        push_table_value(stream, offsets[t], bytes);
+        push_table_value(stream, sizes[t], bytes);
+    }
+    push_table_value(stream, written, bytes);
+    status = stream->error ? QTC_ERROR_BUFFER : write_streaming_bytes(output, stream->start, stream->ptr - stream->start);
+
+done:
+    freeBitStream(stream);
+    if (top) free_quadtree(top);
+    free(top_u);
+    free(eps);
+    free(top_v);
+    free(offsets);
+    free(sizes);
+    free(sigmas);
+    return status;
+}
@@ -5,6 +5,8 @@
  * This file provides functions for allocating and freeing memory of an Image structure.
  */
 #include "image.h"
+#include "quadtree.h"
+#include <string.h>
 
 // Fonction d'allocation de mémoire pour une image
 /**
@@ -19,7 +21,7 @@
  * 
  * @note Exits program with an error message if memory allocation fails.
  */
-Image* allocate_image(int width, int image_size, int max_val) {
+Image* allocate_image(int width, size_t image_size, int max_val) {
     Image *image = (Image*) malloc(sizeof(Image));
     if (!image) {
         fprintf(stderr, "Error while allocating memory for the image structure.\n");
@@ -28,6 +30,7 @@ Image* allocate_image(int width, int image_size, int max_val) {
     image->width = width;
     image->image_size = image_size;
     image->max_val = max_val;
+    image->layout = IMAGE_RASTER;
     image->image = (unsigned char*) malloc(image_size * sizeof(unsigned char));
     if (!image->image) {
         fprintf(stderr, "Error while allocating memory for the image's pixel data.\n");
@@ -46,4 +49,145 @@ Image* allocate_image(int width, int image_size, int max_val) {
 void free_image(Image * image) {
     free(image->image);
     free(image);
-}
\ No newline at end of file
+}
+
+/**
+ * @brief Allocates memory for a multi-plane image.
+ * 
+ * The samples of a pixel are consecutive (RGB, RGBA), as in a P6 or P7 file.
+ * 
+ * @param width Width of the image (assumes the image to be square, width = height).
+ * @param planes Number of samples of a pixel (1 to 4).
+ * @param max_val Maximum value of a sample (max 255).
+ * @return Pointer to the allocated ColorImage.
+ * 
+ * @note Exits program with an error message if memory allocation fails.
+ */
+ColorImage * allocate_color_image(int width, int planes, int max_val) {
+    ColorImage * image = (ColorImage *) malloc(sizeof(ColorImage));
+    if (!image) {
+        fprintf(stderr, "Error while allocating memory for the image structure.\n");
+        exit(EXIT_FAILURE);
+    }
+    image->width = width;
+    image->planes = planes;
+    image->max_val = max_val;
+    image->pixels = (unsigned char *) malloc((size_t) width * width * planes);
+    if (!image->pixels) {
+        fprintf(stderr, "Error while allocating memory for the image's pixel data.\n");
+        exit(EXIT_FAILURE);
+    }
+    return image;
+}
+
+/**
+ * @brief Frees allocated memory for a ColorImage.
+ * 
+ * @param image Pointer to the ColorImage to be freed.
+ */
+void free_color_image(ColorImage * image) {
+    free(image->pixels);
+    free(image);
+}
+
+/**
+ * @brief Copies the 16 pixels of a 4x4 bloc between 4 raster rows and 16 consecutive leaves.
+ * 
+ * Lists leaf k of the bloc with its column and row, clockwise at both levels, unrolled so
+ * every copy has constant offsets.
+ * 
+ * @param COPY Macro copying between leaf k and the pixel at column dx, row dy of the bloc.
+ */
+#define BLOC_4X4(COPY) \
+    COPY(0, 0, 0)  COPY(1, 1, 0)  COPY(2, 1, 1)  COPY(3, 0, 1) \
+    COPY(4, 2, 0)  COPY(5, 3, 0)  COPY(6, 3, 1)  COPY(7, 2, 1) \
+    COPY(8, 2, 2)  COPY(9, 3, 2)  COPY(10, 3, 3) COPY(11, 2, 3) \
+    COPY(12, 0, 2) COPY(13, 1, 2) COPY(14, 1, 3) COPY(15, 0, 3)
+
+/**
+ * @brief Copies rows of a raster image into a buffer of the whole image in leaf order.
+ * 
+ * Rows are taken 4 at a time when they are aligned: the 16 pixels of each 4x4 bloc are 16
+ * consecutive leaves, written at once after a single node_index(). Other rows are copied pixel by pixel.
+ * 
+ * @param raster Rows to copy, `rows` rows of `width` pixels.
+ * @param leaves Pixels of the whole image in leaf order.
+ * @param width Width (and height) of the image, a power of 2.
+ * @param first_row Row of the image of the first row to copy.
+ * @param rows Number of rows to copy.
+ */
+void raster_to_leaf_order(const unsigned char * raster, unsigned char * leaves, int width, int first_row, int rows) {
+    for (int row = 0; row < rows; row++) {
+        int y = first_row + row;
+        const unsigned char * line = raster + (size_t) row * width;
+        if (width >= 4 && y % 4 == 0 && row + 4 <= rows) {
+            for (int x = 0; x < width; x += 4) {
+                unsigned char * bloc = leaves + node_index(x, y);
+                const unsigned char * rows4[4] = {line + x, line + width + x, line + 2 * width + x, line + 3 * width + x};
+#define TO_LEAF(k, dx, dy) bloc[k] = rows4[dy][dx];
+                BLOC_4X4(TO_LEAF)
+#undef TO_LEAF
+            }
+            row += 3;
+            continue;
+        }
+        for (int x = 0; x < width; x++) leaves[node_index(x, y)] = line[x];
+    }
+}
+
+/**
+ * @brief Copies rows of an image in leaf order into a raster buffer.
+ * 
+ * Same 4x4 blocs as raster_to_leaf_order(), read instead of written.
+ * 
+ * @param leaves Pixels of the whole image in leaf order.
+ * @param raster Buffer receiving `rows` rows of `width` pixels.
+ * @param width Width (and height) of the image, a power of 2.
+ * @param first_row Row of the image of the first row to copy.
+ * @param rows Number of rows to copy.
+ */
+void leaf_order_to_raster(const unsigned char * leaves, unsigned char * raster, int width, int first_row, int rows) {
+    for (int row = 0; row < rows; row++) {
+        int y = first_row + row;
+        unsigned char * line = raster + (size_t) row * width;
+        if (width >= 4 && y % 4 == 0 && row + 4 <= rows) {
+            for (int x = 0; x < width; x += 4) {
+                const unsigned char * bloc = leaves + node_index(x, y);
+                unsigned char * rows4[4] = {line + x, line + width + x, line + 2 * width + x, line + 3 * width + x};
+#define TO_RASTER(k, dx, dy) rows4[dy][dx] = bloc[k];
+                BLOC_4X4(TO_RASTER)
+#undef TO_RASTER
+            }
+            row += 3;
+            continue;
+        }
+        for (int x = 0; x < width; x++) line[x] = leaves[node_index(x, y)];
+    }
+}
+
+/**
+ * @brief Puts the pixels of an Image in the given order.
+ * 
+ * The pixels are converted into a new buffer, which replaces the old one.
+ * 
+ * @param image Image to convert (square, with a size power of 2 for IMAGE_LEAF_ORDER).
+ * @param layout New order of the pixels.
+ * 
+ * @note Exits program with an error message if memory allocation fails.
+ */
+void set_image_layout(Image * image, ImageLayout layout) {
+    if (image->layout == layout) return;
+    unsigned char * pixels = (unsigned char *) malloc(image->image_size);
+    if (!pixels) {
+        fprintf(stderr, "Error while allocating memory for the image's pixel data.\n");
+        exit(EXIT_FAILURE);
+    }
+    if (layout == IMAGE_LEAF_ORDER) {
+        raster_to_leaf_order(image->image, pixels, image->width, 0, image->width);
+    } else {
+        leaf_order_to_raster(image->image, pixels, image->width, 0, image->width);
+    }
+    free(image->image);
+    image->image = pixels;
+    image->layout = layout;
+}
@@ -0,0 +1,87 @@
+/**
+ * @file index.c
+ * @brief Implementation of the seek index of a Q1 file.
+ */
+
+#include "index.h"
+
+/**
+ * @brief Allocates the arrays of an index.
+ *
+ * @param index Index whose `levels` and `level` are set.
+ * @return QTC_OK or QTC_ERROR_MEMORY.
+ */
+QtcStatus allocate_qtc_index(QtcIndex * index) {
+    size_t subtrees = nodes_in_level(index->level);
+    index->roots = (unsigned char *) malloc(2 * subtrees);
+    index->offsets = (uint64_t *) malloc((subtrees * (index->levels - index->level) + 1) * sizeof(uint64_t));
+    if (!index->roots || !index->offsets) {
+        free_qtc_index(index);
+        return QTC_ERROR_MEMORY;
+    }
+    return QTC_OK;
+}
+
+/**
+ * @brief Frees the arrays of an index.
+ *
+ * @param index Index to free.
+ */
+void free_qtc_index(QtcIndex * index) {
+    free(index->roots);
+    free(index->offsets);
+    index->roots = NULL;
+    index->offsets = NULL;
+}
+
+/**
+ * @brief Builds the index of the Q1 payload of a Quadtree, without encoding it.
+ *
+ * Walks the nodes in the order encode() writes them and counts their bits: 8 for `moyenne`
+ * (except for the 4th child), 2 for `epsilon` and 1 for `u` when `epsilon` is 0 on non-leaf levels.
+ * The children of uniform nodes are not written. A subtree starts on a multiple of 4 in each level,
+ * so its first node is never skipped with its siblings.
+ *
+ * @param quadtree Quadtree encoded at Q1 format.
+ * @param level Level of the subtrees roots (clamped to the levels of the Quadtree).
+ * @param index Index on output, to free with free_qtc_index().
+ * @return QTC_OK or QTC_ERROR_MEMORY.
+ */
+QtcStatus build_qtc_index(Quadtree * quadtree, int level, QtcIndex * index) {
+    int levels = quadtree->levels;
+    if (level > levels) level = levels;
+    if (level < 0) level = 0;
+    index->levels = levels;
+    index->level = level;
+    if (allocate_qtc_index(index) != QTC_OK) return QTC_ERROR_MEMORY;
+
+    // Roots as decoded: below a uniform node, `moyenne` is the one of that node and `u` is 1
+    int64_t subtrees = nodes_in_level(level);
+    for (int64_t t = 0; t < subtrees; t++) {
+        int a = 0;
+        while (a < level && !get_u(quadtree, a, t >> (2 * (level - a)))) a++;
+        int64_t j = t >> (2 * (level - a));
+        index->roots[2 * t] = get_moyenne(quadtree, a, j);
+        index->roots[2 * t + 1] = a < level ? 4 : get_epsilon(quadtree, level, t) | get_u(quadtree, level, t) << 2;
+    }
+
+    // Levels byte, then the root, always written as a node
+    uint64_t bits = 8 + 10 + !get_epsilon(quadtree, 0, 0);
+    int depth = levels - level;
+    for (int l = 1; l <= levels; l++) {
+        int64_t count = l > level ? nodes_in_level(l - level) : 0; // Nodes of a subtree in this level
+        int leaf = is_leaf(quadtree, l);
+        int64_t total = nodes_in_level(l);
+        for (int64_t j = 0; j < total; j++) {
+            if (count && j % count == 0) index->offsets[(size_t) (j / count) * depth + l - level - 1] = bits;
+            if (get_u(quadtree, l - 1, j / 4)) {
+                j += 3;
+                continue;
+            }
+            bits += (j % 4 != 3) ? 8 : 0;
+            if (!leaf) bits += 2 + !get_epsilon(quadtree, l, j);
+        }
+    }
+    index->payload_size = (bits + 7) / 8;
+    return QTC_OK;
+}
@@ -2,21 +2,97 @@
 #include <getopt.h>
 #include <string.h>
 #define MAX_SIZE 256
+#define MAX_ALPHAS 16
+
+// Stream of the verbose messages and of the statistics, the standard error when the output goes to the standard output
+static FILE * messages;
+
+// Long options without a short equivalent
+enum {
+    OPTION_TARGET_BYTES = 256,
+    OPTION_TARGET_BPP,
+    OPTION_TARGET_PSNR,
+    OPTION_ALPHAS,
+    OPTION_MAX_LEVEL,
+    OPTION_INDEX,
+    OPTION_ROI,
+    OPTION_STATS,
+    OPTION_GRID_LIST,
+    OPTION_SEQUENCE,
+    OPTION_SERVE,
+    OPTION_CACHE,
+    OPTION_RCT
+};
+
+static const struct option long_options[] = {
+    {"target-bytes", required_argument, NULL, OPTION_TARGET_BYTES},
+    {"target-bpp", required_argument, NULL, OPTION_TARGET_BPP},
+    {"target-psnr", required_argument, NULL, OPTION_TARGET_PSNR},
+    {"alphas", required_argument, NULL, OPTION_ALPHAS},
+    {"max-level", required_argument, NULL, OPTION_MAX_LEVEL},
+    {"index", required_argument, NULL, OPTION_INDEX},
+    {"roi", required_argument, NULL, OPTION_ROI},
+    {"stats", no_argument, NULL, OPTION_STATS},
+    {"grid-list", no_argument, NULL, OPTION_GRID_LIST},
+    {"sequence", no_argument, NULL, OPTION_SEQUENCE},
+    {"serve", required_argument, NULL, OPTION_SERVE},
+    {"cache", required_argument, NULL, OPTION_CACHE},
+    {"rct", no_argument, NULL, OPTION_RCT},
+    {"help", no_argument, NULL, 'h'},
+    {NULL, 0, NULL, 0}
+};
 
 // Displays help message (-h) on the standard output
 static void print_help(char ** argv) {
-    fprintf(stdout, " Usage: %s [-c|-u|-g] [-v] [-i input.{pgm|qtc}] [-o output.{qtc|pgm}] [-a alpha] [-h].\n"
+    fprintf(stdout, " Usage: %s [-c|-u|-g] [-v] [-i input.{pgm|ppm|pam|qtc}] [-o output.{qtc|pgm|ppm|pam}] [-a alpha] [-t threads] [-f Q1|Q2|Q3] [-m memory] [-n] [-b batch]\n"
+                "\t[--target-bytes bytes|--target-bpp bpp|--target-psnr dB] [--alphas a1,a2,...] [--max-level k]\n"
+                "\t[--index k] [--roi x,y,w,h] [--stats] [--grid-list] [--sequence] [--serve address [--cache MiB]] [--rct] [-h].\n"
                 "-c : Encodes a PGM image into QTC format.\n"
-                "-u : Decodes a QTC file into a PGM image.\n"
+                "\tA color image (.ppm P6 file, or .pam P7 file of up to 4 planes such as RGB and alpha) gives a Q5 file:\n"
+                "\tone Quadtree per plane, built, filtered and encoded at the -f format on a thread of its own (only with -a, -f and -t).\n"
+                "-u : Decodes a QTC file into a PGM image, a Q5 file into a P6 image (3 planes) or a P7 image, its planes decoded concurrently.\n"
                 "-g : Generates a segmentation grid from a PGM image.\n"
                 "-v : Enables verbose mode (displays additional information during execution).\n"
-                "-i : Specifies the input file.\n"
-                "-o : Specifies the output file.\n"
+                "-i : Specifies the input file, - reads it from the standard input.\n"
+                "-o : Specifies the output file, - writes it to the standard output (the messages then go to the standard error).\n"
                 "-a : Specifies the alpha parameter for filtering (lossy compression). This option is applicable only with -c."
                 "\n\tAlpha value range:"
                 "\n\t\t- alpha <= 1.0 -> no filtering, no additional compression gain."
                 "\n\t\t- alpha ~ 1.5 -> moderate filtering, reasonable compression gain."
                 "\n\t\t- alpha >= 2.0 -> excessive filtering, significantly degraded image quality.\n"
+                "-t : Specifies the number of threads used to build or decode the Quadtree (default 1).\n"
+                "-f : Specifies the QTC format to write: Q1 (default), Q2 (independent chunks, decoded concurrently with -t)\n"
+                "\tor Q3 (entropy coded with rANS, smaller files).\n"
+                "-m : Encodes with a memory cap in MiB: the image is read by bands and written at Q2 format as it goes (P5 images only, not with -g).\n"
+                "-n : Leaves out the date and compression rate comments, so the output only depends on the input.\n"
+                "-b : Batch mode: encodes (-c) or decodes (-u) a directory, a manifest file (one path per line) or a quoted glob pattern.\n"
+                "\tOutputs mirror the input tree under the -o directory, -t sets the number of worker threads. A Q5 file is decoded into a .ppm or .pam image.\n"
+                "\tA file that can't be coded is reported and skipped, the exit status is then 1.\n"
+                "--target-bytes : Chooses alpha so that the encoded data (without the header lines) fits in this number of bytes.\n"
+                "\tThe size is predicted from the Quadtree, the image is filtered and encoded once (replaces -a, not with -m or -b).\n"
+                "--target-bpp : Same as --target-bytes with a budget in bits per pixel.\n"
+                "--target-psnr : Chooses the largest alpha whose decoded image has at least this PSNR in dB.\n"
+                "\tThe error is predicted from the Quadtree, the image is filtered and encoded once (replaces -a, not with -m or -b).\n"
+                "--alphas : Encodes one file per alpha of a comma separated list (up to 16 distinct values) from a single Quadtree construction.\n"
+                "\tThe variants are filtered and encoded in parallel with -t, out.qtc gives out_a<alpha>.qtc (not with -a, -g, -m, -b or a target).\n"
+                "--max-level : Decodes only the first levels and writes a 2^k x 2^k thumbnail of the means of level k (-u only, not with -g).\n"
+                "--index : Also writes a seek index of the subtrees of level k next to a Q1 file (out.qtc gives out.qtci, not with -m, -b or --alphas).\n"
+                "--roi : Decodes only the subtrees that intersect a region and writes a w x h image (-u only, not with -g, -b or --max-level).\n"
+                "\tA Q1 file needs its index, a Q2 file uses its chunks, a Q3 file can't be used.\n"
+                "--stats : Prints the time of each stage and the counters of the coding loops: nodes visited, emitted and skipped,\n"
+                "\tbits of each field of the format (rANS cost of the mean residuals and flags for Q3), interpolated 4th children,\n"
+                "\tnodes made uniform by filtering with the MSE and PSNR, bytes allocated by the codec buffers (not with -m, -b or --alphas).\n"
+                "--grid-list : With -g, writes the list of the uniform blocs (x, y, size) instead of the grid image.\n"
+                "\tout.qtc gives PGM/out_g.qtcb: 'QB' line, side on 16 bits (0 for 65536), number of blocs on 64 bits, x and y on 16 bits and log2 of the size on 8 bits.\n"
+                "--sequence : With -b, codes the files as the frames of a sequence, in path order on a single thread: the first one at the -f format,\n"
+                "\tthe next ones as Q4 deltas of the previous frame (only the changed subtrees are written), or at the -f format if the delta isn't smaller.\n"
+                "\tA Q4 file is decoded with its sequence.\n"
+                "--serve : Runs a tile server on a TCP port of 127.0.0.1 (a number) or a Unix socket (a path), -t sets the number of workers.\n"
+                "\tEach request line 'GET file.qtc [level [x y w h]]' gets a P5 PGM image of the means of a level or of a window of it,\n"
+                "\t'STATS' the counters of the cache. The decoded Quadtrees stay in a cache shared by the workers (no other option).\n"
+                "--cache : Memory cap in MiB of the Quadtrees kept by --serve, the least recently used ones are freed first (default 256).\n"
+                "--rct : With a color image, codes the red and blue planes as differences with the green one (mod 256), exactly reversible\n"
+                "\tand giving flatter planes on gray areas (lossless only, not with -a).\n"
                 "-h : Displays this help message.\n", argv[0]);
 }
 
@@ -28,23 +104,94 @@ static int check_file_extension(const char * filename, const char * expected_ext
     return strcmp(extension + 1, expected_extension) == 0; // Compares the extracted extension with the expected extension
 }
 
-// Function to generate a segmentation grid from a quadtree
-static void handle_segmentation_grid(const char *grid_file, Quadtree *quadtree, int verbose) {
-    if (verbose) fprintf(stdout, "Generating segmentation grid.\n");
-    Image *segmentation_grid = generate_segmentation_grid(quadtree);
-    write_pgm(grid_file, segmentation_grid);
-    if (verbose) fprintf(stdout, "Segmentation grid generated. File written: %s\n", grid_file);
-    free_image(segmentation_grid);
+// Function that parses a comma separated list of alpha values, returns their number or -1 if the list is invalid
+// Two values giving the same file name (see variant_filename) are a duplicate, the second file would overwrite the first one
+static int parse_alphas(const char * list, double * alphas, int max) {
+    int count = 0;
+    const char * p = list;
+    while (*p) {
+        char * end;
+        double alpha = strtod(p, &end);
+        if (end == p || alpha < 0 || count == max || (*end && *end != ',')) return -1;
+        char name[32], other[32];
+        snprintf(name, sizeof(name), "%g", alpha);
+        for (int i = 0; i < count; i++) {
+            snprintf(other, sizeof(other), "%g", alphas[i]);
+            if (!strcmp(name, other)) return -1;
+        }
+        alphas[count++] = alpha;
+        p = *end ? end + 1 : end;
+    }
+    return count;
+}
+
+// Function that builds the name of a ladder variant: the alpha is inserted before the extension
+static void variant_filename(char * variant, size_t size, const char * output_file, double alpha) {
+    const char * dot = strrchr(output_file, '.');
+    const char * slash = strrchr(output_file, '/');
+    int stem = (dot && (!slash || dot > slash)) ? (int) (dot - output_file) : (int) strlen(output_file);
+    snprintf(variant, size, "%.*s_a%g%s", stem, output_file, alpha, output_file + stem);
+}
+
+// Function that prepares the segmentation grid filled by the codec: a white image, or only the list of the blocs
+static void init_grid(SegmentationGrid * grid, int width, int list) {
+    init_segmentation_grid(grid, list ? NULL : allocate_image(width, (size_t) width * width, 255), list);
+}
+
+// Function that writes the segmentation grid filled by the codec, then frees it (date: compression date comment of a decoded file, or NULL)
+static void handle_segmentation_grid(const char * grid_file, SegmentationGrid * grid, int width, int verbose, int comments, const char * date) {
+    if (grid->list) write_grid_blocs(grid_file, grid, width);
+    else write_pgm(grid_file, grid->image, comments, date);
+    if (verbose) fprintf(messages, "Segmentation grid generated. File written: %s\n", grid_file);
+    if (grid->image) free_image(grid->image);
+    free_segmentation_grid(grid);
+}
+
+// Function that exits with an error message if a decoding into the buffers of a context failed
+static void check_decode_status(BitStream * stream, QtcStatus status, int region) {
+    if (status == QTC_OK) return;
+    if (status == QTC_ERROR_MEMORY) {
+        fprintf(stderr, "Error while allocating memory for decoding.\n");
+    } else if (region && status == QTC_ERROR_ARGUMENT) {
+        fprintf(stderr, stream->format == 3 ? "Regions can't be decoded from a Q3 file.\n" :
+                        stream->format == 2 ? "Region outside of the image.\n" : "Region outside of the image or index not matching the Q1 file.\n");
+    } else {
+        fprintf(stderr, stream->format == 2 ? "Invalid Q2 file.\n" : stream->format == 3 ? "Invalid Q3 file.\n" : "Erreur lors de la lecture du flux binaire.\n");
+    }
+    exit(EXIT_FAILURE);
+}
+
+// Function that completes and prints the statistics of a coding, the counters were filled by the coding loops
+static void print_context_stats(QtcStats * stats, BitStream * stream, const QtcContext * context) {
+    stats->payload_bytes = stream->ptr - stream->start;
+    stats->bytes_allocated = context_memory_size(context); // The context is only used for this image
+    print_stats(messages, stats);
 }
 
 int main (int argc, char **argv) {
-    int c = 0, u = 0, v = 0, g = 0, option;
-    double alpha = 0.;
+    int c = 0, u = 0, v = 0, g = 0, threads = 1, format = 1, option;
+    int comments = 1; // Date and compression rate comments in the output headers
+    double alpha = 0., memory = 0., target_bytes = 0., target_bpp = 0., target_psnr = 0.;
+    double alphas[MAX_ALPHAS];
+    int variants = 0;
+    int max_level = -1;
+    int index_level = -1;
+    int roi[4] = {0};
+    int region = 0;
+    int with_stats = 0;
+    int grid_list = 0;
+    int sequence = 0;
+    int rct = 0;
+    double cache = 0.;
+    QtcStats stats;
+    init_stats(&stats);
     char input_file[MAX_SIZE] = "";
     char output_file[MAX_SIZE] = "";
     char grid_file[MAX_SIZE] = "";
+    char batch_input[MAX_SIZE] = "";
+    char serve_address[MAX_SIZE] = "";
 
-    while ((option = getopt(argc, argv, "cuvgi:o:a:h")) != -1) {
+    while ((option = getopt_long(argc, argv, "cuvgi:o:a:t:f:m:nb:h", long_options, NULL)) != -1) {
         switch (option) {
             case 'c':
                 c = 1; // Encode
@@ -74,6 +221,117 @@ int main (int argc, char **argv) {
                     return EXIT_FAILURE;
                 }
                 break;
+            case 't':
+                threads = atoi(optarg);
+                if (threads < 1) {
+                    fprintf(stderr, "Threads number must be at least 1.\n");
+                    print_help(argv);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'f':
+                if (strcmp(optarg, "Q1") && strcmp(optarg, "Q2") && strcmp(optarg, "Q3")) {
+                    fprintf(stderr, "Format must be Q1, Q2 or Q3.\n");
+                    print_help(argv);
+                    return EXIT_FAILURE;
+                }
+                format = optarg[1] - '0';
+                break;
+            case 'm':
+                memory = atof(optarg);
+                if (memory <= 0) {
+                    fprintf(stderr, "Memory cap must be greater than 0.\n");
+                    print_help(argv);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'n':
+                comments = 0; // Reproducible output
+                break;
+            case 'b':
+                strncpy(batch_input, optarg, sizeof(batch_input) - 1);
+                batch_input[sizeof(batch_input) - 1] = '\0';
+                break;
+            case OPTION_TARGET_BYTES:
+                target_bytes = atof(optarg);
+                if (target_bytes < 1) {
+                    fprintf(stderr, "Target size must be at least 1 byte.\n");
+                    print_help(argv);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case OPTION_TARGET_BPP:
+                target_bpp = atof(optarg);
+                if (target_bpp <= 0) {
+                    fprintf(stderr, "Target bits per pixel must be greater than 0.\n");
+                    print_help(argv);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case OPTION_TARGET_PSNR:
+                target_psnr = atof(optarg);
+                if (target_psnr <= 0) {
+                    fprintf(stderr, "Target PSNR must be greater than 0 dB.\n");
+                    print_help(argv);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case OPTION_ALPHAS:
+                variants = parse_alphas(optarg, alphas, MAX_ALPHAS);
+                if (variants < 1) {
+                    fprintf(stderr, "Alphas must be a comma separated list of 1 to %d distinct values greater than 0.\n", MAX_ALPHAS);
+                    print_help(argv);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case OPTION_MAX_LEVEL:
+                max_level = atoi(optarg);
+                if (max_level < 0 || max_level > QUADTREE_MAX_LEVELS) {
+                    fprintf(stderr, "Max level must be between 0 and %d.\n", QUADTREE_MAX_LEVELS);
+                    print_help(argv);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case OPTION_INDEX:
+                index_level = atoi(optarg);
+                if (index_level < 0 || index_level > QUADTREE_MAX_LEVELS) {
+                    fprintf(stderr, "Index level must be between 0 and %d.\n", QUADTREE_MAX_LEVELS);
+                    print_help(argv);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case OPTION_ROI:
+                region = sscanf(optarg, "%d,%d,%d,%d", &roi[0], &roi[1], &roi[2], &roi[3]) == 4;
+                if (!region || roi[0] < 0 || roi[1] < 0 || roi[2] < 1 || roi[3] < 1) {
+                    fprintf(stderr, "The region must be given as x,y,w,h with x, y >= 0 and w, h >= 1.\n");
+                    print_help(argv);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case OPTION_STATS:
+                with_stats = 1;
+                break;
+            case OPTION_GRID_LIST:
+                grid_list = 1;
+                break;
+            case OPTION_SEQUENCE:
+                sequence = 1;
+                break;
+            case OPTION_SERVE:
+                strncpy(serve_address, optarg, sizeof(serve_address) - 1);
+                serve_address[sizeof(serve_address) - 1] = '\0';
+                break;
+            case OPTION_CACHE:
+                cache = atof(optarg);
+                if (cache <= 0) {
+                    fprintf(stderr, "Cache size must be greater than 0.\n");
+                    print_help(argv);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case OPTION_RCT:
+                rct = 1; // Reversible color transform
+                break;
             case 'h': // Help
                 print_help(argv);
                 return EXIT_SUCCESS;
@@ -82,76 +340,365 @@ int main (int argc, char **argv) {
                 return EXIT_FAILURE;
         }
     }
+    messages = strcmp(output_file, "-") ? stdout : stderr;
+    // Tile server, the files are decoded when they are first requested
+    if (cache && !strlen(serve_address)) {
+        fprintf(stderr, "--cache sets the memory cap of the tile server, it needs --serve.\n");
+        return EXIT_FAILURE;
+    }
+    if (strlen(serve_address)) {
+        if (c || u || g || strlen(input_file) || strlen(output_file) || strlen(batch_input)) {
+            fprintf(stderr, "--serve runs the tile server alone, only with -t, -v and --cache.\n");
+            return EXIT_FAILURE;
+        }
+        ServerOptions options = {(size_t) ((cache ? cache : 256) * 1024 * 1024), threads, v};
+        run_server(serve_address, &options);
+        return EXIT_SUCCESS;
+    }
     // Encoding and decoding cannot be done simultaneously
     if ((c + u) != 1) {
         fprintf(stderr,"You must choose either -c (encoding) or -u (decoding).\n");
         return EXIT_FAILURE;
     }
+    // Rate control replaces alpha, it needs the whole Quadtree of one image
+    int target = target_bytes || target_bpp;
+    if (target && (!c || alpha || memory || (target_bytes && target_bpp) || strlen(batch_input) || format == 3)) {
+        fprintf(stderr, "--target-bytes and --target-bpp encode a single image (-c) at Q1 or Q2 format, without -a, -m, -b or each other.\n");
+        return EXIT_FAILURE;
+    }
+    // Quality control replaces alpha as well
+    if (target_psnr && (!c || alpha || memory || target || strlen(batch_input))) {
+        fprintf(stderr, "--target-psnr encodes a single image (-c), without -a, -m, -b or a target size.\n");
+        return EXIT_FAILURE;
+    }
+    // Encode ladder, one output per alpha from a single Quadtree
+    if (variants && (!c || alpha || memory || g || target || target_psnr || strlen(batch_input))) {
+        fprintf(stderr, "--alphas encodes a single image (-c), without -a, -g, -m, -b or a target size.\n");
+        return EXIT_FAILURE;
+    }
+    // Thumbnail, only the first levels are decoded
+    if (max_level >= 0 && (!u || g)) {
+        fprintf(stderr, "--max-level decodes a thumbnail (-u), without -g.\n");
+        return EXIT_FAILURE;
+    }
+    // Seek index, written next to a single Q1 file
+    if (index_level >= 0 && (!c || format != 1 || memory || variants || strlen(batch_input))) {
+        fprintf(stderr, "--index encodes a single image (-c) at Q1 format, without -m, -b or --alphas.\n");
+        return EXIT_FAILURE;
+    }
+    // Region of interest, only the subtrees intersecting it are decoded
+    if (region && (!u || g || max_level >= 0 || strlen(batch_input))) {
+        fprintf(stderr, "--roi decodes a region (-u), without -g, -b or --max-level.\n");
+        return EXIT_FAILURE;
+    }
+    // Statistics of a single image
+    if (with_stats && (memory || variants || strlen(batch_input))) {
+        fprintf(stderr, "--stats works on a single image, without -m, -b or --alphas.\n");
+        return EXIT_FAILURE;
+    }
+    // Block list, written instead of the grid image
+    if (grid_list && !g) {
+        fprintf(stderr, "--grid-list lists the blocs of the segmentation grid, it needs -g.\n");
+        return EXIT_FAILURE;
+    }
+    // Sequence of frames, each one coded against the previous one
+    if (sequence && (!strlen(batch_input) || memory || max_level >= 0)) {
+        fprintf(stderr, "--sequence codes the files of a batch (-b), without -m or --max-level.\n");
+        return EXIT_FAILURE;
+    }
+    // Standard input and output, the files next to them need a name
+    int from_stdin = !strcmp(input_file, "-"), to_stdout = !strcmp(output_file, "-");
+    if ((to_stdout && (index_level >= 0 || variants || strlen(batch_input))) || (from_stdin && region)) {
+        fprintf(stderr, "-o - can't be used with --index, --alphas or -b, and -i - can't be used with --roi.\n");
+        return EXIT_FAILURE;
+    }
+    // Color image, one Quadtree per plane
+    int color = c && !from_stdin && strlen(input_file) && (check_file_extension(input_file, "ppm") || check_file_extension(input_file, "pam"));
+    if (color && (memory || g || target || target_psnr || variants || index_level >= 0 || with_stats)) {
+        fprintf(stderr, "A color image (.ppm or .pam) is encoded with -a, -f and -t only, without -m, -g, --index, --stats, --alphas or a target.\n");
+        return EXIT_FAILURE;
+    }
+    if (rct && (!color || alpha)) {
+        fprintf(stderr, "--rct codes the planes of a color image (-c with a .ppm or .pam input), without -a.\n");
+        return EXIT_FAILURE;
+    }
+    // Batch mode, the output is a directory
+    if (strlen(batch_input)) {
+        if (g) {
+            fprintf(stderr, "The segmentation grid can't be generated in batch mode.\n");
+            return EXIT_FAILURE;
+        }
+        BatchOptions options = {c, alpha, format, (size_t) (memory * 1024 * 1024), threads, v, max_level < 0 ? QUADTREE_MAX_LEVELS : max_level, sequence, comments};
+        size_t failed;
+        size_t done = run_batch(batch_input, strlen(output_file) ? output_file : (c ? "QTC" : "PGM"), &options, &failed);
+        return done && !failed ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
     // If no input file is provided
     if (strlen(input_file) == 0) {
         fprintf(stderr, "You did not provide an input file with -i.\n");
         return EXIT_FAILURE;
     }
     // If no output file is provided, use a default filename
-    if (strlen(output_file) == 0) snprintf(output_file, MAX_SIZE, "%s", c ? "QTC/out.qtc" : "PGM/out.pgm");
+    int default_output = strlen(output_file) == 0;
+    if (default_output) snprintf(output_file, MAX_SIZE, "%s", c ? "QTC/out.qtc" : "PGM/out.pgm");
     // If necessary, construct the filename for the segmentation grid
     if (g) {
-        const char * basename = output_file; // By default, if no '/'
-        const char * last_slash = strrchr(output_file, '/');
+        const char * basename = to_stdout ? "out" : output_file; // By default, if no '/'
+        const char * last_slash = strrchr(basename, '/');
         if (last_slash) {
             basename = last_slash + 1; // After the last '/'
         }
         snprintf(grid_file, sizeof(grid_file), "PGM/%s", basename);
-        // Add the "_g.pgm" suffix for the grid
+        // Add the "_g.pgm" suffix for the grid, "_g.qtcb" for the block list
         char * dot = strrchr(grid_file, '.'); // Locate the last extension
         if (dot) *dot = '\0'; // Replace the '.' with '\0' to remove the extension
-        strncat(grid_file, "_g.pgm", sizeof(grid_file) - strlen(grid_file) - 1);
+        strncat(grid_file, grid_list ? "_g.qtcb" : "_g.pgm", sizeof(grid_file) - strlen(grid_file) - 1);
     }
     // Encoding case
     if (c) {
+        // Color image: the planes are built, filtered and encoded concurrently, each one on its own thread
+        if (color) {
+            if (v) fprintf(messages, "Encoding color image %s started.\n", input_file);
+            ColorImage * image = read_ppm(input_file);
+            if (rct && image->planes < 3) {
+                fprintf(stderr, "--rct needs a red, a green and a blue plane.\n");
+                return EXIT_FAILURE;
+            }
+            int flags = rct ? QTC_PLANES_RCT : 0;
+            BitStream ** streams = encode_planes(image, alpha, format, flags, threads);
+            write_qtc_planes(output_file, streams, image->planes, flags, image->width, comments);
+            for (int p = 0; p < image->planes; p++) {
+                if (v) fprintf(messages, "Plane %d: %zu bytes at Q%d format.\n", p, (size_t) (streams[p]->ptr - streams[p]->start), streams[p]->format);
+                freeBitStream(streams[p]);
+            }
+            if (v && alpha) fprintf(messages, "Lossy compression applied with alpha = %.2f\n", alpha);
+            if (v) fprintf(messages, "Encoding completed with %d planes. File written: %s\n", image->planes, output_file);
+            free(streams);
+            free_color_image(image);
+            return EXIT_SUCCESS;
+        }
         // Validate the file extension
-        if (!check_file_extension(input_file, "pgm")) {
-            fprintf(stderr, "Input file must be in PGM format.\nCheck the file extension provided to the -i option.\n");
+        if (!from_stdin && !check_file_extension(input_file, "pgm")) {
+            fprintf(stderr, "Input file must be in PGM, PPM or PAM format.\nCheck the file extension provided to the -i option.\n");
+            return EXIT_FAILURE;
+        }
+        if (v) fprintf(messages, "Encoding image %s started.\n", input_file);
+        // Streaming encoding, the image and the Quadtree are never loaded entirely
+        if (memory) {
+            if (g) {
+                fprintf(stderr, "The segmentation grid needs the whole Quadtree, it can't be generated with -m.\n");
+                return EXIT_FAILURE;
+            }
+            int split;
+            if (write_qtc_streaming(input_file, output_file, alpha, threads, (size_t) (memory * 1024 * 1024), comments, &split) != QTC_OK) {
+                return EXIT_FAILURE;
+            }
+            if (v && alpha) fprintf(messages, "Lossy compression applied with alpha = %.2f\n", alpha);
+            if (v) fprintf(messages, "Encoding completed with %d chunks. File written: %s\n", 1 << (2 * split), output_file);
+            return EXIT_SUCCESS;
+        }
+        // Build the image and quadtree, the pixels are read in leaf order so the construction reads them linearly
+        double start = stats_clock();
+        Image * image = read_pgm_layout(input_file, IMAGE_LEAF_ORDER);
+        stats_stage(&stats, QTC_STAGE_READ, start);
+        // The Quadtree, the stream and the working arrays are the buffers of a context, which counts them in the statistics
+        QtcContext context;
+        init_context(&context);
+        context.stats = with_stats ? &stats : NULL;
+        start = stats_clock();
+        Quadtree * quadtree;
+        QtcStatus status = build_quadtree_in_context(image, threads, &context, &quadtree);
+        if (status != QTC_OK) {
+            fprintf(stderr, status == QTC_ERROR_ARGUMENT ? "Image must be square with a size power of 2.\n" : "Error while allocating memory for Quadtree construction.\n");
             return EXIT_FAILURE;
         }
-        if (v) fprintf(stdout, "Encoding image %s started.\n", input_file);
-        // Build the image and quadtree
-        Image * image = read_pgm(input_file);
-        Quadtree * quadtree = build_quadtree_from_image(image);
-        // If alpha is provided, apply quadtree filtering
+        stats_stage(&stats, QTC_STAGE_BUILD, start);
+        // Encode ladder: every variant is filtered on its own copy of the epsilon and uniformity planes
+        if (variants) {
+            BitStream ** streams;
+            status = encode_ladder(quadtree, alphas, variants, format, threads, &streams);
+            if (status != QTC_OK) {
+                fprintf(stderr, status == QTC_ERROR_MEMORY ? "Error while allocating memory for the encode ladder.\n" : "Error while encoding the encode ladder.\n");
+                return EXIT_FAILURE;
+            }
+            for (int i = 0; i < variants; i++) {
+                char variant[MAX_SIZE + 32];
+                variant_filename(variant, sizeof(variant), output_file, alphas[i]);
+                write_qtc(variant, streams[i], quadtree, comments);
+                if (v) fprintf(messages, "Variant alpha = %g written: %s\n", alphas[i], variant);
+                freeBitStream(streams[i]);
+            }
+            free(streams);
+            free_image(image);
+            release_context(&context);
+            return EXIT_SUCCESS;
+        }
+        // Rate control: alpha giving the best image within the budget
+        if (target) {
+            size_t budget = target_bytes ? (size_t) target_bytes : (size_t) (target_bpp * image->image_size / 8);
+            UniformThresholds thresholds;
+            if (compute_uniform_thresholds(quadtree, &thresholds) != QTC_OK) {
+                fprintf(stderr, "Error while allocating memory for the rate control.\n");
+                return EXIT_FAILURE;
+            }
+            size_t predicted;
+            if (!alpha_for_target_size(quadtree, &thresholds, budget, format, &alpha, &predicted)) {
+                fprintf(stderr, "Target size of %zu bytes can't be reached, smallest size is %zu bytes.\n", budget, predicted);
+            }
+            if (v) fprintf(messages, "Target size %zu bytes: alpha = %.17g, predicted size %zu bytes.\n", budget, alpha, predicted);
+            free_uniform_thresholds(&thresholds);
+        }
+        // Quality control: largest alpha whose decoded image meets the PSNR
+        if (target_psnr) {
+            UniformThresholds thresholds;
+            if (compute_uniform_thresholds(quadtree, &thresholds) != QTC_OK || compute_uniform_errors(quadtree, &thresholds) != QTC_OK) {
+                fprintf(stderr, "Error while allocating memory for the rate control.\n");
+                return EXIT_FAILURE;
+            }
+            uint64_t predicted;
+            alpha_for_target_psnr(quadtree, &thresholds, target_psnr, &alpha, &predicted);
+            if (v) fprintf(messages, "Target PSNR %.2f dB: alpha = %.17g, predicted PSNR %.2f dB.\n", target_psnr, alpha,
+                           psnr_of_error(predicted, (uint64_t) 1 << (2 * quadtree->levels)));
+            free_uniform_thresholds(&thresholds);
+        }
+        // If alpha is provided, apply quadtree filtering, the error of the decoded image comes with it
         if (alpha) {
-            filtrage(quadtree, quadtree->nodes, 0, quadtree->medvar / quadtree->maxvar, alpha);
-            if (v) fprintf(stdout, "Lossy compression applied with alpha = %.2f\n", alpha);
-        }
-        // Generate the segmentation grid
-        if (g) handle_segmentation_grid(grid_file, quadtree, v);
-        // Encode the quadtree
-        BitStream * stream = encode(quadtree);
-        write_qtc(output_file, stream, quadtree);
-        if (v) fprintf(stdout, "Encoding completed. File written: %s\n", output_file);
+            uint64_t uniform = with_stats ? count_uniform_nodes(quadtree) : 0;
+            BlocError error;
+            start = stats_clock();
+            filtrage_error(quadtree, 0, 0, quadtree->medvar / quadtree->maxvar, alpha, &error);
+            stats_stage(&stats, QTC_STAGE_FILTER, start);
+            stats.squared_error = error.error;
+            stats.pixels = (uint64_t) 1 << (2 * quadtree->levels);
+            if (with_stats) stats.uniformized = count_uniform_nodes(quadtree) - uniform;
+            if (v) fprintf(messages, "Lossy compression applied with alpha = %.2f (MSE %.4f, PSNR %.2f dB)\n", alpha,
+                           (double) stats.squared_error / (double) stats.pixels, psnr_of_error(stats.squared_error, stats.pixels));
+        }
+        // Encode the quadtree, the segmentation grid is filled as the nodes are written
+        BitStream payload;
+        BitStream * stream = &payload;
+        size_t bound = encoded_size_bound(quadtree->levels);
+        unsigned char * buffer = (unsigned char *) scratch_reserve(&context.stream, bound);
+        if (!buffer) {
+            fprintf(stderr, "Error while allocating memory for the encoded stream.\n");
+            return EXIT_FAILURE;
+        }
+        initBitStreamOver(stream, buffer, bound);
+        SegmentationGrid grid;
+        if (g) init_grid(&grid, image->width, grid_list);
+        start = stats_clock();
+        status = encode_grid_to_stream(stream, quadtree, format, &context, g ? &grid : NULL);
+        stats_stage(&stats, QTC_STAGE_ENCODE, start);
+        if (status == QTC_ERROR_MEMORY) {
+            fprintf(stderr, "Error while allocating memory for the encoding.\n");
+            return EXIT_FAILURE;
+        } else if (status != QTC_OK) {
+            fprintf(stderr, "Erreur lors de l'écriture des bits\n");
+            return EXIT_FAILURE;
+        }
+        if (g) handle_segmentation_grid(grid_file, &grid, image->width, v, comments, NULL);
+        start = stats_clock();
+        write_qtc(output_file, stream, quadtree, comments);
+        stats_stage(&stats, QTC_STAGE_WRITE, start);
+        if (v) fprintf(messages, "Encoding completed. File written: %s\n", output_file);
+        // Seek index of the subtrees of a level
+        if (index_level >= 0) {
+            QtcIndex index;
+            char index_file[MAX_SIZE + 1];
+            snprintf(index_file, sizeof(index_file), "%si", output_file);
+            if (build_qtc_index(quadtree, index_level, &index) != QTC_OK) {
+                fprintf(stderr, "Error while allocating memory for the index.\n");
+                return EXIT_FAILURE;
+            }
+            write_qtc_index(index_file, &index);
+            if (v) fprintf(messages, "Index of the subtrees of level %d written: %s\n", index.level, index_file);
+            free_qtc_index(&index);
+        }
+        if (with_stats) print_context_stats(&stats, stream, &context);
         free_image(image);
-        free_quadtree(quadtree);
-        freeBitStream(stream);
+        release_context(&context);
     }
     // Decoding case
     if (u) {
         // Validate the file extension
-        if (!check_file_extension(input_file, "qtc")) {
+        if (!from_stdin && !check_file_extension(input_file, "qtc")) {
             fprintf(stderr, "Input file must be in QTC format.\nCheck the file extension provided to the -o option.\n");
             return EXIT_FAILURE;
         }
-        if (v) fprintf(stdout, "Decoding file %s started.\n", input_file);
+        if (v) fprintf(messages, "Decoding file %s started.\n", input_file);
         // Decode the quadtree
-        BitStream * stream = read_qtc(input_file);
-        Quadtree * quadtree = decode(stream);
-        Image * image = build_image_from_quadtree(quadtree);
-        write_pgm(output_file, image);
-        if (g) handle_segmentation_grid(grid_file, quadtree, v);
-        if (v) fprintf(stdout, "Decoding completed. File written: %s\n", output_file);
-        // Generate the segmentation grid
+        double start = stats_clock();
+        // The compression date of the file goes in the comments of the decoded image
+        char date[QTC_DATE_COMMENT_SIZE];
+        BitStream * stream = read_qtc(input_file, date);
+        stats_stage(&stats, QTC_STAGE_READ, start);
+        if (stream->format == 4) {
+            fprintf(stderr, "%s is a delta frame, it is decoded with the previous frames of its sequence (-b with --sequence).\n", input_file);
+            return EXIT_FAILURE;
+        }
+        // Multi-plane file, the planes are decoded concurrently into the interleaved pixels
+        if (stream->format == 5) {
+            if (g || region || max_level >= 0 || with_stats) {
+                fprintf(stderr, "A Q5 file is decoded whole, without -g, --roi, --max-level or --stats.\n");
+                return EXIT_FAILURE;
+            }
+            ColorImage * image = decode_planes(stream, threads);
+            if (default_output) snprintf(output_file, MAX_SIZE, "PGM/out.%s", image->planes == 3 ? "ppm" : "pam");
+            write_ppm(output_file, image, comments, date);
+            if (v) fprintf(messages, "Decoding of %d planes completed. File written: %s\n", image->planes, output_file);
+            free_color_image(image);
+            freeBitStream(stream);
+            return EXIT_SUCCESS;
+        }
+        // The pixels and the working arrays are the buffers of a context, which counts them in the statistics
+        QtcContext context;
+        init_context(&context);
+        context.stats = with_stats ? &stats : NULL;
+        // Region of interest, written as a w x h image
+        if (region) {
+            QtcIndex index = {0};
+            if (stream->format == 1) {
+                char index_file[MAX_SIZE + 1];
+                snprintf(index_file, sizeof(index_file), "%si", input_file);
+                read_qtc_index(index_file, &index);
+            }
+            unsigned char * pixels = (unsigned char *) scratch_reserve(&context.pixels, (size_t) roi[2] * roi[3]);
+            check_decode_status(stream, pixels ? QTC_OK : QTC_ERROR_MEMORY, 1);
+            start = stats_clock();
+            check_decode_status(stream, decode_region_into(stream, stream->format == 1 ? &index : NULL, roi[0], roi[1], roi[2], roi[3], pixels, &context), 1);
+            stats_stage(&stats, QTC_STAGE_DECODE, start);
+            start = stats_clock();
+            write_pgm_pixels(output_file, pixels, roi[2], roi[3], 255, comments, date);
+            stats_stage(&stats, QTC_STAGE_WRITE, start);
+            if (with_stats) print_context_stats(&stats, stream, &context);
+            if (v) fprintf(messages, "Region %dx%d at (%d, %d) decoded. File written: %s\n", roi[2], roi[3], roi[0], roi[1], output_file);
+            release_context(&context);
+            free_qtc_index(&index);
+            freeBitStream(stream);
+            return EXIT_SUCCESS;
+        }
+        int width;
+        if (decoded_image_width(stream, &width) != QTC_OK) {
+            fprintf(stderr, "Unsupported Quadtree levels.\n");
+            return EXIT_FAILURE;
+        }
+        // A thumbnail is as wide as the nodes of --max-level, the segmentation grid is filled as the blocs are decoded
+        int image_width = max_level >= 0 && max_level < QUADTREE_MAX_LEVELS && width > (1 << max_level) ? 1 << max_level : width;
+        Image * image = context_image(&context, image_width, 0);
+        check_decode_status(stream, image ? QTC_OK : QTC_ERROR_MEMORY, 0);
+        SegmentationGrid grid;
+        if (g) init_grid(&grid, width, grid_list);
+        start = stats_clock();
+        check_decode_status(stream, decode_image_grid_into(stream, image, g ? &grid : NULL, threads, &context), 0);
+        stats_stage(&stats, QTC_STAGE_DECODE, start);
+        if (g) handle_segmentation_grid(grid_file, &grid, width, v, comments, date);
+        start = stats_clock();
+        write_pgm(output_file, image, comments, date);
+        stats_stage(&stats, QTC_STAGE_WRITE, start);
+        if (with_stats) print_context_stats(&stats, stream, &context);
+        if (v) fprintf(messages, "Decoding completed. File written: %s\n", output_file);
         freeBitStream(stream);
-        free_quadtree(quadtree);
-        free_image(image);
+        release_context(&context);
     } 
     return EXIT_SUCCESS;
 }
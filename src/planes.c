@@ -0,0 +1,353 @@
+/**
+ * @file planes.c
+ * @brief Implementation of the multi-plane images (RGB and alpha).
+ *
+ * Every plane of an image gets its own Quadtree, built, filtered and encoded on a thread of its own
+ * with its own context, so the planes never share a buffer. The Q5 payload is a head (number of planes,
+ * flags, then the format byte and the 64-bit size of each plane) followed by the Q1, Q2 or Q3 payload
+ * of each plane. The decoder rebuilds the planes concurrently into the interleaved pixels.
+ *
+ * With QTC_PLANES_RCT, the red and blue planes are coded as differences with the green one, offset
+ * by 128 and taken mod 256: the transform is exactly reversible, the gray areas give flat planes.
+ */
+
+#include "planes.h"
+
+#define PLANES_BAND (1 << 16) // Samples of a plane gathered at a time before they are put in leaf order
+
+/**
+ * @struct PlaneTask
+ * @brief Work of the thread of one plane.
+ */
+typedef struct {
+    ColorImage * image;     // Source (encoding) or destination (decoding) of the samples
+    int plane;              // Index of the plane in a pixel
+    int flags;              // Flags of the payload (QTC_PLANES_RCT)
+    double alpha;           // Filtering parameter (encoding only)
+    int format;             // Format of the plane payload (encoding only)
+    int threads;            // Threads used to build or decode the Quadtree of the plane
+    BitStream * stream;     // Payload of the plane, written (encoding) or read (decoding)
+    QtcStatus status;       // Status of the work
+    int started;            // Set if the work got a thread of its own
+} PlaneTask;
+
+/**
+ * @struct PlanesLayout
+ * @brief Head of a Q5 payload and read-only BitStreams over its planes.
+ */
+typedef struct {
+    int planes;                             // Number of planes
+    int flags;                              // Flags of the payload
+    int width;                              // Width (and height) of every plane
+    BitStream payloads[QTC_MAX_PLANES];     // Payload of each plane, with its format
+} PlanesLayout;
+
+/**
+ * @brief Size of the head of a Q5 payload, before the planes.
+ *
+ * @param planes Number of planes.
+ * @return Size in bytes.
+ */
+size_t planes_head_size(int planes) {
+    return 2 + 9 * (size_t) planes;
+}
+
+/**
+ * @brief Runs the task of every plane, the calling thread takes the first one and the ones whose thread can't be created.
+ *
+ * @param tasks Tasks of the planes.
+ * @param planes Number of planes.
+ * @param run Work of a task.
+ */
+static void run_plane_tasks(PlaneTask * tasks, int planes, void * (* run)(void *)) {
+    pthread_t workers[QTC_MAX_PLANES];
+    for (int p = 1; p < planes; p++) {
+        tasks[p].started = !pthread_create(&workers[p], NULL, run, &tasks[p]);
+    }
+    run(&tasks[0]);
+    for (int p = 1; p < planes; p++) {
+        if (tasks[p].started) {
+            pthread_join(workers[p], NULL);
+        } else {
+            run(&tasks[p]);
+        }
+    }
+}
+
+/**
+ * @brief Threads of a plane: the threads are shared between the planes, the first ones get the remainder.
+ *
+ * @param threads Number of threads.
+ * @param planes Number of planes.
+ * @param plane Index of the plane.
+ * @return Number of threads of the plane, at least 1.
+ */
+static int plane_threads(int threads, int planes, int plane) {
+    int share = threads / planes + (plane < threads % planes);
+    return share < 1 ? 1 : share;
+}
+
+/**
+ * @brief Copies a plane of the interleaved samples into an Image in leaf order, applying the color transform.
+ *
+ * The samples are gathered by bands of rows (a multiple of 4, as read_pgm_layout() does), each band is put
+ * in leaf order while it is still in cache, so the Quadtree is built reading its leaves linearly.
+ *
+ * @param image Interleaved image.
+ * @param plane Index of the plane.
+ * @param flags Flags of the payload.
+ * @param leaves Image of the plane on output, set to IMAGE_LEAF_ORDER.
+ * @return QTC_OK, or QTC_ERROR_MEMORY if the band can't be allocated.
+ */
+static QtcStatus extract_plane(const ColorImage * image, int plane, int flags, Image * leaves) {
+    int width = image->width, planes = image->planes;
+    int rows = PLANES_BAND / width < 4 ? 4 : PLANES_BAND / width;
+    if (rows > width) rows = width;
+    unsigned char * band = (unsigned char *) malloc((size_t) rows * width);
+    if (!band) return QTC_ERROR_MEMORY;
+    int difference = (flags & QTC_PLANES_RCT) && (plane == 0 || plane == 2);
+    for (int y = 0; y < width; y += rows) {
+        size_t size = (size_t) rows * width;
+        const unsigned char * src = image->pixels + (size_t) y * width * planes;
+        if (difference) {
+            for (size_t i = 0; i < size; i++) band[i] = (unsigned char) (src[i * planes + plane] - src[i * planes + 1] + 128);
+        } else {
+            for (size_t i = 0; i < size; i++) band[i] = src[i * planes + plane];
+        }
+        raster_to_leaf_order(band, leaves->image, width, y, rows);
+    }
+    free(band);
+    leaves->layout = IMAGE_LEAF_ORDER;
+    return QTC_OK;
+}
+
+/**
+ * @brief Builds, filters and encodes a plane (thread of the encoder).
+ *
+ * @param arg Pointer to the PlaneTask, whose stream and status are set.
+ * @return NULL.
+ */
+static void * encode_plane(void * arg) {
+    PlaneTask * task = (PlaneTask *) arg;
+    QtcContext context;
+    init_context(&context);
+    Image * pixels = context_image(&context, task->image->width, 0);
+    Quadtree * quadtree = NULL;
+    task->status = pixels ? QTC_OK : QTC_ERROR_MEMORY;
+    if (task->status == QTC_OK) task->status = extract_plane(task->image, task->plane, task->flags, pixels);
+    if (task->status == QTC_OK) task->status = build_quadtree_in_context(pixels, task->threads, &context, &quadtree);
+    if (task->status == QTC_OK) {
+        if (task->alpha) filtrage(quadtree, 0, 0, quadtree->medvar / quadtree->maxvar, task->alpha);
+        task->stream = initBitStream(encoded_size_bound(quadtree->levels));
+        task->status = encode_to_stream(task->stream, quadtree, task->format, &context);
+    }
+    release_context(&context);
+    return NULL;
+}
+
+/**
+ * @brief Builds, filters and encodes every plane of an image on a thread of its own.
+ *
+ * Each thread extracts its plane from the interleaved samples, so the image is only read.
+ *
+ * @param image Image to encode (square, with a size power of 2).
+ * @param alpha Filtering parameter of every plane, 0 for a lossless compression.
+ * @param format 1 for Q1, 2 for Q2, 3 for Q3.
+ * @param flags QTC_PLANES_RCT to code the red and blue planes as differences with the green one (3 planes at least, exact without filtering), 0 otherwise.
+ * @param threads Number of threads, shared between the planes.
+ * @return Array of `image->planes` BitStreams, one payload per plane (each one and the array to free).
+ */
+BitStream ** encode_planes(const ColorImage * image, double alpha, int format, int flags, int threads) {
+    int planes = image->planes;
+    if (planes < 1 || planes > QTC_MAX_PLANES || ((flags & QTC_PLANES_RCT) && planes < 3)) {
+        fprintf(stderr, "Unsupported number of planes.\n");
+        exit(EXIT_FAILURE);
+    }
+    BitStream ** streams = (BitStream **) calloc(planes, sizeof(BitStream *));
+    if (!streams) {
+        fprintf(stderr, "Error while allocating memory for the planes.\n");
+        exit(EXIT_FAILURE);
+    }
+    PlaneTask tasks[QTC_MAX_PLANES];
+    for (int p = 0; p < planes; p++) {
+        tasks[p] = (PlaneTask) {(ColorImage *) image, p, flags, alpha, format, plane_threads(threads, planes, p), NULL, QTC_OK, 0};
+    }
+    run_plane_tasks(tasks, planes, encode_plane);
+    for (int p = 0; p < planes; p++) {
+        if (tasks[p].status == QTC_ERROR_ARGUMENT) {
+            fprintf(stderr, "Image must be square with a size power of 2.\n");
+            exit(EXIT_FAILURE);
+        } else if (tasks[p].status != QTC_OK) {
+            fprintf(stderr, "Error while encoding plane %d.\n", p);
+            exit(EXIT_FAILURE);
+        }
+        streams[p] = tasks[p].stream;
+    }
+    return streams;
+}
+
+/**
+ * @brief Writes the head of a Q5 payload.
+ *
+ * Number of planes and flags on 8 bits, then for each plane its format on 8 bits and the size
+ * of its payload on 64 bits.
+ *
+ * @param head BitStream to write to, at least planes_head_size() bytes.
+ * @param streams Payloads of the planes, as given by encode_planes().
+ * @param planes Number of planes.
+ * @param flags Flags given to encode_planes().
+ * @return QTC_OK, or QTC_ERROR_BUFFER if the BitStream is full.
+ */
+QtcStatus write_planes_head(BitStream * head, BitStream ** streams, int planes, int flags) {
+    head->format = 5;
+    try_push_n_bits64(head, planes, 8);
+    try_push_n_bits64(head, flags, 8);
+    for (int p = 0; p < planes; p++) {
+        uint64_t size = streams[p]->ptr - streams[p]->start;
+        try_push_n_bits64(head, streams[p]->format, 8);
+        try_push_n_bits64(head, size >> 32, 32);
+        try_push_n_bits64(head, size & 0xFFFFFFFF, 32);
+    }
+    finishBitStream(head);
+    return head->error ? QTC_ERROR_BUFFER : QTC_OK;
+}
+
+/**
+ * @brief Reads the head of a Q5 payload and sets a read-only BitStream over each plane.
+ *
+ * A BitStream still being received is read to its end first.
+ *
+ * @param stream BitStream holding a Q5 payload.
+ * @param layout Head and planes on output.
+ * @return QTC_OK, or QTC_ERROR_CORRUPT if the head or a plane is invalid.
+ */
+static QtcStatus open_planes(BitStream * stream, PlanesLayout * layout) {
+    fill_bitstream(stream, SIZE_MAX);
+    size_t size = stream->ptr - stream->start;
+    BitStream head;
+    initReadBitStreamOver(&head, stream->start, size);
+    int planes = try_read_n_bits64(&head, 8);
+    int flags = try_read_n_bits64(&head, 8);
+    if (head.error || planes < 1 || planes > QTC_MAX_PLANES || (flags & ~QTC_PLANES_RCT) || ((flags & QTC_PLANES_RCT) && planes < 3)) {
+        return QTC_ERROR_CORRUPT;
+    }
+    layout->planes = planes;
+    layout->flags = flags;
+    size_t offset = planes_head_size(planes);
+    for (int p = 0; p < planes; p++) {
+        int format = try_read_n_bits64(&head, 8);
+        uint64_t bytes = try_read_n_bits64(&head, 32) << 32;
+        bytes |= try_read_n_bits64(&head, 32);
+        if (head.error || format < 1 || format > 3 || offset > size || bytes > size - offset) return QTC_ERROR_CORRUPT;
+        BitStream * payload = &layout->payloads[p];
+        initReadBitStreamOver(payload, stream->start + offset, bytes);
+        payload->format = format;
+        offset += bytes;
+        int width;
+        if (decoded_image_width(payload, &width) != QTC_OK || (p && width != layout->width)) return QTC_ERROR_CORRUPT;
+        layout->width = width;
+    }
+    return QTC_OK;
+}
+
+/**
+ * @brief Reads the size of the image encoded in a Q5 BitStream.
+ *
+ * @param stream BitStream holding a Q5 payload.
+ * @param width Width (and height) of the image on output.
+ * @param planes Number of planes on output.
+ * @return QTC_OK, or QTC_ERROR_CORRUPT if the head or a plane is invalid.
+ */
+QtcStatus decoded_planes_size(BitStream * stream, int * width, int * planes) {
+    PlanesLayout layout;
+    QtcStatus status = open_planes(stream, &layout);
+    if (status != QTC_OK) return status;
+    *width = layout.width;
+    *planes = layout.planes;
+    return QTC_OK;
+}
+
+/**
+ * @brief Decodes a plane and copies it into the interleaved samples (thread of the decoder).
+ *
+ * @param arg Pointer to the PlaneTask, whose status is set.
+ * @return NULL.
+ */
+static void * decode_plane(void * arg) {
+    PlaneTask * task = (PlaneTask *) arg;
+    ColorImage * image = task->image;
+    QtcContext context;
+    init_context(&context);
+    Image * pixels = context_image(&context, image->width, 0);
+    task->status = pixels ? decode_image_into(task->stream, pixels, task->threads, &context) : QTC_ERROR_MEMORY;
+    if (task->status == QTC_OK) {
+        int planes = image->planes;
+        unsigned char * dst = image->pixels + task->plane;
+        for (size_t i = 0; i < pixels->image_size; i++) dst[i * planes] = pixels->image[i];
+    }
+    release_context(&context);
+    return NULL;
+}
+
+/**
+ * @brief Decodes the planes of a Q5 BitStream concurrently into an interleaved image, without exiting on errors.
+ *
+ * Each thread decodes its plane with its own context and writes its samples of every pixel,
+ * the color transform is undone once all the planes are there.
+ *
+ * @param stream BitStream holding a Q5 payload (only read).
+ * @param image Image to fill, of the width and planes given by decoded_planes_size().
+ * @param threads Number of threads, shared between the planes.
+ * @return QTC_OK, QTC_ERROR_ARGUMENT if the image doesn't have the size of the stream, QTC_ERROR_CORRUPT or QTC_ERROR_MEMORY.
+ */
+QtcStatus decode_planes_into(BitStream * stream, ColorImage * image, int threads) {
+    PlanesLayout layout;
+    QtcStatus status = open_planes(stream, &layout);
+    if (status != QTC_OK) return status;
+    if (image->width != layout.width || image->planes != layout.planes) return QTC_ERROR_ARGUMENT;
+    int planes = layout.planes;
+    PlaneTask tasks[QTC_MAX_PLANES];
+    for (int p = 0; p < planes; p++) {
+        tasks[p] = (PlaneTask) {image, p, layout.flags, 0., layout.payloads[p].format, plane_threads(threads, planes, p), &layout.payloads[p], QTC_OK, 0};
+    }
+    run_plane_tasks(tasks, planes, decode_plane);
+    for (int p = 0; p < planes; p++) {
+        if (tasks[p].status != QTC_OK) return tasks[p].status;
+    }
+    if (layout.flags & QTC_PLANES_RCT) {
+        size_t size = (size_t) image->width * image->width;
+        for (size_t i = 0; i < size; i++) {
+            unsigned char * pixel = image->pixels + i * planes;
+            pixel[0] = (unsigned char) (pixel[0] + pixel[1] - 128);
+            pixel[2] = (unsigned char) (pixel[2] + pixel[1] - 128);
+        }
+    }
+    return QTC_OK;
+}
+
+/**
+ * @brief Decodes the planes of a Q5 BitStream concurrently into a new interleaved image.
+ *
+ * @see decode_planes_into()
+ *
+ * @param stream BitStream holding a Q5 payload.
+ * @param threads Number of threads, shared between the planes.
+ * @return Pointer to the decoded ColorImage.
+ */
+ColorImage * decode_planes(BitStream * stream, int threads) {
+    int width, planes;
+    if (decoded_planes_size(stream, &width, &planes) != QTC_OK) {
+        fprintf(stderr, "Invalid Q5 file.\n");
+        exit(EXIT_FAILURE);
+    }
+    ColorImage * image = allocate_color_image(width, planes, 255);
+    QtcStatus status = decode_planes_into(stream, image, threads);
+    if (status == QTC_ERROR_MEMORY) {
+        fprintf(stderr, "Error while allocating memory for decoding.\n");
+        exit(EXIT_FAILURE);
+    } else if (status != QTC_OK) {
+        fprintf(stderr, "Invalid Q5 file.\n");
+        exit(EXIT_FAILURE);
+    }
+    return image;
+}
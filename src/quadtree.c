@@ -3,72 +3,258 @@
  * @brief Quadtree implementation.
  */
 #include "quadtree.h"
+#include <string.h>
 
 /**
- * @brief Memory allocation for Quadtree nodes.
+ * @brief Rounds a size up to a multiple of 16 bytes.
  * 
- * Allocates memory for Quadtree nodes and handles errors.
+ * Keeps every level array aligned inside the single allocation.
  * 
- * @param total_nodes Quadtree nodes number.
+ * @param size Size in bytes.
+ */
+static size_t align16(size_t size) {
+    return (size + 15) & ~(size_t) 15;
+}
+
+/**
+ * @brief Checks if the nodes of the given level are leaves or not.
+ * 
+ * Checks if the nodes of the given level are leaves or not.
  * 
- * @note Exits program with an error message if memory allocation fails.
+ * @param quadtree Current quadtree.
+ * @param level Level of the nodes we want to check. 
  */
-static Node* allocate_nodes(int total_nodes) {
-    Node *nodes = (Node*) malloc(total_nodes * sizeof(Node));
-    if (!nodes) {
-        fprintf(stderr, "Error while allocating memory for Quadtree nodes.\n");
-        exit(EXIT_FAILURE);
+int is_leaf(Quadtree * quadtree, int level) {
+    return level == quadtree->levels;
+}
+
+/**
+ * @brief Gives the decoded values to the nodes below a uniform node: its `moyenne`, `epsilon` 0 and `u` 1.
+ * 
+ * Each level below is filled with a few memset() calls, so a large uniform bloc costs about its size in bytes.
+ * 
+ * @param quadtree Decoded Quadtree, its leaves in raster order or stored.
+ * @param level Level of the uniform node.
+ * @param j Index of the uniform node in its level.
+ */
+void fill_uniform_subtree(Quadtree * quadtree, int level, int64_t j) {
+    int levels = quadtree->levels;
+    unsigned char moyenne = get_moyenne(quadtree, level, j);
+    for (int l = level + 1; l <= levels; l++) {
+        int depth = l - level;
+        size_t first = (size_t) j << (2 * depth), count = (size_t) 1 << (2 * depth);
+        if (l == levels && quadtree->pixels) {
+            // Bloc of the raster
+            uint32_t x, y;
+            node_coordinates(j, &x, &y);
+            size_t side = (size_t) 1 << depth;
+            for (size_t row = 0; row < side; row++) {
+                memset(quadtree->pixels + ((y * side + row) << levels) + x * side, moyenne, side);
+            }
+            continue;
+        }
+        memset(quadtree->moyennes[l] + first, moyenne, count);
+        if (l == levels) continue;
+        memset(quadtree->epsilons[l] + first / 4, 0, count / 4);
+        if (count >= 8) {
+            memset(quadtree->uniforms[l] + first / 8, 0xFF, count / 8);
+        } else {
+            for (size_t k = 0; k < count; k++) set_u(quadtree, l, first + k, 1);
+        }
     }
-    return nodes;
 }
 
 /**
- * @brief Memory allocation for Quadtree structure.
+ * @brief Returns the size of the level arrays of a Quadtree, with or without its leaf level.
+ * 
+ * The means of every level, then the packed epsilon and uniformity planes and the optional
+ * variance plane of the non-leaf levels, each array starting on 16 bytes.
+ * 
+ * @param levels Quadtree levels (at most QUADTREE_MAX_LEVELS).
+ * @param with_variance Counts the variance plane if not 0.
+ * @param with_leaves Counts the means of the leaf level if not 0.
+ * @return Size in bytes.
+ */
+static size_t levels_memory_size(int levels, int with_variance, int with_leaves) {
+    size_t memory_size = 0;
+    for (int i = 0; i <= levels; i++) {
+        if (i < levels || with_leaves) memory_size += align16(nodes_in_level(i));
+        if (i < levels) {
+            memory_size += align16((nodes_in_level(i) + 3) / 4) + align16((nodes_in_level(i) + 7) / 8);
+            if (with_variance) memory_size += align16(nodes_in_level(i) * sizeof(float));
+        }
+    }
+    return memory_size;
+}
+
+/**
+ * @brief Lays out the level arrays of an empty Quadtree over a memory block.
+ * 
+ * @param quadtree Quadtree to initialize.
+ * @param memory 16 bytes aligned memory of at least levels_memory_size() bytes.
+ * @param levels Quadtree levels (at most QUADTREE_MAX_LEVELS).
+ * @param with_variance Uses a variance plane if not 0.
+ * @param pixels Pixels of the leaf level, NULL to store the leaves in `moyennes`.
+ */
+static void init_levels(Quadtree * quadtree, void * memory, int levels, int with_variance, unsigned char * pixels) {
+    memset(quadtree, 0, sizeof(Quadtree));
+    quadtree->memory = memory;
+    quadtree->pixels = pixels;
+    unsigned char * next = memory;
+    for (int i = 0; i <= levels; i++) {
+        if (i < levels || !pixels) {
+            quadtree->moyennes[i] = next;
+            next += align16(nodes_in_level(i));
+        }
+        quadtree->total_nodes += nodes_in_level(i); // 4^i
+    }
+    for (int i = 0; i < levels; i++) {
+        quadtree->epsilons[i] = next;
+        next += align16((nodes_in_level(i) + 3) / 4);
+        quadtree->uniforms[i] = next;
+        next += align16((nodes_in_level(i) + 7) / 8);
+        if (with_variance) {
+            quadtree->variances[i] = (float *) next;
+            next += align16(nodes_in_level(i) * sizeof(float));
+        }
+    }
+    quadtree->levels = levels;
+    quadtree->medvar = 0.;
+    quadtree->maxvar = 0.;
+}
+
+/**
+ * @brief Returns the size of the level arrays of a Quadtree.
+ * 
+ * @param levels Quadtree levels (at most QUADTREE_MAX_LEVELS).
+ * @param with_variance Counts the variance plane if not 0.
+ * @return Size in bytes.
+ */
+size_t quadtree_memory_size(int levels, int with_variance) {
+    return levels_memory_size(levels, with_variance, 1);
+}
+
+/**
+ * @brief Returns the size of the level arrays of a Quadtree whose leaf level is an image.
+ * 
+ * About a quarter of quadtree_memory_size() without variances: the leaves are 3/4 of the nodes.
+ * 
+ * @param levels Quadtree levels (at most QUADTREE_MAX_LEVELS).
+ * @param with_variance Counts the variance plane if not 0.
+ * @return Size in bytes.
+ */
+size_t quadtree_memory_size_over_pixels(int levels, int with_variance) {
+    return levels_memory_size(levels, with_variance, !levels);
+}
+
+/**
+ * @brief Initializes an empty Quadtree over level arrays owned by the caller.
+ * 
+ * @param quadtree Quadtree to initialize.
+ * @param memory 16 bytes aligned memory of at least quadtree_memory_size() bytes.
+ * @param levels Quadtree levels (at most QUADTREE_MAX_LEVELS).
+ * @param with_variance Uses a variance plane if not 0.
+ */
+void init_quadtree_over(Quadtree * quadtree, void * memory, int levels, int with_variance) {
+    init_levels(quadtree, memory, levels, with_variance, NULL);
+}
+
+/**
+ * @brief Initializes an empty Quadtree whose leaf level is the pixels of an image.
  * 
- * Allocates memory for Quadtree structure and handles errors.
+ * Leaf j is the pixel at leaf_offset(levels, j), no copy of the image is made. The root of a single
+ * pixel Quadtree is its only leaf, it is still stored in `moyennes` so the root is always there.
  * 
- * @note Exits program with an error message if memory allocation fails.
+ * @param quadtree Quadtree to initialize.
+ * @param memory 16 bytes aligned memory of at least quadtree_memory_size_over_pixels() bytes.
+ * @param levels Quadtree levels (at most QUADTREE_MAX_LEVELS).
+ * @param with_variance Uses a variance plane if not 0.
+ * @param pixels 2^levels x 2^levels pixels in raster order, they must outlive the Quadtree.
  */
-static Quadtree* allocate_quadtree() {
+void init_quadtree_over_pixels(Quadtree * quadtree, void * memory, int levels, int with_variance, unsigned char * pixels) {
+    init_levels(quadtree, memory, levels, with_variance, levels ? pixels : NULL);
+}
+
+/**
+ * @brief Creates and initializes an empty Quadtree, without exiting on errors.
+ * 
+ * Creates an empty Quadtree and initializes its values.
+ * All the level arrays live in a single allocation (see quadtree_memory_size()).
+ * 
+ * @param levels Quadtree levels.
+ * @param with_variance Allocates the variance plane if not 0 (only needed to encode).
+ * @return The Quadtree, NULL if levels is too large or memory allocation fails.
+ */
+Quadtree* try_create_empty_quadtree(int levels, int with_variance) {
+    if (levels < 0 || levels > QUADTREE_MAX_LEVELS) {
+        return NULL;
+    }
+    // Memory allocation 
     Quadtree *quadtree = (Quadtree*) malloc(sizeof(Quadtree));
     if (!quadtree) {
-        fprintf(stderr, "Error while allocating memory for Quadtree structure.\n");
-        exit(EXIT_FAILURE);
+        return NULL;
+    }
+    void * memory = aligned_alloc(16, quadtree_memory_size(levels, with_variance));
+    if (!memory) {
+        free(quadtree);
+        return NULL;
     }
+    init_quadtree_over(quadtree, memory, levels, with_variance);
     return quadtree;
 }
 
 /**
- * @brief Checks if the given node is a leaf or not.
+ * @brief Creates a view of a Quadtree with its own epsilon and uniformity planes.
  * 
- * Checks if the given node is a leaf or not.
+ * The means (and the pixels of the leaf level) and variances stay the ones of the Quadtree (they are only read by filtrage() and the encoders),
+ * the packed planes are copied in a single allocation so the view can be filtered without changing the Quadtree.
  * 
- * @param quadtree Current quadtree.
- * @param index Index of the node we want to check. 
+ * @param quadtree Quadtree to view, it must outlive the view.
+ * @return The view (freed with free_quadtree()), NULL if memory allocation fails.
  */
-int is_leaf(Quadtree * quadtree, int index) {
-    return index >= quadtree->total_nodes - (1 << (2 * quadtree->levels));
+Quadtree* try_create_quadtree_view(const Quadtree * quadtree) {
+    Quadtree * view = (Quadtree *) malloc(sizeof(Quadtree));
+    if (!view) return NULL;
+    *view = *quadtree;
+    size_t memory_size = 0;
+    for (int i = 0; i < quadtree->levels; i++) {
+        memory_size += align16((nodes_in_level(i) + 3) / 4) + align16((nodes_in_level(i) + 7) / 8);
+    }
+    view->memory = aligned_alloc(16, memory_size ? memory_size : 16);
+    if (!view->memory) {
+        free(view);
+        return NULL;
+    }
+    unsigned char * next = view->memory;
+    for (int i = 0; i < quadtree->levels; i++) {
+        view->epsilons[i] = memcpy(next, quadtree->epsilons[i], (nodes_in_level(i) + 3) / 4);
+        next += align16((nodes_in_level(i) + 3) / 4);
+        view->uniforms[i] = memcpy(next, quadtree->uniforms[i], (nodes_in_level(i) + 7) / 8);
+        next += align16((nodes_in_level(i) + 7) / 8);
+    }
+    return view;
 }
 
 /**
  * @brief Creates and initializes an empty Quadtree.
  * 
- * Creates an empty Quadtree and initializes its values.
+ * @see try_create_empty_quadtree()
  * 
  * @param levels Quadtree levels.
+ * @param with_variance Allocates the variance plane if not 0 (only needed to encode).
+ * 
+ * @note Exits program with an error message if levels is too large or memory allocation fails.
  */
-Quadtree* create_empty_quadtree(int levels) {
-    int total_nodes = 0;
-    for (int i = 0; i <= levels; i++) {
-        total_nodes += (1 << (2 * i)); // 4^i
+Quadtree* create_empty_quadtree(int levels, int with_variance) {
+    if (levels < 0 || levels > QUADTREE_MAX_LEVELS) {
+        fprintf(stderr, "Unsupported Quadtree levels: %d.\n", levels);
+        exit(EXIT_FAILURE);
+    }
+    Quadtree * quadtree = try_create_empty_quadtree(levels, with_variance);
+    if (!quadtree) {
+        fprintf(stderr, "Error while allocating memory for Quadtree nodes.\n");
+        exit(EXIT_FAILURE);
     }
-    // Memory allocation 
-    Quadtree *quadtree = allocate_quadtree();
-    quadtree->nodes = allocate_nodes(total_nodes);
-    quadtree->total_nodes = total_nodes;
-    quadtree->levels = levels;
-    quadtree->medvar = 0.;
-    quadtree->maxvar = 0.;
     return quadtree;
 }
 
@@ -80,6 +266,6 @@ Quadtree* create_empty_quadtree(int levels) {
  * @param quadtree Pointer to the Quadtree to be freed.
  */
 void free_quadtree(Quadtree *quadtree) {
-    free(quadtree->nodes);
+    free(quadtree->memory);
     free(quadtree);
-}
\ No newline at end of file
+}
@@ -0,0 +1,231 @@
+/**
+ * @file rans.c
+ * @brief Implementation of the interleaved rANS entropy coder.
+ *
+ * Byte-wise rANS with 32-bit states and 12-bit static frequencies. Consecutive symbols go to
+ * RANS_LANES independent states sharing one byte stream, so the decoder can work on several
+ * symbols at once instead of waiting on the state of the previous one.
+ * The encoder gets the symbols in reverse order and writes backward, so the decoder reads forward.
+ */
+
+#include "rans.h"
+#include <math.h>
+
+/**
+ * @brief Normalizes symbol counts into the frequencies of a model.
+ *
+ * Each frequency is scaled to RANS_PROB_SCALE, symbols that occur keep at least 1, and the rounding
+ * error is taken from (or given to) the most frequent symbols, where it costs the least.
+ * A model without any symbol gets only zero frequencies.
+ *
+ * @param model Model to fill (`freq` and `cum`).
+ * @param counts Number of occurrences of each symbol.
+ * @param alphabet Number of symbols (at most RANS_MAX_SYMBOLS).
+ */
+void rans_model_from_counts(RansModel * model, const uint32_t * counts, int alphabet) {
+    uint64_t total = 0;
+    for (int s = 0; s < alphabet; s++) total += counts[s];
+    memset(model->freq, 0, sizeof(model->freq));
+    memset(model->cum, 0, sizeof(model->cum));
+    if (!total) return;
+
+    int sum = 0;
+    for (int s = 0; s < alphabet; s++) {
+        if (!counts[s]) continue;
+        uint32_t freq = counts[s] * (uint64_t) RANS_PROB_SCALE / total;
+        model->freq[s] = freq ? freq : 1;
+        sum += model->freq[s];
+    }
+    while (sum != RANS_PROB_SCALE) {
+        int best = -1;
+        for (int s = 0; s < alphabet; s++) {
+            if (model->freq[s] > (sum > RANS_PROB_SCALE) && (best < 0 || model->freq[s] > model->freq[best])) best = s;
+        }
+        if (sum > RANS_PROB_SCALE) {
+            model->freq[best]--;
+            sum--;
+        } else {
+            model->freq[best]++;
+            sum++;
+        }
+    }
+    for (int s = 1; s < alphabet; s++) {
+        model->cum[s] = model->cum[s - 1] + model->freq[s - 1];
+    }
+}
+
+/**
+ * @brief Writes the frequencies of a model into a BitStream.
+ *
+ * A frequency below 128 takes one byte, a larger one two bytes with the high bit set.
+ * A zero byte is followed by the number of zero frequencies after it (at most 255),
+ * so the models of the top levels, which only hold a few symbols, take a few bytes.
+ *
+ * @param stream BitStream to write to, byte aligned.
+ * @param model Model to write.
+ * @param alphabet Number of symbols.
+ */
+void rans_push_model(BitStream * stream, const RansModel * model, int alphabet) {
+    for (int s = 0; s < alphabet; s++) {
+        uint16_t freq = model->freq[s];
+        if (!freq) {
+            int run = 0;
+            while (s + 1 < alphabet && !model->freq[s + 1] && run < 255) {
+                run++;
+                s++;
+            }
+            try_push_n_bits64(stream, run, 16);
+        } else if (freq < 128) {
+            try_push_n_bits64(stream, freq, 8);
+        } else {
+            try_push_n_bits64(stream, 0x8000 | freq, 16);
+        }
+    }
+}
+
+/**
+ * @brief Reads the frequencies of a model from a BitStream and builds its decoding table.
+ *
+ * @see rans_push_model() for the layout.
+ *
+ * @param stream BitStream to read from, byte aligned.
+ * @param model Model to fill.
+ * @param alphabet Number of symbols.
+ * @return QTC_OK, or QTC_ERROR_CORRUPT if the frequencies are truncated or don't sum to RANS_PROB_SCALE (or 0).
+ */
+QtcStatus rans_read_model(BitStream * stream, RansModel * model, int alphabet) {
+    memset(model->freq, 0, sizeof(model->freq));
+    int sum = 0;
+    for (int s = 0; s < alphabet; s++) {
+        uint32_t byte = try_read_n_bits64(stream, 8);
+        if (!byte) {
+            s += try_read_n_bits64(stream, 8);
+        } else if (byte & 0x80) {
+            model->freq[s] = ((byte & 0x7F) << 8) | try_read_n_bits64(stream, 8);
+        } else {
+            model->freq[s] = byte;
+        }
+        if (stream->error || s >= alphabet) return QTC_ERROR_CORRUPT;
+        sum += model->freq[s];
+    }
+    if (sum != RANS_PROB_SCALE && sum) return QTC_ERROR_CORRUPT;
+
+    // Slots of each symbol, packed so that a decoding step reads a single entry
+    // An empty model maps every slot to symbol 0, its data is never valid
+    if (!sum) memset(model->slot, 0, sizeof(model->slot));
+    int cum = 0;
+    for (int s = 0; s < alphabet; s++) {
+        model->cum[s] = cum;
+        for (int k = 0; k < model->freq[s]; k++) {
+            model->slot[cum + k] = s | (uint32_t) (model->freq[s] - 1) << 8 | (uint32_t) k << 20;
+        }
+        cum += model->freq[s];
+    }
+    return QTC_OK;
+}
+
+/**
+ * @brief Returns the bits taken by symbols coded with a model.
+ *
+ * A symbol of frequency f costs RANS_PROB_BITS - log2(f) bits, the states flushed at the end are not counted.
+ *
+ * @param model Model of the symbols.
+ * @param counts Number of occurrences of each symbol (their frequency must not be 0).
+ * @param alphabet Number of symbols.
+ * @return Size in bits, rounded.
+ */
+uint64_t rans_cost(const RansModel * model, const uint32_t * counts, int alphabet) {
+    double bits = 0.;
+    for (int s = 0; s < alphabet; s++) {
+        if (counts[s]) bits += counts[s] * (RANS_PROB_BITS - log2(model->freq[s]));
+    }
+    return (uint64_t) llround(bits);
+}
+
+/**
+ * @brief Largest output of the encoder for a number of symbols.
+ *
+ * A symbol of frequency 1 takes 12 bits, so at most 2 bytes are written per symbol, plus the final states.
+ *
+ * @param symbols Number of symbols.
+ * @return Size in bytes.
+ */
+size_t rans_size_bound(size_t symbols) {
+    return 2 * symbols + 4 * RANS_LANES;
+}
+
+/**
+ * @brief Initializes an encoder writing backward from the end of a buffer.
+ *
+ * The last symbol is encoded first, it goes to the lane the decoder reads it from.
+ *
+ * @param encoder Encoder to initialize.
+ * @param buffer Buffer receiving the data.
+ * @param size Size of the buffer in bytes.
+ * @param symbols Number of symbols that will be encoded.
+ */
+void rans_encoder_init(RansEncoder * encoder, unsigned char * buffer, size_t size, size_t symbols) {
+    for (int i = 0; i < RANS_LANES; i++) encoder->state[i] = RANS_LOW;
+    encoder->start = buffer;
+    encoder->end = buffer + size;
+    encoder->ptr = encoder->end;
+    encoder->lane = (symbols + RANS_LANES - 1) % RANS_LANES;
+    encoder->error = 0;
+}
+
+/**
+ * @brief Writes the final states in front of the data, big-endian, lane 0 first.
+ *
+ * @param encoder Encoder whose symbols are all encoded.
+ * @return Size of the data in bytes (starting at encoder->ptr), 0 if the buffer is full.
+ */
+size_t rans_encoder_flush(RansEncoder * encoder) {
+    if (encoder->error || (size_t) (encoder->ptr - encoder->start) < 4 * RANS_LANES) {
+        encoder->error = 1;
+        return 0;
+    }
+    for (int i = RANS_LANES - 1; i >= 0; i--) {
+        for (int b = 0; b < 4; b++) {
+            *--encoder->ptr = encoder->state[i] >> (8 * b);
+        }
+    }
+    return encoder->end - encoder->ptr;
+}
+
+/**
+ * @brief Initializes a decoder over the output of rans_encoder_flush().
+ *
+ * Missing states are read as zeros and set the error flag.
+ *
+ * @param decoder Decoder to initialize.
+ * @param data First byte of the data.
+ * @param size Size of the data in bytes.
+ */
+void rans_decoder_init(RansDecoder * decoder, const unsigned char * data, size_t size) {
+    decoder->ptr = data;
+    decoder->end = data + size;
+    decoder->error = size < 4 * RANS_LANES;
+    for (int i = 0; i < RANS_LANES; i++) {
+        uint32_t x = 0;
+        for (int b = 0; b < 4 && !decoder->error; b++) {
+            x = (x << 8) | *decoder->ptr++;
+        }
+        decoder->state[i] = x;
+    }
+}
+
+/**
+ * @brief Checks that a decoder read exactly the data of the encoder.
+ *
+ * The encoder starts every lane at RANS_LOW, decoding all the symbols brings them back to it.
+ *
+ * @param decoder Decoder whose symbols are all decoded.
+ * @return 1 if the data wasn't truncated, the states are back to their initial value and every byte was read.
+ */
+int rans_decoder_done(const RansDecoder * decoder) {
+    if (decoder->error || decoder->ptr != decoder->end) return 0;
+    for (int i = 0; i < RANS_LANES; i++) {
+        if (decoder->state[i] != RANS_LOW) return 0;
+    }
+    return 1;
+}
@@ -0,0 +1,435 @@
+/**
+ * @file rate.c
+ * @brief Implementation of the rate control.
+ * 
+ * filtrage() makes a node uniform when its 4 children end up uniform and its variance is at most
+ * sigma * alpha^level. Both conditions only get easier when alpha grows, so each node has a smallest
+ * alpha from which it is uniform: the largest of its own threshold and the ones of its children.
+ * Once these thresholds are known, the nodes written and their fields (hence the payload size)
+ * follow for any alpha, the Quadtree is filtered and encoded a single time with the alpha chosen.
+ * So does the decoded image: each pixel takes the mean of its highest uniform ancestor, and the squared
+ * error of a node made uniform only depends on its bloc, so it is computed once per node.
+ */
+
+#include "rate.h"
+#include <string.h>
+
+/**
+ * @brief Tells if the variance of a node passes the filtering threshold of its level.
+ * 
+ * Same sequence of products and same comparison as filtrage(), so the result is exactly its own.
+ * 
+ * @param variance Variance of the node.
+ * @param sigma Threshold of the root (medvar/maxvar).
+ * @param alpha Filtering parameter.
+ * @param level Level of the node.
+ */
+static int below_threshold(float variance, double sigma, double alpha, int level) {
+    for (int l = 0; l < level; l++) sigma *= alpha;
+    return !(variance > sigma);
+}
+
+/**
+ * @brief Reinterprets the bits of a positive double (their order is the order of the values).
+ */
+static uint64_t double_bits(double value) {
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return bits;
+}
+
+/**
+ * @brief Reinterprets bits as a double.
+ */
+static double bits_double(uint64_t bits) {
+    double value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+/**
+ * @brief Returns the smallest alpha from which the variance of a node passes its filtering threshold.
+ * 
+ * Starts from the closed form (variance / sigma)^(1 / level), then gallops and bisects over the
+ * doubles around it with the exact test of filtrage().
+ * 
+ * @param variance Variance of the node.
+ * @param sigma Threshold of the root (medvar/maxvar).
+ * @param level Level of the node (at least 1).
+ * @return Smallest positive alpha passing the test (INFINITY if none).
+ */
+static double smallest_alpha(float variance, double sigma, int level) {
+    const uint64_t min_bits = double_bits(DBL_TRUE_MIN), max_bits = double_bits(INFINITY);
+    double guess = pow(variance / sigma, 1.0 / level);
+    if (!(guess >= DBL_TRUE_MIN)) guess = DBL_TRUE_MIN;
+    if (guess > DBL_MAX) guess = DBL_MAX;
+
+    // lo fails and hi passes the test
+    uint64_t lo, hi, step = 1;
+    if (below_threshold(variance, sigma, guess, level)) {
+        hi = double_bits(guess);
+        for (;;) {
+            if (hi == min_bits) return DBL_TRUE_MIN;
+            lo = hi - min_bits > step ? hi - step : min_bits;
+            if (!below_threshold(variance, sigma, bits_double(lo), level)) break;
+            hi = lo;
+            step <<= 1;
+        }
+    } else {
+        lo = double_bits(guess);
+        for (;;) {
+            if (lo == max_bits) return INFINITY;
+            hi = max_bits - lo > step ? lo + step : max_bits;
+            if (below_threshold(variance, sigma, bits_double(hi), level)) break;
+            lo = hi;
+            step <<= 1;
+        }
+    }
+    while (hi - lo > 1) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if (below_threshold(variance, sigma, bits_double(mid), level)) {
+            hi = mid;
+        } else {
+            lo = mid;
+        }
+    }
+    return bits_double(hi);
+}
+
+/**
+ * @brief Returns the index of the first node of a level in UniformThresholds::alphas.
+ */
+static size_t level_offset(int level) {
+    return (((size_t) 1 << (2 * level)) - 1) / 3;
+}
+
+/**
+ * @brief Sorts doubles in increasing order (qsort comparator, used if the radix sort can't allocate its histogram).
+ */
+static int compare_doubles(const void * a, const void * b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief Sorts positive doubles in increasing order.
+ * 
+ * LSD radix sort on their bits, 16 bits at a time (positive doubles sort like their bits),
+ * the passes where every value has the same digit are skipped.
+ * 
+ * @param values Values to sort.
+ * @param buffer Working array of the same size.
+ * @param count Number of values.
+ * @return Pointer to the sorted values (values or buffer).
+ */
+static double * sort_positive_doubles(double * values, double * buffer, size_t count) {
+    static const int digits = 1 << 16;
+    size_t * histogram = (size_t *) malloc((digits + 1) * sizeof(size_t));
+    if (!histogram) {
+        qsort(values, count, sizeof(double), compare_doubles);
+        return values;
+    }
+    for (int shift = 0; shift < 64; shift += 16) {
+        memset(histogram, 0, (digits + 1) * sizeof(size_t));
+        for (size_t i = 0; i < count; i++) histogram[((double_bits(values[i]) >> shift) & 0xffff) + 1]++;
+        int skip = 0;
+        for (int d = 0; d < digits; d++) {
+            if (histogram[d + 1] == count) skip = 1;
+            histogram[d + 1] += histogram[d];
+        }
+        if (skip) continue;
+        for (size_t i = 0; i < count; i++) buffer[histogram[(double_bits(values[i]) >> shift) & 0xffff]++] = values[i];
+        double * swap = values;
+        values = buffer;
+        buffer = swap;
+    }
+    free(histogram);
+    return values;
+}
+
+/**
+ * @brief Computes once the filtering threshold of every node of an unfiltered Quadtree.
+ * 
+ * Bottom-up over the non-leaf levels: leaves and nodes already uniform have threshold 0, the others
+ * the largest of the smallest alpha passing their own variance test and the thresholds of their children.
+ * The root test doesn't depend on alpha.
+ * 
+ * @param quadtree Unfiltered Quadtree, with its variance plane.
+ * @param thresholds Thresholds on output, to free with free_uniform_thresholds().
+ * @return QTC_OK or QTC_ERROR_MEMORY.
+ */
+QtcStatus compute_uniform_thresholds(Quadtree * quadtree, UniformThresholds * thresholds) {
+    int n = quadtree->levels;
+    size_t internal = level_offset(n);
+    *thresholds = (UniformThresholds) {NULL, NULL, NULL, 0, n};
+    thresholds->alphas = (double *) malloc((internal ? internal : 1) * sizeof(double));
+    thresholds->sorted = (double *) malloc((internal ? internal : 1) * sizeof(double));
+    if (!thresholds->alphas || !thresholds->sorted) {
+        free_uniform_thresholds(thresholds);
+        return QTC_ERROR_MEMORY;
+    }
+    double sigma = quadtree->medvar / quadtree->maxvar;
+    for (int level = n - 1; level >= 0; level--) {
+        double * alphas = thresholds->alphas + level_offset(level);
+        const double * children = level + 1 < n ? thresholds->alphas + level_offset(level + 1) : NULL;
+        for (int64_t j = 0; j < nodes_in_level(level); j++) {
+            if (get_u(quadtree, level, j)) {
+                alphas[j] = 0.;
+                continue;
+            }
+            double a = 0.;
+            if (children) {
+                for (int i = 0; i < 4; i++) {
+                    if (children[4 * j + i] > a) a = children[4 * j + i];
+                }
+            }
+            // Its own test only matters when the children don't already need a larger alpha
+            float variance = quadtree->variances[level][j];
+            if (!a || !below_threshold(variance, sigma, a, level)) {
+                a = level ? smallest_alpha(variance, sigma, level)
+                          : (below_threshold(variance, sigma, 1., 0) ? DBL_TRUE_MIN : INFINITY);
+            }
+            alphas[j] = a;
+        }
+    }
+
+    // Distinct thresholds, the working array of the sort receives them
+    size_t count = 0;
+    for (size_t i = 0; i < internal; i++) {
+        double a = thresholds->alphas[i];
+        if (a > 0. && a < INFINITY) thresholds->sorted[count++] = a;
+    }
+    double * buffer = (double *) malloc((count ? count : 1) * sizeof(double));
+    if (!buffer) {
+        free_uniform_thresholds(thresholds);
+        return QTC_ERROR_MEMORY;
+    }
+    const double * sorted = sort_positive_doubles(thresholds->sorted, buffer, count);
+    for (size_t i = 0; i < count; i++) {
+        if (!thresholds->count || sorted[i] != buffer[thresholds->count - 1]) {
+            buffer[thresholds->count++] = sorted[i];
+        }
+    }
+    free(thresholds->sorted);
+    thresholds->sorted = buffer;
+    return QTC_OK;
+}
+
+/**
+ * @brief Sums the pixels of the bloc of a node and their squares, and stores the error of the node made uniform.
+ * 
+ * Depth-first like filtrage_error(). A uniform node is a constant bloc of its mean: its error is 0,
+ * like the ones of its descendants (left at 0, they never are the highest uniform node).
+ * 
+ * @param quadtree Unfiltered Quadtree.
+ * @param errors Errors of the non-leaf nodes, level by level.
+ * @param level Level of the node.
+ * @param j Index of the node in its level.
+ * @param bloc Sums of the bloc on output (its error is not used).
+ */
+static void sum_bloc(Quadtree * quadtree, uint64_t * errors, int level, int64_t j, BlocError * bloc) {
+    uint64_t n = (uint64_t) 1 << (2 * (quadtree->levels - level));
+    uint64_t m = get_moyenne(quadtree, level, j);
+    if (level == quadtree->levels || get_u(quadtree, level, j)) {
+        *bloc = (BlocError) {n * m, n * m * m, 0};
+        return;
+    }
+    *bloc = (BlocError) {0, 0, 0};
+    for (int i = 0; i < 4; i++) {
+        BlocError child;
+        sum_bloc(quadtree, errors, level + 1, 4 * j + i, &child);
+        bloc->sum += child.sum;
+        bloc->squares += child.squares;
+    }
+    errors[level_offset(level) + j] = bloc->squares + n * m * m - 2 * m * bloc->sum;
+}
+
+/**
+ * @brief Computes once the squared error of every non-leaf node of an unfiltered Quadtree if it is made uniform.
+ * 
+ * A node made uniform decodes as its mean m, its error is sum((p - m)^2) = squares - 2 m sum + n m^2
+ * over the n pixels p of its bloc.
+ * 
+ * @param quadtree Unfiltered Quadtree.
+ * @param thresholds Thresholds of the Quadtree, receiving the errors.
+ * @return QTC_OK or QTC_ERROR_MEMORY.
+ */
+QtcStatus compute_uniform_errors(Quadtree * quadtree, UniformThresholds * thresholds) {
+    size_t internal = level_offset(quadtree->levels);
+    free(thresholds->errors);
+    thresholds->errors = (uint64_t *) calloc(internal ? internal : 1, sizeof(uint64_t));
+    if (!thresholds->errors) return QTC_ERROR_MEMORY;
+    BlocError root;
+    sum_bloc(quadtree, thresholds->errors, 0, 0, &root);
+    return QTC_OK;
+}
+
+/**
+ * @brief Frees the arrays of UniformThresholds.
+ * 
+ * @param thresholds Thresholds to free.
+ */
+void free_uniform_thresholds(UniformThresholds * thresholds) {
+    free(thresholds->alphas);
+    free(thresholds->sorted);
+    free(thresholds->errors);
+    thresholds->alphas = NULL;
+    thresholds->sorted = NULL;
+    thresholds->errors = NULL;
+    thresholds->count = 0;
+}
+
+/**
+ * @brief Predicts the exact size of the payload encode_to_stream() would write after filtrage() with an alpha.
+ * 
+ * A node is written when its parent isn't uniform (thresholds only grow towards the root, so no
+ * ancestor is uniform either). It costs its mean (except the 4th child), its epsilon, and its
+ * uniformity bit when epsilon is 0, a filtered node having epsilon 0. Leaves only cost their mean.
+ * Bits are summed per byte aligned section: the whole payload for Q1, each chunk and the top section for Q2.
+ * 
+ * @param quadtree Unfiltered Quadtree.
+ * @param thresholds Thresholds of the Quadtree.
+ * @param alpha Filtering parameter, 0 for a lossless compression.
+ * @param format 1 for Q1, 2 for Q2.
+ * @return Size of the payload in bytes (the header lines are not counted).
+ */
+size_t predict_encoded_size(Quadtree * quadtree, const UniformThresholds * thresholds, double alpha, int format) {
+    int n = quadtree->levels;
+    int split = -1; // Q1: a single section
+    if (format == 2) {
+        split = n - 3 < QTC_Q2_SPLIT ? n - 3 : QTC_Q2_SPLIT;
+        if (split < 0) split = 0;
+    }
+    uint64_t chunk_bits[1 << (2 * QTC_Q2_SPLIT)] = {0};
+    uint64_t top_bits = 0;
+
+    // Root
+    const double * alphas = thresholds->alphas;
+    int root_uniform = !n || alphas[0] <= alpha;
+    top_bits += 10 + (root_uniform || !get_epsilon(quadtree, 0, 0));
+
+    for (int level = 1; level <= n; level++) {
+        const double * parents = alphas + level_offset(level - 1);
+        const double * nodes = level < n ? alphas + level_offset(level) : NULL;
+        int shift = split >= 0 && level > split ? 2 * (level - split) : -1;
+        for (int64_t p = 0; p < nodes_in_level(level - 1); p++) {
+            if (parents[p] <= alpha) continue; // Uniform parent, its children are not written
+            uint64_t bits = 24; // Means of the first 3 children
+            if (nodes) {
+                for (int i = 0; i < 4; i++) {
+                    int64_t j = 4 * p + i;
+                    bits += 2 + (nodes[j] <= alpha || !get_epsilon(quadtree, level, j));
+                }
+            }
+            if (shift >= 0) {
+                chunk_bits[(4 * p) >> shift] += bits;
+            } else {
+                top_bits += bits;
+            }
+        }
+    }
+
+    if (split < 0) return (8 + top_bits + 7) / 8;
+    size_t size = 2 + (top_bits + 7) / 8 + (2 * (size_t) nodes_in_level(split) + 1) * q2_table_bytes(n);
+    for (int64_t t = 0; t < nodes_in_level(split); t++) size += (chunk_bits[t] + 7) / 8;
+    return size;
+}
+
+/**
+ * @brief Finds the smallest alpha whose payload fits in a budget, without filtering or encoding.
+ * 
+ * The size only shrinks when alpha grows and only changes at the node thresholds,
+ * so a bisection over the sorted thresholds gives the smallest alpha meeting the budget;
+ * filtrage() with it gives exactly the predicted size.
+ * 
+ * @param quadtree Unfiltered Quadtree.
+ * @param thresholds Thresholds of the Quadtree.
+ * @param target Budget of the payload in bytes.
+ * @param format 1 for Q1, 2 for Q2.
+ * @param alpha Alpha on output (0 if the lossless payload fits, the largest useful one if nothing fits).
+ * @param predicted Size of the payload with this alpha on output.
+ * @return 1 if the budget is met, 0 otherwise.
+ */
+int alpha_for_target_size(Quadtree * quadtree, const UniformThresholds * thresholds, size_t target, int format,
+                          double * alpha, size_t * predicted) {
+    *alpha = 0.;
+    *predicted = predict_encoded_size(quadtree, thresholds, 0., format);
+    if (*predicted <= target || !thresholds->count) return *predicted <= target;
+
+    // sorted[hi] is the first threshold known to fit, count if none does
+    size_t lo = 0, hi = thresholds->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (predict_encoded_size(quadtree, thresholds, thresholds->sorted[mid], format) <= target) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+    int met = hi < thresholds->count;
+    *alpha = thresholds->sorted[met ? hi : thresholds->count - 1];
+    *predicted = predict_encoded_size(quadtree, thresholds, *alpha, format);
+    return met;
+}
+
+/**
+ * @brief Predicts the exact squared error of the decoded pixels after filtrage() with an alpha.
+ * 
+ * The error is the one of the highest uniform nodes: uniform with a parent that isn't
+ * (thresholds only grow towards the root), the other pixels are decoded losslessly.
+ * 
+ * @param quadtree Unfiltered Quadtree.
+ * @param thresholds Thresholds of the Quadtree, with their errors.
+ * @param alpha Filtering parameter, 0 for a lossless compression.
+ * @return Sum of the squared differences between the decoded pixels and the pixels.
+ */
+uint64_t predict_squared_error(Quadtree * quadtree, const UniformThresholds * thresholds, double alpha) {
+    int n = quadtree->levels;
+    uint64_t error = 0;
+    if (!n) return 0;
+    if (thresholds->alphas[0] <= alpha) return thresholds->errors[0];
+    for (int level = 1; level < n; level++) {
+        const double * parents = thresholds->alphas + level_offset(level - 1);
+        const double * nodes = thresholds->alphas + level_offset(level);
+        const uint64_t * errors = thresholds->errors + level_offset(level);
+        for (int64_t j = 0; j < nodes_in_level(level); j++) {
+            if (nodes[j] <= alpha && parents[j / 4] > alpha) error += errors[j];
+        }
+    }
+    return error;
+}
+
+/**
+ * @brief Finds the largest alpha whose decoded image meets a PSNR, without filtering or decoding.
+ * 
+ * The error only changes at the node thresholds, and grows with alpha as larger blocs take a single mean
+ * (up to the rounding of the means), so a bisection over the sorted thresholds gives the largest alpha
+ * meeting the PSNR. The alpha returned is always one whose error was predicted, filtrage() with it
+ * gives exactly this error.
+ * 
+ * @param quadtree Unfiltered Quadtree.
+ * @param thresholds Thresholds of the Quadtree, with their errors.
+ * @param psnr Smallest PSNR in dB.
+ * @param alpha Alpha on output (0 if no filtering meets the PSNR, the lossless image always does).
+ * @param predicted Squared error of the decoded pixels with this alpha on output.
+ */
+void alpha_for_target_psnr(Quadtree * quadtree, const UniformThresholds * thresholds, double psnr,
+                           double * alpha, uint64_t * predicted) {
+    uint64_t pixels = (uint64_t) 1 << (2 * quadtree->levels);
+    *alpha = 0.;
+    *predicted = 0;
+
+    // sorted[lo - 1] is the last threshold known to meet the PSNR, sorted[hi] the first known not to
+    size_t lo = 0, hi = thresholds->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        uint64_t error = predict_squared_error(quadtree, thresholds, thresholds->sorted[mid]);
+        if (psnr_of_error(error, pixels) >= psnr) {
+            lo = mid + 1;
+            *alpha = thresholds->sorted[mid];
+            *predicted = error;
+        } else {
+            hi = mid;
+        }
+    }
+}
@@ -3,36 +3,134 @@
  * @brief Implementation of a segmentation grid.
  * 
  * This file provides functions to generate a segmentation grid from a Quadtre.
- * The segmentation grid is reprensented as an image with visible boundaries of uniform blocs.
+ * The segmentation grid is reprensented as an image with visible boundaries of uniform blocs,
+ * or as the list of the uniform blocs. The encoders and decoders add the blocs to a grid as they
+ * visit them, the functions taking a Quadtree walk it again.
  */
 
 #include "segmentation_grid.h"
 
 /**
- * @brief Draws the borders of a uniform bloc using a specific grayscale value (190).
+ * @brief Draws the top and left borders of a bloc using a specific grayscale value (190).
  * 
- * @param image Pointer to the image where the grid is being drawn.
- * @param x X coordinate of the top-left corner of a uniform bloc.
- * @param y Y coordinate of the top-left corner of a uniform bloc.
- * @param size Size of the uniform bloc.
+ * The top border is a single row span, the left border one pixel per row.
+ * Borders on the column `left` - 1 and the row `top` - 1 belong to an enclosing bloc and are left out,
+ * so a thread drawing the blocs of one subtree only writes inside it.
+ * 
+ * @param grid Grid whose raster is being drawn.
+ * @param x X coordinate of the top-left corner of the bloc.
+ * @param y Y coordinate of the top-left corner of the bloc.
+ * @param size Size of the bloc.
  */
-static void build_grid(Image * image, int x, int y, int size) {
+static void draw_borders(SegmentationGrid * grid, uint32_t x, uint32_t y, uint32_t size) {
+    size_t width = grid->image->width;
     // Draw the top border of the bloc
-    if (y > 0) {
-        for (int i = 0; i < size; i++) {
-            if (x + i < image->width) {
-                image->image[(y - 1) * image->width + x + i] = 190;
-            }
-        }
+    if (y > grid->top) {
+        memset(grid->image->image + (y - 1) * width + x, 190, size);
     }
     // Draw the left border of the bloc
-    if (x > 0) {
-        for (int i = 0; i < size; i++) {
-            if (y + i < image->width) {
-                image->image[(y + i) * image->width + x - 1] = 190;
+    if (x > grid->left) {
+        unsigned char * pixel = grid->image->image + y * width + x - 1;
+        for (uint32_t i = 0; i < size; i++, pixel += width) {
+            *pixel = 190;
+        }
+    }
+}
+
+/**
+ * @brief Initializes an empty segmentation grid.
+ * 
+ * @param grid Grid to initialize.
+ * @param image Raster receiving the borders (of the image size), whited, NULL to only list the blocs.
+ * @param list Lists the blocs if not 0.
+ */
+void init_segmentation_grid(SegmentationGrid * grid, Image * image, int list) {
+    memset(grid, 0, sizeof(SegmentationGrid));
+    grid->image = image;
+    grid->list = list;
+    // initialise l'image avec des pixels blancs
+    if (image) memset(image->image, 255, image->image_size);
+}
+
+/**
+ * @brief Adds a uniform bloc to a segmentation grid.
+ * 
+ * Draws its top and left borders in the raster and appends it to the list, which doubles when full.
+ * 
+ * @param grid Current grid.
+ * @param x X coordinate of the top-left corner of the bloc.
+ * @param y Y coordinate of the top-left corner of the bloc.
+ * @param size Size of the bloc.
+ */
+void grid_add_bloc(SegmentationGrid * grid, uint32_t x, uint32_t y, uint32_t size) {
+    if (grid->image) draw_borders(grid, x, y, size);
+    if (!grid->list || grid->failed) return;
+    if (grid->count == grid->capacity) {
+        size_t capacity = grid->capacity ? 2 * grid->capacity : 1024;
+        GridBloc * blocs = (GridBloc *) realloc(grid->blocs, capacity * sizeof(GridBloc));
+        if (!blocs) {
+            grid->failed = 1;
+            return;
+        }
+        grid->blocs = blocs;
+        grid->capacity = capacity;
+    }
+    grid->blocs[grid->count++] = (GridBloc) {x, y, size};
+}
+
+/**
+ * @brief Draws the top and left borders of a non-uniform bloc, without listing it.
+ * 
+ * They are the borders its descendants leave out when they are drawn with `left` and `top` on the bloc.
+ * 
+ * @param grid Current grid.
+ * @param x X coordinate of the top-left corner of the bloc.
+ * @param y Y coordinate of the top-left corner of the bloc.
+ * @param size Size of the bloc.
+ */
+void grid_draw_borders(SegmentationGrid * grid, uint32_t x, uint32_t y, uint32_t size) {
+    if (grid->image) draw_borders(grid, x, y, size);
+}
+
+/**
+ * @brief Appends the blocs listed in a part of a grid to the grid.
+ * 
+ * @param grid Grid receiving the blocs.
+ * @param part Grid filled for a part of the image (by one thread), its list is freed.
+ * @return QTC_OK or QTC_ERROR_MEMORY.
+ */
+QtcStatus merge_segmentation_grid(SegmentationGrid * grid, SegmentationGrid * part) {
+    QtcStatus status = part->failed ? QTC_ERROR_MEMORY : QTC_OK;
+    if (status == QTC_OK && grid->list && part->count) {
+        if (grid->count + part->count > grid->capacity) {
+            GridBloc * blocs = (GridBloc *) realloc(grid->blocs, (grid->count + part->count) * sizeof(GridBloc));
+            if (blocs) {
+                grid->blocs = blocs;
+                grid->capacity = grid->count + part->count;
+            } else {
+                status = QTC_ERROR_MEMORY;
             }
         }
+        if (status == QTC_OK) {
+            memcpy(grid->blocs + grid->count, part->blocs, part->count * sizeof(GridBloc));
+            grid->count += part->count;
+        }
     }
+    if (status != QTC_OK) grid->failed = 1;
+    free_segmentation_grid(part);
+    return status;
+}
+
+/**
+ * @brief Frees the list of a segmentation grid, the raster belongs to the caller.
+ * 
+ * @param grid Grid to free.
+ */
+void free_segmentation_grid(SegmentationGrid * grid) {
+    free(grid->blocs);
+    grid->blocs = NULL;
+    grid->count = 0;
+    grid->capacity = 0;
 }
 
 /**
@@ -42,26 +140,40 @@ static void build_grid(Image * image, int x, int y, int size) {
  * Traverses the quadtree to identify unifrom bloc and draw them in the segmentation grid.
  *
  * @param quadtree Pointer to the Quadtree.
- * @param image Pointer to the image representing the grid.
+ * @param grid Grid receiving the uniform blocs.
  * @param size Size of the current bloc.
- * @param index Index of the current node.
+ * @param level Level of the current node.
+ * @param j Index of the current node in its level.
  * @param x X coordinate of the top-left corner of the current bloc.
  * @param y Y coordinate of the top-left corner of the current bloc.
  */
-static void build_segmentation_grid(Quadtree * quadtree, Image * image, int size, int index, int x, int y) {
-    Node * node = &quadtree->nodes[index];
+static void build_segmentation_grid(Quadtree * quadtree, SegmentationGrid * grid, int size, int level, int64_t j, int x, int y) {
     // If the node is uniform, draw its corresponding bloc
-    if (node->u) {
-        build_grid(image, x, y, size);
+    if (get_u(quadtree, level, j)) {
+        grid_add_bloc(grid, x, y, size);
         return;
     }
 
     // Same logic as the Quadtree construction and image reconstruction
     int child_size = size / 2;
-    build_segmentation_grid(quadtree, image, child_size, 4 * index + 1, x, y);
-    build_segmentation_grid(quadtree, image, child_size, 4 * index + 2, x + child_size, y);
-    build_segmentation_grid(quadtree, image, child_size, 4 * index + 3, x + child_size, y + child_size);
-    build_segmentation_grid(quadtree, image, child_size, 4 * index + 4, x, y + child_size);
+    build_segmentation_grid(quadtree, grid, child_size, level + 1, 4 * j, x, y);
+    build_segmentation_grid(quadtree, grid, child_size, level + 1, 4 * j + 1, x + child_size, y);
+    build_segmentation_grid(quadtree, grid, child_size, level + 1, 4 * j + 2, x + child_size, y + child_size);
+    build_segmentation_grid(quadtree, grid, child_size, level + 1, 4 * j + 3, x, y + child_size);
+}
+
+/**
+ * @brief Draws the segmentation grid of a Quadtree into an existing Image.
+ * 
+ * Whites the Image, then draws the borders of the uniform blocs of the Quadtree.
+ * 
+ * @param quadtree Pointer to the Quadtree.
+ * @param image Image of the Quadtree size receiving the grid.
+ */
+void draw_segmentation_grid(Quadtree * quadtree, Image * image) {
+    SegmentationGrid grid;
+    init_segmentation_grid(&grid, image, 0);
+    build_segmentation_grid(quadtree, &grid, image->width, 0, 0, 0, 0);
 }
 
 /**
@@ -75,9 +187,7 @@ static void build_segmentation_grid(Quadtree * quadtree, Image * image, int size
 Image * generate_segmentation_grid(Quadtree * quadtree) {
     int width = 1 << quadtree->levels; // équivalant à pow(2, quadtree->levels) ou simplement 2^quadtree->levels
     // Allocation de mémoire pour l'image
-    Image * image = allocate_image(width, width * width, 255);
-    // initialise l'image avec des pixels blancs
-    memset(image->image, 255, image->image_size);
-    build_segmentation_grid(quadtree, image, width, 0, 0, 0);
+    Image * image = allocate_image(width, (size_t) width * width, 255);
+    draw_segmentation_grid(quadtree, image);
     return image;
 }
\ No newline at end of file
@@ -0,0 +1,555 @@
+/**
+ * @file server.c
+ * @brief Implementation of the tile server.
+ *
+ * Every worker thread accepts a connection on the shared socket and answers its requests, one text line each:
+ * `GET <file.qtc> [level [x y w h]]` gives a P5 PGM image of the means of a level (the whole image by default)
+ * or of a window of it, `STATS` the counters of the cache, an error is a line starting with `ERR`.
+ * A file is decoded once into a Quadtree holding the means of every level (see decode_quadtree_into()),
+ * which stays in an LRU cache shared by the workers: the next requests only copy nodes.
+ */
+
+#include "server.h"
+
+#define SERVER_LINE 4096 // Longest request line, path included
+
+/**
+ * @struct CacheEntry
+ * @brief Decoded Quadtree of a file, in the LRU list of the cache.
+ */
+typedef struct CacheEntry {
+    char * path;                    // Path of the file, as requested
+    dev_t device;                   // Identity of the file when it was decoded
+    ino_t inode;
+    off_t size;
+    struct timespec mtime;
+    Quadtree * quadtree;            // Decoded Quadtree, NULL while loading or if the file is invalid
+    size_t bytes;                   // Memory held by the Quadtree
+    QtcStatus status;               // Result of the decoding
+    int loading;                    // Set while a worker decodes the file, the others wait for it
+    int references;                 // Requests using the entry, it is only freed at 0
+    int cached;                     // Set while the entry is in the list
+    struct CacheEntry * previous;   // More recently used entry
+    struct CacheEntry * next;       // Less recently used entry
+} CacheEntry;
+
+/**
+ * @struct TileCache
+ * @brief Decoded Quadtrees shared by the workers, the least recently used ones are freed above the memory cap.
+ */
+typedef struct {
+    CacheEntry * first;             // Most recently used entry
+    CacheEntry * last;              // Least recently used entry
+    size_t entries;                 // Entries in the list
+    size_t bytes;                   // Memory held by their Quadtrees
+    size_t capacity;                // Memory cap in bytes
+    uint64_t hits, misses, evictions;
+    pthread_mutex_t lock;
+    pthread_cond_t loaded;          // Signaled when a file is decoded
+} TileCache;
+
+/**
+ * @struct ServerState
+ * @brief State shared by the workers of the server.
+ */
+typedef struct {
+    TileCache * cache;
+    int listener;                   // Listening socket
+    int verbose;
+} ServerState;
+
+/**
+ * @brief Frees a cache entry and its Quadtree.
+ *
+ * @param entry Entry out of the list.
+ */
+static void free_entry(CacheEntry * entry) {
+    if (entry->quadtree) free_quadtree(entry->quadtree);
+    free(entry->path);
+    free(entry);
+}
+
+/**
+ * @brief Puts an entry at the front of the LRU list.
+ *
+ * @param cache Cache, locked.
+ * @param entry Entry out of the list.
+ */
+static void link_entry(TileCache * cache, CacheEntry * entry) {
+    entry->previous = NULL;
+    entry->next = cache->first;
+    if (cache->first) cache->first->previous = entry;
+    else cache->last = entry;
+    cache->first = entry;
+    cache->entries++;
+    cache->bytes += entry->bytes;
+    entry->cached = 1;
+}
+
+/**
+ * @brief Takes an entry out of the LRU list.
+ *
+ * @param cache Cache, locked.
+ * @param entry Entry in the list.
+ */
+static void unlink_entry(TileCache * cache, CacheEntry * entry) {
+    if (entry->previous) entry->previous->next = entry->next;
+    else cache->first = entry->next;
+    if (entry->next) entry->next->previous = entry->previous;
+    else cache->last = entry->previous;
+    cache->entries--;
+    cache->bytes -= entry->bytes;
+    entry->cached = 0;
+}
+
+/**
+ * @brief Frees the least recently used entries no request is using, until the cache fits in its memory cap.
+ *
+ * @param cache Cache, locked.
+ */
+static void evict_entries(TileCache * cache) {
+    CacheEntry * entry = cache->last;
+    while (entry && cache->bytes > cache->capacity) {
+        CacheEntry * previous = entry->previous;
+        if (!entry->references) {
+            unlink_entry(cache, entry);
+            free_entry(entry);
+            cache->evictions++;
+        }
+        entry = previous;
+    }
+}
+
+/**
+ * @brief Tells if an entry was decoded from the current version of its file.
+ *
+ * @param entry Cache entry.
+ * @param st Status of the file now.
+ * @return 1 if the file didn't change, 0 otherwise.
+ */
+static int same_file(const CacheEntry * entry, const struct stat * st) {
+    return entry->device == st->st_dev && entry->inode == st->st_ino && entry->size == st->st_size
+           && entry->mtime.tv_sec == st->st_mtim.tv_sec && entry->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+/**
+ * @brief Decodes a QTC file into a Quadtree, without exiting on errors.
+ *
+ * @param path Path of the file.
+ * @param context Context of the worker.
+ * @param quadtree Quadtree on output.
+ * @return QTC_OK, QTC_ERROR_ARGUMENT for a Q4 delta frame or a Q5 multi-plane file, QTC_ERROR_CORRUPT or QTC_ERROR_MEMORY.
+ */
+static QtcStatus load_quadtree(const char * path, QtcContext * context, Quadtree ** quadtree) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return QTC_ERROR_CORRUPT;
+    struct stat st;
+    if (fstat(fd, &st) || st.st_size < 2) {
+        close(fd);
+        return QTC_ERROR_CORRUPT;
+    }
+    size_t size = st.st_size;
+    unsigned char * data = (unsigned char *) mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd); // The mapping stays valid after closing the file
+    if (data == MAP_FAILED) return QTC_ERROR_MEMORY;
+    QtcStatus status = QTC_ERROR_CORRUPT;
+    if (data[0] == 'Q' && data[1] >= '1' && data[1] <= '5') {
+        size_t offset = skip_qtc_header(data, size);
+        BitStream stream;
+        initReadBitStreamOver(&stream, data + offset, size - offset);
+        stream.format = qtc_format(data, size);
+        status = decode_quadtree_into(&stream, 1, context, quadtree);
+    }
+    munmap(data, size);
+    return status;
+}
+
+/**
+ * @brief Drops a request on an entry, the entry is freed if it left the list and nothing uses it anymore.
+ *
+ * @param cache Cache, locked.
+ * @param entry Entry used by the request.
+ */
+static void release_entry_locked(TileCache * cache, CacheEntry * entry) {
+    entry->references--;
+    // A failed decoding is not kept, the next request tries again
+    if (entry->status != QTC_OK && entry->cached && !entry->loading) unlink_entry(cache, entry);
+    if (!entry->references && !entry->cached) free_entry(entry);
+    else evict_entries(cache);
+}
+
+/**
+ * @brief Drops a request on an entry.
+ *
+ * @param cache Cache.
+ * @param entry Entry returned by acquire_entry().
+ */
+static void release_entry(TileCache * cache, CacheEntry * entry) {
+    pthread_mutex_lock(&cache->lock);
+    release_entry_locked(cache, entry);
+    pthread_mutex_unlock(&cache->lock);
+}
+
+/**
+ * @brief Returns the entry of a file, decoding it if it isn't in the cache or if it changed.
+ *
+ * Only one worker decodes a given file, the others asking for it meanwhile wait for its Quadtree.
+ * The decoding is done without holding the lock, so the other files are served in the meantime.
+ *
+ * @param cache Cache.
+ * @param path Path of the file.
+ * @param st Status of the file, a regular file.
+ * @param context Context of the worker, used for the decoding.
+ * @param status QTC_OK, QTC_ERROR_ARGUMENT for a Q4 delta frame or a Q5 multi-plane file, QTC_ERROR_CORRUPT or QTC_ERROR_MEMORY.
+ * @return The entry, to give back with release_entry(), NULL on errors.
+ */
+static CacheEntry * acquire_entry(TileCache * cache, const char * path, const struct stat * st, QtcContext * context, QtcStatus * status) {
+    pthread_mutex_lock(&cache->lock);
+    CacheEntry * entry = cache->first;
+    while (entry && strcmp(entry->path, path)) entry = entry->next;
+    if (entry && !same_file(entry, st)) {
+        // The file changed, the old Quadtree is freed once its last request is served
+        unlink_entry(cache, entry);
+        if (!entry->references) free_entry(entry);
+        entry = NULL;
+    }
+    if (entry) {
+        cache->hits++;
+        entry->references++;
+        unlink_entry(cache, entry);
+        link_entry(cache, entry);
+        while (entry->loading) pthread_cond_wait(&cache->loaded, &cache->lock);
+    } else {
+        cache->misses++;
+        entry = (CacheEntry *) calloc(1, sizeof(CacheEntry));
+        char * copy = entry ? (char *) malloc(strlen(path) + 1) : NULL;
+        if (!copy) {
+            free(entry);
+            pthread_mutex_unlock(&cache->lock);
+            *status = QTC_ERROR_MEMORY;
+            return NULL;
+        }
+        entry->path = strcpy(copy, path);
+        entry->device = st->st_dev;
+        entry->inode = st->st_ino;
+        entry->size = st->st_size;
+        entry->mtime = st->st_mtim;
+        entry->loading = 1;
+        entry->references = 1;
+        link_entry(cache, entry);
+        pthread_mutex_unlock(&cache->lock);
+
+        Quadtree * quadtree = NULL;
+        QtcStatus loaded = load_quadtree(path, context, &quadtree);
+
+        pthread_mutex_lock(&cache->lock);
+        entry->status = loaded;
+        entry->quadtree = quadtree;
+        entry->bytes = quadtree ? sizeof(Quadtree) + quadtree_memory_size(quadtree->levels, 0) : 0;
+        if (entry->cached) cache->bytes += entry->bytes;
+        entry->loading = 0;
+        pthread_cond_broadcast(&cache->loaded);
+        evict_entries(cache);
+    }
+    *status = entry->status;
+    if (*status != QTC_OK) {
+        release_entry_locked(cache, entry);
+        entry = NULL;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return entry;
+}
+
+/**
+ * @brief Sends a whole buffer on a socket.
+ *
+ * @param fd Socket.
+ * @param data Data to send.
+ * @param size Size of the data in bytes.
+ * @return 1 if everything was sent, 0 if the connection is closed.
+ */
+static int send_all(int fd, const void * data, size_t size) {
+    const char * next = (const char *) data;
+    while (size) {
+        ssize_t sent = send(fd, next, size, MSG_NOSIGNAL); // A closed connection doesn't raise SIGPIPE
+        if (sent < 0 && errno == EINTR) continue;
+        if (sent <= 0) return 0;
+        next += sent;
+        size -= sent;
+    }
+    return 1;
+}
+
+/**
+ * @brief Sends an error line.
+ *
+ * @param fd Socket.
+ * @param message Message, without the line feed.
+ * @return 1 if it was sent, 0 if the connection is closed.
+ */
+static int send_error(int fd, const char * message) {
+    char line[256];
+    int length = snprintf(line, sizeof(line), "ERR %s\n", message);
+    return send_all(fd, line, length);
+}
+
+/**
+ * @brief Copies the means of a window of a level of a Quadtree.
+ *
+ * The leaves are read row by row from the raster, the nodes of an upper level one by one at their index.
+ *
+ * @param quadtree Decoded Quadtree.
+ * @param level Level of the means, each node is a pixel.
+ * @param x Column of the window in the level.
+ * @param y Row of the window in the level.
+ * @param width Width of the window.
+ * @param height Height of the window.
+ * @param pixels Buffer of width * height bytes receiving the means.
+ */
+static void copy_window(const Quadtree * quadtree, int level, uint32_t x, uint32_t y, uint32_t width, uint32_t height, unsigned char * pixels) {
+    for (uint32_t row = 0; row < height; row++, pixels += width) {
+        if (level == quadtree->levels && quadtree->pixels) {
+            memcpy(pixels, quadtree->pixels + ((size_t) (y + row) << level) + x, width);
+            continue;
+        }
+        const unsigned char * moyennes = quadtree->moyennes[level];
+        for (uint32_t column = 0; column < width; column++) pixels[column] = moyennes[node_index(x + column, y + row)];
+    }
+}
+
+/**
+ * @brief Tells if a requested path stays under the working directory of the server.
+ *
+ * @param path Requested path.
+ * @return 1 if it is relative and has no ".." component, 0 otherwise.
+ */
+static int is_served_path(const char * path) {
+    if (path[0] == '/') return 0;
+    for (const char * part = path; part; part = strchr(part, '/') ? strchr(part, '/') + 1 : NULL) {
+        if (part[0] == '.' && part[1] == '.' && (part[2] == '/' || part[2] == '\0')) return 0;
+    }
+    return 1;
+}
+
+/**
+ * @brief Answers a GET request: the means of a level, or of a window of it, as a P5 PGM image.
+ *
+ * @param state State of the server.
+ * @param fd Socket of the connection.
+ * @param path Requested file.
+ * @param level Requested level, clamped to the levels of the Quadtree.
+ * @param window Window x, y, w, h in the level, NULL for the whole level.
+ * @param context Context of the worker.
+ * @param response Buffer of the worker holding the response.
+ * @return 1 if the response was sent, 0 if the connection is closed.
+ */
+static int serve_get(ServerState * state, int fd, const char * path, int level, const int * window, QtcContext * context, Scratch * response) {
+    if (!is_served_path(path)) return send_error(fd, "only relative paths without '..' are served");
+    struct stat st;
+    if (stat(path, &st) || !S_ISREG(st.st_mode) || access(path, R_OK)) {
+        char message[SERVER_LINE + 32];
+        snprintf(message, sizeof(message), "can't open %s", path);
+        return send_error(fd, message);
+    }
+    QtcStatus status;
+    CacheEntry * entry = acquire_entry(state->cache, path, &st, context, &status);
+    if (!entry) {
+        if (status == QTC_ERROR_MEMORY) return send_error(fd, "out of memory");
+        // Their Quadtree is not in the file: a delta needs the previous frames, a Q5 file holds one per plane
+        if (status == QTC_ERROR_ARGUMENT) return send_error(fd, "delta (Q4) frames and multi-plane (Q5) files can't be served on their own");
+        return send_error(fd, "invalid QTC file");
+    }
+    const Quadtree * quadtree = entry->quadtree;
+    if (level > quadtree->levels) level = quadtree->levels;
+    long long side = 1LL << level;
+    long long x = 0, y = 0, width = side, height = side;
+    if (window) {
+        x = window[0];
+        y = window[1];
+        width = window[2];
+        height = window[3];
+    }
+    int sent;
+    if (x < 0 || y < 0 || width < 1 || height < 1 || x + width > side || y + height > side) {
+        sent = send_error(fd, "window out of the level");
+    } else {
+        char header[64];
+        int length = snprintf(header, sizeof(header), "P5\n%lld %lld\n255\n", width, height);
+        size_t size = length + (size_t) (width * height);
+        unsigned char * data = (unsigned char *) scratch_reserve(response, size);
+        if (data) {
+            memcpy(data, header, length);
+            copy_window(quadtree, level, x, y, width, height, data + length);
+            sent = send_all(fd, data, size);
+        } else {
+            sent = send_error(fd, "out of memory");
+        }
+    }
+    release_entry(state->cache, entry);
+    return sent;
+}
+
+/**
+ * @brief Answers a STATS request with the counters of the cache.
+ *
+ * @param state State of the server.
+ * @param fd Socket of the connection.
+ * @return 1 if the response was sent, 0 if the connection is closed.
+ */
+static int serve_stats(ServerState * state, int fd) {
+    TileCache * cache = state->cache;
+    char line[256];
+    pthread_mutex_lock(&cache->lock);
+    int length = snprintf(line, sizeof(line), "STATS entries %zu bytes %zu capacity %zu hits %llu misses %llu evictions %llu\n",
+                          cache->entries, cache->bytes, cache->capacity, (unsigned long long) cache->hits,
+                          (unsigned long long) cache->misses, (unsigned long long) cache->evictions);
+    pthread_mutex_unlock(&cache->lock);
+    return send_all(fd, line, length);
+}
+
+/**
+ * @brief Parses and answers a request line.
+ *
+ * @param state State of the server.
+ * @param fd Socket of the connection.
+ * @param line Request line.
+ * @param context Context of the worker.
+ * @param response Buffer of the worker holding the response.
+ * @return 1 if the response was sent, 0 if the connection is closed.
+ */
+static int serve_request(ServerState * state, int fd, const char * line, QtcContext * context, Scratch * response) {
+    char command[8], path[SERVER_LINE];
+    int level = QUADTREE_MAX_LEVELS, window[4];
+    int fields = sscanf(line, "%7s %4095s %d %d %d %d %d", command, path, &level, &window[0], &window[1], &window[2], &window[3]);
+    if (fields < 1) return 1; // Empty line
+    if (!strcmp(command, "STATS") && fields == 1) return serve_stats(state, fd);
+    if (strcmp(command, "GET") || (fields != 2 && fields != 3 && fields != 7) || level < 0) {
+        return send_error(fd, "usage: GET <file.qtc> [level [x y w h]] or STATS");
+    }
+    if (state->verbose) fprintf(stdout, "%s", line);
+    return serve_get(state, fd, path, level, fields == 7 ? window : NULL, context, response);
+}
+
+/**
+ * @brief Answers the requests of a connection until the client closes it.
+ *
+ * @param state State of the server.
+ * @param fd Socket of the connection, closed on return.
+ * @param context Context of the worker.
+ * @param response Buffer of the worker holding the responses.
+ */
+static void serve_connection(ServerState * state, int fd, QtcContext * context, Scratch * response) {
+    FILE * input = fdopen(fd, "r");
+    if (!input) {
+        close(fd);
+        return;
+    }
+    char line[SERVER_LINE];
+    while (fgets(line, sizeof(line), input)) {
+        if (!strchr(line, '\n') && !feof(input)) {
+            send_error(fd, "request line too long");
+            break;
+        }
+        if (!serve_request(state, fd, line, context, response)) break;
+    }
+    fclose(input);
+}
+
+/**
+ * @brief Worker of the server: accepts the next connection and serves it, forever.
+ *
+ * @param arg Pointer to the ServerState.
+ * @return Never returns.
+ */
+static void * server_worker(void * arg) {
+    ServerState * state = (ServerState *) arg;
+    QtcContext context;
+    init_context(&context);
+    Scratch response = {NULL, 0};
+    for (;;) {
+        int fd = accept(state->listener, NULL, NULL);
+        if (fd < 0) continue; // Connection aborted or interrupted call
+        serve_connection(state, fd, &context, &response);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Opens the listening socket of the server.
+ *
+ * @param address TCP port on 127.0.0.1 if it is a number, path of a Unix socket otherwise (replaced if it exists).
+ * @return The socket, -1 on errors.
+ */
+static int open_listener(const char * address) {
+    char * end;
+    long port = strtol(address, &end, 10);
+    int fd;
+    if (*address && !*end) {
+        if (port < 1 || port > 65535) return -1;
+        struct sockaddr_in inet;
+        memset(&inet, 0, sizeof(inet));
+        inet.sin_family = AF_INET;
+        inet.sin_port = htons((uint16_t) port);
+        inet.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        int reuse = 1;
+        if (fd >= 0 && (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) || bind(fd, (struct sockaddr *) &inet, sizeof(inet)))) {
+            close(fd);
+            fd = -1;
+        }
+    } else {
+        struct sockaddr_un local;
+        memset(&local, 0, sizeof(local));
+        local.sun_family = AF_UNIX;
+        if (strlen(address) >= sizeof(local.sun_path)) return -1;
+        strcpy(local.sun_path, address);
+        unlink(address);
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd >= 0 && bind(fd, (struct sockaddr *) &local, sizeof(local))) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    if (fd >= 0 && listen(fd, SOMAXCONN)) {
+        close(fd);
+        fd = -1;
+    }
+    return fd;
+}
+
+/**
+ * @brief Serves the levels and windows of QTC files over a socket, until the process is stopped.
+ *
+ * The workers accept the connections on the same socket, a connection stays with its worker
+ * until it is closed and the decoded Quadtrees are shared by all of them.
+ *
+ * @param address TCP port on 127.0.0.1 if it is a number, path of a Unix socket otherwise.
+ * @param options Parameters of the server.
+ * @note Exits program with an error message if the socket can't be opened, never returns otherwise.
+ */
+void run_server(const char * address, const ServerOptions * options) {
+    int listener = open_listener(address);
+    if (listener < 0) {
+        fprintf(stderr, "Error while opening the socket %s\n", address);
+        exit(EXIT_FAILURE);
+    }
+    TileCache cache;
+    memset(&cache, 0, sizeof(cache));
+    cache.capacity = options->cache_bytes;
+    pthread_mutex_init(&cache.lock, NULL);
+    pthread_cond_init(&cache.loaded, NULL);
+    ServerState state = {&cache, listener, options->verbose};
+
+    int workers = options->workers < 1 ? 1 : options->workers;
+    for (int i = 1; i < workers; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, server_worker, &state)) {
+            fprintf(stderr, "Error while creating the server workers.\n");
+            exit(EXIT_FAILURE);
+        }
+        pthread_detach(thread);
+    }
+    fprintf(stdout, "Serving on %s with %d workers and a cache of %zu MiB\n", address, workers, options->cache_bytes >> 20);
+    fflush(stdout);
+    server_worker(&state);
+}
@@ -0,0 +1,214 @@
+/**
+ * @file stats.c
+ * @brief Implementation of the codec statistics.
+ *
+ * The counters are incremented by the coding loops once per level (or per node for the `u` fields),
+ * with the nodes and the bits they actually wrote or read.
+ */
+
+#include "stats.h"
+#include <string.h>
+
+/**
+ * @brief Names of the stages, in QtcStage order.
+ */
+static const char * stage_names[QTC_STAGE_COUNT] = {"read", "build", "filter", "encode", "decode", "image", "write"};
+
+/**
+ * @brief Clears the statistics.
+ *
+ * @param stats Statistics to clear.
+ */
+void init_stats(QtcStats * stats) {
+    memset(stats, 0, sizeof(QtcStats));
+}
+
+/**
+ * @brief Returns the time of a monotonic clock, to time a stage.
+ *
+ * @return Time in seconds.
+ */
+double stats_clock(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/**
+ * @brief Adds the time elapsed since `start` to a stage.
+ *
+ * @param stats Statistics to update, nothing is done if NULL.
+ * @param stage Stage timed.
+ * @param start Time returned by stats_clock() when the stage started.
+ */
+void stats_stage(QtcStats * stats, QtcStage stage, double start) {
+    if (stats) stats->seconds[stage] += stats_clock() - start;
+}
+
+/**
+ * @brief Counts the nodes of a level walked by a coding loop.
+ *
+ * The 4th children are interpolated, a 4th leaf has no field left. Below a uniform node of level L,
+ * the 4 + 16 + ... + 4^(levels - L) descendants are skipped.
+ *
+ * @param stats Statistics to update, nothing is done if NULL.
+ * @param levels Levels of the Quadtree.
+ * @param level Level of the nodes.
+ * @param nodes Nodes walked: 1 for the root, else the 4 children of each non-uniform parent.
+ * @param uniform Uniform non-leaf nodes among them, whose descendants are skipped.
+ */
+void stats_nodes(QtcStats * stats, int levels, int level, uint64_t nodes, uint64_t uniform) {
+    if (!stats) return;
+    uint64_t interpolated = level ? nodes / 4 : 0;
+    stats->nodes_visited += nodes;
+    stats->nodes_emitted += level == levels ? nodes - interpolated : nodes;
+    stats->interpolations += interpolated;
+    if (level < levels) stats->nodes_skipped += uniform * (((((uint64_t) 1) << (2 * (levels - level) + 2)) - 4) / 3);
+}
+
+/**
+ * @brief Counts the fields of Q1 (or Q2) nodes written or read by a coding loop.
+ *
+ * @param stats Statistics to update, nothing is done if NULL.
+ * @param moyennes Number of `moyenne` fields (8 bits each).
+ * @param epsilons Number of `epsilon` fields (2 bits each).
+ * @param us Number of `u` fields (1 bit each).
+ */
+void stats_fields(QtcStats * stats, uint64_t moyennes, uint64_t epsilons, uint64_t us) {
+    if (!stats) return;
+    stats->bits_moyenne += 8 * moyennes;
+    stats->bits_epsilon += 2 * epsilons;
+    stats->bits_u += us;
+}
+
+/**
+ * @brief Counts the rANS cost of the symbols of Q3 levels coded or decoded.
+ *
+ * The mean residuals go to `bits_moyenne`, the flags symbols (`epsilon` and `u`) to `bits_epsilon`.
+ *
+ * @param stats Statistics to update, nothing is done if NULL.
+ * @param levels Levels of the Quadtree.
+ * @param last Last level coded.
+ * @param models Models of every level (see QTC_Q3_FLAGS for their order).
+ * @param counts RANS_MAX_SYMBOLS counters per model, the symbols coded.
+ */
+void stats_q3_fields(QtcStats * stats, int levels, int last, const RansModel * models, const uint32_t * counts) {
+    if (!stats) return;
+    for (int level = 1; level <= last; level++) {
+        const uint32_t * flags = counts + (2 * level - 2) * RANS_MAX_SYMBOLS;
+        if (level < levels) stats->bits_epsilon += rans_cost(models + 2 * level - 2, flags, QTC_Q3_FLAGS);
+        stats->bits_moyenne += rans_cost(models + 2 * level - 1, flags + RANS_MAX_SYMBOLS, RANS_MAX_SYMBOLS);
+    }
+}
+
+/**
+ * @brief Counts the bits of a whole payload that are not in the fields, once it is coded.
+ *
+ * They are the levels byte and the last byte padding, for Q2 the split, the chunks padding and the offset table,
+ * for Q3 the root bytes, the models and the rANS states.
+ *
+ * @param stats Statistics to update, nothing is done if NULL.
+ * @param format Format of the payload.
+ * @param fields Bits of the fields before the payload was coded (see stats_field_bits()).
+ * @param bytes Size of the payload.
+ */
+void stats_payload(QtcStats * stats, int format, uint64_t fields, uint64_t bytes) {
+    if (!stats) return;
+    uint64_t coded = stats_field_bits(stats) - fields;
+    stats->format = format;
+    stats->bits_header += 8 * bytes > coded ? 8 * bytes - coded : 0;
+}
+
+/**
+ * @brief Returns the bits of the fields counted so far.
+ *
+ * @param stats Current statistics, NULL gives 0.
+ * @return Sum of the `moyenne`, `epsilon` and `u` bits.
+ */
+uint64_t stats_field_bits(const QtcStats * stats) {
+    return stats ? stats->bits_moyenne + stats->bits_epsilon + stats->bits_u : 0;
+}
+
+/**
+ * @brief Adds the node and bits counters of a part of the work (one thread) to the statistics.
+ *
+ * @param stats Statistics to update, nothing is done if NULL.
+ * @param part Counters of the part.
+ */
+void merge_stats(QtcStats * stats, const QtcStats * part) {
+    if (!stats) return;
+    stats->nodes_visited += part->nodes_visited;
+    stats->nodes_emitted += part->nodes_emitted;
+    stats->nodes_skipped += part->nodes_skipped;
+    stats->interpolations += part->interpolations;
+    stats->bits_moyenne += part->bits_moyenne;
+    stats->bits_epsilon += part->bits_epsilon;
+    stats->bits_u += part->bits_u;
+}
+
+/**
+ * @brief Counts the uniform non-leaf nodes of a Quadtree.
+ *
+ * @param quadtree Current Quadtree.
+ * @return Number of nodes whose `u` is 1.
+ */
+uint64_t count_uniform_nodes(const Quadtree * quadtree) {
+    uint64_t count = 0;
+    for (int level = 0; level < quadtree->levels; level++) {
+        int64_t total = nodes_in_level(level);
+        for (int64_t j = 0; j < total; j++) count += get_u(quadtree, level, j);
+    }
+    return count;
+}
+
+/**
+ * @brief Returns the PSNR of 8 bit pixels from their squared error.
+ *
+ * PSNR = 10 log10(255^2 / MSE), the MSE being the squared error over the number of pixels.
+ *
+ * @param squared_error Sum of the squared differences between the decoded pixels and the pixels.
+ * @param pixels Number of pixels.
+ * @return PSNR in dB, INFINITY if the error is 0.
+ */
+double psnr_of_error(uint64_t squared_error, uint64_t pixels) {
+    if (!squared_error) return INFINITY;
+    return 10. * log10(255. * 255. * (double) pixels / (double) squared_error);
+}
+
+/**
+ * @brief Prints the statistics, one value per line.
+ *
+ * Only the stages that ran are printed.
+ *
+ * @param out Output stream.
+ * @param stats Statistics to print.
+ */
+void print_stats(FILE * out, const QtcStats * stats) {
+    double total = 0.;
+    for (int s = 0; s < QTC_STAGE_COUNT; s++) total += stats->seconds[s];
+    fprintf(out, "Stats:\n");
+    for (int s = 0; s < QTC_STAGE_COUNT; s++) {
+        if (stats->seconds[s] > 0) fprintf(out, "  time %-8s %10.3f ms\n", stage_names[s], stats->seconds[s] * 1e3);
+    }
+    fprintf(out, "  time %-8s %10.3f ms\n", "total", total * 1e3);
+    fprintf(out, "  nodes visited   %12llu\n", (unsigned long long) stats->nodes_visited);
+    fprintf(out, "  nodes emitted   %12llu\n", (unsigned long long) stats->nodes_emitted);
+    fprintf(out, "  nodes skipped   %12llu (under a uniform node)\n", (unsigned long long) stats->nodes_skipped);
+    fprintf(out, "  interpolations  %12llu (4th children)\n", (unsigned long long) stats->interpolations);
+    fprintf(out, "  uniformized     %12llu (by filtrage)\n", (unsigned long long) stats->uniformized);
+    if (stats->pixels) {
+        fprintf(out, "  mse             %12.4f\n", (double) stats->squared_error / (double) stats->pixels);
+        fprintf(out, "  psnr            %12.4f dB\n", psnr_of_error(stats->squared_error, stats->pixels));
+    }
+    fprintf(out, "  bits header     %12llu (Q%d, outside the fields)\n", (unsigned long long) stats->bits_header, stats->format);
+    if (stats->format == 3) {
+        fprintf(out, "  bits moyenne    %12llu (rANS, mean residuals)\n", (unsigned long long) stats->bits_moyenne);
+        fprintf(out, "  bits flags      %12llu (rANS, epsilon and u)\n", (unsigned long long) stats->bits_epsilon);
+    } else {
+        fprintf(out, "  bits moyenne    %12llu\n", (unsigned long long) stats->bits_moyenne);
+        fprintf(out, "  bits epsilon    %12llu\n", (unsigned long long) stats->bits_epsilon);
+        fprintf(out, "  bits u          %12llu\n", (unsigned long long) stats->bits_u);
+    }
+    fprintf(out, "  payload bytes   %12llu\n", (unsigned long long) stats->payload_bytes);
+    fprintf(out, "  bytes allocated %12llu\n", (unsigned long long) stats->bytes_allocated);
+}
@@ -6,327 +6,811 @@
  */
 
 #include "utils.h"
+#include "encode.h"
+#include "planes.h"
+#include <ctype.h>
+#include <limits.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
-/*
-Why did i use fgets and sscanf, because in the documentation of fscanf,
-it is recommended not to use fscanf and instead use fgets and sscanf.
-
-Possible improvements : 
+/**
+ * @brief Size of the chunks read by the P2 parser.
+ */
+#define PGM_P2_CHUNK (1 << 16)
+#define PGM_P5_BAND (1 << 16) // Bytes of the rows read at a time to put a P5 image in leaf order
 
-- Change the retrun value of readline to an int and retrun the number of elements in the line.
-This would help avoid the case where the dimensions are each on a separate line, as currently, 
-the dimensions are read on he same line as he grayscale value.
+/**
+ * @brief Prints an error message, closes the file and exits.
+ * 
+ * @param file File to close.
+ * @param error_message Error message to display.
+ */
+static void pgm_error(FILE * file, const char * error_message) {
+    fprintf(stderr, "%s\n", error_message);
+    fclose(file);
+    exit(EXIT_FAILURE);
+}
 
-- Add a function specifically for reading the image dimension to reduce code duplication in the two functions that handle reading PGM files.
-*/
+/**
+ * @brief Prints the error message of a reader that doesn't exit.
+ * 
+ * @param error_message Error message to display.
+ * @param status Status of the error.
+ * @return `status`.
+ */
+static QtcStatus pgm_failure(const char * error_message, QtcStatus status) {
+    fprintf(stderr, "%s\n", error_message);
+    return status;
+}
 
 /**
- * @brief Global variable used to store compression information.
+ * @brief Closes the file and exits if a reader failed, its error message is already printed.
  * 
- * Stocks metadata about the compression process such as the date and compression rate.
+ * @param file File to close.
+ * @param status Status returned by the reader.
  */
-char compression_info[128]; 
+static void pgm_check(FILE * file, QtcStatus status) {
+    if (status == QTC_OK) return;
+    fclose(file);
+    exit(EXIT_FAILURE);
+}
 
 /**
- * @brief Reads a line from a file and handles errors.
+ * @brief Reads an int value of a PGM header.
  * 
- * Reads a line of text from the specified file. If an error occurs during the read,
- * an error message is printed, and the program exits.
+ * Skips the whitespaces and the comments (from `#` to the end of the line) before the value,
+ * so the values can be on one or several lines. The character following the value is consumed,
+ * as the single whitespace that ends the header.
  * 
- * @param file Pointer to the file to read from.
- * @param line Buffer to store the line.
- * @param size Size of the buffer.
+ * @param file Pointer to file to read from.
+ * @param value Pointer to store the parsed int value.
  * @param error_message Error message to display in case of failure.
+ * @return QTC_OK, or QTC_ERROR_CORRUPT if there is no valid value.
  */
-static void readline(FILE * file, char * line, int size, char * error_message) {
-    if (!fgets(line, size, file)) {
-        fprintf(stderr, "%s\n", error_message);
-        fclose(file);
-        exit(EXIT_FAILURE);
+static QtcStatus read_header_int(FILE * file, int * value, const char * error_message) {
+    int c = fgetc(file);
+    while (c == '#' || (c != EOF && isspace(c))) {
+        if (c == '#') {
+            while (c != '\n' && c != EOF) c = fgetc(file);
+        }
+        c = fgetc(file);
     }
+    if (c == EOF || !isdigit(c)) return pgm_failure(error_message, QTC_ERROR_CORRUPT);
+    long v = 0;
+    while (c != EOF && isdigit(c)) {
+        v = v * 10 + (c - '0');
+        if (v > INT_MAX) return pgm_failure(error_message, QTC_ERROR_CORRUPT);
+        c = fgetc(file);
+    }
+    if (c == '#') ungetc(c, file); // A comment may follow a value without whitespace
+    *value = v;
+    return QTC_OK;
 }
 
 /**
- * @brief Skips comments in a PGM file.
- * 
- * Reads and skips linnes starting with `#` (comments) in a PGM file.
- * Stops when a non-comment line occurs.
+ * @brief Checks that an image can be compressed: square, with a size power of 2, and 8-bit samples.
  * 
- * @param file File pointer to read from.
- * @param line Buffer to store the line.
- * @param size Size of the buffer.
+ * @param width Width of the image.
+ * @param height Height of the image.
+ * @param max_val Maximum sample value.
+ * @return QTC_OK, or QTC_ERROR_ARGUMENT for an image that can't be compressed.
  */
-static void ignore_comments(FILE * file, char * line, int size) {
-    unsigned char c = fgetc(file); // Read the line first caracter
-    while(c == '#') {
-        readline(file, line, size, "Error while reading comments.");
-        c = fgetc(file); 
+static QtcStatus check_pgm_size(int width, int height, int max_val) {
+    if (max_val < 1 || max_val > 255) return pgm_failure("Unsupported max grayscale value.", QTC_ERROR_ARGUMENT);
+    if (width != height || width < 1 || width > (1 << QUADTREE_MAX_LEVELS) || (width & (width - 1))) {
+        return pgm_failure("Image must be square with a size power of 2.", QTC_ERROR_ARGUMENT);
     }
-    ungetc(c, file); // Putback the readed caracter if its not a #
-    return;
+    return QTC_OK;
 }
 
 /**
- * @brief Reads an int value from a line.
+ * @brief Reads the header of a PGM file.
  * 
- * Parses an int value from a line of text. If parsing fails, an error message is displayed,
- * and the program exits.
+ * Reads the format, the dimensions and the maximum grayscale value, and checks that the image
+ * can be compressed: square, with a size power of 2, and 8-bit pixels.
+ * The file is left on the first pixel.
  * 
- * @param file Pointer to file for error handling.
- * @param line Line to parse.
- * @param value Pointer to store the parsed int value.
- * @param error_message Error message to display in case of failure.
+ * @param file Pointer to file to read from.
+ * @param format 2 for a P2 file, 5 for a P5 file on output.
+ * @param width Width of the image on output.
+ * @param max_val Maximum grayscale value on output.
+ * @return QTC_OK, QTC_ERROR_CORRUPT for an invalid header, or QTC_ERROR_ARGUMENT for an image that can't be compressed.
  */
-static void scan_int(FILE * file, char * line, int * value, char * error_message) {
-    if (sscanf(line, "%d", value) != 1) {
-        fprintf(stderr, "%s\n", error_message);
-        fclose(file);
-        exit(EXIT_FAILURE);
+static QtcStatus read_pgm_header(FILE * file, int * format, int * width, int * max_val) {
+    int height;
+    if (fgetc(file) != 'P') return pgm_failure("Error while reading file format.", QTC_ERROR_CORRUPT);
+    *format = fgetc(file) - '0';
+    if (*format == 6 || *format == 7) return pgm_failure("Color image, it is read from a .ppm or .pam file.", QTC_ERROR_ARGUMENT);
+    if (*format != 2 && *format != 5) return pgm_failure("Unsupported file format.", QTC_ERROR_CORRUPT);
+    QtcStatus status = read_header_int(file, width, "Error while reading image width.");
+    if (status == QTC_OK) status = read_header_int(file, &height, "Error while reading image height.");
+    if (status == QTC_OK) status = read_header_int(file, max_val, "Error while reading max grayscale value.");
+    if (status == QTC_OK) status = check_pgm_size(*width, height, *max_val);
+    return status;
+}
+
+/**
+ * @brief Reads the header of a PAM file (P7), after its format.
+ * 
+ * Lines of a keyword and its value up to ENDHDR, comments included. The samples of a pixel are given
+ * by DEPTH, TUPLTYPE is not checked. The file is left on the first sample.
+ * 
+ * @param file Pointer to file to read from.
+ * @param width Width of the image on output.
+ * @param height Height of the image on output.
+ * @param depth Number of samples of a pixel on output.
+ * @param max_val Maximum sample value on output.
+ */
+static void read_pam_header(FILE * file, int * width, int * height, int * depth, int * max_val) {
+    char keyword[16];
+    *width = *height = *depth = *max_val = -1;
+    for (;;) {
+        if (fscanf(file, " %15s", keyword) != 1) pgm_error(file, "Error while reading the PAM header.");
+        if (!strcmp(keyword, "ENDHDR")) break;
+        if (keyword[0] == '#' || !strcmp(keyword, "TUPLTYPE")) {
+            int c = fgetc(file);
+            while (c != '\n' && c != EOF) c = fgetc(file);
+            continue;
+        }
+        int * value = !strcmp(keyword, "WIDTH") ? width : !strcmp(keyword, "HEIGHT") ? height :
+                      !strcmp(keyword, "DEPTH") ? depth : !strcmp(keyword, "MAXVAL") ? max_val : NULL;
+        if (!value) pgm_error(file, "Unknown keyword in the PAM header.");
+        pgm_check(file, read_header_int(file, value, "Error while reading the PAM header."));
     }
+    if (fgetc(file) != '\n') pgm_error(file, "Error while reading the PAM header.");
 }
 
 /**
- * @brief Validates a pixel value.
+ * @brief Checks that all the pixels are in the valid range (0 to max_val).
  * 
- * Checks if a pixel value is within the valid range (0 to max_val).
- * If the value is invalid, an error message is displayed, and the program exits.
+ * With SSE2, the maximum of the pixels is computed 16 bytes at a time.
  * 
- * @param file Pointer to file for error handling.
- * @param image Pointer to the Image for cleanup in case of error.
- * @param pxeil Pixel value to check.
+ * @param pixels Pixels to check.
+ * @param size Number of pixels.
  * @param max_val Maximum valid pixel value.
+ * @return 1 if all the pixels are valid, 0 otherwise.
  */
-static void check_pixel_value(FILE * file, Image * image, int pixel, int max_val) {
-    if (pixel < 0 || pixel > max_val) {
-        fprintf(stderr, "EError invalid pixel value.\n");
-        fclose(file);
-        free(image);
-        exit(EXIT_FAILURE);
+static int pixels_in_range(const unsigned char * pixels, size_t size, int max_val) {
+    if (max_val >= 255) return 1;
+    unsigned char max = 0;
+    size_t i = 0;
+#ifdef __SSE2__
+    __m128i vmax = _mm_setzero_si128();
+    for (; i + 64 <= size; i += 64) {
+        __m128i a = _mm_max_epu8(_mm_loadu_si128((const __m128i *) (pixels + i)), _mm_loadu_si128((const __m128i *) (pixels + i + 16)));
+        __m128i b = _mm_max_epu8(_mm_loadu_si128((const __m128i *) (pixels + i + 32)), _mm_loadu_si128((const __m128i *) (pixels + i + 48)));
+        vmax = _mm_max_epu8(vmax, _mm_max_epu8(a, b));
+    }
+    vmax = _mm_max_epu8(vmax, _mm_srli_si128(vmax, 8));
+    vmax = _mm_max_epu8(vmax, _mm_srli_si128(vmax, 4));
+    vmax = _mm_max_epu8(vmax, _mm_srli_si128(vmax, 2));
+    vmax = _mm_max_epu8(vmax, _mm_srli_si128(vmax, 1));
+    max = _mm_cvtsi128_si32(vmax) & 0xFF;
+#endif
+    for (; i < size; i++) {
+        if (pixels[i] > max) max = pixels[i];
     }
+    return max <= max_val;
 }
 
 /**
- * @brief Reads a PGM image in P2 format.
+ * @brief Reads the pixels of a PGM image in P2 format.
  * 
- * Reads an ASCII PGM image (P2 format) from the specified file and stores it in an Image struture.
+ * Parses the ASCII values in fixed-size chunks, a value split between two chunks is carried over.
  * 
- * @param file Pointer to file to read from.
- * @preturn Pointer to the allocated Image structure.
- */
-static Image* read_pgm_P2(FILE * file) {
-    char line[128];
-    int width, height, max_val;
-
-    // Reads file format
-    readline(file, line, sizeof(line), "Error while reading file format.");
-
-    // Ignoring comments
-    ignore_comments(file, line, sizeof(line));
-
-    // Reads width and height
-    readline(file, line, sizeof(line), "Error while reading width/height.");
-    scan_int(file, line, &width, "Error while reading image width.");
-    scan_int(file, line, &height, "Error while reading image height.");
-
-    // Reads grayscale
-    readline(file, line, sizeof(line), "Error while reading max grayscale value.");
-    scan_int(file, line, &max_val, "Error while reading max grayscale value.");
-
-    // Allocation memory for Image structure
-    int image_size = width * height;
-    Image *image = allocate_image(width, image_size, max_val);
-
-    // Reads Image pixels
-    char data[image_size * 4]; // a line = 4 * image_size (max val = 255 so 3 char + space 4 char) * image_size number of pixel on a line
-    int i = 0;
-    while(i < image_size) {
-        readline(file, data, sizeof(data), "Error while reading pixels values.");
-        // Use strtok to split pixels values on a same line
-        char * token = strtok(line, " ");
-        while (token != NULL && i < image_size) {
-            int pixel = strtol(token, NULL, 10); // Convertion of a string to a long base 10
-            check_pixel_value(file, image, pixel, max_val);
-            image->image[i] = (unsigned char) pixel;
-            i++;
-            token = strtok(NULL, " "); // Move the pointer on token
+ * @param file Pointer to file to read from, on the first pixel.
+ * @param image Image receiving the pixels.
+ * @return QTC_OK, QTC_ERROR_CORRUPT for missing or invalid pixels, or QTC_ERROR_MEMORY.
+ */
+static QtcStatus read_pgm_P2(FILE * file, Image * image) {
+    char * chunk = (char *) malloc(PGM_P2_CHUNK);
+    if (!chunk) return pgm_failure("Error while allocating memory for the P2 parser.", QTC_ERROR_MEMORY);
+    const char * error = NULL;
+    size_t i = 0, n;
+    int value = 0, in_value = 0, in_comment = 0;
+    while (!error && i < image->image_size && (n = fread(chunk, 1, PGM_P2_CHUNK, file)) > 0) {
+        for (size_t k = 0; !error && k < n && i < image->image_size; k++) {
+            unsigned char c = chunk[k];
+            if (in_comment) {
+                in_comment = c != '\n';
+            } else if (c >= '0' && c <= '9') {
+                value = value * 10 + (c - '0');
+                in_value = 1;
+                if (value > image->max_val) error = "Error invalid pixel value.";
+            } else if (isspace(c) || c == '#') {
+                if (in_value) image->image[i++] = value;
+                value = in_value = 0;
+                in_comment = c == '#';
+            } else {
+                error = "Error while reading pixels values.";
+            }
         }
     }
-
-    fclose(file);
-    return image;
+    if (!error && in_value && i < image->image_size) image->image[i++] = value; // Last value at the end of the file
+    free(chunk);
+    if (!error && i < image->image_size) error = "Error while reading pixels values.";
+    return error ? pgm_failure(error, QTC_ERROR_CORRUPT) : QTC_OK;
 }
 
 /**
- * @brief Reads a PGM image in P5 format.
+ * @brief Reads the pixels of a PGM image in P5 format.
  * 
- * Reads a binary PGM image (P5 format) form the specified file and stores int in an Image structure.
+ * Reads the whole raster with a single fread, then checks the range of the pixels.
  * 
- * @param file Pointer to file to read from.
- * @return Pointer to the allocated Image structure.
+ * @param file Pointer to file to read from, on the first pixel.
+ * @param image Image receiving the pixels.
+ * @return QTC_OK, or QTC_ERROR_CORRUPT for missing or invalid pixels.
  */
-static Image* read_pgm_P5(FILE * file) {
-    char line[128];
-    int width, height, max_val;
-
-    // Reads file format
-    readline(file, line, sizeof(line), "Error while reading file format.");
-
-    // Ignores comments
-    ignore_comments(file, line, sizeof(line));
-
-    // Reads width and height
-    readline(file, line, sizeof(line), "Error while reading width/height.");
-    scan_int(file, line, &width, "Error while reading image width.");
-    scan_int(file, line, &height, "Error while reading image height.");
-
-    // reads grayscale
-    readline(file, line, sizeof(line), "Error while reading max grayscale value.");
-    scan_int(file, line, &max_val, "Error while reading max grayscale value.");
-
-    // Memory allocation for Image structure
-    int image_size = width * height;
-    Image *image = allocate_image(width, image_size, max_val);
-
-    // Reads image pixels values
-    int i = 0;
-    while(i < image_size) {
-        int pixel = fgetc(file);
+static QtcStatus read_pgm_P5(FILE * file, Image * image) {
+    if (fread(image->image, 1, image->image_size, file) != image->image_size) {
+        return pgm_failure("Error while reading pixels values.", QTC_ERROR_CORRUPT);
+    }
+    if (!pixels_in_range(image->image, image->image_size, image->max_val)) {
+        return pgm_failure("Error invalid pixel value.", QTC_ERROR_CORRUPT);
+    }
+    return QTC_OK;
+}
 
-        check_pixel_value(file, image, pixel, max_val);
-        image->image[i] = pixel;
-        i++;
+/**
+ * @brief Reads the pixels of a PGM image in P5 format straight into leaf order.
+ * 
+ * The raster is read by bands of rows (a multiple of 4, so the 4x4 blocs of raster_to_leaf_order() are whole),
+ * each band is checked and scattered into the Image while it is still in cache.
+ * 
+ * @param file Pointer to file to read from, on the first pixel.
+ * @param image Image receiving the pixels, with a size power of 2.
+ * @return QTC_OK, QTC_ERROR_CORRUPT for missing or invalid pixels, or QTC_ERROR_MEMORY.
+ */
+static QtcStatus read_pgm_P5_leaf_order(FILE * file, Image * image) {
+    int width = image->width;
+    int rows = PGM_P5_BAND / width < 4 ? 4 : PGM_P5_BAND / width;
+    if (rows > width) rows = width;
+    unsigned char * band = (unsigned char *) malloc((size_t) rows * width);
+    if (!band) return pgm_failure("Error while allocating memory for the pixels band.", QTC_ERROR_MEMORY);
+    for (int y = 0; y < width; y += rows) {
+        size_t size = (size_t) rows * width;
+        if (fread(band, 1, size, file) != size) {
+            free(band);
+            return pgm_failure("Error while reading pixels values.", QTC_ERROR_CORRUPT);
+        }
+        if (!pixels_in_range(band, size, image->max_val)) {
+            free(band);
+            return pgm_failure("Error invalid pixel value.", QTC_ERROR_CORRUPT);
+        }
+        raster_to_leaf_order(band, image->image, width, y, rows);
     }
+    free(band);
+    image->layout = IMAGE_LEAF_ORDER;
+    return QTC_OK;
+}
 
-    fclose(file);
-    return image;
+/**
+ * @brief Opens an input file, "-" being the standard input.
+ * 
+ * @param filename Path to the file.
+ * @return Opened file, NULL (reported) if it can't be opened.
+ */
+static FILE * try_open_input(const char * filename) {
+    FILE * file = strcmp(filename, "-") ? fopen(filename, "rb") : stdin;
+    if (!file) fprintf(stderr, "Error while opening file %s\n", filename);
+    return file;
+}
 
+/**
+ * @brief Opens an input file, "-" being the standard input.
+ * 
+ * @param filename Path to the file.
+ * @return Opened file, the program exits if it can't be opened.
+ */
+static FILE * open_input(const char * filename) {
+    FILE * file = try_open_input(filename);
+    if (!file) exit(EXIT_FAILURE);
+    return file;
 }
 
 /**
  * @brief Reads a PGM image from a file.
  * 
- * Determines the format of a PGM file (P2 or P5) and calls the appropriate function to read the file.
+ * Reads the header, then the pixels with the reader of the format (P2 or P5).
  * 
- * @param filename Path to the PGM file.
+ * @param filename Path to the PGM file, "-" for the standard input.
  * @return Pointer to the allocated Image structure.
  */
 Image* read_pgm(const char *filename) {
-    FILE * file = fopen(filename, "rb"); // Open file in read binary
-    if (!file) {
-        fprintf(stderr, "Error while opening file %s\n", filename);
-        exit(EXIT_FAILURE);
-    }
+    return read_pgm_layout(filename, IMAGE_RASTER);
+}
 
-    // Reads file format
-    char format[3];
-    readline(file, format, sizeof(format), "Error while reading file format.\n");
+/**
+ * @brief Reads a PGM image from a file, its pixels in the given order.
+ * 
+ * @see load_pgm()
+ * 
+ * @param filename Path to the PGM file, "-" for the standard input.
+ * @param layout Order of the pixels of the Image.
+ * @return Pointer to the allocated Image structure, the program exits if the file can't be read.
+ */
+Image * read_pgm_layout(const char * filename, ImageLayout layout) {
+    Image * image;
+    if (load_pgm(filename, layout, &image) != QTC_OK) exit(EXIT_FAILURE);
+    return image;
+}
 
-    // Calls the appropriate function
-    if (strncmp(format, "P2", 2) == 0) {
-        return read_pgm_P2(file);
-    } else if (strncmp(format, "P5", 2) == 0) {
-        return read_pgm_P5(file);
-    } else {
-        fprintf(stderr, "Unsupported file format.\n");
+/**
+ * @brief Reads a PGM image from a file, its pixels in the given order, without exiting on errors.
+ * 
+ * A P5 image is read straight into leaf order, a P2 image is converted once parsed.
+ * An image whose size isn't a power of 2 has no leaf order, it stays in raster order.
+ * The cause of a failure is printed on the standard error.
+ * 
+ * @param filename Path to the PGM file, "-" for the standard input.
+ * @param layout Order of the pixels of the Image.
+ * @param image Allocated Image on output, NULL on errors.
+ * @return QTC_OK, QTC_ERROR_ARGUMENT for a file that can't be opened or an image that can't be compressed,
+ * QTC_ERROR_CORRUPT for an invalid or truncated file, or QTC_ERROR_MEMORY.
+ */
+QtcStatus load_pgm(const char * filename, ImageLayout layout, Image ** image) {
+    *image = NULL;
+    FILE * file = try_open_input(filename);
+    if (!file) return QTC_ERROR_ARGUMENT;
+    int format, width, max_val;
+    QtcStatus status = read_pgm_header(file, &format, &width, &max_val);
+    if (status != QTC_OK) {
         fclose(file);
-        exit(EXIT_FAILURE);
+        return status;
+    }
+    Image * loaded = allocate_image(width, (size_t) width * width, max_val);
+    if (width & (width - 1)) layout = IMAGE_RASTER;
+    if (format == 2) {
+        status = read_pgm_P2(file, loaded);
+        if (status == QTC_OK) set_image_layout(loaded, layout);
+    } else if (layout == IMAGE_LEAF_ORDER) {
+        status = read_pgm_P5_leaf_order(file, loaded);
+    } else {
+        status = read_pgm_P5(file, loaded);
     }
+    fclose(file);
+    if (status != QTC_OK) {
+        free_image(loaded);
+        return status;
+    }
+    *image = loaded;
+    return QTC_OK;
 }
 
 /**
- * @brief Writes a BitStream to a file at Q1 format.
+ * @brief Reads a multi-plane image from a PPM (P6) or PAM (P7) file.
  * 
- * Writes a QTC file using a BitStream representation of the data.
+ * A P6 image has 3 samples per pixel (RGB), a P7 image as many as its DEPTH (4 for RGB and alpha).
+ * The samples are read in a single fread, interleaved as in the file.
  * 
- * @param file File pointer to write to.
- * @param stream BitStream containing the data.
- * @param quadtree Quadtree to retrieves info such as his levels and total_nodes.
+ * @param filename Path to the PPM or PAM file, "-" for the standard input.
+ * @return Pointer to the allocated ColorImage structure.
  */
-static void write_bitstream_to_file_Q1(FILE * file, BitStream *stream, Quadtree *quadtree) {
+ColorImage * read_ppm(const char * filename) {
+    FILE * file = open_input(filename);
+    int width, height, planes = 3, max_val;
+    if (fgetc(file) != 'P') pgm_error(file, "Error while reading file format.");
+    int format = fgetc(file) - '0';
+    if (format == 6) {
+        pgm_check(file, read_header_int(file, &width, "Error while reading image width."));
+        pgm_check(file, read_header_int(file, &height, "Error while reading image height."));
+        pgm_check(file, read_header_int(file, &max_val, "Error while reading max sample value."));
+    } else if (format == 7) {
+        read_pam_header(file, &width, &height, &planes, &max_val);
+        if (planes < 1 || planes > QTC_MAX_PLANES) pgm_error(file, "Unsupported number of planes.");
+    } else {
+        pgm_error(file, "Unsupported file format, a P6 or P7 image is expected.");
+    }
+    pgm_check(file, check_pgm_size(width, height, max_val));
+    ColorImage * image = allocate_color_image(width, planes, max_val);
+    size_t size = (size_t) width * width * planes;
+    if (fread(image->pixels, 1, size, file) != size) pgm_error(file, "Error while reading pixels values.");
+    if (!pixels_in_range(image->pixels, size, max_val)) pgm_error(file, "Error invalid pixel value.");
+    fclose(file);
+    return image;
+}
+
+/**
+ * @brief Formats the header of a QTC file.
+ * 
+ * Format line, then if `comments` is set the compression date and, when known, the compression rate.
+ * Leaving the comments out makes the output files depend only on their content.
+ * 
+ * @param header Buffer receiving the header.
+ * @param size Size of the buffer.
+ * @param format 1 for Q1, 2 for Q2, 3 for Q3, 4 for a delta frame, 5 for a multi-plane file.
+ * @param compression_rate Compression rate in percent, negative if unknown.
+ * @param comments Writes the date and compression rate comments if not 0.
+ * @return Size of the header in bytes.
+ */
+static size_t format_qtc_header(char * header, size_t size, int format, double compression_rate, int comments) {
     // Wrtting format
-    fprintf(file, "Q1\n");
+    size_t n = snprintf(header, size, "Q%d\n", format);
+    if (!comments) return n;
 
     // Adds comments with date of creation and compression rate
     time_t now = time(NULL);
-    if (now == (time_t)(-1)) {
+    char date[32];
+    if (now == (time_t)(-1) || !ctime_r(&now, date)) {
         fprintf(stderr, "Error while retrieving date.\n");
         exit(EXIT_FAILURE);
     }
-    snprintf(compression_info, sizeof(compression_info), "# Compression date : %s", ctime(&now));
-    fprintf(file, "%s", compression_info);
+    n += snprintf(header + n, size - n, "# Compression date : %s", date);
+    if (compression_rate >= 0) {
+        n += snprintf(header + n, size - n, "# Compression rate %.2f%%\n", compression_rate);
+    }
+    return n;
+}
 
-    size_t original_image_size = (1 << quadtree->levels) * (1 << quadtree->levels) * 8; // Size of an Image in bits
-    size_t compressed_image_size = (stream->ptr - stream->start) * 8 - 8; // Compressed size in bits
-    double compression_rate = 100.0 * compressed_image_size / original_image_size; // Compression rate
-    fprintf(file, "# Compression rate %.2f%%\n", compression_rate);
-    
-    // Wrtting encoded data
-    size_t bytes_to_write = stream->ptr - stream->start;
-    if (fwrite(stream->start, 1, bytes_to_write, file) != bytes_to_write) {
-        fprintf(stderr, "Error while reading encoded data.\n");
-        fclose(file);
+/**
+ * @brief Writes buffers into a file with a single system call.
+ * 
+ * The buffers are sent with writev, partial writes are resumed.
+ * 
+ * @param filename Path to the output file, "-" for the standard output.
+ * @param iov Buffers to write, modified as they are written.
+ * @param count Number of buffers.
+ */
+static void write_buffers(const char * filename, struct iovec * iov, int count) {
+    int to_stdout = !strcmp(filename, "-");
+    int fd = to_stdout ? STDOUT_FILENO : open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "Error while opening file %s\n", filename);
         exit(EXIT_FAILURE);
     }
-    fclose(file);
+    struct iovec * next = iov;
+    while (count) {
+        ssize_t written = writev(fd, next, count);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "Error while writing file %s\n", filename);
+            if (!to_stdout) close(fd);
+            exit(EXIT_FAILURE);
+        }
+        // Skips what has been written
+        while (count && (size_t) written >= next->iov_len) {
+            written -= next->iov_len;
+            next++;
+            count--;
+        }
+        if (count) {
+            next->iov_base = (char *) next->iov_base + written;
+            next->iov_len -= written;
+        }
+    }
+    if (!to_stdout && close(fd)) {
+        fprintf(stderr, "Error while writing file %s\n", filename);
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * @brief Writes a header and a payload into a file with a single system call.
+ * 
+ * @see write_buffers()
+ * 
+ * @param filename Path to the output file, "-" for the standard output.
+ * @param header Header of the file.
+ * @param header_size Size of the header in bytes.
+ * @param data Payload of the file.
+ * @param size Size of the payload in bytes.
+ */
+static void write_file(const char * filename, const char * header, size_t header_size, const unsigned char * data, size_t size) {
+    struct iovec iov[2] = {{(void *) header, header_size}, {(void *) data, size}};
+    write_buffers(filename, iov, 2);
 }
 
 /**
  * @brief Writes a BitStream to a QTC file.
  * 
- * Writes a BitStream and metadata (including compression information) to a QTC file.
+ * Writes a BitStream and metadata (including compression information) to a QTC file at Q1, Q2 or Q3 format,
+ * the format line follows stream->format.
  * 
  * @param filename Path to the output QTC file.
  * @param stream Pointer to the BitStream o write.
  * @param quadtree Pointer to the associaed Quadtree.
+ * @param comments Writes the date and compression rate comments if not 0.
  */
-void write_qtc(const char * filename, BitStream *stream, Quadtree *quadtree) {
-    FILE * file = fopen(filename, "wb");
-    if (!file) {
-        fprintf(stderr, "Error while opening file %s\n", filename);
+void write_qtc(const char * filename, BitStream *stream, Quadtree *quadtree, int comments) {
+    size_t original_image_size = (size_t) (1 << quadtree->levels) * (1 << quadtree->levels) * 8; // Size of an Image in bits
+    size_t compressed_image_size = (stream->ptr - stream->start) * 8 - 8; // Compressed size in bits
+    double compression_rate = 100.0 * compressed_image_size / original_image_size; // Compression rate
+    char header[192];
+    size_t header_size = format_qtc_header(header, sizeof(header), stream->format, compression_rate, comments);
+    write_file(filename, header, header_size, stream->start, stream->ptr - stream->start);
+}
+
+/**
+ * @brief Writes the planes of an image to a QTC file at Q5 format.
+ * 
+ * Format line and comments, head of the payload (see write_planes_head()), then the payload of each plane,
+ * all of them in a single system call.
+ * 
+ * @param filename Path to the output QTC file, "-" for the standard output.
+ * @param streams Payloads of the planes, as given by encode_planes().
+ * @param planes Number of planes.
+ * @param flags Flags given to encode_planes().
+ * @param width Width (and height) of the image.
+ * @param comments Writes the date and compression rate comments if not 0.
+ */
+void write_qtc_planes(const char * filename, BitStream ** streams, int planes, int flags, int width, int comments) {
+    unsigned char buffer[2 + 9 * QTC_MAX_PLANES];
+    BitStream head;
+    initBitStreamOver(&head, buffer, sizeof(buffer));
+    if (planes < 1 || planes > QTC_MAX_PLANES || write_planes_head(&head, streams, planes, flags) != QTC_OK) {
+        fprintf(stderr, "Unsupported number of planes.\n");
         exit(EXIT_FAILURE);
     }
-    write_bitstream_to_file_Q1(file, stream, quadtree);
+    size_t compressed_image_size = head.ptr - head.start; // Compressed size in bytes
+    struct iovec iov[2 + QTC_MAX_PLANES];
+    for (int p = 0; p < planes; p++) {
+        iov[2 + p] = (struct iovec) {streams[p]->start, streams[p]->ptr - streams[p]->start};
+        compressed_image_size += iov[2 + p].iov_len;
+    }
+    double compression_rate = 100.0 * compressed_image_size / ((double) width * width * planes);
+    char header[192];
+    iov[0] = (struct iovec) {header, format_qtc_header(header, sizeof(header), 5, compression_rate, comments)};
+    iov[1] = (struct iovec) {head.start, head.ptr - head.start};
+    write_buffers(filename, iov, 2 + planes);
+}
+
+/**
+ * @brief Compresses a P5 PGM image into a Q2 file without loading it in memory.
+ * 
+ * Reads the P5 header, then lets encode_q2_streaming() read the raster by bands and write the chunks
+ * as soon as they are encoded. The compression rate comment is not written since the header comes
+ * before the encoded data.
+ * 
+ * @param input_file Path to the P5 PGM image (square, with a size power of 2).
+ * @param output_file Path to the output QTC file.
+ * @param alpha Filtering parameter, 0 for a lossless compression.
+ * @param threads Number of threads used to build each subtree.
+ * @param memory_cap Memory cap in bytes.
+ * @param comments Writes the date comment if not 0.
+ * @param chunks_level Level of the chunks roots used on output.
+ * @return QTC_OK, or the status of a failure: QTC_ERROR_ARGUMENT for a file that can't be opened or isn't a P5 image
+ * that can be compressed, QTC_ERROR_CORRUPT for an invalid or truncated image, QTC_ERROR_MEMORY, or QTC_ERROR_BUFFER
+ * if the output can't be written. Nothing is written then.
+ */
+QtcStatus write_qtc_streaming(const char * input_file, const char * output_file, double alpha, int threads, size_t memory_cap,
+                              int comments, int * chunks_level) {
+    FILE * input = try_open_input(input_file);
+    if (!input) return QTC_ERROR_ARGUMENT;
+    int format, width, max_val;
+    QtcStatus status = read_pgm_header(input, &format, &width, &max_val);
+    if (status == QTC_OK && format != 5) status = pgm_failure("Streaming compression needs a P5 image.", QTC_ERROR_ARGUMENT);
+    if (status != QTC_OK) {
+        fclose(input);
+        return status;
+    }
+    int levels = 0;
+    while ((1 << levels) < width) levels++;
+
+    int to_stdout = !strcmp(output_file, "-");
+    FILE * output = to_stdout ? stdout : fopen(output_file, "wb");
+    if (!output) {
+        fprintf(stderr, "Error while opening file %s\n", output_file);
+        fclose(input);
+        return QTC_ERROR_ARGUMENT;
+    }
+    char header[192];
+    size_t header_size = format_qtc_header(header, sizeof(header), 2, -1., comments);
+    if (fwrite(header, 1, header_size, output) != header_size) {
+        fprintf(stderr, "Error while writing encoded data.\n");
+        status = QTC_ERROR_BUFFER;
+    } else {
+        status = encode_q2_streaming(input, levels, max_val, output, alpha, threads, memory_cap, chunks_level);
+    }
+    fclose(input);
+    if (fclose(output) && status == QTC_OK) {
+        fprintf(stderr, "Error while writing encoded data.\n");
+        status = QTC_ERROR_BUFFER;
+    }
+    // The chunks are written as they are encoded, the start of a file whose input turned out invalid is removed
+    if (status != QTC_OK && !to_stdout) unlink(output_file);
+    return status;
+}
+
+/**
+ * @brief Returns the offset of the encoded data in a QTC file.
+ * 
+ * Skips the format line and the comment lines (starting with `#`) that follow it.
+ * 
+ * @param data Content of the QTC file.
+ * @param size Size of the content in bytes.
+ * @return Offset of the first byte of encoded data.
+ */
+size_t skip_qtc_header(const unsigned char * data, size_t size) {
+    const unsigned char * eol = memchr(data, '\n', size);
+    size_t pos = eol ? (size_t) (eol - data) + 1 : size;
+    while (pos < size && data[pos] == '#') {
+        eol = memchr(data + pos, '\n', size - pos);
+        pos = eol ? (size_t) (eol - data) + 1 : size;
+    }
+    return pos;
+}
+
+/**
+ * @brief Returns the format of a QTC file from its format line.
+ * 
+ * @param data Content of the QTC file.
+ * @param size Size of the content in bytes.
+ * @return 2 for a Q2 file, 3 for a Q3 file, 4 for a delta frame (Q4), 5 for a multi-plane file (Q5), 1 otherwise.
+ */
+int qtc_format(const unsigned char * data, size_t size) {
+    return (size >= 2 && data[0] == 'Q' && data[1] >= '2' && data[1] <= '5') ? data[1] - '0' : 1;
+}
+
+/**
+ * @brief Copies the compression date comment line of a QTC header, for the comments of the decoded image.
+ * 
+ * The date travels from the QTC file to the image written from it, the line is only taken whole.
+ * 
+ * @param data Content of the QTC file, from its format line.
+ * @param size Size of the content in bytes.
+ * @param date Buffer of QTC_DATE_COMMENT_SIZE bytes receiving the line, empty if the header has none.
+ */
+void qtc_compression_date(const unsigned char * data, size_t size, char * date) {
+    static const char prefix[] = "# Compression date : ";
+    size_t end = skip_qtc_header(data, size);
+    const unsigned char * eol = memchr(data, '\n', end);
+    size_t pos = eol ? (size_t) (eol - data) + 1 : end;
+    date[0] = '\0';
+    while (pos < end) {
+        eol = memchr(data + pos, '\n', end - pos);
+        if (!eol) return;
+        size_t length = (size_t) (eol - data) + 1 - pos;
+        if (length > sizeof(prefix) - 1 && length < QTC_DATE_COMMENT_SIZE && !memcmp(data + pos, prefix, sizeof(prefix) - 1)) {
+            memcpy(date, data + pos, length);
+            date[length] = '\0';
+            return;
+        }
+        pos += length;
+    }
+}
+
+/**
+ * @brief Reads bytes of a pipe, exits if it ends before.
+ * 
+ * @param fd Descriptor of the pipe.
+ * @param data Buffer receiving the bytes.
+ * @param size Number of bytes.
+ */
+static void read_pipe_bytes(int fd, unsigned char * data, size_t size) {
+    while (size) {
+        ssize_t n = read(fd, data, size);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            fprintf(stderr, "Error while reading encoded data.\n");
+            exit(EXIT_FAILURE);
+        }
+        data += n;
+        size -= n;
+    }
+}
+
+/**
+ * @brief Starts reading a QTC file that can't be mapped (a pipe), the data is received as it is decoded.
+ * 
+ * Reads the header lines and the levels byte, then reserves a buffer of the largest payload of that
+ * many levels (of the size given by the head of a Q5 file): its pages are only allocated as the data comes in, and it never moves, so the decoders
+ * can read the first levels while fill_bitstream() receives the next ones.
+ * 
+ * @param file Pointer to file, not closed.
+ * @param date Buffer receiving the compression date comment line, NULL if not wanted.
+ * @return A BitStream holding the levels byte, its `fd` set to the file.
+ */
+static BitStream * read_bitstream_from_pipe(FILE * file, char * date) {
+    int fd = fileno(file);
+    unsigned char header[256];
+    size_t size = 0;
+    int line_start = 0; // Set at the start of the lines following the format line
+    for (;;) {
+        ssize_t n = read(fd, header + size, 1);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0 || size + 1 == sizeof(header)) {
+            fprintf(stderr, "Error while reading file format.\n");
+            exit(EXIT_FAILURE);
+        }
+        unsigned char c = header[size++];
+        if (line_start && c != '#') break; // First byte of the encoded data
+        line_start = c == '\n';
+    }
+    int format = qtc_format(header, size);
+    if (date) qtc_compression_date(header, size, date);
+    unsigned char head[2 + 9 * QTC_MAX_PLANES] = {header[size - 1]};
+    size_t head_size = 1, capacity;
+    if (format == 5) {
+        // The head of a multi-plane file gives the size of each plane, the payload is as large as they say
+        if (head[0] < 1 || head[0] > QTC_MAX_PLANES) {
+            fprintf(stderr, "Invalid Q5 file.\n");
+            exit(EXIT_FAILURE);
+        }
+        head_size = planes_head_size(head[0]);
+        read_pipe_bytes(fd, head + 1, head_size - 1);
+        capacity = head_size;
+        for (int p = 0; p < head[0]; p++) {
+            uint64_t bytes = load_be64(head + 3 + 9 * p);
+            if (bytes > encoded_size_bound(QUADTREE_MAX_LEVELS)) {
+                fprintf(stderr, "Invalid Q5 file.\n");
+                exit(EXIT_FAILURE);
+            }
+            capacity += bytes;
+        }
+    } else {
+        if (head[0] > QUADTREE_MAX_LEVELS) {
+            fprintf(stderr, "Unsupported Quadtree levels.\n");
+            exit(EXIT_FAILURE);
+        }
+        capacity = encoded_size_bound(head[0]);
+    }
+    void * map = mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Memory allocation for BitStream stream failed.\n");
+        exit(EXIT_FAILURE);
+    }
+    unsigned char * data = (unsigned char *) map;
+    memcpy(data, head, head_size);
+    BitStream * stream = initReadBitStream(data, head_size, map, capacity);
+    stream->end = data + capacity;
+    stream->format = format;
+    stream->fd = fd;
+    return stream;
 }
 
 /**
  * @brief Reads a QTC file and retrieves his data into a BitStream.
  * 
- * Reads a QTC file and retireves his data into a BitStream.
+ * Maps the QTC file in memory and returns a read-only BitStream pointing straight at the encoded data,
+ * the payload is never copied. If the file can't be mapped, its content is read in a single fread.
+ * A pipe is read as the data is decoded (see read_bitstream_from_pipe()).
+ * The format line (Q1, Q2 or Q3) is recorded in the BitStream.
  * 
  * @param file Pointer to file.
+ * @param date Buffer receiving the compression date comment line, NULL if not wanted.
  * @return A BitStream filled with the encoded data.
  */
-static BitStream * read_bitstream_from_file_Q1(FILE *file) {
-    char line[128];
-    readline(file, line, sizeof(line), "Error while reading file format.");
-    ignore_comments(file, line, sizeof(line));
-
-    // Save current position
-    long pos = ftell(file);
-
-    // Go to the end of file to compute buffer size
-    fseek(file, 0, SEEK_END);
-    int size = ftell(file) - pos;
-    // Replace cursor at the saved position
-    fseek(file, pos, SEEK_SET);
-    
-    // Initialize BitStream
-    BitStream * stream = initBitStream(size);
-
-    // Reads encoded data
-    unsigned char buffer[size];
-    size_t bytes_readed = fread(buffer, 1, size, file);
-    if ((int) bytes_readed != size) {
-        fprintf(stderr, "Error while reading encoded data.\n");
+static BitStream * read_bitstream_from_file(FILE *file, char * date) {
+    struct stat st;
+    int status = fstat(fileno(file), &st);
+    if (!status && !S_ISREG(st.st_mode)) return read_bitstream_from_pipe(file, date);
+    if (status || st.st_size <= 0) {
+        fprintf(stderr, "Error while reading file format.\n");
         fclose(file);
         exit(EXIT_FAILURE);
     }
-    // Writes data into BitStream
-    for (int i = 0; i < size; i++) {
-        push_n_bits(stream, buffer[i], 8);
+    size_t file_size = st.st_size;
+
+    void * map = mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+    if (map != MAP_FAILED) {
+        madvise(map, file_size, MADV_SEQUENTIAL);
+        fclose(file); // The mapping stays valid after closing the file
+        size_t offset = skip_qtc_header(map, file_size);
+        BitStream * stream = initReadBitStream((unsigned char *) map + offset, file_size - offset, map, file_size);
+        stream->format = qtc_format(map, file_size);
+        if (date) qtc_compression_date(map, file_size, date);
+        return stream;
+    }
+
+    // Fallback: reads the whole file at once
+    unsigned char * buffer = (unsigned char *) malloc(file_size);
+    if (!buffer) {
+        fprintf(stderr, "Memory allocation for BitStream stream failed.\n");
+        fclose(file);
+        exit(EXIT_FAILURE);
+    }
+    if (fread(buffer, 1, file_size, file) != file_size) {
+        fprintf(stderr, "Error while reading encoded data.\n");
+        free(buffer);
+        fclose(file);
+        exit(EXIT_FAILURE);
     }
-    finishBitStream(stream);
     fclose(file);
+    size_t offset = skip_qtc_header(buffer, file_size);
+    BitStream * stream = initReadBitStream(buffer + offset, file_size - offset, buffer, 0);
+    stream->format = qtc_format(buffer, file_size);
+    if (date) qtc_compression_date(buffer, file_size, date);
     return stream;
 }
 
@@ -335,61 +819,236 @@ static BitStream * read_bitstream_from_file_Q1(FILE *file) {
  * 
  * Reads encoded data from a QTC file and reconstucts the corresponding BitStream.
  * 
- * @param filename Path to the QTC file.
+ * @param filename Path to the QTC file, "-" for the standard input.
+ * @param date Buffer of QTC_DATE_COMMENT_SIZE bytes receiving the compression date comment line, NULL if not wanted.
  * @return Pointer to the reconstructed BitStream.
  */
-BitStream * read_qtc(const char *filename) {
-    FILE *file = fopen(filename, "rb");
+BitStream * read_qtc(const char *filename, char * date) {
+    return read_bitstream_from_file(open_input(filename), date);
+}
+
+/**
+ * @brief Size of the binary part of an index file.
+ * 
+ * @param index Index whose `levels` and `level` are set.
+ * @return Size in bytes.
+ */
+static size_t qtc_index_data_size(const QtcIndex * index) {
+    size_t subtrees = nodes_in_level(index->level);
+    return 10 + 2 * subtrees + 8 * subtrees * (index->levels - index->level);
+}
+
+/**
+ * @brief Writes the seek index of a Q1 file.
+ * 
+ * After the "QI" format line: `levels` and `level` on 8 bits, the size of the payload on 64 bits,
+ * the `moyenne` and flags byte of each subtree root, then the bit offsets of each subtree in the
+ * levels below its root, on 64 bits, all big-endian.
+ * 
+ * @param filename Path to the index file (the QTC file path followed by 'i').
+ * @param index Index to write.
+ */
+void write_qtc_index(const char * filename, const QtcIndex * index) {
+    size_t subtrees = nodes_in_level(index->level);
+    size_t count = subtrees * (index->levels - index->level);
+    size_t size = qtc_index_data_size(index);
+    unsigned char * data = (unsigned char *) malloc(size);
+    if (!data) {
+        fprintf(stderr, "Error while allocating memory for the index.\n");
+        exit(EXIT_FAILURE);
+    }
+    data[0] = index->levels;
+    data[1] = index->level;
+    store_be64(data + 2, index->payload_size);
+    memcpy(data + 10, index->roots, 2 * subtrees);
+    for (size_t i = 0; i < count; i++) store_be64(data + 10 + 2 * subtrees + 8 * i, index->offsets[i]);
+    write_file(filename, "QI\n", 3, data, size);
+    free(data);
+}
+
+/**
+ * @brief Writes the list of the uniform blocs of a segmentation grid.
+ * 
+ * After the "QB" format line: the side of the image on 16 bits (0 for 65536) and the number of blocs on 64 bits,
+ * then for each bloc its column and row on 16 bits and the log2 of its size on 8 bits, all big-endian.
+ * The blocs are in the order the codec visited them.
+ * 
+ * @param filename Path to the block list file.
+ * @param grid Grid whose blocs are listed.
+ * @param width Side of the image.
+ */
+void write_grid_blocs(const char * filename, const SegmentationGrid * grid, int width) {
+    size_t size = 10 + 5 * grid->count;
+    unsigned char * data = (unsigned char *) malloc(size);
+    if (!data) {
+        fprintf(stderr, "Error while allocating memory for the block list.\n");
+        exit(EXIT_FAILURE);
+    }
+    data[0] = (width >> 8) & 0xFF;
+    data[1] = width & 0xFF;
+    store_be64(data + 2, grid->count);
+    unsigned char * next = data + 10;
+    for (size_t i = 0; i < grid->count; i++, next += 5) {
+        const GridBloc * bloc = &grid->blocs[i];
+        int log = 0;
+        while ((1u << log) < bloc->size) log++;
+        next[0] = bloc->x >> 8;
+        next[1] = bloc->x & 0xFF;
+        next[2] = bloc->y >> 8;
+        next[3] = bloc->y & 0xFF;
+        next[4] = log;
+    }
+    write_file(filename, "QB\n", 3, data, size);
+    free(data);
+}
+
+/**
+ * @brief Reads the seek index of a Q1 file.
+ * 
+ * @see write_qtc_index() for the layout.
+ * 
+ * @param filename Path to the index file.
+ * @param index Index on output, to free with free_qtc_index().
+ */
+void read_qtc_index(const char * filename, QtcIndex * index) {
+    unsigned char * data = NULL;
+    int valid = 0;
+    index->roots = NULL;
+    index->offsets = NULL;
+    FILE * file = fopen(filename, "rb");
     if (!file) {
         fprintf(stderr, "Error while opening file %s\n", filename);
         exit(EXIT_FAILURE);
     }
-    return read_bitstream_from_file_Q1(file);
+    unsigned char head[13];
+    if (fread(head, 1, sizeof(head), file) != sizeof(head) || memcmp(head, "QI\n", 3) || head[3] > QUADTREE_MAX_LEVELS || head[4] > head[3]) {
+        fprintf(stderr, "Invalid index file %s\n", filename);
+        goto done;
+    }
+    index->levels = head[3];
+    index->level = head[4];
+    index->payload_size = load_be64(head + 5);
+    size_t subtrees = nodes_in_level(index->level);
+    size_t count = subtrees * (index->levels - index->level);
+    size_t size = qtc_index_data_size(index) - 10;
+    data = (unsigned char *) malloc(size + 1);
+    if (!data || allocate_qtc_index(index) != QTC_OK) {
+        fprintf(stderr, "Error while allocating memory for the index.\n");
+        goto done;
+    }
+    // One byte more than the index is asked for, so a truncated file and trailing bytes both fail
+    if (fread(data, 1, size + 1, file) != size) {
+        fprintf(stderr, "Invalid index file %s\n", filename);
+        goto done;
+    }
+    memcpy(index->roots, data, 2 * subtrees);
+    for (size_t i = 0; i < count; i++) index->offsets[i] = load_be64(data + 2 * subtrees + 8 * i);
+    valid = 1;
+
+done:
+    fclose(file);
+    free(data);
+    if (!valid) {
+        free_qtc_index(index);
+        exit(EXIT_FAILURE);
+    }
 }
 
 /**
- * @brief Writes a Image into a file at P5 format.
+ * @brief Formats the comments of a decoded image: compression and decompression dates, unless `comments` is 0.
  * 
- * @param file Pointer to file to write to.
- * @param image Pointer to Image to retrieves data from.
+ * @param header Buffer receiving the comments.
+ * @param size Size of the buffer.
+ * @param comments Writes the comments if not 0.
+ * @param date Compression date comment line of the decoded QTC file, NULL or empty if unknown.
+ * @return Size of the comments in bytes.
  */
-static void write_pgm_P5(FILE * file, Image * image) {
-    // Writes format
-    fprintf(file, "P5\n");
-    // Adds comments with the date of compression
+static size_t format_decompression_comments(char * header, size_t size, int comments, const char * date) {
+    if (!comments) return 0;
     time_t now = time(NULL);
-    if (now == (time_t)(-1)) {
+    char now_date[32];
+    if (now == (time_t)(-1) || !ctime_r(&now, now_date)) {
         fprintf(stderr, "Error while retrieving date.\n");
         exit(EXIT_FAILURE);
     }
+    return snprintf(header, size, "%s# Decompression date : %s", date ? date : "", now_date);
+}
 
-    fprintf(file, "%s# Decompression date : %s", compression_info, ctime(&now));
-
+/**
+ * @brief Writes pixels as a PGM image in P5 format.
+ * 
+ * Writes a binary PGM image (P5 format) to the specified file, header and pixels in a single system call.
+ * Includes metadata such as compression and decompression dates in the header, unless `comments` is 0.
+ * The image doesn't have to be square (a decoded region for instance).
+ * 
+ * @param filename Path to the output PGM file.
+ * @param pixels Pixels of the image, row by row.
+ * @param width Width of the image.
+ * @param height Height of the image.
+ * @param max_val Maximum grayscale value.
+ * @param comments Writes the date comments if not 0.
+ * @param date Compression date comment line of the decoded QTC file, NULL or empty if unknown.
+ */
+void write_pgm_pixels(const char * filename, const unsigned char * pixels, int width, int height, int max_val, int comments, const char * date) {
+    // Writes format
+    char header[256];
+    size_t n = snprintf(header, sizeof(header), "P5\n");
+    // Adds comments with the date of compression
+    n += format_decompression_comments(header + n, sizeof(header) - n, comments, date);
     // Writes image dimensions
-    fprintf(file, "%d %d\n%d\n", image->width, image->width, image->max_val);
-
-    // Writes pixels values
-    for (int i = 0; i < image->image_size; i++) {
-        fputc(image->image[i], file);
-    }
-    fclose(file);
+    n += snprintf(header + n, sizeof(header) - n, "%d %d\n%d\n", width, height, max_val);
+    // Possiblity to add P2 format writting
+    write_file(filename, header, n, pixels, (size_t) width * height);
 }
 
 /**
  * @brief Writes a PGM image in P5 format.
  * 
- * Writes a binary PGM image (P5 format) to the specified file.
- * Includes metadata such as compression and decompression dates in the header.
+ * @see write_pgm_pixels()
+ * 
+ * An Image in leaf order is put back in raster order in a buffer of its own first.
  * 
  * @param filename Path to the output PGM file.
  * @param image Pointer to the Image structure to write.
+ * @param comments Writes the date comments if not 0.
+ * @param date Compression date comment line of the decoded QTC file, NULL or empty if unknown.
  */
-void write_pgm(const char * filename, Image * image) {
-    FILE * file = fopen(filename, "wb");
-    if (!file) {
-        fprintf(stderr, "Error while opening file %s\n", filename);
-        exit(EXIT_FAILURE);
+void write_pgm(const char * filename, Image * image, int comments, const char * date) {
+    if (image->layout == IMAGE_LEAF_ORDER) {
+        unsigned char * raster = (unsigned char *) malloc(image->image_size);
+        if (!raster) {
+            fprintf(stderr, "Error while allocating memory for the image's pixel data.\n");
+            exit(EXIT_FAILURE);
+        }
+        leaf_order_to_raster(image->image, raster, image->width, 0, image->width);
+        write_pgm_pixels(filename, raster, image->width, image->width, image->max_val, comments, date);
+        free(raster);
+        return;
     }
-    // Possiblity to add P2 format writting
-    write_pgm_P5(file, image);
-}
\ No newline at end of file
+    write_pgm_pixels(filename, image->image, image->width, image->width, image->max_val, comments, date);
+}
+
+/**
+ * @brief Writes a multi-plane image in P6 format (3 planes) or P7 format (PAM, any other number of planes).
+ * 
+ * Same comments as write_pgm_pixels(), header and samples in a single system call.
+ * 
+ * @param filename Path to the output file, "-" for the standard output.
+ * @param image Pointer to the ColorImage structure to write.
+ * @param comments Writes the date comments if not 0.
+ * @param date Compression date comment line of the decoded QTC file, NULL or empty if unknown.
+ */
+void write_ppm(const char * filename, const ColorImage * image, int comments, const char * date) {
+    static const char * tuple_types[] = {"GRAYSCALE", "GRAYSCALE_ALPHA", "RGB", "RGB_ALPHA"};
+    char header[320];
+    int ppm = image->planes == 3;
+    size_t n = snprintf(header, sizeof(header), ppm ? "P6\n" : "P7\n");
+    n += format_decompression_comments(header + n, sizeof(header) - n, comments, date);
+    if (ppm) {
+        n += snprintf(header + n, sizeof(header) - n, "%d %d\n%d\n", image->width, image->width, image->max_val);
+    } else {
+        n += snprintf(header + n, sizeof(header) - n, "WIDTH %d\nHEIGHT %d\nDEPTH %d\nMAXVAL %d\nTUPLTYPE %s\nENDHDR\n",
+                      image->width, image->width, image->planes, image->max_val, tuple_types[image->planes - 1]);
+    }
+    write_file(filename, header, n, image->pixels, (size_t) image->width * image->width * image->planes);
+}
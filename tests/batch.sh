@@ -0,0 +1,73 @@
+#!/bin/sh
+# Batch mode with a bad file among good ones: the good outputs are all written,
+# the bad file is reported as skipped and the exit status is 1.
+# Run from the root of the repository (make test).
+
+CODEC=bin/codec
+DATA=data/PGM
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+failures=0
+
+fail() {
+    echo "FAIL: $1"
+    failures=$((failures + 1))
+}
+
+# Runs a batch and checks its exit status, the outputs written and the file skipped.
+# $1 name of the case, $2 expected outputs, $3 skipped input, then the arguments of codec.
+check_batch() {
+    name=$1 outputs=$2 skipped=$3
+    shift 3
+    "$CODEC" "$@" > "$WORK/$name.out" 2> "$WORK/$name.err"
+    status=$?
+    [ $status -eq 1 ] || fail "$name: exit status $status instead of 1"
+    grep -q "^Invalid file .*$skipped, skipped$" "$WORK/$name.err" || fail "$name: $skipped not reported as skipped"
+    grep -q "^3 files (1 failed)" "$WORK/$name.out" || fail "$name: wrong summary: $(cat "$WORK/$name.out")"
+    for output in $outputs; do
+        [ -s "$output" ] || fail "$name: $output not written"
+    done
+}
+
+# Encoding, with a truncated image and an empty one
+mkdir -p "$WORK/pgm" "$WORK/pgm.empty"
+cp "$DATA/TEST4x4.pgm" "$WORK/pgm/a.pgm"
+cp "$DATA/boat.512.pgm" "$WORK/pgm/c.pgm"
+cp "$WORK/pgm/a.pgm" "$WORK/pgm/c.pgm" "$WORK/pgm.empty"
+head -c 1000 "$DATA/boat.512.pgm" > "$WORK/pgm/b.pgm"
+: > "$WORK/pgm.empty/b.pgm"
+check_batch encode "$WORK/qtc/a.qtc $WORK/qtc/c.qtc" b.pgm -c -n -b "$WORK/pgm" -o "$WORK/qtc"
+check_batch encode.empty "$WORK/qtc.empty/a.qtc $WORK/qtc.empty/c.qtc" b.pgm -c -n -b "$WORK/pgm.empty" -o "$WORK/qtc.empty"
+check_batch encode.glob "$WORK/qtc.glob/$WORK/pgm/a.qtc $WORK/qtc.glob/$WORK/pgm/c.qtc" b.pgm -c -n -b "$WORK/pgm/*.pgm" -o "$WORK/qtc.glob"
+
+# Streaming encoding, nothing is written for the bad file
+check_batch streaming "$WORK/qtc.m/a.qtc $WORK/qtc.m/c.qtc" b.pgm -c -n -m 1 -b "$WORK/pgm" -o "$WORK/qtc.m"
+[ -e "$WORK/qtc.m/b.qtc" ] && fail "streaming: b.qtc written"
+check_batch streaming.lossy "$WORK/qtc.ml/a.qtc $WORK/qtc.ml/c.qtc" b.pgm -c -n -m 1 -a 1.5 -b "$WORK/pgm" -o "$WORK/qtc.ml"
+
+# Decoding, with an empty file
+mkdir -p "$WORK/in.qtc"
+cp "$WORK/qtc/a.qtc" "$WORK/qtc/c.qtc" "$WORK/in.qtc"
+: > "$WORK/in.qtc/b.qtc"
+check_batch decode "$WORK/dec/a.pgm $WORK/dec/c.pgm" b.qtc -u -n -b "$WORK/in.qtc" -o "$WORK/dec"
+check_batch decode.sequence "$WORK/dec.s/a.pgm $WORK/dec.s/c.pgm" b.qtc -u -n --sequence -b "$WORK/in.qtc" -o "$WORK/dec.s"
+mkdir -p "$WORK/in.qtc.t"
+cp "$WORK/qtc/a.qtc" "$WORK/qtc/c.qtc" "$WORK/in.qtc.t"
+head -c 2000 "$WORK/qtc/c.qtc" > "$WORK/in.qtc.t/b.qtc"
+check_batch decode.sequence.truncated "$WORK/dec.t/a.pgm $WORK/dec.t/c.pgm" b.qtc -u -n --sequence -b "$WORK/in.qtc.t" -o "$WORK/dec.t"
+tail -c 262144 "$DATA/boat.512.pgm" > "$WORK/boat.raw"
+tail -c 262144 "$WORK/dec/c.pgm" | cmp -s - "$WORK/boat.raw" || fail "decode: boat.512 not decoded losslessly"
+
+# Comments: each decoded image gets the compression date of its own file, on a single worker
+mkdir -p "$WORK/in.date"
+{ printf 'Q1\n# Compression date : Mon Jan  1 00:00:00 2024\n'; tail -c +4 "$WORK/qtc/a.qtc"; } > "$WORK/in.date/a.qtc"
+cp "$WORK/qtc/c.qtc" "$WORK/in.date/c.qtc"
+"$CODEC" -u -t 1 -b "$WORK/in.date" -o "$WORK/dec.date" > /dev/null || fail "date: decoding failed"
+grep -q "^# Compression date : Mon Jan  1 00:00:00 2024$" "$WORK/dec.date/a.pgm" || fail "date: a.pgm without the date of a.qtc"
+grep -q "^# Compression date" "$WORK/dec.date/c.pgm" && fail "date: c.pgm with a compression date, c.qtc has none"
+
+if [ $failures -ne 0 ]; then
+    echo "batch: $failures failures"
+    exit 1
+fi
+echo "batch: all tests passed"
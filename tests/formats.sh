@@ -0,0 +1,139 @@
+#!/bin/sh
+# Round trips of the QTC formats: each image is encoded, decoded and compared with its source
+# (lossless) or with the image decoded from another encoding of the same alpha (lossy),
+# regions are compared with the window of the source and rate targets with their budget.
+# Run from the root of the repository (make test).
+
+CODEC=bin/codec
+DATA=data/PGM
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+failures=0
+
+fail() {
+    echo "FAIL: $1"
+    failures=$((failures + 1))
+}
+
+# Writes the raster of a P5 image, its last width * width bytes.
+# $1 image, $2 width, $3 output.
+raster() {
+    tail -c $(($2 * $2)) "$1" > "$3" 2> /dev/null
+    [ "$(wc -c < "$3")" -eq $(($2 * $2)) ] || fail "$1: not a $2 x $2 image"
+}
+
+# Encodes an image then decodes it, the decoded image is $WORK/$1.pgm.
+# $1 name of the case, $2 image, then the arguments of the encoding.
+encode_decode() {
+    coded=$1 source=$2
+    shift 2
+    "$CODEC" -c -n -i "$source" -o "$WORK/$coded.qtc" "$@" > /dev/null || fail "$coded: encoding failed"
+    "$CODEC" -u -n -i "$WORK/$coded.qtc" -o "$WORK/$coded.pgm" > /dev/null || fail "$coded: decoding failed"
+}
+
+# Checks that a lossless encoding decodes to the pixels of its image.
+# $1 name of the case, $2 image (in data/PGM), $3 width, then the arguments of the encoding.
+check_lossless() {
+    name=$1 image=$DATA/$2 width=$3
+    shift 3
+    encode_decode "$name" "$image" "$@"
+    raster "$image" "$width" "$WORK/$name.source"
+    raster "$WORK/$name.pgm" "$width" "$WORK/$name.raw"
+    cmp -s "$WORK/$name.raw" "$WORK/$name.source" || fail "$name: not decoded losslessly"
+}
+
+# Checks that two encodings of an image decode to the same pixels.
+# $1 name of the case, $2 image (in data/PGM), $3 width, $4 arguments of the first encoding, then the ones of the second.
+check_same_pixels() {
+    name=$1 image=$DATA/$2 width=$3 first=$4
+    shift 4
+    encode_decode "$name.1" "$image" $first
+    encode_decode "$name.2" "$image" "$@"
+    raster "$WORK/$name.1.pgm" "$width" "$WORK/$name.1.raw"
+    raster "$WORK/$name.2.pgm" "$width" "$WORK/$name.2.raw"
+    cmp -s "$WORK/$name.1.raw" "$WORK/$name.2.raw" || fail "$name: decoded pixels differ"
+}
+
+# Checks that a region decoded with --roi is the window of the source image.
+# $1 name of the case, $2 image (in data/PGM), $3 width, $4 region x,y,w,h, then the arguments of the encoding.
+check_roi() {
+    name=$1 image=$DATA/$2 width=$3 region=$4
+    shift 4
+    "$CODEC" -c -n -i "$image" -o "$WORK/$name.qtc" "$@" > /dev/null || fail "$name: encoding failed"
+    "$CODEC" -u -n -i "$WORK/$name.qtc" -o "$WORK/$name.pgm" --roi "$region" > /dev/null || fail "$name: decoding failed"
+    x=${region%%,*} rest=${region#*,}
+    y=${rest%%,*} rest=${rest#*,}
+    w=${rest%%,*} h=${rest#*,}
+    raster "$image" "$width" "$WORK/$name.source"
+    for row in $(seq "$y" $((y + h - 1))); do
+        tail -c +$((row * width + x + 1)) "$WORK/$name.source" | head -c "$w"
+    done > "$WORK/$name.window"
+    tail -c $((w * h)) "$WORK/$name.pgm" | cmp -s - "$WORK/$name.window" || fail "$name: not the window of $image"
+}
+
+# Checks that a rate target gives a file whose data (after the format line, written with -n) fits the budget
+# closely, and that it decodes to an image of the size of the source.
+# $1 name of the case, $2 image (in data/PGM), $3 width, $4 budget in bytes, then the arguments of the encoding.
+check_target() {
+    name=$1 image=$DATA/$2 width=$3 budget=$4
+    shift 4
+    encode_decode "$name" "$image" "$@"
+    size=$(tail -n +2 "$WORK/$name.qtc" | wc -c)
+    [ "$size" -le "$budget" ] || fail "$name: $size bytes for a budget of $budget"
+    [ "$size" -ge $((budget * 9 / 10)) ] || fail "$name: $size bytes only for a budget of $budget"
+    [ "$(wc -c < "$WORK/$name.pgm")" -gt $((width * width)) ] || fail "$name: not a $width x $width image"
+}
+
+# Checks that a color image is coded as a Q5 file decoding to the same image (headers included, written with -n).
+# $1 name of the case, $2 image (.ppm or .pam in $WORK), then the arguments of the encoding.
+check_planes() {
+    name=$1 image=$WORK/$2
+    shift 2
+    "$CODEC" -c -n -i "$image" -o "$WORK/$name.qtc" "$@" > /dev/null || fail "$name: encoding failed"
+    [ "$(head -c 2 "$WORK/$name.qtc")" = "Q5" ] || fail "$name: not a Q5 file"
+    "$CODEC" -u -n -i "$WORK/$name.qtc" -o "$WORK/$name.${image##*.}" > /dev/null || fail "$name: decoding failed"
+    cmp -s "$WORK/$name.${image##*.}" "$image" || fail "$name: not decoded losslessly"
+}
+
+# Streaming encoder (-m): a Q2 file whose chunks are in raster order, decoded as with -f Q2
+check_lossless streaming boat.512.pgm 512 -m 1
+for alpha in 0 1.5; do
+    check_same_pixels "streaming.a$alpha" boat.512.pgm 512 "-f Q2 -a $alpha" -m 1 -a "$alpha"
+    check_same_pixels "streaming.cells.a$alpha" cells.1024.pgm 1024 "-f Q2 -a $alpha" -m 1 -a "$alpha"
+done
+
+# rANS entropy coding (-f Q3): the same tree as Q1, so the same pixels at every alpha
+check_lossless q3 boat.512.pgm 512 -f Q3
+check_lossless q3.chessboard chessboard.256.pgm 256 -f Q3 -t 4
+for alpha in 1.5 3; do
+    check_same_pixels "q3.a$alpha" boat.512.pgm 512 "-a $alpha" -f Q3 -a "$alpha"
+done
+
+# Rate targeting: the alpha is chosen from the Quadtree so that the data fits a budget in bytes or in bits per pixel
+for format in Q1 Q2; do
+    check_target "target.$format" boat.512.pgm 512 40000 -f "$format" --target-bytes 40000
+    check_target "target.cells.$format" cells.1024.pgm 1024 60000 -f "$format" --target-bytes 60000 -t 4
+done
+check_target target.bpp boat.512.pgm 512 32768 --target-bpp 1
+
+# Regions (--roi): a Q1 file through its seek index (--index), a Q2 file through its chunks
+check_roi roi.q1 boat.512.pgm 512 100,200,64,32 --index 3
+check_roi roi.q1.edge cells.1024.pgm 1024 1000,0,24,1024 --index 4
+[ -f "$WORK/roi.q1.qtci" ] || fail "roi.q1: no index written"
+check_roi roi.q2 boat.512.pgm 512 37,411,100,90 -f Q2
+
+# Planes (Q5): an RGB image with and without the reversible color transform, and an RGB and alpha image
+printf 'P6\n512 512\n255\n' > "$WORK/rgb.ppm"
+tail -c 786432 "$DATA/cactus.2048.pgm" >> "$WORK/rgb.ppm"
+printf 'P7\nWIDTH 256\nHEIGHT 256\nDEPTH 4\nMAXVAL 255\nTUPLTYPE RGB_ALPHA\nENDHDR\n' > "$WORK/rgba.pam"
+tail -c 262144 "$DATA/boat.512.pgm" >> "$WORK/rgba.pam"
+check_planes q5 rgb.ppm -t 3
+check_planes q5.rct rgb.ppm --rct
+check_planes q5.rgba.q2 rgba.pam -f Q2 -t 4
+check_planes q5.rgba.q3 rgba.pam -f Q3
+
+if [ $failures -ne 0 ]; then
+    echo "formats: $failures failures"
+    exit 1
+fi
+echo "formats: all tests passed"
@@ -0,0 +1,70 @@
+#!/bin/sh
+# Sequence mode (--sequence): frames coded as Q4 deltas of the previous one, a scene cut
+# coded as a key frame, and every frame decoded losslessly.
+# Run from the root of the repository (make test).
+
+CODEC=bin/codec
+DATA=data/PGM
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+failures=0
+
+fail() {
+    echo "FAIL: $1"
+    failures=$((failures + 1))
+}
+
+# Writes a 512 x 512 P5 image from a raw raster.
+# $1 raw raster, $2 output image.
+write_frame() {
+    printf 'P5\n512 512\n255\n' > "$2"
+    cat "$1" >> "$2"
+}
+
+# Copies a band of rows of a raster over another one.
+# $1 raster the rows come from, $2 raster patched, $3 first row, $4 number of rows.
+patch_rows() {
+    dd if="$1" of="$2" bs=512 skip="$3" seek="$3" count="$4" conv=notrunc 2> /dev/null
+}
+
+# Frames: boat, boat with a band of peng, then a scene cut to peng, and peng with a band of boat
+mkdir -p "$WORK/pgm"
+tail -c 262144 "$DATA/boat.512.pgm" > "$WORK/boat.raw"
+tail -c 262144 "$DATA/peng.512.pgm" > "$WORK/peng.raw"
+cp "$WORK/boat.raw" "$WORK/f00.raw"
+cp "$WORK/boat.raw" "$WORK/f01.raw"
+patch_rows "$WORK/peng.raw" "$WORK/f01.raw" 200 16
+cp "$WORK/peng.raw" "$WORK/f02.raw"
+cp "$WORK/peng.raw" "$WORK/f03.raw"
+patch_rows "$WORK/boat.raw" "$WORK/f03.raw" 300 8
+for frame in f00 f01 f02 f03; do
+    write_frame "$WORK/$frame.raw" "$WORK/pgm/$frame.pgm"
+done
+
+# Checks the format of each frame and that the sequence decodes to the frames.
+# $1 name of the case, $2 formats of the frames (f00 to f03), then the arguments of the encoding.
+check_sequence() {
+    name=$1 formats=$2
+    shift 2
+    "$CODEC" -c -n --sequence -b "$WORK/pgm" -o "$WORK/$name.qtc" "$@" > /dev/null || fail "$name: encoding failed"
+    "$CODEC" -u -n --sequence -b "$WORK/$name.qtc" -o "$WORK/$name.pgm" > /dev/null || fail "$name: decoding failed"
+    i=0
+    for format in $formats; do
+        frame=f0$i
+        [ "$(head -c 2 "$WORK/$name.qtc/$frame.qtc")" = "$format" ] || fail "$name: $frame is not $format"
+        tail -c 262144 "$WORK/$name.pgm/$frame.pgm" | cmp -s - "$WORK/$frame.raw" || fail "$name: $frame not decoded losslessly"
+        i=$((i + 1))
+    done
+}
+
+# The scene cut is a key frame at the -f format, smaller than its delta
+check_sequence q1 "Q1 Q4 Q1 Q4"
+check_sequence q3 "Q3 Q4 Q3 Q4" -f Q3
+"$CODEC" -c -n -i "$WORK/pgm/f02.pgm" -o "$WORK/f02.qtc" > /dev/null
+cmp -s "$WORK/f02.qtc" "$WORK/q1.qtc/f02.qtc" || fail "q1: the key frame differs from f02 coded alone"
+
+if [ $failures -ne 0 ]; then
+    echo "sequence: $failures failures"
+    exit 1
+fi
+echo "sequence: all tests passed"
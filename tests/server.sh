@@ -0,0 +1,84 @@
+#!/bin/bash
+# Tile server (--serve): GET requests of a whole image, of a level and of a window, STATS,
+# and the error lines of the files that can't be served. Bash is needed for /dev/tcp.
+# Run from the root of the repository (make test), the served paths are relative to it.
+
+CODEC=bin/codec
+DATA=data/PGM
+WORK=$(mktemp -d tests/server.XXXXXX)
+PORT=$((30000 + $$ % 20000))
+server=
+trap '[ -n "$server" ] && kill $server; rm -rf "$WORK"' EXIT
+failures=0
+
+fail() {
+    echo "FAIL: $1"
+    failures=$((failures + 1))
+}
+
+# Sends a request line on the connection and reads the answer line.
+# $1 request line, the answer is in $reply.
+request() {
+    printf '%s\n' "$1" >&3
+    IFS= read -r reply <&3
+}
+
+# Sends a GET request and reads the P5 image of its answer.
+# $1 request line, $2 expected width and height, $3 file receiving the pixels.
+check_get() {
+    request "$1"
+    [ "$reply" = "P5" ] || { fail "$1: answer $reply"; return; }
+    IFS= read -r size <&3
+    IFS= read -r max_val <&3
+    [ "$size" = "$2" ] || fail "$1: size $size instead of $2"
+    head -c $((${2% *} * ${2#* })) <&3 > "$3"
+}
+
+# Files: boat losslessly, a delta frame of it, and a file that isn't a QTC one
+tail -c 262144 "$DATA/boat.512.pgm" > "$WORK/boat.raw"
+"$CODEC" -c -n -i "$DATA/boat.512.pgm" -o "$WORK/boat.qtc" > /dev/null
+mkdir -p "$WORK/frames"
+cp "$DATA/boat.512.pgm" "$WORK/frames/f00.pgm"
+cp "$DATA/boat.512.pgm" "$WORK/frames/f01.pgm"
+"$CODEC" -c -n --sequence -b "$WORK/frames" -o "$WORK/sequence" > /dev/null
+[ "$(head -c 2 "$WORK/sequence/f01.qtc")" = "Q4" ] || fail "f01.qtc is not a delta frame"
+echo "not a QTC file" > "$WORK/text.qtc"
+
+"$CODEC" --serve "$PORT" -t 2 > "$WORK/server.log" 2>&1 &
+server=$!
+for i in $(seq 50); do
+    exec 3<> "/dev/tcp/127.0.0.1/$PORT" 2> /dev/null && break
+    sleep 0.1
+done
+if ! { true >&3; } 2> /dev/null; then
+    echo "FAIL: the server doesn't accept connections"
+    exit 1
+fi
+
+check_get "GET $WORK/boat.qtc" "512 512" "$WORK/boat.get"
+cmp -s "$WORK/boat.get" "$WORK/boat.raw" || fail "GET: boat.512 not served losslessly"
+check_get "GET $WORK/boat.qtc 3" "8 8" "$WORK/level.get"
+check_get "GET $WORK/boat.qtc 9 100 200 16 8" "16 8" "$WORK/window.get"
+for row in $(seq 0 7); do
+    tail -c +$(((200 + row) * 512 + 101)) "$WORK/boat.raw" | head -c 16
+done > "$WORK/window.raw"
+cmp -s "$WORK/window.get" "$WORK/window.raw" || fail "GET: window not the pixels of boat.512"
+
+request "GET $WORK/missing.qtc"
+[ "$reply" = "ERR can't open $WORK/missing.qtc" ] || fail "missing file: $reply"
+request "GET $WORK/sequence/f01.qtc"
+[ "$reply" = "ERR delta (Q4) frames and multi-plane (Q5) files can't be served on their own" ] || fail "delta frame: $reply"
+request "GET $WORK/text.qtc"
+[ "$reply" = "ERR invalid QTC file" ] || fail "text file: $reply"
+request "STATS"
+case "$reply" in
+    "STATS entries 1 "*) ;;
+    *) fail "STATS: $reply" ;;
+esac
+exec 3<&-
+
+if [ $failures -ne 0 ]; then
+    echo "server: $failures failures"
+    exit 1
+fi
+echo "server: all tests passed"